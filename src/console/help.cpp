@@ -72,6 +72,7 @@ void show_help(void)
         "  -o,  --optimize                     perform full optimization\n"
         "  -q,  --quick-optimize               perform quick optimization\n"
         "       --optimize-mft                 optimize master file tables only\n"
+        "       --consolidate-free-space       join free space regions together\n"
         "  -l,  --list-available-volumes       list all fixed disks available\n"
         "                                      for defragmentation\n"
         "  -la, --list-available-volumes=all   list all available disks,\n"
@@ -85,6 +86,8 @@ void show_help(void)
         "Options:\n"
         "  -r,  --repeat                       repeat the disk processing multiple\n"
         "                                      times whenever it makes sense\n"
+        "       --resume                       continue the job interrupted before\n"
+        "                                      by a reboot or by the user\n"
         "  -b,  --use-system-color-scheme      disable colorization of output\n"
         "  -p,  --suppress-progress-indicator  hide progress indicator and cluster map\n"
         "  -v,  --show-volume-information      show disk information after the job\n"
@@ -153,17 +156,50 @@ void show_help(void)
         "                                      SIZE (sort by size), C_TIME (sort by\n"
         "                                      creation time), M_TIME (sort by last\n"
         "                                      modification time) and A_TIME (sort by\n"
-        "                                      last access time)\n"
+        "                                      last access time); TREE and TREE_BFS\n"
+        "                                      place each directory right before its\n"
+        "                                      files, depth-first or breadth-first;\n"
+        "                                      ZONES may precede any of them, like\n"
+        "                                      ZONES,SIZE, to place recently used\n"
+        "                                      files first and long unused ones last\n"
+        "\n"
+        "  UD_HOT_ZONE_AGE                     files used within the specified number\n"
+        "                                      of days are hot; the default is 7\n"
+        "\n"
+        "  UD_COLD_ZONE_AGE                    files not used for the specified number\n"
+        "                                      of days are cold; the default is 180\n"
         "\n"
         "  UD_SORTING_ORDER                    set sorting order for the disk\n"
         "                                      optimization; ASC (ascending) is used\n"
         "                                      by default, DESC (descending) forces\n"
         "                                      to sort files in reverse order\n"
         "\n"
+        "  UD_SORTING_TRACE                    path of the file access order trace,\n"
+        "                                      like %%WINDIR%%\\Prefetch\\Layout.ini;\n"
+        "                                      listed files are placed first, in\n"
+        "                                      order of the trace\n"
+        "\n"
+        "  UD_IN_PLACE_OPTIMIZATION            set it to 1 (one) to move files\n"
+        "                                      straight to their places in the\n"
+        "                                      sorted order; needs just a few\n"
+        "                                      percent of free space\n"
+        "\n"
+        "  UD_INCREMENTAL_OPTIMIZATION         set it to 1 (one) to let the quick\n"
+        "                                      optimization skip ranges of the disk\n"
+        "                                      left intact since the last run\n"
+        "\n"
         "  UD_FRAGMENTATION_THRESHOLD          cancel all tasks except of the MFT\n"
         "                                      optimization when fragmentation level\n"
         "                                      is below than specified\n"
         "\n"
+        "  UD_FREE_SPACE_TARGET                stop free space consolidation when\n"
+        "                                      the largest free region reaches the\n"
+        "                                      specified size, like 10 GB\n"
+        "\n"
+        "  UD_FREE_SPACE_FRAGMENTS             stop free space consolidation when\n"
+        "                                      number of free regions falls to the\n"
+        "                                      specified value\n"
+        "\n"
         "  UD_TIME_LIMIT                       terminate the job automatically when\n"
         "                                      the specified time interval elapses;\n"
         "                                      the following time format is accepted:\n"
@@ -174,8 +210,25 @@ void show_help(void)
         "  UD_REFRESH_INTERVAL                 set the progress refresh interval,\n"
         "                                      in milliseconds; the default value is 100\n"
         "\n"
+        "  UD_MOVE_QUEUE_DEPTH                 set the number of move requests kept\n"
+        "                                      in flight simultaneously; values above\n"
+        "                                      1 may speed up processing of SSD drives\n"
+        "                                      and RAID arrays; the default value is 4\n"
+        "\n"
+        "  UD_MOVE_VERIFICATION                set verification of moved files;\n"
+        "                                      IMMEDIATE is used by default, DEFERRED\n"
+        "                                      verifies moved files once per pass,\n"
+        "                                      SAMPLED verifies one of 16 moved files\n"
+        "\n"
+        "  UD_CANCELLATION_LATENCY             set the desired maximum duration of\n"
+        "                                      a single move request, in milliseconds;\n"
+        "                                      0 (zero) disables adjustment of amount\n"
+        "                                      of data moved at once, which is\n"
+        "                                      the default\n"
+        "\n"
         "  UD_DISABLE_REPORTS                  set it to 1 (one) to disable generation\n"
         "                                      of the file fragmentation reports\n"
+        "                                      and of the performance counters\n"
         "\n"
         "  UD_DBGPRINT_LEVEL                   set amount of debugging output;\n"
         "                                      NORMAL is used by default, DETAILED\n"
@@ -191,6 +244,14 @@ void show_help(void)
         "                                      the disk processing; this allows to\n"
         "                                      check out algorithms quickly\n"
         "\n"
+        "  UD_DRY_RUN_LATENCY                  set the simulated duration of a single\n"
+        "                                      move request, in milliseconds; it is\n"
+        "                                      used together with UD_DRY_RUN\n"
+        "\n"
+        "  UD_TIMELINE                         set it to 1 (one) to save the timeline\n"
+        "                                      of the job to the reports directory;\n"
+        "                                      it can be viewed in chrome://tracing\n"
+        "\n"
         "Note:\n"
         "  All the environment variables are ignored when the --shellex switch is\n"
         "  on the command line. Instead of taking environment variables into account\n"
@@ -54,11 +54,13 @@ bool g_analyze = false;
 bool g_optimize = false;
 bool g_quick_optimization = false;
 bool g_optimize_mft = false;
+bool g_consolidate_free_space = false;
 bool g_all = false;
 bool g_all_fixed = false;
 bool g_list_volumes = false;
 bool g_list_all = false;
 bool g_repeat = false;
+bool g_resume = false;
 bool g_no_progress = false;
 bool g_show_vol_info = false;
 bool g_show_map = false;
@@ -286,6 +288,25 @@ int terminator(void *p)
     return g_stop;
 }
 
+static udefrag_job_type get_job_type(void)
+{
+    udefrag_job_type job_type = DEFRAGMENTATION_JOB;
+    if(g_analyze) job_type = ANALYSIS_JOB;
+    else if(g_optimize) job_type = FULL_OPTIMIZATION_JOB;
+    else if(g_quick_optimization) job_type = QUICK_OPTIMIZATION_JOB;
+    else if(g_optimize_mft) job_type = MFT_OPTIMIZATION_JOB;
+    else if(g_consolidate_free_space) job_type = FREE_SPACE_CONSOLIDATION_JOB;
+    return job_type;
+}
+
+static int get_job_flags(void)
+{
+    int flags = g_repeat ? UD_JOB_REPEAT : 0;
+    if(g_resume) flags |= UD_JOB_RESUME;
+    if(g_shellex) flags |= UD_JOB_CONTEXT_MENU_HANDLER;
+    return flags;
+}
+
 static bool process_single_volume(char letter)
 {
     int result = udefrag_validate_volume(letter,false);
@@ -298,14 +319,8 @@ static bool process_single_volume(char letter)
 
     long map_size = g_map_rows * g_map_symbols_per_line;
 
-    udefrag_job_type job_type = DEFRAGMENTATION_JOB;
-    if(g_analyze) job_type = ANALYSIS_JOB;
-    else if(g_optimize) job_type = FULL_OPTIMIZATION_JOB;
-    else if(g_quick_optimization) job_type = QUICK_OPTIMIZATION_JOB;
-    else if(g_optimize_mft) job_type = MFT_OPTIMIZATION_JOB;
-
-    int flags = g_repeat ? UD_JOB_REPEAT : 0;
-    if(g_shellex) flags |= UD_JOB_CONTEXT_MENU_HANDLER;
+    udefrag_job_type job_type = get_job_type();
+    int flags = get_job_flags();
 
     g_stop = false; g_first_progress_update = true;
 
@@ -317,6 +332,100 @@ static bool process_single_volume(char letter)
     return (result == 0);
 }
 
+// progress of multiple jobs is delivered by multiple threads
+static CRITICAL_SECTION g_progress_lock;
+
+static void update_total_progress(char letter, udefrag_progress_info *pi,
+    udefrag_progress_info *total, void *p)
+{
+    EnterCriticalSection(&g_progress_lock);
+
+    if(!g_no_progress){
+        clear_line();
+        if(pi->completion_status != 0 && !g_stop){
+            const char *op_name = "optimize: ";
+            if(pi->current_operation == VOLUME_ANALYSIS) op_name = "analyze:  ";
+            else if(pi->current_operation == VOLUME_DEFRAGMENTATION) op_name = "defrag:   ";
+            printf("\r%c: %s100.00%% complete, fragmented/total = %lu/%lu\n",
+                letter,op_name,pi->fragmented,pi->files);
+        }
+        printf("\rtotal:  %6.2lf%% complete, %lu disks done, fragmented/total = %lu/%lu",
+            total->percentage,total->pass_number,total->fragmented,total->files);
+        if(total->completion_status != 0) printf("\n");
+    }
+
+    if(pi->completion_status != 0 && g_show_vol_info){
+        /* print results of the completed job */
+        char *results = udefrag_get_results(pi);
+        if(results){
+            printf("\n%c:\n%s",letter,results);
+            udefrag_release_results(results);
+        }
+    }
+
+    LeaveCriticalSection(&g_progress_lock);
+}
+
+/**
+ * @brief Processes volumes residing on
+ * different physical disks simultaneously.
+ * @note The cluster map can display
+ * a single volume only, so volumes get
+ * processed one by one when it is shown.
+ */
+static bool process_multiple_volumes(const char *letters)
+{
+    if(g_show_map || strlen(letters) < 2){
+        bool overall_result = false;
+        for(int i = 0; letters[i]; i++){
+            if(g_stop) break;
+            if(process_single_volume(letters[i]))
+                overall_result = true;
+        }
+        return overall_result;
+    }
+
+    char valid_letters[MAX_DOS_DRIVES + 1]; int n = 0;
+    for(int i = 0; letters[i]; i++){
+        int result = udefrag_validate_volume(letters[i],false);
+        if(result < 0){
+            fprintf(stderr,"%c: ",letters[i]);
+            display_invalid_volume_error(result);
+            continue;
+        }
+        valid_letters[n++] = letters[i];
+    }
+    valid_letters[n] = 0;
+    if(n == 0 || g_stop) return false;
+
+    udefrag_job_type job_type = get_job_type();
+    g_first_progress_update = true;
+
+    InitializeCriticalSection(&g_progress_lock);
+    int result = udefrag_start_jobs(valid_letters,job_type,get_job_flags(),0,
+        update_total_progress,terminator,NULL);
+    DeleteCriticalSection(&g_progress_lock);
+
+    if(result < 0) display_defrag_error(job_type,result);
+    return (result == 0);
+}
+
+/**
+ * @brief Adds the volume letter
+ * to the list unless it is there.
+ */
+static void add_letter(char *letters, char letter)
+{
+    letter = winx_toupper(letter);
+    if(strchr(letters,letter)) return;
+
+    int n = (int)strlen(letters);
+    if(n < MAX_DOS_DRIVES){
+        letters[n] = letter;
+        letters[n + 1] = 0;
+    }
+}
+
 static int process_volumes(void)
 {
     bool overall_result = false;
@@ -401,25 +510,25 @@ static int process_volumes(void)
         wxUnsetEnv(wxT("UD_CUT_FILTER"));
 
     /* process volumes */
-    for(int i = 0; i < (int)g_volumes->GetCount(); i++){
-        if(g_stop) break;
-        if(process_single_volume((*g_volumes)[i][0]))
-            overall_result = true;
-    }
+    char letters[MAX_DOS_DRIVES + 1]; letters[0] = 0;
+    for(int i = 0; i < (int)g_volumes->GetCount(); i++)
+        add_letter(letters,(char)(*g_volumes)[i][0]);
 
     /* handle --all and --all-fixed options */
     if(g_all || g_all_fixed){
         volume_info *v = udefrag_get_vollist(g_all_fixed);
         if(v){
-            for(int i = 0; v[i].letter; i++){
-                if(g_stop) break;
-                if(process_single_volume(v[i].letter))
-                    overall_result = true;
-            }
+            for(int i = 0; v[i].letter; i++)
+                add_letter(letters,v[i].letter);
             udefrag_release_vollist(v);
         }
     }
 
+    if(letters[0] && !g_stop){
+        if(process_multiple_volumes(letters))
+            overall_result = true;
+    }
+
     end_synchronization();
 
     (void)SetConsoleCtrlHandler((PHANDLER_ROUTINE)CtrlHandlerRoutine,FALSE);
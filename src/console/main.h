@@ -94,11 +94,13 @@ extern bool g_analyze;
 extern bool g_optimize;
 extern bool g_quick_optimization;
 extern bool g_optimize_mft;
+extern bool g_consolidate_free_space;
 extern bool g_all;
 extern bool g_all_fixed;
 extern bool g_list_volumes;
 extern bool g_list_all;
 extern bool g_repeat;
+extern bool g_resume;
 extern bool g_no_progress;
 extern bool g_show_vol_info;
 extern bool g_show_map;
@@ -63,6 +63,7 @@ static struct option long_options[] = {
     { "optimize",                    no_argument,       0, 'o' },
     { "quick-optimize",              no_argument,       0, 'q' },
     { "optimize-mft",                no_argument,       0,  0  },
+    { "consolidate-free-space",      no_argument,       0,  0  },
     { "all",                         no_argument,       0,  0  },
     { "all-fixed",                   no_argument,       0,  0  },
 
@@ -75,6 +76,7 @@ static struct option long_options[] = {
     * Volume processing options.
     */
     { "repeat",                      no_argument,       0, 'r' },
+    { "resume",                      no_argument,       0,  0  },
 
     /*
     * Progress indicators options.
@@ -143,6 +145,8 @@ bool parse_cmdline(int argc, char **argv)
                 /* do nothing */
             } else if(!strcmp(long_option_name,"optimize-mft")){
                 g_optimize_mft = true;
+            } else if(!strcmp(long_option_name,"consolidate-free-space")){
+                g_consolidate_free_space = true;
             } else if(!strcmp(long_option_name,"map-border-color")){
                 if(!optarg) break;
                 if(!strcmp(optarg,"black")){
@@ -207,6 +211,8 @@ bool parse_cmdline(int argc, char **argv)
                 g_all = true;
             } else if(!strcmp(long_option_name,"all-fixed")){
                 g_all_fixed = true;
+            } else if(!strcmp(long_option_name,"resume")){
+                g_resume = true;
             }
             break;
         case 'a':
@@ -359,14 +365,26 @@ bool set_shellex_options(void)
     wxUnsetEnv(wxT("UD_OPTIMIZER_FILE_SIZE_THRESHOLD"));
     wxUnsetEnv(wxT("UD_FRAGMENTS_THRESHOLD"));
     wxUnsetEnv(wxT("UD_FRAGMENTATION_THRESHOLD"));
+    wxUnsetEnv(wxT("UD_FREE_SPACE_TARGET"));
+    wxUnsetEnv(wxT("UD_FREE_SPACE_FRAGMENTS"));
     wxUnsetEnv(wxT("UD_REFRESH_INTERVAL"));
     wxUnsetEnv(wxT("UD_DISABLE_REPORTS"));
     wxUnsetEnv(wxT("UD_DBGPRINT_LEVEL"));
     wxUnsetEnv(wxT("UD_LOG_FILE_PATH"));
     wxUnsetEnv(wxT("UD_TIME_LIMIT"));
+    wxUnsetEnv(wxT("UD_CANCELLATION_LATENCY"));
+    wxUnsetEnv(wxT("UD_TIMELINE"));
     wxUnsetEnv(wxT("UD_DRY_RUN"));
+    wxUnsetEnv(wxT("UD_DRY_RUN_LATENCY"));
+    wxUnsetEnv(wxT("UD_MOVE_QUEUE_DEPTH"));
+    wxUnsetEnv(wxT("UD_MOVE_VERIFICATION"));
     wxUnsetEnv(wxT("UD_SORTING"));
+    wxUnsetEnv(wxT("UD_HOT_ZONE_AGE"));
+    wxUnsetEnv(wxT("UD_COLD_ZONE_AGE"));
     wxUnsetEnv(wxT("UD_SORTING_ORDER"));
+    wxUnsetEnv(wxT("UD_SORTING_TRACE"));
+    wxUnsetEnv(wxT("UD_IN_PLACE_OPTIMIZATION"));
+    wxUnsetEnv(wxT("UD_INCREMENTAL_OPTIMIZATION"));
 
     /* interprete options.lua file */
     wxFileName path(wxT("%UD_INSTALL_DIR%\\options.lua"));
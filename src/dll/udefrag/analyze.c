@@ -81,6 +81,8 @@ struct fs fs_types[] = {
  * @brief Defines how many clusters to move at once in the move_file routine.
  * @details This algorithm has been suggested by Joachim Otahal:
  * http://sourceforge.net/projects/ultradefrag/forums/forum/709672/topic/4779581
+ * @note The value defined here is just an initial guess; it gets
+ * adjusted according to the measured speed of moves then.
  */
 void adjust_move_at_once_parameter(udefrag_job_parameters *jp)
 {
@@ -107,6 +109,13 @@ void adjust_move_at_once_parameter(udefrag_job_parameters *jp)
     winx_bytes_to_hr(bytes_at_once,0,buffer,sizeof(buffer));
     itrace("the program will move %s (%I64u clusters) at once",
         buffer, jp->clusters_at_once);
+    if(jp->udo.cancellation_latency)
+        itrace("this value will be adjusted on the fly");
+    
+    /* the value is adjusted by move routines then */
+    jp->p_counters.initial_clusters_at_once = jp->clusters_at_once;
+    jp->p_counters.min_clusters_at_once = jp->clusters_at_once;
+    jp->p_counters.max_clusters_at_once = jp->clusters_at_once;
 }
 
 /**
@@ -572,6 +581,9 @@ static int find_files(udefrag_job_parameters *jp)
     int flags = 0;
     winx_file_info *f;
     winx_blockmap *block;
+    winx_ftw_statistics *stats = &jp->p_counters.ftw_statistics;
+    
+    timeline_begin(jp,"scan");
     
     /* check for context menu handler */
     if(jp->udo.job_flags & UD_JOB_CONTEXT_MENU_HANDLER){
@@ -606,11 +618,27 @@ static int find_files(udefrag_job_parameters *jp)
         jp->filelist = winx_scan_disk(jp->volume_letter,
             WINX_FTW_DUMP_FILES | WINX_FTW_ALLOW_PARTIAL_SCAN | \
             WINX_FTW_SKIP_RESIDENT_STREAMS,
-            filter,progress_callback,terminator,(void *)jp);
+            filter,progress_callback,terminator,(void *)jp,stats);
+    }
+    
+    /* stages of the NTFS scan are timed by zenwinx */
+    if(stats->path_building_end){
+        timeline_span(jp,"path building",stats->path_building_start,
+            stats->path_building_end,"files",stats->path_builds.count);
+    }
+    if(stats->filtering_end){
+        timeline_span(jp,"filtering",stats->filtering_start,
+            stats->filtering_end,NULL,0);
     }
+    timeline_end(jp,"scan");
+    
     if(jp->filelist == NULL && !jp->termination_router((void *)jp))
         return (-1);
     
+    /* the list serves for everything, just slower */
+    if(build_file_table(jp) < 0)
+        itrace("the list of files will be used instead of the table");
+    
     /* calculate number of fragmented files; redraw map */
     for(f = jp->filelist; f; f = f->next){
         /* skip excluded files */
@@ -708,6 +736,25 @@ static int is_well_known_locked_file(winx_file_info *f,udefrag_job_parameters *j
     return 0;
 }
 
+/**
+ * @internal
+ * @brief Checks whether the file is a well
+ * known locked file and is locked indeed.
+ * @return Nonzero value indicates that it is.
+ */
+static int detect_well_known_locked_file(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(!is_well_known_locked_file(f,jp))
+        return 0;
+    if(!is_file_locked(f,jp)){
+        /* possibility of this case should be reduced */
+        itrace("false detection: %ws",f->path);
+        return 0;
+    }
+    itrace("true detection:  %ws",f->path);
+    return 1;
+}
+
 /**
  * @brief Searches for well known locked files
  * and applies their dispositions to the map.
@@ -715,26 +762,27 @@ static int is_well_known_locked_file(winx_file_info *f,udefrag_job_parameters *j
  */
 static void redraw_well_known_locked_files(udefrag_job_parameters *jp)
 {
+    struct file_table *t = &jp->file_table;
     winx_file_info *f;
     ULONGLONG time;
     ULONGLONG n = 0;
+    ULONG i;
 
     winx_dbg_print_header(0,0,I"search for well known locked files...");
     time = winx_xtime();
     
-    for(f = jp->filelist; f; f = f->next){
-        if(f->disp.blockmap){ /* otherwise nothing to redraw */
-            if(is_well_known_locked_file(f,jp)){
-                if(!is_file_locked(f,jp)){
-                    /* possibility of this case should be reduced */
-                    itrace("false detection: %ws",f->path);
-                } else {
-                    itrace("true detection:  %ws",f->path);
-                    n ++;
-                }
-            }
+    /* files having no clusters have nothing to redraw */
+    if(has_file_table(jp)){
+        for(i = 0; i < t->count; i++){
+            if(t->first_lcn[i] != FILE_TABLE_NO_LCN)
+                n += detect_well_known_locked_file(t->files[i],jp);
+        }
+    } else {
+        for(f = jp->filelist; f; f = f->next){
+            if(f->disp.blockmap)
+                n += detect_well_known_locked_file(f,jp);
+            if(f->next == jp->filelist) break;
         }
-        if(f->next == jp->filelist) break;
     }
 
     itrace("%I64u locked files found",n);
@@ -792,18 +840,29 @@ void truncate_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp
  */
 static void produce_list_of_fragmented_files(udefrag_job_parameters *jp)
 {
+    struct file_table *t = &jp->file_table;
     winx_file_info *f;
     ULONGLONG bad_fragments = 0;
+    ULONG i;
     
     itrace("started creation of fragmented files list");
     jp->fragmented_files = prb_create(fragmented_files_compare,(void *)jp,NULL);
-    for(f = jp->filelist; f; f = f->next){
-        if(is_fragmented(f) && !is_excluded(f)){
-            expand_fragmented_files_list(f,jp);
-            /* more precise calculation seems to be too slow */
-            bad_fragments += f->disp.fragments;
+    /* more precise calculation of bad fragments seems to be too slow */
+    if(has_file_table(jp)){
+        for(i = 0; i < t->count; i++){
+            if(t->fragments[i] > 1 && !t->excluded[i]){
+                expand_fragmented_files_list(t->files[i],jp);
+                bad_fragments += t->fragments[i];
+            }
+        }
+    } else {
+        for(f = jp->filelist; f; f = f->next){
+            if(is_fragmented(f) && !is_excluded(f)){
+                expand_fragmented_files_list(f,jp);
+                bad_fragments += f->disp.fragments;
+            }
+            if(f->next == jp->filelist) break;
         }
-        if(f->next == jp->filelist) break;
     }
     jp->pi.bad_fragments = bad_fragments;
     itrace("finished creation of fragmented files list");
@@ -895,6 +954,9 @@ int analyze(udefrag_job_parameters *jp)
     
     jp->p_counters.analysis_time = winx_xtime() - time;
     stop_timing("analysis",time,jp);
+    
+    /* the journal needs to know the volume */
+    (void)open_journal(jp);
     return 0;
 }
 
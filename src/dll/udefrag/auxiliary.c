@@ -70,6 +70,7 @@ ULONGLONG start_timing(char *operation_name,udefrag_job_parameters *jp)
 {
     winx_dbg_print_header(0,0,I"%s of %c: started",operation_name,jp->volume_letter);
     jp->progress_trigger = 0;
+    timeline_begin(jp,operation_name);
     return winx_xtime();
 }
 
@@ -84,6 +85,7 @@ void stop_timing(char *operation_name,ULONGLONG start_time,udefrag_job_parameter
     ULONGLONG time, seconds;
     char buffer[32];
     
+    timeline_end(jp,operation_name);
     time = winx_xtime() - start_time;
     seconds = time / 1000;
     winx_time2str(seconds,buffer,sizeof(buffer));
@@ -93,6 +95,19 @@ void stop_timing(char *operation_name,ULONGLONG start_time,udefrag_job_parameter
     jp->progress_trigger = 0;
 }
 
+/**
+ * @internal
+ * @brief Displays percentiles
+ * of the latency histogram.
+ */
+static void dbg_print_histogram(char *name,winx_histogram *h)
+{
+    if(h->count == 0) return;
+    itrace("%s latency: %I64u times, mean %I64u us, p50 %I64u us, p90 %I64u us, p99 %I64u us, max %I64u us",
+        name,h->count,h->sum / h->count,winx_histogram_percentile(h,50),
+        winx_histogram_percentile(h,90),winx_histogram_percentile(h,99),h->max);
+}
+
 /**
  * @internal
  * @brief Displays a single
@@ -146,15 +161,72 @@ void dbg_print_performance_counters(udefrag_job_parameters *jp)
     dbg_print_single_counter(jp,jp->p_counters.searching_time,            "searching ..............");
     dbg_print_single_counter(jp,jp->p_counters.moving_time,               "moving .................");
     dbg_print_single_counter(jp,jp->p_counters.temp_space_releasing_time, "releasing temp space ...");
+    dbg_print_single_counter(jp,jp->p_counters.sorting_time,              "sorting ................");
+    dbg_print_single_counter(jp,jp->p_counters.verification_time,         "verification of moves ..");
+    dbg_print_single_counter(jp,jp->p_counters.file_opening_time,         "file opening ...........");
+    if(jp->p_counters.file_opens){
+        itrace("%I64u files opened, %I64u closed, %I64u moves reused open handles",
+            jp->p_counters.file_opens,jp->p_counters.file_closes,
+            jp->p_counters.handle_cache_hits);
+    }
+    if(jp->p_counters.file_moves){
+        itrace("%I64u files redumped for %I64u moves, %I64u moved not as calculated",
+            jp->p_counters.redumped_files,jp->p_counters.file_moves,
+            jp->p_counters.mismatched_files);
+    }
+    if(jp->p_counters.max_move_latency){
+        itrace("clusters moved at once: initial %I64u, final %I64u, min %I64u, max %I64u",
+            jp->p_counters.initial_clusters_at_once,jp->clusters_at_once,
+            jp->p_counters.min_clusters_at_once,jp->p_counters.max_clusters_at_once);
+        itrace("the longest move request took %I64u ms",jp->p_counters.max_move_latency);
+    }
+    dbg_print_histogram("move",&jp->p_counters.move_latency);
+    dbg_print_histogram("free region search",&jp->p_counters.search_latency);
+    dbg_print_histogram("MFT record read",&jp->p_counters.ftw_statistics.mft_record_reads);
+    dbg_print_histogram("path build",&jp->p_counters.ftw_statistics.path_builds);
+    if(jp->p_counters.progress_notifications){
+        itrace("%I64u progress notifications delivered in %I64u ms on average, %I64u ms at most",
+            jp->p_counters.progress_notifications,
+            jp->p_counters.notification_latency / jp->p_counters.progress_notifications,
+            jp->p_counters.max_notification_latency);
+    }
+}
+
+/**
+ * @internal
+ * @brief Displays memory usage
+ * of a single subsystem.
+ */
+static void dbg_print_heap_usage(winx_heap_usage *u)
+{
+    char current[32], peak[32];
+    
+    if(u->allocations == 0) return;
+    (void)winx_bytes_to_hr(u->bytes,1,current,sizeof(current));
+    (void)winx_bytes_to_hr(u->peak_bytes,1,peak,sizeof(peak));
+    itrace(" - %-20s %10s in use, %10s at peak, %I64u blocks (%I64u at peak)",
+        u->name,current,peak,u->blocks,u->peak_blocks);
 }
 
 /**
  * @brief Displays how much time
  * the entire disk processing job
  * took.
+ * @details Displays memory usage
+ * of the process as well.
  */
 void dbg_print_footer(udefrag_job_parameters *jp)
 {
+    winx_heap_statistics hs;
+    int i;
+    
+    winx_get_heap_statistics(&hs);
+    winx_dbg_print_header(0,0,I"*");
+    itrace("memory usage since the library initialization:");
+    for(i = 0; i < WINX_HEAP_TAGS; i++)
+        dbg_print_heap_usage(&hs.tags[i]);
+    dbg_print_heap_usage(&hs.total);
+    
     winx_dbg_print_header(0,0,I"*");
     winx_dbg_print_header(0,0,I"Processing of %c: %s",
         jp->volume_letter, (jp->pi.completion_status > 0) ? "succeeded" : "failed");
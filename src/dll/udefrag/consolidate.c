@@ -0,0 +1,387 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file consolidate.c
+ * @brief Free space consolidation.
+ * @details Joins free space regions together
+ * by moving file blocks separating them to
+ * the free space elsewhere. The smallest gaps
+ * are cleaned up first, as they give the most
+ * of the contiguous free space per moved cluster.
+ * Blocks are moved to the smallest free regions
+ * fitting them to keep large regions intact.
+ * @addtogroup Consolidation
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+/*
+* Space occupied by files
+* between two free regions.
+*/
+struct gap {
+    ULONGLONG lcn;     /* the first cluster of the gap */
+    ULONGLONG length;  /* length of the gap, in clusters */
+    ULONGLONG start;   /* the first cluster of the free region preceding the gap */
+    ULONGLONG end;     /* the cluster following the free region after the gap */
+};
+
+/************************************************************/
+/*                   Auxiliary routines                     */
+/************************************************************/
+
+/**
+ * @brief Retrieves number of free space
+ * regions and length of the largest one.
+ */
+static void get_free_space_state(udefrag_job_parameters *jp,
+    ULONGLONG *count, ULONGLONG *largest)
+{
+    winx_volume_region *rgn;
+
+    *count = *largest = 0;
+    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
+        if(rgn->length){
+            (*count) ++;
+            if(rgn->length > *largest)
+                *largest = rgn->length;
+        }
+        if(rgn->next == jp->free_regions) break;
+    }
+}
+
+/**
+ * @brief Checks whether the free space
+ * is consolidated enough already.
+ */
+static int is_target_reached(udefrag_job_parameters *jp)
+{
+    ULONGLONG count, largest;
+
+    get_free_space_state(jp,&count,&largest);
+    if(count <= 1) return 1;
+
+    if(jp->udo.free_space_target){
+        if(largest * jp->v_info.bytes_per_cluster >= jp->udo.free_space_target)
+            return 1;
+    }
+    if(jp->udo.free_space_fragments){
+        if(count <= jp->udo.free_space_fragments)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Searches for the smallest free region
+ * fitting the block, outside of the specified range.
+ */
+static winx_volume_region *find_best_fit_region(udefrag_job_parameters *jp,
+    ULONGLONG length, ULONGLONG start, ULONGLONG end)
+{
+    winx_volume_region *rgn, *best = NULL;
+    ULONGLONG time = winx_xtime();
+
+    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
+        if(jp->termination_router((void *)jp)) break;
+        if(rgn->length >= length && \
+          (rgn->lcn + rgn->length <= start || rgn->lcn >= end)){
+            if(best == NULL || rgn->length < best->length){
+                best = rgn;
+                if(best->length == length) break;
+            }
+        }
+        if(rgn->next == jp->free_regions) break;
+    }
+    jp->p_counters.searching_time += winx_xtime() - time;
+    return best;
+}
+
+static int gaps_compare(const void *prb_a, const void *prb_b, void *prb_param)
+{
+    struct gap *a, *b;
+
+    a = (struct gap *)prb_a;
+    b = (struct gap *)prb_b;
+
+    if(a->length != b->length)
+        return (a->length < b->length) ? (-1) : 1;
+    if(a->lcn != b->lcn)
+        return (a->lcn < b->lcn) ? (-1) : 1;
+    return 0;
+}
+
+static void free_gap(void *prb_item, void *prb_param)
+{
+    winx_free(prb_item);
+}
+
+/**
+ * @brief Builds tree of gaps between
+ * free regions, sorted by length.
+ * @return The tree, NULL indicates failure.
+ */
+static struct prb_table *collect_gaps(udefrag_job_parameters *jp,ULONGLONG *total)
+{
+    struct prb_table *gaps;
+    winx_volume_region *rgn, *prev = NULL;
+    struct gap *g;
+
+    *total = 0;
+    gaps = prb_create(gaps_compare,NULL,NULL);
+    if(gaps == NULL){
+        mtrace();
+        return NULL;
+    }
+
+    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
+        if(rgn->length){
+            if(prev && rgn->lcn > prev->lcn + prev->length){
+                g = winx_tmalloc(sizeof(struct gap));
+                if(g == NULL){
+                    mtrace();
+                    prb_destroy(gaps,free_gap);
+                    return NULL;
+                }
+                g->lcn = prev->lcn + prev->length;
+                g->length = rgn->lcn - g->lcn;
+                g->start = prev->lcn;
+                g->end = rgn->lcn + rgn->length;
+                if(prb_probe(gaps,(void *)g) == NULL){
+                    mtrace();
+                    winx_free(g);
+                    prb_destroy(gaps,free_gap);
+                    return NULL;
+                }
+                *total += g->length;
+            }
+            prev = rgn;
+        }
+        if(rgn->next == jp->free_regions) break;
+    }
+    return gaps;
+}
+
+/**
+ * @brief Brings bounds of the gap
+ * in line with the current free regions.
+ * @details Gaps are collected once per pass,
+ * while free regions surrounding them may be
+ * joined or filled in by previous moves.
+ * @return Zero if the gap still lies between
+ * two free regions, negative value otherwise.
+ */
+static int refresh_gap(udefrag_job_parameters *jp,struct gap *g)
+{
+    winx_volume_region *rgn, *prev = NULL;
+
+    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
+        if(rgn->lcn > g->lcn) break;
+        if(rgn->length) prev = rgn;
+        if(rgn->next == jp->free_regions){ rgn = NULL; break; }
+    }
+    if(prev == NULL || rgn == NULL) return (-1);
+    if(prev->lcn + prev->length != g->lcn) return (-1);
+    if(rgn->lcn != g->lcn + g->length || rgn->length == 0) return (-1);
+    g->start = prev->lcn;
+    g->end = rgn->lcn + rgn->length;
+    return 0;
+}
+
+/**
+ * @brief Checks whether the gap is entirely
+ * occupied by blocks of movable files.
+ */
+static int is_gap_movable(udefrag_job_parameters *jp,struct gap *g)
+{
+    winx_file_info *file;
+    winx_blockmap *block;
+    ULONGLONG lcn, min_lcn;
+
+    lcn = min_lcn = g->lcn;
+    while(lcn < g->lcn + g->length){
+        block = find_first_block(jp,&min_lcn,0,&file);
+        /* unmovable data or metadata found */
+        if(block == NULL || block->lcn != lcn) return 0;
+        lcn += block->length;
+    }
+    return 1;
+}
+
+/**
+ * @brief Moves all the blocks
+ * out of the gap.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int cleanup_gap(udefrag_job_parameters *jp,struct gap *g)
+{
+    winx_file_info *file;
+    winx_blockmap *block;
+    winx_volume_region *rgn;
+    ULONGLONG min_lcn, next_lcn;
+    int result = 0;
+
+    min_lcn = g->lcn;
+    while(!jp->termination_router((void *)jp)){
+        block = find_first_block(jp,&min_lcn,0,&file);
+        if(block == NULL || block->lcn >= g->lcn + g->length)
+            return result;
+        rgn = find_best_fit_region(jp,block->length,g->start,g->end);
+        if(rgn == NULL) return (-1);
+        /* the block may be not moved entirely, so skip it anyway */
+        next_lcn = block->lcn + block->length;
+        if(move_file(file,block->vcn,block->length,rgn->lcn,jp) < 0)
+            result = (-1);
+        min_lcn = next_lcn;
+    }
+    return (-1);
+}
+
+/**
+ * @brief Consolidates free space.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int consolidation_routine(udefrag_job_parameters *jp)
+{
+    struct prb_table *gaps;
+    struct prb_traverser t;
+    struct gap *g;
+    ULONGLONG count, largest, total;
+    ULONGLONG cleaned_gaps, skipped_gaps;
+    ULONGLONG time;
+    char buffer[32];
+    int result = 0;
+
+    jp->pi.current_operation = VOLUME_OPTIMIZATION;
+
+    /* open the volume */
+    jp->fVolume = winx_vopen(winx_toupper(jp->volume_letter));
+    if(jp->fVolume == NULL)
+        return (-1);
+
+    time = start_timing("free space consolidation",jp);
+
+    /* no files are excluded by this task currently */
+    clear_currently_excluded_flag(jp);
+
+    while(!jp->termination_router((void *)jp)){
+        winx_dbg_print_header(0,0,I"free space consolidation pass #%u",jp->pi.pass_number);
+        jp->pi.moved_clusters = 0;
+
+        /* actualize list of free regions */
+        release_temp_space_regions(jp);
+        get_free_space_state(jp,&count,&largest);
+        winx_bytes_to_hr(largest * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+        itrace("%I64u free regions, the largest one is %s",count,buffer);
+        if(is_target_reached(jp)) break;
+
+        gaps = collect_gaps(jp,&total);
+        if(gaps == NULL){
+            result = (-1);
+            break;
+        }
+        jp->pi.clusters_to_process = jp->pi.processed_clusters + total;
+
+        /* clean up the smallest gaps first */
+        cleaned_gaps = skipped_gaps = 0;
+        prb_t_init(&t,gaps);
+        g = prb_t_first(&t,gaps);
+        while(g){
+            if(jp->termination_router((void *)jp)) break;
+            if(refresh_gap(jp,g) == 0 && is_gap_movable(jp,g) && cleanup_gap(jp,g) == 0){
+                cleaned_gaps ++;
+                /* each cleaned gap joins two regions */
+                if(count) count --;
+                if((jp->udo.free_space_fragments && count <= jp->udo.free_space_fragments) || \
+                  (jp->udo.free_space_target && (g->end - g->start) * \
+                  jp->v_info.bytes_per_cluster >= jp->udo.free_space_target)){
+                    release_temp_space_regions(jp);
+                    if(is_target_reached(jp)) break;
+                }
+            } else {
+                skipped_gaps ++;
+                jp->pi.processed_clusters += g->length;
+            }
+            g = prb_t_next(&t);
+        }
+        prb_destroy(gaps,free_gap);
+
+        itrace("%I64u gaps cleaned up, %I64u gaps skipped",cleaned_gaps,skipped_gaps);
+        itrace("%I64u clusters moved",jp->pi.moved_clusters);
+        winx_bytes_to_hr(jp->pi.moved_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+        itrace("%s moved",buffer);
+        jp->pi.pass_number ++; /* the pass is completed */
+
+        /* break if nothing moved */
+        if(jp->pi.moved_clusters == 0) break;
+
+        /* break if no repeat allowed */
+        if(!(jp->udo.job_flags & UD_JOB_REPEAT)) break;
+    }
+
+    /* display the result */
+    release_temp_space_regions(jp);
+    get_free_space_state(jp,&count,&largest);
+    winx_bytes_to_hr(largest * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+    itrace("%I64u free regions left, the largest one is %s",count,buffer);
+    stop_timing("free space consolidation",time,jp);
+
+    /* cleanup */
+    clear_currently_excluded_flag(jp);
+    winx_fclose(jp->fVolume);
+    jp->fVolume = NULL;
+    return result;
+}
+
+/************************************************************/
+/*                    The entry point                       */
+/************************************************************/
+
+/**
+ * @brief Consolidates free space on the disk.
+ * @details Stops when the largest free region
+ * reaches %UD_FREE_SPACE_TARGET or number of free
+ * regions falls to %UD_FREE_SPACE_FRAGMENTS.
+ * @return Zero for success, negative value otherwise.
+ */
+int consolidate_free_space(udefrag_job_parameters *jp)
+{
+    int result;
+
+    /* reset filters */
+    release_options(jp);
+    jp->udo.size_limit = MAX_FILE_SIZE;
+    jp->udo.fragments_limit = 0;
+
+    /* perform volume analysis */
+    result = analyze(jp); /* we need to call it once, here */
+    if(result < 0) return result;
+
+    /* reset counters */
+    jp->pi.processed_clusters = 0;
+    jp->pi.clusters_to_process = 0;
+
+    return consolidation_routine(jp);
+}
+
+/** @} */
@@ -156,14 +156,14 @@ static int can_defragment(winx_file_info *f,udefrag_job_parameters *jp)
 /**
  * @brief build_fragments_list helper.
  */
-static winx_blockmap *add_fragment(winx_blockmap **fragments,
+static winx_blockmap *add_fragment(winx_file_info *f,winx_blockmap **fragments,
     winx_blockmap **prev_fragment, ULONGLONG vcn, ULONGLONG lcn,
     ULONGLONG length)
 {
     winx_blockmap *fragment;
     
-    fragment = (winx_blockmap *)winx_list_insert((list_entry **)(void *)fragments,
-        (list_entry *)*prev_fragment,sizeof(winx_blockmap));
+    fragment = winx_blockmap_insert(f,fragments,*prev_fragment);
+    if(fragment == NULL) return NULL;
     fragment->vcn = vcn;
     fragment->lcn = lcn;
     fragment->length = length;
@@ -191,7 +191,7 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
                 length += block->length;
             } else {
                 if(length){
-                    if(!add_fragment(&fragments,&p,vcn,lcn,length))
+                    if(!add_fragment(f,&fragments,&p,vcn,lcn,length))
                         break;
                     if(n_fragments) (*n_fragments) ++;
                 }
@@ -204,7 +204,7 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
     }
     
     if(length){
-        if(add_fragment(&fragments,&p,vcn,lcn,length)){
+        if(add_fragment(f,&fragments,&p,vcn,lcn,length)){
             if(n_fragments) (*n_fragments) ++;
         }
     }
@@ -214,11 +214,114 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
 }
 
 /**
- * @brief Releases list of file fragments.
+ * @brief Releases list of file fragments
+ * built by build_fragments_list for the file.
  */
-void release_fragments_list(winx_blockmap **fragments)
+void release_fragments_list(winx_file_info *f,winx_blockmap **fragments)
 {
-    winx_list_destroy((list_entry **)(void *)fragments);
+    winx_blockmap_destroy(f,fragments);
+}
+
+/**
+ * @brief Returns array of fragments of the file.
+ * @details The array is built once from the map of
+ * blocks and reused until the file gets moved or
+ * another file gets requested. Thus loops walking
+ * through fragments of the same file don't need
+ * to allocate anything.
+ * @param[in] f pointer to the file.
+ * @param[out] n_fragments number of fragments.
+ * @param[in] jp job parameters.
+ * @return Pointer to the array of fragments,
+ * NULL indicates failure. The array must not be
+ * modified and becomes invalid after the next
+ * call of this routine or move_file.
+ */
+udefrag_fragment *get_fragment_index(winx_file_info *f,
+    ULONGLONG *n_fragments,udefrag_job_parameters *jp)
+{
+    struct fragment_index *fi = &jp->fragment_index;
+    udefrag_fragment *fragments;
+    winx_blockmap *block;
+    ULONGLONG n, capacity;
+    
+    *n_fragments = 0;
+
+    if(fi->file == f){
+        fi->hits ++;
+        *n_fragments = fi->n_fragments;
+        return fi->fragments;
+    }
+    
+    fi->file = NULL;
+    
+    /* the number of fragments cannot exceed the number of blocks */
+    n = 0;
+    for(block = f->disp.blockmap; block; block = block->next){
+        n ++; if(block->next == f->disp.blockmap) break;
+    }
+    if(n == 0) return NULL;
+    
+    if(n > fi->capacity){
+        capacity = max(n,2 * fi->capacity);
+        fragments = winx_tmalloc((size_t)capacity * sizeof(udefrag_fragment));
+        if(fragments == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                capacity * sizeof(udefrag_fragment));
+            return NULL;
+        }
+        winx_free(fi->fragments);
+        fi->fragments = fragments;
+        fi->capacity = capacity;
+    }
+    
+    /* join adjacent blocks */
+    fragments = fi->fragments; n = 0;
+    for(block = f->disp.blockmap; block; block = block->next){
+        if(n && block->lcn == fragments[n - 1].lcn + fragments[n - 1].length){
+            fragments[n - 1].length += block->length;
+        } else if(block->length){
+            fragments[n].vcn = block->vcn;
+            fragments[n].lcn = block->lcn;
+            fragments[n].length = block->length;
+            n ++;
+        }
+        if(block->next == f->disp.blockmap) break;
+    }
+
+    fi->file = f;
+    fi->n_fragments = n;
+    fi->rebuilds ++;
+    *n_fragments = n;
+    return n ? fragments : NULL;
+}
+
+/**
+ * @brief Invalidates the array of fragments
+ * returned by get_fragment_index for the file.
+ * @note Must be called whenever the map
+ * of blocks of the file gets changed.
+ */
+void invalidate_fragment_index(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(jp->fragment_index.file == f)
+        jp->fragment_index.file = NULL;
+}
+
+/**
+ * @brief Releases the array of fragments
+ * allocated by get_fragment_index.
+ */
+void release_fragment_index(udefrag_job_parameters *jp)
+{
+    struct fragment_index *fi = &jp->fragment_index;
+    
+    if(fi->hits || fi->rebuilds){
+        itrace("fragment index: %I64u requests, %I64u rebuilds, %I64u entries",
+            fi->hits + fi->rebuilds,fi->rebuilds,fi->capacity);
+    }
+    winx_free(fi->fragments);
+    memset(fi,0,sizeof(struct fragment_index));
 }
 
 /**
@@ -256,6 +359,178 @@ static ULONGLONG defrag_cc_routine(udefrag_job_parameters *jp)
     return n;
 }
 
+/**
+ * @brief Decides whether the file should
+ * be moved entirely rather than partially.
+ */
+static int is_moved_entirely(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(f->disp.clusters * jp->v_info.bytes_per_cluster \
+      < 2 * jp->udo.fragment_size_threshold) return 1;
+    if(jp->win_version < WINDOWS_XP && jp->fs_type == FS_NTFS)
+        return 1; /* keep algorithm simple */
+    return 0;
+}
+
+/************************************************************/
+/*                  Time budget scheduling                  */
+/************************************************************/
+
+/*
+* When the time limit is set, the most fragmented
+* files may easily eat the entire time window. So
+* files are ordered by the number of eliminated
+* fragments per moved cluster instead; recently
+* accessed files are preferred. Files which cannot
+* be processed in the remaining time are skipped,
+* so the window is filled by smaller ones.
+*/
+
+/* number of days in which the recency weight halves */
+#define RECENCY_HALF_WEIGHT_DAYS 30
+
+struct defrag_candidate {
+    winx_file_info *file;
+    double priority;  /* weighted eliminated fragments per moved cluster */
+    ULONGLONG cost;   /* clusters expected to be moved */
+};
+
+static int candidates_compare(const void *prb_a, const void *prb_b, void *prb_param)
+{
+    struct defrag_candidate *a, *b;
+    
+    a = (struct defrag_candidate *)prb_a;
+    b = (struct defrag_candidate *)prb_b;
+    
+    if(a->priority > b->priority) return (-1);
+    if(a->priority < b->priority) return 1;
+    if(a->cost < b->cost) return (-1);
+    if(a->cost > b->cost) return 1;
+    /* candidates are stored in an array */
+    if(a < b) return (-1);
+    if(a > b) return 1;
+    return 0;
+}
+
+/**
+ * @brief Estimates cost and benefit of the file defragmentation.
+ * @param[in] c the candidate to be filled.
+ * @param[in] now the current time, in the standard time format.
+ * @param[in] jp the job parameters.
+ */
+static void estimate_defrag_profit(struct defrag_candidate *c,
+    ULONGLONG now,udefrag_job_parameters *jp)
+{
+    winx_file_info *f = c->file;
+    winx_blockmap *block;
+    ULONGLONG fragments = 0, clusters = 0, days = 0;
+    double weight;
+    
+    if(is_moved_entirely(f,jp)){
+        fragments = f->disp.fragments - 1;
+        clusters = f->disp.clusters;
+    } else {
+        /* only little fragments are moved */
+        for(block = f->disp.blockmap; block; block = block->next){
+            if(block->length * jp->v_info.bytes_per_cluster < jp->udo.fragment_size_threshold){
+                fragments ++;
+                clusters += block->length;
+            }
+            if(block->next == f->disp.blockmap) break;
+        }
+    }
+    
+    if(f->last_access_time && f->last_access_time < now)
+        days = (now - f->last_access_time) / ((ULONGLONG)24 * 3600 * 1000 * 1000 * 10);
+    weight = 1.0 + (double)RECENCY_HALF_WEIGHT_DAYS / \
+        (double)(RECENCY_HALF_WEIGHT_DAYS + days);
+    
+    c->cost = clusters;
+    c->priority = weight * (double)fragments / (double)max(clusters,1);
+}
+
+/**
+ * @brief Orders fragmented files by profit
+ * of their defragmentation.
+ * @param[out] array pointer to the array of
+ * candidates which must be released then.
+ * @return The ordered tree of candidates,
+ * NULL if it cannot be built.
+ */
+static struct prb_table *order_by_profit(udefrag_job_parameters *jp,
+    struct defrag_candidate **array)
+{
+    struct prb_table *candidates;
+    struct prb_traverser t;
+    winx_file_info *file;
+    struct defrag_candidate *c;
+    LARGE_INTEGER now;
+    ULONGLONG n;
+    
+    *array = NULL;
+    n = prb_count(jp->fragmented_files);
+    if(n == 0) return NULL;
+    
+    if(!NT_SUCCESS(NtQuerySystemTime(&now)))
+        now.QuadPart = 0;
+    
+    c = winx_tmalloc(n * sizeof(struct defrag_candidate));
+    if(c == NULL){
+        mtrace();
+        return NULL;
+    }
+    candidates = prb_create(candidates_compare,NULL,NULL);
+    if(candidates == NULL){
+        mtrace();
+        winx_free(c);
+        return NULL;
+    }
+    
+    *array = c;
+    prb_t_init(&t,jp->fragmented_files);
+    file = prb_t_first(&t,jp->fragmented_files);
+    while(file){
+        if(can_defragment(file,jp)){
+            c->file = file;
+            estimate_defrag_profit(c,(ULONGLONG)now.QuadPart,jp);
+            if(prb_probe(candidates,(void *)c) == NULL){
+                mtrace();
+                prb_destroy(candidates,NULL);
+                winx_free(*array);
+                *array = NULL;
+                return NULL;
+            }
+            c ++;
+        }
+        file = prb_t_next(&t);
+    }
+    return candidates;
+}
+
+/**
+ * @brief Checks whether the file can be defragmented
+ * in time remaining before the time limit.
+ * @note The moving speed is unknown until the first
+ * request completes; all the files fit until then.
+ */
+static int fits_time_budget(struct defrag_candidate *c,udefrag_job_parameters *jp)
+{
+    ULONGLONG elapsed, budget;
+    double speed = jp->move_queue.speed;
+    
+    if(speed == 0) return 1;
+    
+    elapsed = winx_xtime() - jp->start_time;
+    budget = jp->udo.time_limit * 1000;
+    if(elapsed >= budget) return 0;
+    
+    return ((double)c->cost / speed <= (double)(budget - elapsed)) ? 1 : 0;
+}
+
+/************************************************************/
+/*                   Defragmentation pass                   */
+/************************************************************/
+
 /**
  * @brief Eliminates little fragments
  * respect to the fragment size threshold filter.
@@ -265,12 +540,16 @@ static int defrag_routine(udefrag_job_parameters *jp)
     winx_volume_region *rgn, *largest_rgn;
     struct prb_traverser t;
     winx_file_info *file, *next_file;
+    struct prb_table *candidates = NULL;
+    struct defrag_candidate *array, *c = NULL, *next_c = NULL;
+    ULONGLONG skipped_files = 0;
     int move_entirely;
     ULONGLONG defragmented_files;
     ULONGLONG defragmented_entirely = 0, defragmented_partially = 0;
     ULONGLONG x, moved_entirely = 0, moved_partially = 0;
     ULONGLONG min_vcn, max_vcn; /* used to avoid infinite loops */
-    winx_blockmap *fragments, *fr, *fr2, *next_fr, *head_fr;
+    udefrag_fragment *fragments, *fr, *fr2;
+    ULONGLONG n_fragments, i, j, first, last;
     ULONGLONG vcn, length, n, new_min_vcn;
     ULONGLONG cut_length;
     int defrag_succeeded;
@@ -303,20 +582,34 @@ static int defrag_routine(udefrag_job_parameters *jp)
 
     /*
     * Eliminate little fragments. Defragment
-    * the most fragmented files first of all.
+    * the most fragmented files first of all,
+    * unless the time limit is set.
     */
     defragmented_files = 0;
-    prb_t_init(&t,jp->fragmented_files);
-    file = prb_t_first(&t,jp->fragmented_files);
+    if(jp->udo.time_limit)
+        candidates = order_by_profit(jp,&array);
+    if(candidates){
+        prb_t_init(&t,candidates);
+        c = prb_t_first(&t,candidates);
+        file = c ? c->file : NULL;
+    } else {
+        prb_t_init(&t,jp->fragmented_files);
+        file = prb_t_first(&t,jp->fragmented_files);
+    }
     while(file){
         if(jp->termination_router((void *)jp)) break;
-        next_file = prb_t_next(&t);
+        if(candidates){
+            next_c = prb_t_next(&t);
+            next_file = next_c ? next_c->file : NULL;
+            if(!fits_time_budget(c,jp)){
+                skipped_files ++;
+                goto completed;
+            }
+        } else {
+            next_file = prb_t_next(&t);
+        }
         if(can_defragment(file,jp)){
-            move_entirely = 0;
-            if(file->disp.clusters * jp->v_info.bytes_per_cluster \
-              < 2 * jp->udo.fragment_size_threshold) move_entirely = 1;
-            else if(jp->win_version < WINDOWS_XP && jp->fs_type == FS_NTFS)
-                move_entirely = 1; /* keep algorithm simple */
+            move_entirely = is_moved_entirely(file,jp);
             if(move_entirely){
                 /* move entire file */
                 rgn = find_first_free_region(jp,0,file->disp.clusters,NULL);
@@ -341,19 +634,19 @@ static int defrag_routine(udefrag_job_parameters *jp)
                 defrag_succeeded = 0;
                 x = jp->pi.moved_clusters;
                 while(min_vcn < max_vcn && can_defragment(file,jp)){
-                    /* build list of fragments */
-                    fragments = build_fragments_list(file,NULL);
+                    /* get fragments of the file */
+                    fragments = get_fragment_index(file,&n_fragments,jp);
                     if(fragments == NULL) break;
                     
                     /* cut off already processed fragments and data after max_vcn */
-                    for(fr = fragments; fr; fr = next_fr){
-                        head_fr = fragments;
-                        next_fr = fr->next;
-                        if(fr->vcn < min_vcn || (fr->vcn + fr->length > max_vcn))
-                            winx_list_remove((list_entry **)(void *)&fragments,(list_entry *)(void *)fr);
-                        if(fragments == NULL) goto completed;
-                        if(next_fr == head_fr) break;
+                    first = last = 0;
+                    for(i = 0; i < n_fragments; i++){
+                        if(fragments[i].vcn < min_vcn) continue;
+                        if(fragments[i].vcn + fragments[i].length > max_vcn) continue;
+                        if(first == last) first = i;
+                        last = i + 1;
                     }
+                    if(first == last) goto completed;
                     
                     /* how much clusters can we join together? */
                     largest_rgn = find_largest_free_region(jp);
@@ -361,7 +654,8 @@ static int defrag_routine(udefrag_job_parameters *jp)
                     
                     /* find clusters needing optimization */
                     vcn = length = n = new_min_vcn = 0;
-                    for(fr = fragments; fr; fr = fr->next){
+                    for(i = first; i < last; i++){
+                        fr = &fragments[i];
                         /* find the first little fragment */
                         if(fr->length * jp->v_info.bytes_per_cluster < jp->udo.fragment_size_threshold){
                             if(fr->length >= largest_rgn->length) break;
@@ -369,7 +663,8 @@ static int defrag_routine(udefrag_job_parameters *jp)
                             length = fr->length, n++;
                             new_min_vcn = fr->vcn + fr->length;
                             /* look forward for the next little fragments */
-                            for(fr2 = fr->next; fr2 != fragments; fr2 = fr2->next){
+                            for(j = i + 1; j < last; j++){
+                                fr2 = &fragments[j];
                                 if(fr2->length * jp->v_info.bytes_per_cluster >= jp->udo.fragment_size_threshold)
                                     break;
                                 if(length + fr2->length > largest_rgn->length) goto move_clusters;
@@ -382,8 +677,9 @@ static int defrag_routine(udefrag_job_parameters *jp)
                                 if(cut_length * jp->v_info.bytes_per_cluster != jp->udo.fragment_size_threshold)
                                     cut_length ++;
                                 cut_length -= length;
-                                if(fr2 != fragments){
+                                if(j < last){
                                     /* let's cut from the next fragment */
+                                    fr2 = &fragments[j];
                                     if((fr2->length - cut_length) * jp->v_info.bytes_per_cluster \
                                       < jp->udo.fragment_size_threshold){
                                         length += fr2->length, n++;
@@ -392,21 +688,21 @@ static int defrag_routine(udefrag_job_parameters *jp)
                                         length += cut_length, n++;
                                         new_min_vcn = fr2->vcn + cut_length;
                                     }
-                                } else if(fr != fragments){
+                                } else if(i > first){
                                     /* let's cut from the previous fragment */
-                                    if((fr->prev->length - cut_length) * jp->v_info.bytes_per_cluster \
+                                    fr2 = &fragments[i - 1];
+                                    if((fr2->length - cut_length) * jp->v_info.bytes_per_cluster \
                                       < jp->udo.fragment_size_threshold){
-                                        vcn = fr->prev->vcn;
-                                        length += fr->prev->length, n++;
+                                        vcn = fr2->vcn;
+                                        length += fr2->length, n++;
                                     } else {
-                                        vcn = fr->prev->vcn + (fr->prev->length - cut_length);
+                                        vcn = fr2->vcn + (fr2->length - cut_length);
                                         length += cut_length, n++;
                                     }
                                 }
                             }
                             break;
                         }
-                        if(fr->next == fragments) break;
                     }
                     
 move_clusters:                    
@@ -426,9 +722,6 @@ move_clusters:
                         }
                         min_vcn = new_min_vcn;
                     }
-                    
-                    /* release list of fragments */
-                    release_fragments_list(&fragments);
                 }
                 if(defrag_succeeded){
                     defragmented_files ++;
@@ -440,6 +733,13 @@ move_clusters:
 completed:
         file->user_defined_flags |= UD_FILE_CURRENTLY_EXCLUDED;
         file = next_file;
+        c = next_c;
+    }
+    
+    if(candidates){
+        prb_destroy(candidates,NULL);
+        winx_free(array);
+        itrace("%I64u files skipped to fit the time limit",skipped_files);
     }
     
     /*
@@ -483,7 +783,9 @@ static int defrag_sequence(udefrag_job_parameters *jp)
     if(jp->pi.fragmented == 0) return 0;
     
     while(!jp->termination_router((void *)jp)){
+        timeline_begin(jp,"defragmentation pass");
         result = defrag_routine(jp);
+        timeline_end(jp,"defragmentation pass");
         if(result == 0){
             /* defragmentation succeeded at least once */
             overall_result = 0;
@@ -508,7 +810,9 @@ static int defrag_sequence(udefrag_job_parameters *jp)
         itrace("partial defragmentation: fragment size threshold = %I64u",
             jp->udo.fragment_size_threshold);
         while(!jp->termination_router((void *)jp)){
+            timeline_begin(jp,"partial defragmentation pass");
             result = defrag_routine(jp);
+            timeline_end(jp,"partial defragmentation pass");
             if(result == 0){
                 /* defragmentation succeeded at least once */
                 overall_result = 0;
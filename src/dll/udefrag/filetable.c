@@ -0,0 +1,212 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file filetable.c
+ * @brief Table of files.
+ * @details Once the volume is scanned, the list of files
+ * is mirrored by the table of columns addressed by 32-bit
+ * identifiers of files: attributes, numbers of clusters
+ * and fragments, the first cluster, times and identifiers
+ * of parent directories. Filters and counters walk through
+ * the columns they need instead of the list, so they touch
+ * a few bytes per file instead of the whole list entry.
+ *
+ * The list stays the primary view of files; the files
+ * column leads from the identifier back to the list entry
+ * and the user_defined_id field of the entry leads to its
+ * identifier. Columns depending on the disposition of the
+ * file are updated after each move of the file. If there
+ * is not enough memory for the table, filters and counters
+ * walk through the list instead.
+ * @addtogroup FileTable
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+/**
+ * @internal
+ * @brief Fills columns of the file.
+ */
+static void fill_columns(struct file_table *t,ULONG id,winx_file_info *f)
+{
+    t->clusters[id] = f->disp.clusters;
+    t->fragments[id] = f->disp.fragments;
+    t->first_lcn[id] = f->disp.blockmap ? f->disp.blockmap->lcn : FILE_TABLE_NO_LCN;
+    t->excluded[id] = is_excluded(f) ? 1 : 0;
+}
+
+/**
+ * @internal
+ * @brief Fills the column of parent directories.
+ * @details Only NTFS scans provide identifiers
+ * of parent directories; on other file systems
+ * parents remain unknown.
+ */
+static void find_parents(udefrag_job_parameters *jp)
+{
+    struct file_table *t = &jp->file_table;
+    struct file_position *dirs;
+    winx_file_info *f;
+    ULONGLONG mft_id;
+    ULONG i, n, lo, hi, mid;
+
+    for(i = 0; i < t->count; i++)
+        t->parent[i] = FILE_TABLE_NO_ID;
+    if(jp->fs_type != FS_NTFS) return;
+
+    for(i = 0, n = 0; i < t->count; i++)
+        if(t->flags[i] & FILE_ATTRIBUTE_DIRECTORY) n ++;
+    if(n == 0) return;
+
+    /* the second half is used by sorting */
+    dirs = winx_tmalloc((size_t)n * 2 * sizeof(struct file_position));
+    if(dirs == NULL){
+        mtrace();
+        return;
+    }
+    for(i = 0, n = 0; i < t->count; i++){
+        if(t->flags[i] & FILE_ATTRIBUTE_DIRECTORY){
+            dirs[n].lcn = t->files[i]->internal.BaseMftId;
+            dirs[n].index = i;
+            n ++;
+        }
+    }
+    sort_by_lcn(dirs,dirs + n,n);
+
+    for(i = 0; i < t->count; i++){
+        f = t->files[i];
+        mft_id = f->internal.ParentDirectoryMftId;
+        /* the root directory has no parent */
+        if(mft_id == f->internal.BaseMftId) continue;
+        for(lo = 0, hi = n; lo < hi;){
+            mid = lo + (hi - lo) / 2;
+            if(dirs[mid].lcn < mft_id) lo = mid + 1;
+            else hi = mid;
+        }
+        if(lo < n && dirs[lo].lcn == mft_id)
+            t->parent[i] = (ULONG)dirs[lo].index;
+    }
+    winx_free(dirs);
+}
+
+/**
+ * @brief Builds the table of files
+ * from the list of files.
+ * @return Zero for success,
+ * negative value otherwise.
+ * @note Must be rebuilt whenever
+ * the list of files gets changed.
+ */
+int build_file_table(udefrag_job_parameters *jp)
+{
+    struct file_table *t = &jp->file_table;
+    winx_file_info *f;
+    ULONGLONG n = 0;
+    size_t size;
+    char *p;
+    ULONG i;
+
+    release_file_table(jp);
+
+    for(f = jp->filelist; f; f = f->next){
+        n ++;
+        if(f->next == jp->filelist) break;
+    }
+    if(n >= FILE_TABLE_NO_ID){
+        etrace("too many files: %I64u",n);
+        return (-1);
+    }
+    if(n == 0) return 0;
+
+    /* columns of the same type follow each other to keep them aligned */
+    size = (size_t)n * (6 * sizeof(ULONGLONG) + sizeof(winx_file_info *) \
+        + 2 * sizeof(ULONG) + sizeof(UCHAR));
+    p = winx_tmalloc_tagged(size,WINX_HEAP_TAG_FILE_INFO);
+    if(p == NULL){
+        etrace("cannot allocate %Iu bytes of memory",size);
+        return (-1);
+    }
+    t->clusters = (ULONGLONG *)p; p += (size_t)n * sizeof(ULONGLONG);
+    t->fragments = (ULONGLONG *)p; p += (size_t)n * sizeof(ULONGLONG);
+    t->first_lcn = (ULONGLONG *)p; p += (size_t)n * sizeof(ULONGLONG);
+    t->creation_time = (ULONGLONG *)p; p += (size_t)n * sizeof(ULONGLONG);
+    t->modification_time = (ULONGLONG *)p; p += (size_t)n * sizeof(ULONGLONG);
+    t->access_time = (ULONGLONG *)p; p += (size_t)n * sizeof(ULONGLONG);
+    t->files = (winx_file_info **)p; p += (size_t)n * sizeof(winx_file_info *);
+    t->flags = (ULONG *)p; p += (size_t)n * sizeof(ULONG);
+    t->parent = (ULONG *)p; p += (size_t)n * sizeof(ULONG);
+    t->excluded = (UCHAR *)p;
+
+    for(i = 0, f = jp->filelist; f; f = f->next, i++){
+        f->user_defined_id = i;
+        t->files[i] = f;
+        t->flags[i] = f->flags;
+        t->creation_time[i] = f->creation_time;
+        t->modification_time[i] = f->last_modification_time;
+        t->access_time[i] = f->last_access_time;
+        fill_columns(t,i,f);
+        if(f->next == jp->filelist) break;
+    }
+    t->count = (ULONG)n;
+
+    find_parents(jp);
+    itrace("file table of %u files built",t->count);
+    return 0;
+}
+
+/**
+ * @brief Updates columns depending
+ * on the disposition of the file.
+ * @note Must be called whenever the map
+ * of blocks of the file or its exclusion
+ * from the disk processing gets changed.
+ */
+void update_file_table(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    struct file_table *t = &jp->file_table;
+    ULONG id = f->user_defined_id;
+
+    if(id < t->count && t->files[id] == f)
+        fill_columns(t,id,f);
+}
+
+/**
+ * @brief Defines whether the table
+ * of files has been built or not.
+ * @note Volumes having no files
+ * have no table as well.
+ */
+int has_file_table(udefrag_job_parameters *jp)
+{
+    return (jp->file_table.files != NULL);
+}
+
+/**
+ * @brief Releases the table of files.
+ */
+void release_file_table(udefrag_job_parameters *jp)
+{
+    /* all the columns are allocated at once */
+    winx_free(jp->file_table.clusters);
+    memset(&jp->file_table,0,sizeof(struct file_table));
+}
+
+/** @} */
@@ -0,0 +1,414 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file incremental.c
+ * @brief Incremental optimization.
+ * @details After the disk optimization the volume
+ * is split into ranges of clusters and fingerprints
+ * of ranges holding sorted out files are saved to the
+ * reports directory. The next quick optimization skips
+ * ranges where the same files still lie in the same
+ * order: their files stay in place, and the rest of
+ * files get placed around them in the sorted order.
+ *
+ * The fingerprint of a range covers paths, positions,
+ * sizes and sort keys of all the files starting there.
+ * Fingerprints of the sorting options and of the volume
+ * are saved as well; any change of them invalidates
+ * the entire layout.
+ * @addtogroup Incremental
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+#define LAYOUT_SIGNATURE "UDLAYOUT"
+#define LAYOUT_VERSION   1
+
+/* the volume is split into this number of ranges at most */
+#define MAX_LAYOUT_RANGES 65536
+
+/* minimal length of a range, in clusters */
+#define MIN_LAYOUT_RANGE 256
+
+struct layout_header {
+    char signature[8];          /* LAYOUT_SIGNATURE */
+    ULONG version;              /* LAYOUT_VERSION */
+    ULONG reserved;
+    ULONGLONG serial_number;    /* serial number of the volume, zero on FAT */
+    ULONGLONG total_clusters;   /* size of the volume, in clusters */
+    ULONGLONG bytes_per_cluster;
+    ULONGLONG options;          /* fingerprint of the sorting options */
+    ULONGLONG range_length;     /* length of each range, in clusters */
+    ULONGLONG count;            /* number of ranges following the header */
+};
+
+struct layout_range {
+    ULONGLONG index;            /* position of the range on the volume */
+    ULONGLONG fingerprint;      /* fingerprint of files starting there */
+};
+
+/************************************************************/
+/*                   Auxiliary routines                     */
+/************************************************************/
+
+/**
+ * @brief Adds bytes to the FNV-1a hash.
+ * @note The hash must be initialized
+ * by FNV_OFFSET_BASIS.
+ */
+ULONGLONG hash_bytes(ULONGLONG hash,const void *data,size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while(size--){
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Adds a number to the FNV-1a hash.
+ */
+ULONGLONG hash_value(ULONGLONG hash,ULONGLONG value)
+{
+    return hash_bytes(hash,&value,sizeof(ULONGLONG));
+}
+
+/**
+ * @brief Returns length of ranges
+ * the volume is split into.
+ */
+static ULONGLONG get_range_length(udefrag_job_parameters *jp)
+{
+    ULONGLONG length;
+
+    length = (jp->v_info.total_clusters + MAX_LAYOUT_RANGES - 1) / MAX_LAYOUT_RANGES;
+    return max(length,MIN_LAYOUT_RANGE);
+}
+
+/**
+ * @brief Returns fingerprint of the options
+ * the order of sorted out files depends on.
+ */
+ULONGLONG get_options_fingerprint(udefrag_job_parameters *jp)
+{
+    ULONGLONG options = FNV_OFFSET_BASIS;
+
+    options = hash_value(options,(ULONGLONG)jp->udo.sorting_flags);
+    options = hash_value(options,jp->udo.optimizer_size_limit);
+    options = hash_value(options,jp->udo.hot_zone_age);
+    options = hash_value(options,jp->udo.cold_zone_age);
+    return options;
+}
+
+/**
+ * @brief Fills the header of the layout
+ * for the volume being processed.
+ */
+static void init_layout_header(udefrag_job_parameters *jp,struct layout_header *h)
+{
+    memset(h,0,sizeof(struct layout_header));
+    memcpy(h->signature,LAYOUT_SIGNATURE,sizeof(h->signature));
+    h->version = LAYOUT_VERSION;
+    if(jp->fs_type == FS_NTFS)
+        h->serial_number = (ULONGLONG)jp->v_info.ntfs_data.VolumeSerialNumber.QuadPart;
+    h->total_clusters = jp->v_info.total_clusters;
+    h->bytes_per_cluster = jp->v_info.bytes_per_cluster;
+    h->options = get_options_fingerprint(jp);
+    h->range_length = get_range_length(jp);
+}
+
+/**
+ * @brief Adds the file to the fingerprint
+ * of the range it starts in.
+ * @details Everything the sorting and
+ * placement of the file depend on is
+ * taken into account.
+ */
+static ULONGLONG hash_file(ULONGLONG hash,winx_file_info *f,
+    ULONGLONG now,udefrag_job_parameters *jp)
+{
+    hash = hash_bytes(hash,f->path,wcslen(f->path) * sizeof(wchar_t));
+    hash = hash_value(hash,f->disp.blockmap->lcn);
+    hash = hash_value(hash,f->disp.clusters);
+    hash = hash_value(hash,f->creation_time);
+    hash = hash_value(hash,f->last_modification_time);
+    hash = hash_value(hash,(ULONGLONG)get_access_rank(f,jp));
+    if(jp->udo.sorting_flags & UD_SORT_BY_ACCESS_TIME)
+        hash = hash_value(hash,f->last_access_time);
+    if(jp->udo.sorting_flags & UD_SORT_BY_ZONES)
+        hash = hash_value(hash,(ULONGLONG)get_file_zone(f,now,jp));
+    return hash;
+}
+
+/**
+ * @brief Builds list of positions of files,
+ * sorted by LCN.
+ * @param[in] sf the list of files.
+ * @param[out] n number of files.
+ * @return The list of positions referring to
+ * the list of files, NULL indicates either
+ * failure or lack of files.
+ * @note The list must be released by winx_free.
+ * It is twice longer than needed, the second half
+ * is used by sorting.
+ */
+static struct file_position *get_file_positions(udefrag_sorted_files *sf,ULONGLONG *n)
+{
+    struct file_position *items;
+    ULONGLONG i;
+
+    *n = sf->count;
+    if(sf->count == 0) return NULL;
+
+    items = winx_tmalloc((size_t)sf->count * 2 * sizeof(struct file_position));
+    if(items == NULL){
+        mtrace();
+        return NULL;
+    }
+    for(i = 0; i < sf->count; i++){
+        items[i].lcn = sf->items[i].file->disp.blockmap->lcn;
+        items[i].index = i;
+    }
+    sort_by_lcn(items,items + sf->count,sf->count);
+    return items;
+}
+
+/**
+ * @brief Searches for the range
+ * in the loaded layout.
+ * @note Ranges are sorted by index.
+ */
+static struct layout_range *find_range(struct layout_range *ranges,
+    ULONGLONG n,ULONGLONG index)
+{
+    ULONGLONG lo = 0, hi = n, i;
+
+    while(lo < hi){
+        i = lo + (hi - lo) / 2;
+        if(ranges[i].index == index) return &ranges[i];
+        if(ranges[i].index < index) lo = i + 1;
+        else hi = i;
+    }
+    return NULL;
+}
+
+/************************************************************/
+/*                    The entry points                      */
+/************************************************************/
+
+/**
+ * @brief Marks files lying in ranges left
+ * intact since the last optimization as
+ * already optimized.
+ * @details Such files stay in the list, so
+ * the rest of files get placed around them in
+ * the sorted order; they are moved only when
+ * files sorted before them cannot fit before
+ * them. Does nothing unless
+ * %UD_INCREMENTAL_OPTIMIZATION is set to 1.
+ * @param[in] jp the job parameters.
+ * @param[in,out] sf the list of files.
+ * @return Zero for success, negative value otherwise.
+ */
+int cut_off_unchanged_ranges(udefrag_job_parameters *jp,udefrag_sorted_files *sf)
+{
+    struct layout_header header, *h;
+    struct layout_range *ranges, *r;
+    struct file_position *items;
+    winx_file_info *f;
+    unsigned char *contents;
+    wchar_t *path;
+    size_t size;
+    LARGE_INTEGER now;
+    ULONGLONG n, i, j, k, index, fingerprint;
+    ULONGLONG total_ranges = 0, unchanged_ranges = 0;
+    ULONGLONG skipped_files = 0, clusters = 0;
+    ULONGLONG time;
+    char buffer[32];
+
+    if(!jp->udo.incremental_optimization) return 0;
+
+    path = get_report_path(jp,L"layout",L"bin");
+    if(path == NULL) return (-1);
+    contents = winx_get_file_contents(path,&size);
+    winx_free(path);
+    if(contents == NULL){
+        itrace("no layout of the previous optimization found");
+        return 0;
+    }
+
+    /* validate the layout */
+    init_layout_header(jp,&header);
+    h = (struct layout_header *)contents;
+    if(size < sizeof(struct layout_header) \
+      || memcmp(h->signature,header.signature,sizeof(header.signature)) \
+      || h->version != header.version \
+      || h->serial_number != header.serial_number \
+      || h->total_clusters != header.total_clusters \
+      || h->bytes_per_cluster != header.bytes_per_cluster \
+      || h->options != header.options \
+      || h->range_length != header.range_length \
+      || h->count > MAX_LAYOUT_RANGES \
+      || size != sizeof(struct layout_header) + h->count * sizeof(struct layout_range)){
+        itrace("layout of the previous optimization is out of date");
+        winx_free(contents);
+        return 0;
+    }
+    ranges = (struct layout_range *)(h + 1);
+
+    time = start_timing("cutting off unchanged ranges",jp);
+    if(!NT_SUCCESS(NtQuerySystemTime(&now)))
+        now.QuadPart = 0;
+
+    items = get_file_positions(sf,&n);
+    if(items == NULL){
+        winx_free(contents);
+        stop_timing("cutting off unchanged ranges",time,jp);
+        return n ? (-1) : 0;
+    }
+
+    /* mark files of ranges whose fingerprint still matches */
+    for(i = 0; i < n; i = j){
+        index = items[i].lcn / header.range_length;
+        fingerprint = FNV_OFFSET_BASIS;
+        for(j = i; j < n && items[j].lcn / header.range_length == index; j++){
+            f = sf->items[items[j].index].file;
+            fingerprint = hash_file(fingerprint,f,(ULONGLONG)now.QuadPart,jp);
+        }
+        total_ranges ++;
+        r = find_range(ranges,h->count,index);
+        if(r == NULL || r->fingerprint != fingerprint) continue;
+        for(k = i; k < j; k++){
+            f = sf->items[items[k].index].file;
+            f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT | UD_FILE_IN_UNCHANGED_RANGE;
+            clusters += f->disp.clusters;
+        }
+        skipped_files += j - i;
+        unchanged_ranges ++;
+    }
+    winx_free(items);
+    winx_free(contents);
+
+    itrace("%I64u of %I64u ranges unchanged, %I64u files skipped",
+        unchanged_ranges,total_ranges,skipped_files);
+    winx_bytes_to_hr(clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+    itrace("%s skipped",buffer);
+    stop_timing("cutting off unchanged ranges",time,jp);
+    return 0;
+}
+
+/**
+ * @brief Saves fingerprints of ranges
+ * holding sorted out files.
+ * @details A range is saved when all the files
+ * starting there are either sorted out by the
+ * current optimization or left intact, and lie
+ * one after another in the sorted order. Does
+ * nothing unless %UD_INCREMENTAL_OPTIMIZATION
+ * is set to 1.
+ * @param[in] jp the job parameters.
+ * @param[in] sf the sorted list of files.
+ * @return Zero for success, negative value otherwise.
+ * @note Nothing is saved in dry run,
+ * as the disk remains the same.
+ */
+int save_layout(udefrag_job_parameters *jp,udefrag_sorted_files *sf)
+{
+    struct layout_header header;
+    struct layout_range *ranges = NULL;
+    struct file_position *items;
+    winx_file_info *f;
+    WINX_FILE *file;
+    wchar_t *path;
+    LARGE_INTEGER now;
+    ULONGLONG n, i, j, k, index, count = 0;
+    ULONGLONG total_ranges = 0;
+    int sorted;
+    int result = (-1);
+
+    if(!jp->udo.incremental_optimization || jp->udo.dry_run) return 0;
+
+    init_layout_header(jp,&header);
+    if(!NT_SUCCESS(NtQuerySystemTime(&now)))
+        now.QuadPart = 0;
+
+    items = get_file_positions(sf,&n);
+    if(items == NULL && n) return (-1);
+    if(n){
+        ranges = winx_tmalloc((size_t)min(n,MAX_LAYOUT_RANGES) * sizeof(struct layout_range));
+        if(ranges == NULL){
+            mtrace();
+            goto cleanup;
+        }
+    }
+
+    for(i = 0; i < n; i = j){
+        index = items[i].lcn / header.range_length;
+        sorted = 1;
+        for(j = i; j < n && items[j].lcn / header.range_length == index; j++){
+            f = sf->items[items[j].index].file;
+            if(!is_moved_to_front(f) || is_moving_failed(f))
+                sorted = 0;
+            /* files left intact may be fragmented, the rest may not */
+            if(is_fragmented(f) && !(f->user_defined_flags & UD_FILE_IN_UNCHANGED_RANGE))
+                sorted = 0;
+            /* sorted files must follow each other */
+            if(j > i && items[j].index != items[j - 1].index + 1)
+                sorted = 0;
+        }
+        total_ranges ++;
+        if(!sorted) continue;
+
+        /* compute the fingerprint exactly as the next run will do */
+        ranges[count].index = index;
+        ranges[count].fingerprint = FNV_OFFSET_BASIS;
+        for(k = i; k < j; k++){
+            ranges[count].fingerprint = hash_file(ranges[count].fingerprint,
+                sf->items[items[k].index].file,(ULONGLONG)now.QuadPart,jp);
+        }
+        count ++;
+    }
+    header.count = count;
+
+    path = get_report_path(jp,L"layout",L"bin");
+    if(path == NULL) goto cleanup;
+    file = winx_fopen(path,"w");
+    winx_free(path);
+    if(file == NULL) goto cleanup;
+    if(winx_fwrite(&header,sizeof(struct layout_header),1,file) == 1){
+        if(count == 0 || winx_fwrite(ranges,sizeof(struct layout_range),(size_t)count,file) == count)
+            result = 0;
+    }
+    winx_fclose(file);
+    if(result == 0)
+        itrace("%I64u of %I64u ranges saved for the next optimization",count,total_ranges);
+    else
+        etrace("cannot save layout of the optimized files");
+
+cleanup:
+    winx_free(ranges);
+    winx_free(items);
+    return result;
+}
+
+/** @} */
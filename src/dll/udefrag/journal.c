@@ -0,0 +1,476 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file journal.c
+ * @brief Journal of moves.
+ * @details Each job moving files appends compact
+ * records to the journal kept in the reports directory:
+ * a record describing the job and the volume comes first,
+ * then records of planned and completed moves follow,
+ * and the state of the optimization is saved after each
+ * pass. The journal gets flushed after each pass and
+ * removed once the job completes.
+ *
+ * If a job is interrupted by a reboot, a power loss
+ * or the user, the journal stays on the disk. The next
+ * job started with the UD_JOB_RESUME flag checks whether
+ * the journal belongs to the same job on the same volume
+ * and, if so, continues the optimization from the last
+ * completed pass instead of starting from scratch.
+ * Moves completed before that pass are carried over to
+ * the new journal; they tell where files sorted out
+ * already must be found.
+ *
+ * Moves themselves are atomic, so a move interrupted
+ * in the middle leaves the file either at the old or
+ * at the new place; records of moves are used for
+ * diagnostics only.
+ * @addtogroup Journal
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+#define JOURNAL_VERSION 1
+
+/* records are written in bulk, flushed after each pass */
+#define JOURNAL_BUFFER_SIZE (64 * 1024)
+
+/* types of journal records */
+enum {
+    JOURNAL_JOB = 0x424f4a55,   /* first record of the journal */
+    JOURNAL_PASS,               /* state of the optimization after the pass */
+    JOURNAL_MOVE_PLANNED,       /* a move is about to be started */
+    JOURNAL_MOVE_COMPLETED      /* the move has succeeded */
+};
+
+/*
+* Layout of the data[] array of records:
+* JOURNAL_JOB: version, serial number of the volume,
+*     total clusters, bytes per cluster, options
+*     fingerprint, job type
+* JOURNAL_PASS: passes completed, processed clusters,
+*     cursor, start LCN, end LCN, files fingerprint
+* JOURNAL_MOVE_xxx: path fingerprint, VCN,
+*     length, target LCN, unused, unused
+*/
+struct journal_record {
+    ULONG type;                 /* one of the JOURNAL_xxx constants */
+    ULONG reserved;
+    ULONGLONG data[6];
+};
+
+/************************************************************/
+/*                   Auxiliary routines                     */
+/************************************************************/
+
+/**
+ * @brief Fills the first record
+ * of the journal for the current job.
+ */
+static void init_job_record(udefrag_job_parameters *jp,struct journal_record *r)
+{
+    memset(r,0,sizeof(struct journal_record));
+    r->type = JOURNAL_JOB;
+    r->data[0] = JOURNAL_VERSION;
+    if(jp->fs_type == FS_NTFS)
+        r->data[1] = (ULONGLONG)jp->v_info.ntfs_data.VolumeSerialNumber.QuadPart;
+    r->data[2] = jp->v_info.total_clusters;
+    r->data[3] = jp->v_info.bytes_per_cluster;
+    r->data[4] = get_options_fingerprint(jp);
+    r->data[5] = (ULONGLONG)jp->job_type;
+}
+
+/**
+ * @brief Returns fingerprint of
+ * the sorted files preceding the cursor.
+ */
+static ULONGLONG get_files_fingerprint(udefrag_sorted_files *sf,ULONGLONG cursor)
+{
+    ULONGLONG fingerprint = FNV_OFFSET_BASIS;
+    winx_file_info *f;
+    ULONGLONG i;
+
+    for(i = 0; i < cursor && i < sf->count; i++){
+        f = sf->items[i].file;
+        fingerprint = hash_bytes(fingerprint,f->path,wcslen(f->path) * sizeof(wchar_t));
+        fingerprint = hash_value(fingerprint,f->disp.clusters);
+    }
+    return fingerprint;
+}
+
+/**
+ * @brief Appends a record to the journal.
+ * @note Journaling stops on the first failure.
+ */
+static void write_record(udefrag_job_parameters *jp,struct journal_record *r)
+{
+    if(jp->journal.f == NULL) return;
+
+    if(winx_fwrite(r,sizeof(struct journal_record),1,jp->journal.f) != 1){
+        etrace("cannot write the journal");
+        winx_fclose(jp->journal.f);
+        jp->journal.f = NULL;
+    }
+}
+
+/**
+ * @brief Releases moves loaded
+ * from the interrupted journal.
+ */
+static void release_moves(udefrag_job_parameters *jp)
+{
+    winx_free(jp->journal.moves);
+    jp->journal.moves = NULL;
+    jp->journal.n_moves = 0;
+}
+
+/**
+ * @brief Loads the resume point
+ * saved by the interrupted job.
+ * @return Nonzero value indicates
+ * that the resume point is valid.
+ */
+static int load_resume_point(udefrag_job_parameters *jp,wchar_t *path)
+{
+    struct journal_record job, *r, *records;
+    struct journal_record *pass = NULL, *planned = NULL;
+    ULONGLONG count, i, n, interrupted_moves = 0;
+    size_t size;
+
+    release_moves(jp);
+    records = winx_get_file_contents(path,&size);
+    if(records == NULL){
+        itrace("no journal of an interrupted job found");
+        return 0;
+    }
+
+    /* validate the journal */
+    init_job_record(jp,&job);
+    count = size / sizeof(struct journal_record);
+    if(count == 0 || memcmp(&records[0],&job,sizeof(struct journal_record))){
+        itrace("the journal belongs to another job");
+        winx_free(records);
+        return 0;
+    }
+
+    /* find the last completed pass; a torn record at the end is ignored */
+    for(i = 1; i < count; i++){
+        r = &records[i];
+        switch(r->type){
+        case JOURNAL_PASS:
+            pass = r;
+            break;
+        case JOURNAL_MOVE_PLANNED:
+            if(planned) interrupted_moves ++;
+            planned = r;
+            break;
+        case JOURNAL_MOVE_COMPLETED:
+            planned = NULL;
+            break;
+        default:
+            etrace("journal record #%I64u is invalid",i);
+            i = count;
+            break;
+        }
+    }
+    if(planned){
+        itrace("the last move has not been completed: VCN = %I64u, length = %I64u, target = %I64u",
+            planned->data[1],planned->data[2],planned->data[3]);
+        interrupted_moves ++;
+    }
+    if(interrupted_moves)
+        itrace("%I64u moves have not been completed",interrupted_moves);
+    if(pass){
+        jp->journal.resume_point.pass_number = pass->data[0];
+        jp->journal.resume_point.processed_clusters = pass->data[1];
+        jp->journal.resume_point.cursor = pass->data[2];
+        jp->journal.resume_point.start_lcn = pass->data[3];
+        jp->journal.resume_point.end_lcn = pass->data[4];
+        jp->journal.resume_point.fingerprint = pass->data[5];
+        itrace("the interrupted job has completed %I64u passes",pass->data[0]);
+
+        /* keep moves completed before the pass */
+        for(r = records + 1, n = 0; r < pass; r++)
+            if(r->type == JOURNAL_MOVE_COMPLETED) n ++;
+        if(n){
+            jp->journal.moves = winx_tmalloc((size_t)n * sizeof(struct journal_record));
+            if(jp->journal.moves == NULL){
+                mtrace();
+                winx_free(records);
+                return 0;
+            }
+            for(r = records + 1; r < pass; r++){
+                if(r->type == JOURNAL_MOVE_COMPLETED)
+                    jp->journal.moves[jp->journal.n_moves++] = *r;
+            }
+        }
+    }
+    winx_free(records);
+    return pass ? 1 : 0;
+}
+
+/**
+ * @brief Searches for the last completed
+ * move of the file in the sorted list
+ * of moves of the interrupted job.
+ * @return Index of the move, -1
+ * if the file has not been moved.
+ */
+static LONGLONG find_last_move(struct file_position *moves,
+    ULONGLONG n,ULONGLONG path)
+{
+    ULONGLONG lo = 0, hi = n, i;
+
+    /* moves of the same file keep their order */
+    while(lo < hi){
+        i = lo + (hi - lo) / 2;
+        if(moves[i].lcn <= path) lo = i + 1;
+        else hi = i;
+    }
+    if(lo == 0 || moves[lo - 1].lcn != path) return (-1);
+    return (LONGLONG)moves[lo - 1].index;
+}
+
+/************************************************************/
+/*                    The entry points                      */
+/************************************************************/
+
+/**
+ * @brief Starts the journal of the job.
+ * @details Loads the resume point of
+ * the interrupted job if the UD_JOB_RESUME
+ * flag is set. Must be called after the volume
+ * analysis; may be called more than once.
+ * @return Zero for success, negative value otherwise.
+ */
+int open_journal(udefrag_job_parameters *jp)
+{
+    struct journal_record r;
+    wchar_t *path;
+    ULONGLONG i;
+
+    if(jp->journal.f || jp->udo.dry_run) return 0;
+    if(jp->job_type == ANALYSIS_JOB) return 0;
+
+    path = get_report_path(jp,L"journal",L"bin");
+    if(path == NULL) return (-1);
+    if(jp->udo.job_flags & UD_JOB_RESUME)
+        jp->journal.resumable = load_resume_point(jp,path);
+
+    jp->journal.f = winx_fbopen(path,"w",JOURNAL_BUFFER_SIZE);
+    winx_free(path);
+    if(jp->journal.f == NULL){
+        etrace("cannot open the journal");
+        release_moves(jp);
+        return (-1);
+    }
+    init_job_record(jp,&r);
+    write_record(jp,&r);
+    if(jp->journal.resumable){
+        /* carry over moves preceding the resume point */
+        for(i = 0; i < jp->journal.n_moves; i++)
+            write_record(jp,&jp->journal.moves[i]);
+        /* keep the resume point until the next pass completes */
+        memset(&r,0,sizeof(struct journal_record));
+        r.type = JOURNAL_PASS;
+        memcpy(r.data,&jp->journal.resume_point,sizeof(struct resume_point));
+        write_record(jp,&r);
+    }
+    if(jp->journal.f) (void)winx_fflush(jp->journal.f);
+    return jp->journal.f ? 0 : (-1);
+}
+
+/**
+ * @brief Adds a move to the journal.
+ * @param[in] completed nonzero value indicates
+ * that the move has succeeded, zero - that
+ * it is about to be started.
+ */
+void journal_move(udefrag_job_parameters *jp,winx_file_info *f,
+    ULONGLONG vcn,ULONGLONG length,ULONGLONG target,int completed)
+{
+    struct journal_record r;
+
+    if(jp->journal.f == NULL) return;
+
+    memset(&r,0,sizeof(struct journal_record));
+    r.type = completed ? JOURNAL_MOVE_COMPLETED : JOURNAL_MOVE_PLANNED;
+    r.data[0] = hash_bytes(FNV_OFFSET_BASIS,f->path,wcslen(f->path) * sizeof(wchar_t));
+    r.data[1] = vcn;
+    r.data[2] = length;
+    r.data[3] = target;
+    write_record(jp,&r);
+}
+
+/**
+ * @brief Saves state of the optimization
+ * after the pass to the journal.
+ * @param[in] jp the job parameters.
+ * @param[in] sf the sorted list of files.
+ * @param[in] cursor index of the first
+ * file not moved yet.
+ * @param[in] start_lcn LCN of the space
+ * not optimized yet.
+ * @param[in] end_lcn LCN of the space beyond
+ * the area cleaned up for sorted out files.
+ */
+void journal_pass(udefrag_job_parameters *jp,udefrag_sorted_files *sf,
+    ULONGLONG cursor,ULONGLONG start_lcn,ULONGLONG end_lcn)
+{
+    struct journal_record r;
+    ULONGLONG time;
+
+    if(jp->journal.f == NULL) return;
+
+    time = winx_xtime();
+    /* moves of the pass must be journaled before it */
+    complete_move_requests(jp);
+    memset(&r,0,sizeof(struct journal_record));
+    r.type = JOURNAL_PASS;
+    r.data[0] = jp->pi.pass_number;
+    r.data[1] = jp->pi.processed_clusters;
+    r.data[2] = cursor;
+    r.data[3] = start_lcn;
+    r.data[4] = end_lcn;
+    r.data[5] = get_files_fingerprint(sf,cursor);
+    write_record(jp,&r);
+    if(jp->journal.f){
+        if(winx_fflush(jp->journal.f) < 0)
+            etrace("cannot flush the journal");
+    }
+    itrace("journal updated in %I64u ms",winx_xtime() - time);
+}
+
+/**
+ * @brief Continues the interrupted optimization.
+ * @details The resume point is accepted only
+ * if files preceding the saved cursor are
+ * sorted the same way again. Of them, files
+ * moved by the interrupted job are considered
+ * sorted out only if they still start at the
+ * target of their last move.
+ * @param[in] jp the job parameters.
+ * @param[in] sf the sorted list of files.
+ * @param[in,out] cursor index of the first
+ * file not moved yet.
+ * @param[in,out] start_lcn LCN of the space
+ * not optimized yet.
+ * @param[in,out] end_lcn LCN of the space beyond
+ * the area cleaned up for sorted out files.
+ * @return Nonzero value indicates that
+ * the optimization has been resumed.
+ */
+int resume_optimization(udefrag_job_parameters *jp,udefrag_sorted_files *sf,
+    ULONGLONG *cursor,ULONGLONG *start_lcn,ULONGLONG *end_lcn)
+{
+    struct resume_point *rp = &jp->journal.resume_point;
+    struct file_position *moves = NULL;
+    struct journal_record *m;
+    winx_file_info *f;
+    ULONGLONG i, n = jp->journal.n_moves, misplaced = 0;
+    LONGLONG k;
+
+    if(!jp->journal.resumable) return 0;
+    jp->journal.resumable = 0; /* resume once */
+
+    if(rp->cursor > sf->count || rp->start_lcn > jp->v_info.total_clusters \
+      || rp->end_lcn > jp->v_info.total_clusters \
+      || get_files_fingerprint(sf,rp->cursor) != rp->fingerprint){
+        itrace("files have been changed since the interruption, starting from scratch");
+        release_moves(jp);
+        return 0;
+    }
+
+    /* sort moves by path, the second half is used by sorting */
+    if(n){
+        moves = winx_tmalloc((size_t)n * 2 * sizeof(struct file_position));
+        if(moves == NULL){
+            mtrace();
+            release_moves(jp);
+            return 0;
+        }
+        for(i = 0; i < n; i++){
+            moves[i].lcn = jp->journal.moves[i].data[0];
+            moves[i].index = i;
+        }
+        sort_by_lcn(moves,moves + n,n);
+    }
+
+    /* files preceding the cursor are sorted out already */
+    for(i = 0; i < rp->cursor; i++){
+        f = sf->items[i].file;
+        k = moves ? find_last_move(moves,n,hash_bytes(FNV_OFFSET_BASIS,
+            f->path,wcslen(f->path) * sizeof(wchar_t))) : (-1);
+        if(k >= 0){
+            m = &jp->journal.moves[k];
+            if(f->disp.blockmap == NULL || f->disp.blockmap->vcn != m->data[1] \
+              || f->disp.blockmap->lcn != m->data[3]){
+                /* leave it to subsequent optimizations */
+                misplaced ++;
+                continue;
+            }
+        }
+        f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+    }
+    winx_free(moves);
+    release_moves(jp);
+    if(misplaced)
+        itrace("%I64u files are not at their targets",misplaced);
+    *cursor = rp->cursor;
+    *start_lcn = rp->start_lcn;
+    *end_lcn = rp->end_lcn;
+    jp->pi.pass_number = (ULONG)rp->pass_number;
+    if(jp->pi.processed_clusters < rp->processed_clusters)
+        jp->pi.processed_clusters = rp->processed_clusters;
+    itrace("optimization resumed at pass #%u, file #%I64u",
+        jp->pi.pass_number,*cursor);
+    return 1;
+}
+
+/**
+ * @brief Closes the journal.
+ * @param[in] jp the job parameters.
+ * @param[in] completed nonzero value indicates
+ * that the job has completed, so the journal
+ * is removed; otherwise it is kept for the
+ * next job to be resumed.
+ */
+void close_journal(udefrag_job_parameters *jp,int completed)
+{
+    wchar_t *path;
+
+    release_moves(jp);
+    if(jp->journal.f == NULL) return;
+
+    winx_fclose(jp->journal.f);
+    jp->journal.f = NULL;
+    if(completed){
+        path = get_report_path(jp,L"journal",L"bin");
+        if(path){
+            (void)winx_delete_file(path);
+            winx_free(path);
+        }
+    } else {
+        itrace("the journal is kept to resume the job");
+    }
+}
+
+/** @} */
@@ -79,13 +79,13 @@ int allocate_map(int map_size,udefrag_job_parameters *jp)
         return (-1);
 
     /* allocate memory */
-    jp->pi.cluster_map = winx_tmalloc(map_size);
+    jp->pi.cluster_map = winx_tmalloc_tagged(map_size,WINX_HEAP_TAG_CLUSTER_MAP);
     if(jp->pi.cluster_map == NULL){
         etrace("cannot allocate %u bytes of memory",map_size);
         return UDEFRAG_NO_MEM;
     }
     array_size = map_size * SPACE_STATES * sizeof(ULONGLONG);
-    jp->cluster_map.array = winx_tmalloc(array_size);
+    jp->cluster_map.array = winx_tmalloc_tagged(array_size,WINX_HEAP_TAG_CLUSTER_MAP);
     if(jp->cluster_map.array == NULL){
         etrace("cannot allocate %u bytes of memory",
             array_size);
@@ -33,8 +33,13 @@
  */
 void release_temp_space_regions(udefrag_job_parameters *jp)
 {
-    ULONGLONG time = winx_xtime();
+    ULONGLONG time;
+    
+    /* dispositions of moved files must be actual before */
+    verify_moved_files(jp);
+    close_cached_handles(jp);
     
+    time = winx_xtime();
     if(!jp->udo.dry_run){
         winx_release_free_volume_regions(jp->free_regions);
         jp->free_regions = winx_get_free_volume_regions(jp->volume_letter,
@@ -149,6 +154,511 @@ int can_move_entirely(winx_file_info *f,udefrag_job_parameters *jp)
     return 1;
 }
 
+/************************************************************/
+/*                       Move queue                         */
+/************************************************************/
+
+/**
+ * @brief Prepares the queue of move requests.
+ * @return Zero for success, negative value otherwise.
+ * @note If asynchronous requests cannot be
+ * set up, the queue falls back to a single
+ * synchronous request in flight.
+ */
+static int create_move_queue(udefrag_job_parameters *jp)
+{
+    struct move_queue *q = &jp->move_queue;
+    int i, depth = jp->udo.move_queue_depth;
+    NTSTATUS status;
+    
+    if(q->requests) return 0;
+    
+    q->requests = winx_tmalloc(depth * sizeof(struct move_request));
+    if(q->requests == NULL){
+        mtrace();
+        return (-1);
+    }
+    memset(q->requests,0,depth * sizeof(struct move_request));
+    q->first = q->count = 0;
+    
+    /* a single request in flight needs no events */
+    if(depth == 1 || jp->udo.dry_run) return 0;
+    
+    status = winx_defrag_vopen(jp->volume_letter,&q->hVolume);
+    if(status != STATUS_SUCCESS){
+        strace(status,"cannot open volume for asynchronous requests");
+        goto fallback;
+    }
+    for(i = 0; i < depth; i++){
+        status = NtCreateEvent(&q->requests[i].hEvent,
+            STANDARD_RIGHTS_ALL | 0x1ff,NULL,NotificationEvent,FALSE);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            q->requests[i].hEvent = NULL;
+            goto fallback;
+        }
+    }
+    itrace("up to %u move requests will be kept in flight",depth);
+    return 0;
+    
+fallback:
+    for(i = 0; i < depth; i++){
+        if(q->requests[i].hEvent){
+            NtClose(q->requests[i].hEvent);
+            q->requests[i].hEvent = NULL;
+        }
+    }
+    winx_defrag_fclose(q->hVolume);
+    q->hVolume = NULL;
+    jp->udo.move_queue_depth = 1;
+    return 0;
+}
+
+/**
+ * @brief Destroys the queue of move requests.
+ * @note Requests still in flight get completed.
+ */
+void destroy_move_queue(udefrag_job_parameters *jp)
+{
+    struct move_queue *q = &jp->move_queue;
+    int i;
+    
+    complete_move_requests(jp);
+    if(q->requests){
+        for(i = 0; i < jp->udo.move_queue_depth; i++){
+            if(q->requests[i].hEvent)
+                NtClose(q->requests[i].hEvent);
+        }
+        winx_free(q->requests);
+    }
+    winx_defrag_fclose(q->hVolume);
+    memset(q,0,sizeof(struct move_queue));
+}
+
+static void complete_file_requests(winx_file_info *f,udefrag_job_parameters *jp);
+static int queue_for_verification(winx_file_info *f,udefrag_job_parameters *jp);
+
+/************************************************************/
+/*                      Handle cache                        */
+/************************************************************/
+
+/**
+ * @brief Opens the file for moves,
+ * reusing the handle opened before if any.
+ * @note The handle must not be closed
+ * by the caller; it gets closed by
+ * close_file_handle or close_cached_handles.
+ */
+static NTSTATUS open_file_handle(winx_file_info *f,
+    HANDLE *phFile,udefrag_job_parameters *jp)
+{
+    struct handle_cache *c = &jp->handle_cache;
+    struct cached_handle *e, *lru = NULL;
+    NTSTATUS status;
+    ULONGLONG time;
+    int i;
+
+    c->uses ++;
+    for(i = 0; i < HANDLE_CACHE_SIZE; i++){
+        e = &c->entries[i];
+        if(e->f == f){
+            e->last_use = c->uses;
+            *phFile = e->hFile;
+            jp->p_counters.handle_cache_hits ++;
+            return STATUS_SUCCESS;
+        }
+        if(lru == NULL || e->f == NULL || \
+          (lru->f && e->last_use < lru->last_use))
+            lru = e;
+    }
+
+    time = winx_xtime();
+    if(lru->f){
+        /* requests in flight may still use the handle */
+        complete_file_requests(lru->f,jp);
+        winx_defrag_fclose(lru->hFile);
+        jp->p_counters.file_closes ++;
+        lru->f = NULL;
+    }
+    status = winx_defrag_fopen(f,WINX_OPEN_FOR_MOVE,phFile);
+    if(status == STATUS_SUCCESS){
+        jp->p_counters.file_opens ++;
+        lru->f = f;
+        lru->hFile = *phFile;
+        lru->last_use = c->uses;
+    }
+    jp->p_counters.file_opening_time += winx_xtime() - time;
+    return status;
+}
+
+/**
+ * @brief Closes the cached handle of the file.
+ */
+static void close_file_handle(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    struct handle_cache *c = &jp->handle_cache;
+    ULONGLONG time;
+    int i;
+
+    for(i = 0; i < HANDLE_CACHE_SIZE; i++){
+        if(c->entries[i].f == f){
+            complete_file_requests(f,jp);
+            time = winx_xtime();
+            winx_defrag_fclose(c->entries[i].hFile);
+            jp->p_counters.file_closes ++;
+            jp->p_counters.file_opening_time += winx_xtime() - time;
+            c->entries[i].f = NULL;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Closes all the cached handles.
+ */
+void close_cached_handles(udefrag_job_parameters *jp)
+{
+    struct handle_cache *c = &jp->handle_cache;
+    int i;
+
+    for(i = 0; i < HANDLE_CACHE_SIZE; i++){
+        if(c->entries[i].f)
+            close_file_handle(c->entries[i].f,jp);
+    }
+}
+
+/**
+ * @brief Checks whether the range of clusters
+ * is involved in any request in flight, either
+ * as a source or as a target.
+ */
+static int is_range_busy(udefrag_job_parameters *jp,ULONGLONG lcn,ULONGLONG length)
+{
+    struct move_queue *q = &jp->move_queue;
+    struct move_request *r;
+    ULONGLONG n;
+    int i;
+    
+    for(i = 0; i < q->count; i++){
+        r = &q->requests[(q->first + i) % jp->udo.move_queue_depth];
+        n = (ULONGLONG)r->mfd.NumVcns;
+        
+        /* check target clusters */
+        if(lcn < r->mfd.TargetLcn.QuadPart + n \
+          && r->mfd.TargetLcn.QuadPart < lcn + length) return 1;
+        
+        /* check source clusters */
+        if(lcn < r->src_end && r->src_lcn < lcn + length) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Defines bounds of clusters
+ * being freed by the move request.
+ * @note The map of blocks of the file
+ * may be replaced by the calculated one
+ * while the request is still in flight,
+ * so the bounds are saved on issue.
+ */
+static void set_source_bounds(struct move_request *r)
+{
+    winx_blockmap *block;
+    ULONGLONG vcn, n, first, last, src;
+    
+    vcn = r->mfd.StartVcn.QuadPart;
+    n = (ULONGLONG)r->mfd.NumVcns;
+    r->src_lcn = (ULONGLONG)-1;
+    r->src_end = 0;
+    for(block = r->f->disp.blockmap; block; block = block->next){
+        if(block->vcn >= vcn + n) break;
+        if(block->vcn + block->length > vcn){
+            first = max(block->vcn,vcn);
+            last = min(block->vcn + block->length,vcn + n);
+            src = block->lcn + (first - block->vcn);
+            r->src_lcn = min(r->src_lcn,src);
+            r->src_end = max(r->src_end,src + (last - first));
+        }
+        if(block->next == r->f->disp.blockmap) break;
+    }
+}
+
+/**
+ * @brief Adjusts the number of clusters moved at once.
+ * @details The number is chosen to keep duration of a single
+ * request, which cannot be interrupted, below the cancellation
+ * latency target, but not less than needed to keep the device
+ * busy. Half of the target is used to tolerate fluctuations.
+ * @param[in] jp the job parameters.
+ * @param[in] length number of clusters moved by the request.
+ * @param[in] latency duration of the request, in milliseconds.
+ */
+static void tune_clusters_at_once(udefrag_job_parameters *jp,
+    ULONGLONG length,ULONGLONG latency)
+{
+    struct move_queue *q = &jp->move_queue;
+    ULONGLONG n, min_n, max_n;
+    double speed;
+    
+    if(latency > jp->p_counters.max_move_latency)
+        jp->p_counters.max_move_latency = latency;
+    
+    /* short requests tell nothing about the speed */
+    if(length < jp->clusters_at_once / 2) return;
+    
+    speed = (double)length / (double)max(latency,1);
+    q->speed = (q->speed == 0) ? speed : (3 * q->speed + speed) / 4;
+    
+    if(jp->udo.cancellation_latency == 0) return;
+    
+    if(latency > (ULONGLONG)jp->udo.cancellation_latency){
+        /* too slow, shrink immediately */
+        n = (ULONGLONG)(speed * jp->udo.cancellation_latency / 2);
+    } else {
+        /* grow smoothly */
+        n = (ULONGLONG)(q->speed * jp->udo.cancellation_latency / 2);
+        n = min(n,jp->clusters_at_once * 2);
+    }
+    
+    min_n = max(MIN_BYTES_AT_ONCE / jp->v_info.bytes_per_cluster,1);
+    max_n = max(MAX_BYTES_AT_ONCE / jp->v_info.bytes_per_cluster,1);
+    n = min(max(n,min_n),max_n);
+    if(n == jp->clusters_at_once) return;
+    
+    if(jp->udo.dbgprint_level >= DBG_DETAILED){
+        itrace("%I64u clusters moved in %I64u ms, will move %I64u clusters at once",
+            length,latency,n);
+    }
+    jp->clusters_at_once = n;
+    if(n < jp->p_counters.min_clusters_at_once)
+        jp->p_counters.min_clusters_at_once = n;
+    if(n > jp->p_counters.max_clusters_at_once)
+        jp->p_counters.max_clusters_at_once = n;
+}
+
+/**
+ * @internal
+ * @brief Forgets moves of the file to be
+ * journaled on completion of its requests.
+ * @details Called on a failure of a request,
+ * so moves never completed get redone
+ * after the interruption.
+ */
+static void cancel_journaling(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    struct move_queue *q = &jp->move_queue;
+    struct move_request *r;
+    int i;
+    
+    for(i = 0; i < q->count; i++){
+        r = &q->requests[(q->first + i) % jp->udo.move_queue_depth];
+        if(r->f == f) r->journal = 0;
+    }
+}
+
+/**
+ * @internal
+ * @brief Adds the completed move to the journal.
+ * @details Requests of the move may still be in
+ * flight, so the move is journaled on completion
+ * of its last request then; requests complete in
+ * order of their issue.
+ */
+static void journal_completed_move(winx_file_info *f,ULONGLONG vcn,
+    ULONGLONG length,ULONGLONG target,udefrag_job_parameters *jp)
+{
+    struct move_queue *q = &jp->move_queue;
+    struct move_request *r;
+    int i;
+    
+    for(i = q->count - 1; i >= 0; i--){
+        r = &q->requests[(q->first + i) % jp->udo.move_queue_depth];
+        if(r->f == f){
+            r->journal = 1;
+            r->move_vcn = vcn;
+            r->move_length = length;
+            r->move_target = target;
+            return;
+        }
+    }
+    journal_move(jp,f,vcn,length,target,1);
+}
+
+/**
+ * @brief Waits for completion of the oldest request in flight.
+ * @return Zero for success, negative value otherwise.
+ */
+static int complete_move_request(udefrag_job_parameters *jp)
+{
+    struct move_queue *q = &jp->move_queue;
+    struct move_request *r;
+    ULONGLONG time, length, start;
+    LARGE_INTEGER interval;
+    NTSTATUS status;
+    HANDLE h;
+    
+    if(q->count == 0) return 0;
+    r = &q->requests[q->first];
+    
+    if(jp->udo.dry_run){
+        time = winx_xtime();
+        if(r->completion_time > time)
+            winx_sleep((int)(r->completion_time - time));
+        status = STATUS_SUCCESS;
+    } else if(r->completion_time){
+        /* completed on issue */
+        status = r->iosb.Status;
+    } else {
+        h = r->hEvent ? r->hEvent : winx_fileno(jp->fVolume);
+        interval.QuadPart = 0;
+        status = NtWaitForSingleObject(h,FALSE,&interval);
+        if(status == STATUS_TIMEOUT){
+            /* the time of completion is known only when we wait for it */
+            status = NtWaitForSingleObject(h,FALSE,NULL);
+            r->completion_time = winx_xtime();
+        }
+        if(NT_SUCCESS(status)) status = r->iosb.Status;
+    }
+    q->first = (q->first + 1) % jp->udo.move_queue_depth;
+    q->count --;
+    
+    length = (ULONGLONG)r->mfd.NumVcns;
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot move file clusters of %ws",r->f->path);
+        jp->pi.processed_clusters += length;
+        cancel_journaling(r->f,jp);
+        if(r->f == q->current){
+            /* keep the first failure */
+            if(NT_SUCCESS(jp->last_move_status))
+                jp->last_move_status = status;
+        } else {
+            /* move_file has used the calculated disposition already */
+            if(queue_for_verification(r->f,jp) < 0)
+                r->f->user_defined_flags |= UD_FILE_MOVING_FAILED;
+        }
+        return (-1);
+    }
+    if(r->completion_time){
+        /*
+        * The device processes requests one by one, so the
+        * request starts when the previous one completes;
+        * time spent in the queue says nothing about speed.
+        */
+        start = max(r->issue_time,q->device_free_time);
+        tune_clusters_at_once(jp,length,r->completion_time - min(start,r->completion_time));
+        q->device_free_time = r->completion_time;
+    }
+    jp->pi.moved_clusters += length;
+    jp->pi.processed_clusters += length;
+    if(r->journal){
+        journal_move(jp,r->f,r->move_vcn,
+            r->move_length,r->move_target,1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Issues a move request without
+ * waiting for its completion.
+ * @return Zero for success, negative value otherwise.
+ * @note The request gets delayed until all the requests
+ * involving the same clusters complete, so the target
+ * space never overlaps with space being freed.
+ */
+static int issue_move_request(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
+    ULONGLONG targetLcn,ULONGLONG n_clusters,udefrag_job_parameters *jp)
+{
+    struct move_queue *q = &jp->move_queue;
+    struct move_request *r;
+    NTSTATUS status;
+    HANDLE hVolume;
+    
+    /* resolve dependencies */
+    while(q->count && is_range_busy(jp,targetLcn,n_clusters))
+        (void)complete_move_request(jp);
+    
+    /* wait for a free slot */
+    if(q->count == jp->udo.move_queue_depth)
+        (void)complete_move_request(jp);
+    
+    /* failures of other files don't stop this one */
+    if(!NT_SUCCESS(jp->last_move_status)) return (-1);
+    
+    /* setup movefile descriptor and make the call */
+    r = &q->requests[(q->first + q->count) % jp->udo.move_queue_depth];
+    r->f = f;
+    memset(&r->iosb,0,sizeof(IO_STATUS_BLOCK));
+    memset(&r->mfd,0,sizeof(MOVEFILE_DESCRIPTOR));
+    r->mfd.FileHandle = hFile;
+    r->mfd.StartVcn.QuadPart = startVcn;
+    r->mfd.TargetLcn.QuadPart = targetLcn;
+#ifdef _WIN64
+    r->mfd.NumVcns = n_clusters;
+#else
+    r->mfd.NumVcns = (ULONG)n_clusters;
+#endif
+    set_source_bounds(r);
+
+    r->issue_time = winx_xtime();
+    r->completion_time = 0;
+    r->journal = 0;
+    if(jp->udo.dry_run){
+        /* simulate a device processing requests one by one */
+        r->completion_time = max(r->issue_time,q->dry_run_free_time) + jp->udo.dry_run_latency;
+        q->dry_run_free_time = r->completion_time;
+        q->count ++;
+        return 0;
+    }
+
+    hVolume = q->hVolume ? q->hVolume : winx_fileno(jp->fVolume);
+    status = NtFsControlFile(hVolume,r->hEvent,NULL,0,&r->iosb,
+                        FSCTL_MOVE_FILE,&r->mfd,sizeof(MOVEFILE_DESCRIPTOR),
+                        NULL,0);
+    if(!NT_SUCCESS(status)){
+        if(NT_SUCCESS(jp->last_move_status))
+            jp->last_move_status = status;
+        strace(status,"cannot move file clusters of %ws",f->path);
+        return (-1);
+    }
+    /* synchronous requests are completed here */
+    if(status != STATUS_PENDING)
+        r->completion_time = winx_xtime();
+    q->count ++;
+    return 0;
+}
+
+/**
+ * @brief Completes all the requests
+ * issued for the file so far.
+ * @note Requests are completed in order
+ * of their issue, so the preceding requests
+ * of other files get completed as well.
+ */
+static void complete_file_requests(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    struct move_queue *q = &jp->move_queue;
+    int i, n = 0;
+    
+    /* find the last request of the file */
+    for(i = 0; i < q->count; i++){
+        if(q->requests[(q->first + i) % jp->udo.move_queue_depth].f == f)
+            n = i + 1;
+    }
+    while(n--) (void)complete_move_request(jp);
+}
+
+/**
+ * @brief Completes all the requests in flight.
+ * @note Must be called before any routine relying
+ * on real dispositions of files, like the free
+ * space rescan, and before closing of handles.
+ */
+void complete_move_requests(udefrag_job_parameters *jp)
+{
+    while(jp->move_queue.count)
+        (void)complete_move_request(jp);
+}
+
 /************************************************************/
 /*                    Internal Routines                     */
 /************************************************************/
@@ -176,14 +686,15 @@ static winx_blockmap *get_first_block_of_cluster_chain(winx_file_info *f,ULONGLO
  * @note 
  * - Volume must be opened before this call,
  * jp->fVolume must contain a proper handle.
+ * - The last requests may still be in flight
+ * on return; failures of those get detected
+ * on their completion.
  */
 static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
     ULONGLONG targetLcn,ULONGLONG n_clusters,udefrag_job_parameters *jp)
 {
-    NTSTATUS status;
-    IO_STATUS_BLOCK iosb;
-    MOVEFILE_DESCRIPTOR mfd;
     ULONGLONG clusters_to_move;
+    int result = 0;
 
     if(jp->udo.dbgprint_level >= DBG_DETAILED){
         itrace("sVcn: %I64u,tLcn: %I64u,n: %u",
@@ -193,10 +704,9 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
     if(jp->termination_router((void *)jp))
         return (-1);
     
-    if(jp->udo.dry_run){
-        jp->pi.moved_clusters += n_clusters;
+    if(create_move_queue(jp) < 0){
         jp->pi.processed_clusters += n_clusters;
-        return 0;
+        return (-1);
     }
 
     /*
@@ -205,33 +715,16 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
     * little portions of data at once.
     */
     while(n_clusters){
-        if(jp->termination_router((void *)jp)) return (-1);
-        clusters_to_move = min(jp->clusters_at_once,n_clusters);
-        /* setup movefile descriptor and make the call */
-        memset(&mfd,0,sizeof(MOVEFILE_DESCRIPTOR));
-        mfd.FileHandle = hFile;
-        mfd.StartVcn.QuadPart = startVcn;
-        mfd.TargetLcn.QuadPart = targetLcn;
-#ifdef _WIN64
-        mfd.NumVcns = clusters_to_move;
-#else
-        mfd.NumVcns = (ULONG)clusters_to_move;
-#endif
-        status = NtFsControlFile(winx_fileno(jp->fVolume),NULL,NULL,0,&iosb,
-                            FSCTL_MOVE_FILE,&mfd,sizeof(MOVEFILE_DESCRIPTOR),
-                            NULL,0);
-        if(NT_SUCCESS(status)){
-            NtWaitForSingleObject(winx_fileno(jp->fVolume),FALSE,NULL);
-            status = iosb.Status;
+        if(jp->termination_router((void *)jp)){
+            result = (-1);
+            break;
         }
-        jp->last_move_status = status;
-        if(!NT_SUCCESS(status)){
-            strace(status,"cannot move file clusters of %ws",f->path);
+        clusters_to_move = min(jp->clusters_at_once,n_clusters);
+        if(issue_move_request(f,hFile,startVcn,targetLcn,clusters_to_move,jp) < 0){
             jp->pi.processed_clusters += n_clusters;
-            return (-1);
+            result = (-1);
+            break;
         }
-        jp->pi.moved_clusters += clusters_to_move;
-        jp->pi.processed_clusters += clusters_to_move;
         startVcn += clusters_to_move;
         targetLcn += clusters_to_move;
         n_clusters -= clusters_to_move;
@@ -242,7 +735,7 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
     * because API may return success in case of
     * partially moved data.
     */
-    return 0;
+    return result;
 }
 
 /**
@@ -297,15 +790,15 @@ static void DbgPrintBlocksOfFile(winx_blockmap *blockmap)
 /**
  * @brief Adds a new block to the file map.
  */
-static winx_blockmap *add_new_block(winx_blockmap **head,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length)
+static winx_blockmap *add_new_block(winx_file_info *f,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length)
 {
     winx_blockmap *block, *last_block = NULL;
     
-    if(*head != NULL)
-        last_block = (*head)->prev;
+    if(f->disp.blockmap != NULL)
+        last_block = f->disp.blockmap->prev;
     
-    block = (winx_blockmap *)winx_list_insert((list_entry **)head,
-                (list_entry *)last_block,sizeof(winx_blockmap));
+    block = winx_blockmap_insert(f,&f->disp.blockmap,last_block);
+    if(block == NULL) return NULL;
     block->vcn = vcn;
     block->lcn = lcn;
     block->length = length;
@@ -345,7 +838,7 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
     for(block = f->disp.blockmap;
       block && block != first_block;
       block = block->next){
-        if(!add_new_block(&new_file_info->disp.blockmap,
+        if(!add_new_block(new_file_info,
             block->vcn,block->lcn,block->length)) goto fail;
     }
     
@@ -355,27 +848,27 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
     curr_target = target;
     for(block = first_block; block; block = block->next){
         if(!clusters_to_check){
-            if(!add_new_block(&new_file_info->disp.blockmap,
+            if(!add_new_block(new_file_info,
                 block->vcn,block->lcn,block->length)) goto fail;
         } else {
             n = min(block->length - (curr_vcn - block->vcn),clusters_to_check);
             
             if(curr_vcn != block->vcn){
                 /* we have the second part of block moved */
-                if(!add_new_block(&new_file_info->disp.blockmap,
+                if(!add_new_block(new_file_info,
                     block->vcn,block->lcn,block->length - n)) goto fail;
-                if(!add_new_block(&new_file_info->disp.blockmap,
+                if(!add_new_block(new_file_info,
                     curr_vcn,curr_target,n)) goto fail;
             } else {
                 if(n != block->length){
                     /* we have the first part of block moved */
-                    if(!add_new_block(&new_file_info->disp.blockmap,
+                    if(!add_new_block(new_file_info,
                         curr_vcn,curr_target,n)) goto fail;
-                    if(!add_new_block(&new_file_info->disp.blockmap,
+                    if(!add_new_block(new_file_info,
                         block->vcn + n,block->lcn + n,block->length - n)) goto fail;
                 } else {
                     /* we have entire block moved */
-                    if(!add_new_block(&new_file_info->disp.blockmap,
+                    if(!add_new_block(new_file_info,
                         block->vcn,curr_target,block->length)) goto fail;
                 }
             }
@@ -392,14 +885,14 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
     
     /* replace list of blocks by list of fragments */
     fragments = build_fragments_list(new_file_info,&n);
-    winx_list_destroy((list_entry **)(void *)&new_file_info->disp.blockmap);
+    winx_blockmap_destroy(new_file_info,&new_file_info->disp.blockmap);
     new_file_info->disp.blockmap = fragments;
     new_file_info->disp.fragments = n;
     return;
     
 fail:
     etrace("not enough memory for %ws",f->path);
-    winx_list_destroy((list_entry **)(void *)&new_file_info->disp.blockmap);
+    winx_blockmap_destroy(new_file_info,&new_file_info->disp.blockmap);
     new_file_info->disp.fragments = 0;
     new_file_info->disp.clusters = 0;
 }
@@ -427,8 +920,8 @@ static int compare_file_dispositions(winx_file_info *f1, winx_file_info *f2)
     /* empty maps are equal */
     if(map1 == NULL && map2 == NULL){
 equal_maps:
-        release_fragments_list(&map1);
-        release_fragments_list(&map2);
+        release_fragments_list(f1,&map1);
+        release_fragments_list(f2,&map2);
         return 0;
     }
     
@@ -447,8 +940,8 @@ equal_maps:
     
 different_maps:
     /* maps are different */
-    release_fragments_list(&map1);
-    release_fragments_list(&map2);
+    release_fragments_list(f1,&map1);
+    release_fragments_list(f2,&map2);
     return 1;
 }
 
@@ -459,6 +952,236 @@ static int dump_terminator(void *user_defined_data)
     return jp->termination_router((void *)jp);
 }
 
+/************************************************************/
+/*                  Deferred verification                   */
+/************************************************************/
+
+/**
+ * @brief Queues the file for verification
+ * unless it is queued already.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int queue_for_verification(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    struct verification_queue *q = &jp->verification_queue;
+    winx_file_info **files;
+    ULONGLONG capacity;
+
+    if(f->user_defined_flags & UD_FILE_TO_BE_VERIFIED) return 0;
+
+    if(q->count == q->capacity){
+        capacity = max(q->capacity * 2,1024);
+        files = winx_tmalloc((size_t)capacity * sizeof(winx_file_info *));
+        if(files == NULL){
+            mtrace();
+            return (-1);
+        }
+        if(q->files){
+            memcpy(files,q->files,(size_t)q->count * sizeof(winx_file_info *));
+            winx_free(q->files);
+        }
+        q->files = files;
+        q->capacity = capacity;
+    }
+    q->files[q->count++] = f;
+    f->user_defined_flags |= UD_FILE_TO_BE_VERIFIED;
+    return 0;
+}
+
+/**
+ * @brief Decides whether the redump of
+ * the moved file can be deferred or not.
+ * @details Queues the file for verification
+ * unless it is queued already.
+ * @return Nonzero value indicates that the
+ * calculated disposition can be used for now.
+ */
+static int defer_verification(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(jp->udo.move_verification == VERIFY_MOVES_IMMEDIATELY) return 0;
+    /* the calculated disposition is wrong after a failed request */
+    if(!NT_SUCCESS(jp->last_move_status)) return 0;
+    if(f->user_defined_flags & UD_FILE_TO_BE_VERIFIED) return 1;
+
+    /* verify it immediately if it cannot be queued */
+    return (queue_for_verification(f,jp) == 0) ? 1 : 0;
+}
+
+/**
+ * @brief Replaces the calculated disposition
+ * of the file by the real one.
+ * @details Adjusts statistics, the cluster map
+ * and all the lists and indices the same way
+ * move_file does. The free space pool gets
+ * updated by release_temp_space_regions.
+ */
+static void apply_real_disposition(winx_file_info *f,
+    winx_file_info *real,udefrag_job_parameters *jp)
+{
+    winx_blockmap *block;
+    int old_color, new_color;
+    int was_fragmented, became_fragmented;
+    int was_excluded;
+    int r1, r2, r3;
+
+    old_color = get_file_color(jp,f);
+    was_fragmented = is_fragmented(f);
+    was_excluded = is_excluded(f);
+    if(was_fragmented && !was_excluded)
+        truncate_fragmented_files_list(f,jp);
+
+    /* reapply filters to the file */
+    f->user_defined_flags &= ~UD_FILE_EXCLUDED;
+    real->user_defined_flags &= ~UD_FILE_EXCLUDED;
+    r1 = exclude_by_fragment_size(real,jp);
+    r2 = exclude_by_fragments(real,jp);
+    r3 = exclude_by_size(real,jp);
+    if(r1 || r2 || r3){
+        f->user_defined_flags |= UD_FILE_EXCLUDED;
+        real->user_defined_flags |= UD_FILE_EXCLUDED;
+    }
+
+    /* adjust statistics */
+    became_fragmented = is_fragmented(real);
+    if(became_fragmented && !is_excluded(f)){
+        if(!was_fragmented || was_excluded){
+            jp->pi.fragmented ++;
+            jp->pi.fragments += (real->disp.fragments - 1);
+            jp->pi.bad_fragments += real->disp.fragments;
+        } else {
+            jp->pi.fragments -= (f->disp.fragments - real->disp.fragments);
+            jp->pi.bad_fragments -= (f->disp.fragments - real->disp.fragments);
+        }
+    }
+    if(!became_fragmented || is_excluded(f)){
+        if(was_fragmented && !was_excluded){
+            jp->pi.fragmented --;
+            jp->pi.fragments -= (f->disp.fragments - 1);
+            jp->pi.bad_fragments -= f->disp.fragments;
+        }
+    }
+
+    /* replace the block map */
+    for(block = f->disp.blockmap; block; block = block->next){
+        colorize_map_region(jp,block->lcn,block->length,FREE_SPACE,old_color);
+        (void)remove_block_from_file_blocks_tree(jp,block);
+        if(block->next == f->disp.blockmap) break;
+    }
+    winx_blockmap_destroy(f,&f->disp.blockmap);
+    memcpy(&f->disp,&real->disp,sizeof(winx_file_disposition));
+    invalidate_fragment_index(f,jp);
+    update_file_table(f,jp);
+    new_color = get_file_color(jp,f);
+    for(block = f->disp.blockmap; block; block = block->next){
+        colorize_map_region(jp,block->lcn,block->length,new_color,FREE_SPACE);
+        if(add_block_to_file_blocks_tree(jp,f,block) < 0) break;
+        if(block->next == f->disp.blockmap) break;
+    }
+
+    /* update list of fragmented files */
+    if(is_fragmented(f) && !is_excluded(f))
+        expand_fragmented_files_list(f,jp);
+}
+
+/**
+ * @brief Redumps the moved file and fixes
+ * its disposition if it differs from the
+ * calculated one.
+ * @details Files moved not as calculated
+ * get marked as failed to move, exactly as
+ * they get marked by the immediate verification.
+ * @return Nonzero value indicates a mismatch.
+ */
+static int verify_moved_file(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    winx_file_info real;
+
+    memcpy(&real,f,sizeof(winx_file_info));
+    real.disp.blockmap = NULL;
+    if(winx_ftw_dump_file(&real,dump_terminator,(void *)jp) < 0){
+        etrace("cannot redump %ws",f->path);
+        return 0;
+    }
+    jp->p_counters.redumped_files ++;
+    if(compare_file_dispositions(&real,f) == 0){
+        winx_blockmap_destroy(&real,&real.disp.blockmap);
+        return 0;
+    }
+    etrace("real file disposition differs from calculated one for %ws",f->path);
+    DbgPrintBlocksOfFile(real.disp.blockmap);
+    apply_real_disposition(f,&real,jp);
+    f->user_defined_flags |= UD_FILE_MOVING_FAILED;
+    jp->p_counters.mismatched_files ++;
+    return 1;
+}
+
+/**
+ * @brief Redumps files moved since
+ * the last verification and fixes
+ * dispositions differing from
+ * the calculated ones.
+ * @details Sampling redumps every n-th file
+ * of the queue first. When it detects a file
+ * moved not as calculated, the rest of queued
+ * files and all the subsequent moves get
+ * verified as well.
+ */
+void verify_moved_files(udefrag_job_parameters *jp)
+{
+    struct verification_queue *q = &jp->verification_queue;
+    winx_file_info *f;
+    ULONGLONG i, mismatches = 0;
+    ULONGLONG time;
+    int sampled;
+
+    /* failed requests may queue more files */
+    complete_move_requests(jp);
+    if(q->count == 0) return;
+
+    time = winx_xtime();
+    sampled = (jp->udo.move_verification == VERIFY_MOVES_SAMPLED) ? 1 : 0;
+    for(i = 0; i < q->count; i++){
+        /* on termination the calculated dispositions are kept */
+        if(jp->termination_router((void *)jp)) break;
+        if(sampled && i % VERIFICATION_SAMPLING_RATE) continue;
+        mismatches += verify_moved_file(q->files[i],jp);
+    }
+
+    if(mismatches && sampled){
+        itrace("%I64u mismatches found by sampling, all moves will be verified",mismatches);
+        jp->udo.move_verification = VERIFY_MOVES_DEFERRED;
+        for(i = 0; i < q->count; i++){
+            if(jp->termination_router((void *)jp)) break;
+            if(i % VERIFICATION_SAMPLING_RATE)
+                (void)verify_moved_file(q->files[i],jp);
+        }
+    }
+
+    for(i = 0; i < q->count; i++){
+        f = q->files[i];
+        f->user_defined_flags &= ~UD_FILE_TO_BE_VERIFIED;
+    }
+    q->count = 0;
+    jp->p_counters.verification_time += winx_xtime() - time;
+}
+
+/**
+ * @brief Releases resources
+ * allocated for the verification.
+ * @note Files still queued remain unverified.
+ */
+void destroy_verification_queue(udefrag_job_parameters *jp)
+{
+    struct verification_queue *q = &jp->verification_queue;
+    ULONGLONG i;
+
+    for(i = 0; i < q->count; i++)
+        q->files[i]->user_defined_flags &= ~UD_FILE_TO_BE_VERIFIED;
+    winx_free(q->files);
+    memset(q,0,sizeof(struct verification_queue));
+}
+
 /************************************************************/
 /*                    move_file routine                     */
 /************************************************************/
@@ -476,29 +1199,11 @@ typedef enum {
 } ud_file_moving_result;
 
 /**
- * @brief Moves a cluster chain of the file.
- * @details Can move any part of any file.
- * @param[in] f pointer to structure describing the file to be moved.
- * @param[in] vcn the VCN of the first cluster to be moved.
- * @param[in] length the length of the cluster chain to be moved.
- * @param[in] target the LCN of the target free region.
- * @param[in] jp job parameters.
- * @return Zero for success, negative value otherwise.
- * @note 
- * - This routine cannot move the first fragment of MFT
- * on NTFS as well as first clusters of FAT directories.
- * - Volume must be opened before this call,
- * jp->fVolume must contain a proper handle.
- * - If this function returns negative value indicating failure, 
- * one of the flags listed in udefrag_internals.h under "file status flags"
- * becomes set to display a proper message in fragmentation reports.
+ * @brief move_file helper doing the actual work.
  */
-int move_file(winx_file_info *f,
-              ULONGLONG vcn,
-              ULONGLONG length,
-              ULONGLONG target,
-              udefrag_job_parameters *jp
-              )
+static int move_file_routine(winx_file_info *f,
+    ULONGLONG vcn,ULONGLONG length,ULONGLONG target,
+    udefrag_job_parameters *jp)
 {
     ULONGLONG time;
     wchar_t *path;
@@ -514,6 +1219,7 @@ int move_file(winx_file_info *f,
     winx_file_info desired_file_info;
     winx_file_info new_file_info;
     ud_file_moving_result moving_result;
+    ULONGLONG verification_time = 0;
     int r1, r2, r3;
     
     time = winx_xtime();
@@ -579,7 +1285,7 @@ int move_file(winx_file_info *f,
     was_excluded = is_excluded(f);
 
     /* open the file */
-    status = winx_defrag_fopen(f,WINX_OPEN_FOR_MOVE,&hFile);
+    status = open_file_handle(f,&hFile,jp);
     if(status != STATUS_SUCCESS){
         strace(status,"cannot open %ws",path);
         f->user_defined_flags |= UD_FILE_LOCKED;
@@ -591,19 +1297,26 @@ int move_file(winx_file_info *f,
     }
     
     /* move the file */
+    journal_move(jp,f,vcn,length,target,0);
+    jp->move_queue.current = f;
     move_file_helper(hFile,f,vcn,length,target,jp);
-    winx_defrag_fclose(hFile);
     
     /* get file moving result */
     calculate_file_disposition(f,vcn,length,target,&desired_file_info);
-    if(jp->udo.dry_run){
+    jp->p_counters.file_moves ++;
+    if(jp->udo.dry_run || defer_verification(f,jp)){
         dump_result = -1;
     } else {
+        /* the redump needs all the requests completed */
+        complete_file_requests(f,jp);
+        verification_time = winx_xtime();
         memcpy(&new_file_info,f,sizeof(winx_file_info));
         new_file_info.disp.blockmap = NULL;
         dump_result = winx_ftw_dump_file(&new_file_info,dump_terminator,(void *)jp);
         if(dump_result < 0)
             etrace("cannot redump the file");
+        else
+            jp->p_counters.redumped_files ++;
     }
     
     if(dump_result < 0){
@@ -638,12 +1351,25 @@ int move_file(winx_file_info *f,
             }
         }
         /* release calculated desired disposition */
-        winx_list_destroy((list_entry **)(void *)&desired_file_info.disp.blockmap);
+        winx_blockmap_destroy(&desired_file_info,&desired_file_info.disp.blockmap);
+        if(moving_result != DETERMINED_MOVING_SUCCESS)
+            jp->p_counters.mismatched_files ++;
+    }
+    if(verification_time)
+        jp->p_counters.verification_time += winx_xtime() - verification_time;
+    
+    if(!NT_SUCCESS(jp->last_move_status)){
+        /* the handle may be unusable now */
+        close_file_handle(f,jp);
+    } else {
+        journal_completed_move(f,vcn,length,target,jp);
     }
+    jp->move_queue.current = NULL;
     
     /* handle a case when nothing has been moved */
     if(moving_result == DETERMINED_MOVING_FAILURE){
-        winx_list_destroy((list_entry **)(void *)&new_file_info.disp.blockmap);
+        close_file_handle(f,jp);
+        winx_blockmap_destroy(&new_file_info,&new_file_info.disp.blockmap);
         f->user_defined_flags |= UD_FILE_MOVING_FAILED;
         /* remove target space from the free space pool */
         jp->free_regions = winx_sub_volume_region(jp->free_regions,target,length);
@@ -741,8 +1467,10 @@ int move_file(winx_file_info *f,
         (void)remove_block_from_file_blocks_tree(jp,block);
         if(block->next == f->disp.blockmap) break;
     }
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_blockmap_destroy(f,&f->disp.blockmap);
     memcpy(&f->disp,&new_file_info.disp,sizeof(winx_file_disposition));
+    invalidate_fragment_index(f,jp);
+    update_file_table(f,jp);
     for(block = f->disp.blockmap; block; block = block->next){
         if(add_block_to_file_blocks_tree(jp,f,block) < 0) break;
         if(block->next == f->disp.blockmap) break;
@@ -756,4 +1484,40 @@ int move_file(winx_file_info *f,
     return (moving_result == DETERMINED_MOVING_PARTIAL_SUCCESS) ? (-1) : 0;
 }
 
+/**
+ * @brief Moves a cluster chain of the file.
+ * @details Can move any part of any file.
+ * @param[in] f pointer to structure describing the file to be moved.
+ * @param[in] vcn the VCN of the first cluster to be moved.
+ * @param[in] length the length of the cluster chain to be moved.
+ * @param[in] target the LCN of the target free region.
+ * @param[in] jp job parameters.
+ * @return Zero for success, negative value otherwise.
+ * @note 
+ * - This routine cannot move the first fragment of MFT
+ * on NTFS as well as first clusters of FAT directories.
+ * - Volume must be opened before this call,
+ * jp->fVolume must contain a proper handle.
+ * - If this function returns negative value indicating failure, 
+ * one of the flags listed in udefrag_internals.h under "file status flags"
+ * becomes set to display a proper message in fragmentation reports.
+ */
+int move_file(winx_file_info *f,
+              ULONGLONG vcn,
+              ULONGLONG length,
+              ULONGLONG target,
+              udefrag_job_parameters *jp
+              )
+{
+    ULONGLONG time = winx_utime();
+    ULONGLONG end_time;
+    int result;
+    
+    result = move_file_routine(f,vcn,length,target,jp);
+    end_time = winx_utime();
+    winx_histogram_add(&jp->p_counters.move_latency,end_time - time);
+    timeline_span(jp,"move",time,end_time,"clusters",length);
+    return result;
+}
+
 /** @} */
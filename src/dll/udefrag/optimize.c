@@ -479,72 +479,56 @@ static int optimize_mft_routine(udefrag_job_parameters *jp)
 }
 
 /**
- * @brief Auxiliary routine to sort files in the binary tree.
- * @details This routine exclusively defines rules of the file
- * sorting on the disk.
+ * @brief Keeps the sorted order around
+ * a file left in place by the cut off.
+ * @details Files following the kept file in
+ * the sorted list are placed beyond it. When
+ * the space before the kept file has been
+ * used up already, or the file lies beyond
+ * the space intended for sorted out files,
+ * so that the following files would find
+ * no room, the file gets moved like any
+ * other one instead.
+ * @return Nonzero if the file stays in place.
  */
-static int files_compare(const void *prb_a, const void *prb_b, void *prb_param)
+static int keep_file_in_place(udefrag_job_parameters *jp,
+    winx_file_info *file,ULONGLONG *start_lcn,ULONGLONG end_lcn)
 {
-    winx_file_info *a, *b;
-    udefrag_job_parameters *jp;
-    int result;
-    
-    a = (winx_file_info *)prb_a;
-    b = (winx_file_info *)prb_b;
-    jp = (udefrag_job_parameters *)prb_param;
-    
-    if(jp->udo.sorting_flags & UD_SORT_BY_SIZE){
-        /* sort files of equal sizes by path */
-        if(a->disp.clusters == b->disp.clusters) goto paths_compare;
-        result = (a->disp.clusters > b->disp.clusters) ? 1 : (-1);
-        goto done;
+    if(file->disp.blockmap == NULL || is_fragmented(file))
+        return 1;
+    if(file->disp.blockmap->lcn >= *start_lcn \
+      && file->disp.blockmap->lcn + file->disp.clusters <= end_lcn){
+        *start_lcn = file->disp.blockmap->lcn + file->disp.clusters;
+        return 1;
     }
-    
-    if(jp->udo.sorting_flags & UD_SORT_BY_CREATION_TIME){
-        /* sort files of equal creation times by path */
-        if(a->creation_time == b->creation_time) goto paths_compare;
-        result = (a->creation_time > b->creation_time) ? 1 : (-1);
-        goto done;
-    }
-
-    if(jp->udo.sorting_flags & UD_SORT_BY_MODIFICATION_TIME){
-        /* sort files of equal last modification times by path */
-        if(a->last_modification_time == b->last_modification_time) goto paths_compare;
-        result = (a->last_modification_time > b->last_modification_time) ? 1 : (-1);
-        goto done;
-    }
-
-    if(jp->udo.sorting_flags & UD_SORT_BY_ACCESS_TIME){
-        /* sort files of equal last access times by path */
-        if(a->last_access_time == b->last_access_time) goto paths_compare;
-        result = (a->last_access_time > b->last_access_time) ? 1 : (-1);
-        goto done;
-    }
-
-paths_compare:    
-    result = winx_wcsicmp(a->path, b->path);
-    
-done:
-    if(jp->udo.sorting_flags & UD_SORT_DESCENDING) result *= (-1);
-    return result;
+    file->user_defined_flags &= ~(UD_FILE_MOVED_TO_FRONT | UD_FILE_IN_UNCHANGED_RANGE);
+    if(jp->already_optimized_clusters >= file->disp.clusters)
+        jp->already_optimized_clusters -= file->disp.clusters;
+    return 0;
 }
 
 /**
  * @brief Moves small files to the 
  * beginning of the disk, sorted.
+ * @details Files left in place by the
+ * cut off of sorted out files are kept
+ * in the sorted order with the rest.
  * @param[in] jp the job parameters.
  * @param[in,out] start_lcn LCN of
  * the space not optimized yet.
  * @param[in] end_lcn LCN of the space
  * beyond the area intended for placement
  * of sorted out files.
- * @param[in] t pointer to the binary tree
- * traverser.
+ * @param[in] sf the sorted list of files.
+ * @param[in,out] cursor index of the first
+ * file not moved yet.
  */
 static void move_files_to_front(udefrag_job_parameters *jp,
-    ULONGLONG *start_lcn, ULONGLONG end_lcn, struct prb_traverser *t)
+    ULONGLONG *start_lcn, ULONGLONG end_lcn,
+    udefrag_sorted_files *sf, ULONGLONG *cursor)
 {
     winx_file_info *file;
+    ULONGLONG i;
     winx_volume_region *rgn;
     int region_not_found;
     ULONGLONG skipped_files = 0;
@@ -559,8 +543,12 @@ static void move_files_to_front(udefrag_job_parameters *jp,
     release_temp_space_regions(jp);
 
     /* do the job */
-    file = prb_t_cur(t);
-    while(file){
+    for(i = *cursor; i < sf->count; i++){
+        file = sf->items[i].file;
+        if(is_moved_to_front(file)){
+            if(keep_file_in_place(jp,file,start_lcn,end_lcn))
+                continue;
+        }
         if(can_move_entirely(file,jp)){
             region_not_found = 1;
             rgn = find_first_free_region(jp,*start_lcn,file->disp.clusters,NULL);
@@ -571,13 +559,11 @@ static void move_files_to_front(udefrag_job_parameters *jp,
             if(region_not_found){
                 if(file->user_defined_flags & UD_FILE_REGION_NOT_FOUND){
                     /* if region is not found twice, skip the file */
-                    file = prb_t_next(t);
                     skipped_files ++;
                     continue;
                 } else {
                     if(skipped_files && !jp->pi.moved_clusters){
                         /* skip all subsequent big files too */
-                        file = prb_t_next(t);
                         skipped_files ++;
                         continue;
                     } else {
@@ -598,8 +584,8 @@ static void move_files_to_front(udefrag_job_parameters *jp,
             }
             file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
         }
-        file = prb_t_next(t);
     }
+    *cursor = i;
     
     /* display amount of moved data */
     itrace("%I64u clusters moved",jp->pi.moved_clusters);
@@ -620,7 +606,8 @@ static int is_block_quite_small(udefrag_job_parameters *jp,
 {
     ULONGLONG file_size, block_size;
     ULONGLONG fragment_size;
-    winx_blockmap *fragments, *fr;
+    udefrag_fragment *fragments;
+    ULONGLONG n, lo, hi, i;
     
     file_size = file->disp.clusters * jp->v_info.bytes_per_cluster;
     block_size = block->length * jp->v_info.bytes_per_cluster;
@@ -638,19 +625,28 @@ static int is_block_quite_small(udefrag_job_parameters *jp,
     if(block_size >= jp->udo.fragment_size_threshold) return 0;
 
     /* move small fragments needing defragmentation */
-    fragments = build_fragments_list(file,NULL);
-    for(fr = fragments; fr; fr = fr->next){
-        if(block->lcn >= fr->lcn && block->lcn < fr->lcn + fr->length){
-            fragment_size = fr->length * jp->v_info.bytes_per_cluster;
-            if(fragment_size >= jp->udo.fragment_size_threshold){
-                release_fragments_list(&fragments);
-                return 0;
-            }
-            break;
-        }
-        if(fr->next == fragments) break;
+    fragments = get_fragment_index(file,&n,jp);
+    if(fragments == NULL) return 1;
+
+    /*
+    * Fragments follow in order of VCNs of their first blocks,
+    * but blocks joined by LCN may leave gaps in VCNs for
+    * compressed and sparse files. So the block belongs to
+    * the last fragment starting at its VCN or before.
+    */
+    lo = 0, hi = n;
+    while(lo < hi){
+        i = lo + (hi - lo) / 2;
+        if(fragments[i].vcn <= block->vcn) lo = i + 1;
+        else hi = i;
+    }
+    if(lo == 0) return 1;
+    i = lo - 1;
+    if(block->lcn >= fragments[i].lcn \
+      && block->lcn < fragments[i].lcn + fragments[i].length){
+        fragment_size = fragments[i].length * jp->v_info.bytes_per_cluster;
+        if(fragment_size >= jp->udo.fragment_size_threshold) return 0;
     }
-    release_fragments_list(&fragments);
     return 1;
 }
 
@@ -714,12 +710,12 @@ done:
  * as already optimized.
  */
 static void cut_off_group_of_files(udefrag_job_parameters *jp,
-    struct prb_table *pt,winx_file_info *first_file,ULONGLONG n,
+    udefrag_sorted_files *sf,ULONGLONG first,ULONGLONG n,
     ULONGLONG length)
 {
-    struct prb_traverser t;
     winx_file_info *file;
     ULONGLONG magic_length;
+    ULONGLONG i;
     
     /* group should be larger than 20 MB or should contain at least 10 files */
     magic_length = min(OPTIMIZER_MAGIC_CONSTANT,jp->udo.optimizer_size_limit);
@@ -728,28 +724,156 @@ static void cut_off_group_of_files(udefrag_job_parameters *jp,
             return;
     }
     
-    prb_t_init(&t,pt);
-    file = prb_t_find(&t,pt,first_file);
-    while(file && n){
+    for(i = first; i < sf->count && n; i++){
+        file = sf->items[i].file;
         file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
         n --;
         jp->already_optimized_clusters += file->disp.clusters;
-        file = prb_t_next(&t);
     }
-    if(n > 0){
-        etrace("cannot find file in tree");
+}
+
+/**
+ * @brief Marks files lying on the disk
+ * in the sorted order already as optimized.
+ * @details Finds the subsequence of not fragmented
+ * files of the sorted list which is sorted by LCN
+ * as well and has the maximum total length. Such
+ * files need no moves, as all the rest of files can
+ * be placed around them. The subsequence is found by
+ * the weighted longest increasing subsequence algorithm;
+ * prefix maximums are kept in the Fenwick tree, so it
+ * takes O(n log n) time. A file may join the run only if
+ * files preceding it in the sorted list fit in front of
+ * it and files following it fit behind it; otherwise
+ * the cursor of placement would jump too far, leaving
+ * the rest of files no room.
+ * @param[in] jp the job parameters.
+ * @param[in] sf the sorted list of files.
+ * @param[in] min_length number of clusters
+ * the run must exceed to be marked.
+ * @param[out] kept number of clusters
+ * in the run found.
+ * @return Zero for success, negative value otherwise.
+ * @note Replaces marks set by cut_off_group_of_files
+ * when the run keeps more clusters in place.
+ */
+static int cut_off_longest_sorted_run(udefrag_job_parameters *jp,
+    udefrag_sorted_files *sf,ULONGLONG min_length,ULONGLONG *kept)
+{
+    struct file_position *positions = NULL, *buffer = NULL;
+    ULONGLONG *rank = NULL, *length = NULL, *prev = NULL, *tree = NULL;
+    ULONGLONG i, j, k, r, n, best;
+    ULONGLONG total = 0, preceding = 0, lcn;
+    #define NO_FILE ((ULONGLONG) -1)
+    winx_file_info *file;
+    int result = (-1);
+
+    *kept = 0;
+
+    /* collect positions of not fragmented files */
+    for(i = 0, n = 0; i < sf->count; i++)
+        if(!is_fragmented(sf->items[i].file)) n ++;
+    if(n == 0) return 0;
+
+    positions = winx_tmalloc((size_t)n * sizeof(struct file_position));
+    buffer = winx_tmalloc((size_t)n * sizeof(struct file_position));
+    rank = winx_tmalloc((size_t)sf->count * sizeof(ULONGLONG));
+    length = winx_tmalloc((size_t)sf->count * sizeof(ULONGLONG));
+    prev = winx_tmalloc((size_t)sf->count * sizeof(ULONGLONG));
+    tree = winx_tmalloc((size_t)(n + 1) * sizeof(ULONGLONG));
+    if(!positions || !buffer || !rank || !length || !prev || !tree){
+        mtrace();
+        goto cleanup;
+    }
+    for(i = 0, j = 0; i < sf->count; i++){
+        file = sf->items[i].file;
+        total += file->disp.clusters;
+        rank[i] = 0;
+        if(!is_fragmented(file)){
+            positions[j].lcn = file->disp.blockmap->lcn;
+            positions[j].index = i;
+            j ++;
+        }
+    }
+
+    /* rank files by position, starting from one */
+    sort_by_lcn(positions,buffer,n);
+    for(j = 0; j < n; j++)
+        rank[positions[j].index] = j + 1;
+    for(j = 0; j <= n; j++)
+        tree[j] = NO_FILE;
+
+    /*
+    * Walk through the sorted list; for each file
+    * find the heaviest run of preceding files lying
+    * before it on the disk and append the file to it.
+    */
+    best = NO_FILE;
+    for(i = 0; i < sf->count; i++, preceding += file->disp.clusters){
+        if(jp->termination_router((void *)jp)) goto cleanup;
+        file = sf->items[i].file;
+        if(rank[i] == 0) continue;
+        /* the rest of files must fit around the file */
+        lcn = file->disp.blockmap->lcn;
+        if(lcn < preceding || lcn + (total - preceding) > jp->v_info.total_clusters)
+            continue;
+        /* query the maximum over ranks below the current one */
+        k = NO_FILE;
+        for(r = rank[i] - 1; r > 0; r -= r & (~r + 1)){
+            if(tree[r] != NO_FILE){
+                if(k == NO_FILE || length[tree[r]] > length[k])
+                    k = tree[r];
+            }
+        }
+        length[i] = sf->items[i].file->disp.clusters;
+        if(k != NO_FILE) length[i] += length[k];
+        prev[i] = k;
+        /* update the maximums */
+        for(r = rank[i]; r <= n; r += r & (~r + 1)){
+            if(tree[r] == NO_FILE || length[i] > length[tree[r]])
+                tree[r] = i;
+        }
+        if(best == NO_FILE || length[i] > length[best])
+            best = i;
     }
+
+    /* mark files of the run, replacing marks of groups */
+    if(best != NO_FILE) *kept = length[best];
+    if(*kept > min_length){
+        /* files of unchanged ranges stay in place anyway */
+        for(i = 0; i < sf->count; i++){
+            file = sf->items[i].file;
+            if(!(file->user_defined_flags & UD_FILE_IN_UNCHANGED_RANGE))
+                file->user_defined_flags &= ~UD_FILE_MOVED_TO_FRONT;
+        }
+        for(i = best; i != NO_FILE; i = prev[i])
+            sf->items[i].file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+    }
+    result = 0;
+
+cleanup:
+    winx_free(positions);
+    winx_free(buffer);
+    winx_free(rank);
+    winx_free(length);
+    winx_free(prev);
+    winx_free(tree);
+    return result;
 }
 
 /**
- * @brief Marks all sorted out groups of
- * files in the tree as already optimized.
+ * @brief Marks all sorted out files
+ * in the list as already optimized.
+ * @details Uses the exact planner and falls
+ * back to the detection of sorted out groups
+ * when the planner fails. The amount of data
+ * kept in place by both is logged.
  */
-static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table *pt)
+static void cut_off_sorted_out_files(udefrag_job_parameters *jp,udefrag_sorted_files *sf)
 {
-    struct prb_traverser t;
     winx_file_info *file;
-    winx_file_info *first_file; /* first file of the group */
+    ULONGLONG i;
+    ULONGLONG first;            /* index of the first file of the group */
     ULONGLONG n;                /* number of files in group */
     ULONGLONG length;           /* length of the group, in clusters */
     ULONGLONG pplcn;            /* LCN of (i - 2)-th file */
@@ -762,6 +886,7 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
     int belongs_to_group;
     ULONGLONG magic_length;
     ULONGLONG second_magic_length;
+    ULONGLONG heuristic, exact;
     ULONGLONG time;
     char buffer[32];
     
@@ -770,16 +895,14 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
     magic_length = min(OPTIMIZER_MAGIC_CONSTANT,jp->udo.optimizer_size_limit);
     
     /* select first not fragmented file */
-    prb_t_init(&t,pt);
-    file = prb_t_first(&t,pt);
-    while(file){
-        if(!is_fragmented(file)) break;
-        file = prb_t_next(&t);
+    for(i = 0; i < sf->count; i++){
+        if(!is_fragmented(sf->items[i].file)) break;
     }
-    if(file == NULL) goto done;
+    if(i == sf->count) goto done;
 
     /* initialize group */
-    first_file = file;
+    file = sf->items[i].file;
+    first = i;
     n = 1;
     length = file->disp.clusters;
     pplcn = INVALID_LCN;
@@ -787,8 +910,8 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
     prev_file = file;
     
     /* analyze subsequent files */
-    file = prb_t_next(&t);
-    while(file){
+    for(i++; i < sf->count; i++){
+        file = sf->items[i].file;
         /* check whether the file is in group or not */
         belongs_to_group = 1;
         /* 1. the file must be not fragmented */
@@ -829,36 +952,124 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
         } else {
             if(n > 1){
                 /* remark all files in previous group */
-                cut_off_group_of_files(jp,pt,first_file,n,length);
+                cut_off_group_of_files(jp,sf,first,n,length);
             }
             /* reset group */
-            while(file){
-                if(!is_fragmented(file)) break;
-                file = prb_t_next(&t);
+            for(; i < sf->count; i++){
+                if(!is_fragmented(sf->items[i].file)) break;
             }
-            if(file == NULL) goto done;
-            first_file = file;
+            if(i == sf->count) goto done;
+            file = sf->items[i].file;
+            first = i;
             n = 1;
             length = file->disp.clusters;
             pplcn = INVALID_LCN;
             plcn = file->disp.blockmap->lcn;
             prev_file = file;
         }
-        file = prb_t_next(&t);
     }
     
     if(n > 1){
         /* remark all files in group */
-        cut_off_group_of_files(jp,pt,first_file,n,length);
+        cut_off_group_of_files(jp,sf,first,n,length);
     }
 
 done:
+    heuristic = jp->already_optimized_clusters;
+    if(cut_off_longest_sorted_run(jp,sf,heuristic,&exact) == 0){
+        itrace("groups of files: %I64u clusters kept in place",heuristic);
+        itrace("longest sorted run: %I64u clusters kept in place",exact);
+        /* groups tolerate slight disorder, so they may keep more */
+        if(exact > heuristic){
+            jp->already_optimized_clusters = exact;
+            itrace("%I64u clusters of moves saved",exact - heuristic);
+        } else {
+            itrace("groups of files used, as they keep more in place");
+        }
+    } else {
+        itrace("cannot find the longest sorted run, groups of files used");
+    }
     itrace("%I64u clusters skipped",jp->already_optimized_clusters);
     winx_bytes_to_hr(jp->already_optimized_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
     itrace("%s skipped",buffer);
     stop_timing("cutting off sorted out files",time,jp);
 }
 
+/*
+* Relative frequencies of access to files
+* of each zone in the seek distance model.
+*/
+#define HOT_ZONE_WEIGHT   100
+#define WARM_ZONE_WEIGHT  10
+#define COLD_ZONE_WEIGHT  1
+
+/**
+ * @brief Estimates the mean seek distance.
+ * @details Models the disk load as a series of
+ * independent reads of files. With zones enabled
+ * a file is read with probability proportional
+ * to the weight of its zone, otherwise all files
+ * are equally probable. The mean distance between
+ * first clusters of two files read one after another
+ * is computed in a single pass over files sorted by LCN.
+ * @return The mean distance, in clusters.
+ * @note Works in dry run as well, so layouts
+ * can be compared on recorded volumes. Returns
+ * zero when the table of files is missing.
+ */
+static ULONGLONG estimate_seek_distance(udefrag_job_parameters *jp)
+{
+    struct file_table *t = &jp->file_table;
+    struct file_position *items;
+    ULONGLONG n = 0, i = 0, time;
+    ULONG id, weights[] = {
+        HOT_ZONE_WEIGHT, WARM_ZONE_WEIGHT, COLD_ZONE_WEIGHT
+    };
+    double x, w, total = 0, moment = 0, sum = 0;
+    LARGE_INTEGER now;
+
+    for(id = 0; id < t->count; id++){
+        if(t->first_lcn[id] != FILE_TABLE_NO_LCN && t->clusters[id]) n ++;
+    }
+    if(n == 0) return 0;
+
+    /* the second half is a buffer for sorting */
+    items = winx_tmalloc((size_t)n * 2 * sizeof(struct file_position));
+    if(items == NULL){
+        mtrace();
+        return 0;
+    }
+    if(!NT_SUCCESS(NtQuerySystemTime(&now)))
+        now.QuadPart = 0;
+
+    /* the index field holds the weight here */
+    for(id = 0; id < t->count && i < n; id++){
+        if(t->first_lcn[id] != FILE_TABLE_NO_LCN && t->clusters[id]){
+            items[i].lcn = t->first_lcn[id];
+            items[i].index = 1;
+            if(jp->udo.sorting_flags & UD_SORT_BY_ZONES){
+                /* the same as get_file_zone does */
+                time = max(t->access_time[id],t->modification_time[id]);
+                items[i].index = weights[get_time_zone(time,(ULONGLONG)now.QuadPart,jp)];
+            }
+            i ++;
+        }
+    }
+    sort_by_lcn(items,items + n,n);
+
+    /* sum of w[i] * w[j] * (x[j] - x[i]) over all i < j */
+    for(i = 0; i < n; i++){
+        x = (double)(LONGLONG)items[i].lcn;
+        w = (double)(LONGLONG)items[i].index;
+        sum += w * (x * total - moment);
+        total += w, moment += w * x;
+    }
+    winx_free(items);
+
+    /* each pair can be read in both orders */
+    return (ULONGLONG)(2 * sum / (total * total));
+}
+
 /**
  * @brief Calculates number of allocated clusters
  * between start_lcn and the end of the disk.
@@ -890,24 +1101,72 @@ static ULONGLONG count_clusters(udefrag_job_parameters *jp,ULONGLONG start_lcn)
  * of clusters still needing
  * to be optimized.
  */
-static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,struct prb_table *pt)
+static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,udefrag_sorted_files *sf)
 {
     winx_file_info *f;
-    struct prb_traverser t;
-    ULONGLONG n = 0;
+    ULONGLONG i, n = 0;
 
-    prb_t_init(&t,pt);
-    f = prb_t_first(&t,pt);
-    while(f){
+    for(i = 0; i < sf->count; i++){
+        f = sf->items[i].file;
         if(!is_moved_to_front(f)){
             if(can_move_entirely(f,jp))
                 n += f->disp.clusters;
         }
-        f = prb_t_next(&t);
     }
     return n;
 }
 
+/**
+ * @internal
+ * @brief Adds the file to the list of files
+ * to be sorted, unless it is too big or
+ * cannot be moved entirely.
+ * @param[in] clusters number of clusters of the file.
+ * @param[in,out] sf the list; NULL forces to count files only.
+ * @param[in] n capacity of the list.
+ * @return Nonzero value if the file is accepted.
+ */
+static int add_file_to_sort(udefrag_job_parameters *jp,winx_file_info *f,
+    ULONGLONG clusters,udefrag_sorted_files *sf,ULONGLONG n)
+{
+    if(clusters * jp->v_info.bytes_per_cluster >= jp->udo.optimizer_size_limit)
+        return 0;
+    if(!can_move_entirely(f,jp))
+        return 0;
+    if(sf){
+        if(sf->count >= n) return 0;
+        sf->items[sf->count++].file = f;
+    }
+    return 1;
+}
+
+/**
+ * @internal
+ * @brief Collects files to be sorted.
+ * @details Walks through the table of files if
+ * it is available, through the list otherwise.
+ * @return Number of files accepted.
+ */
+static ULONGLONG collect_files_to_sort(udefrag_job_parameters *jp,
+    udefrag_sorted_files *sf,ULONGLONG n)
+{
+    struct file_table *t = &jp->file_table;
+    winx_file_info *f;
+    ULONGLONG count = 0;
+    ULONG id;
+
+    if(has_file_table(jp)){
+        for(id = 0; id < t->count; id++)
+            count += add_file_to_sort(jp,t->files[id],t->clusters[id],sf,n);
+    } else {
+        for(f = jp->filelist; f; f = f->next){
+            count += add_file_to_sort(jp,f,f->disp.clusters,sf,n);
+            if(f->next == jp->filelist) break;
+        }
+    }
+    return count;
+}
+
 /**
  * @brief Optimizes the disk.
  * @return Zero for success,
@@ -915,11 +1174,11 @@ static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,struct prb_tabl
  */
 static int optimize_routine(udefrag_job_parameters *jp)
 {
-    winx_file_info *f;
-    struct prb_table *pt;
-    struct prb_traverser t;
+    udefrag_sorted_files sf;
     ULONGLONG start_lcn, end_lcn;
-    void **p;
+    ULONGLONG cursor, n;
+    ULONGLONG seek_distance = 0;
+    int estimate_seeks;
     ULONGLONG time;
     int result = 0;
 
@@ -935,62 +1194,105 @@ static int optimize_routine(udefrag_job_parameters *jp)
     /* no files are excluded by this task currently */
     clear_currently_excluded_flag(jp);
 
-    /* build tree of files sorted by the requested criteria */
-    pt = prb_create(files_compare,(void *)jp,NULL);
-    for(f = jp->filelist; f; f = f->next){
-        if(f->disp.clusters * jp->v_info.bytes_per_cluster \
-          < jp->udo.optimizer_size_limit){
-            if(can_move_entirely(f,jp)){
-                p = prb_probe(pt,(void *)f);
-                if(*p != f) etrace("a duplicate found for %ws",f->path);
-            }
-        }
-        if(f->next == jp->filelist) break;
+    /* the rest of files is sorted as usual if the trace cannot be loaded */
+    (void)load_access_order(jp);
+    /* the estimation takes a pass over all the files, so do it when needed only */
+    estimate_seeks = (jp->udo.sorting_flags & UD_SORT_BY_ZONES) \
+        || jp->udo.dbgprint_level >= DBG_DETAILED;
+    if(estimate_seeks) seek_distance = estimate_seek_distance(jp);
+
+    /* build list of files sorted by the requested criteria */
+    memset(&sf,0,sizeof(udefrag_sorted_files));
+    n = collect_files_to_sort(jp,NULL,0);
+    if(n == 0) goto done;
+    sf.items = winx_tmalloc((size_t)n * sizeof(udefrag_sort_item));
+    if(sf.items == NULL){
+        mtrace();
+        result = (-1);
+        goto done;
+    }
+    (void)collect_files_to_sort(jp,&sf,n);
+    if(jp->job_type == QUICK_OPTIMIZATION_JOB){
+        /* skip ranges left intact since the last optimization; */
+        /* all the files get sorted if the layout cannot be loaded */
+        (void)cut_off_unchanged_ranges(jp,&sf);
+    }
+    if(sort_files(&sf,jp) < 0){
+        result = (-1);
+        goto done;
     }
     
     if(jp->job_type == QUICK_OPTIMIZATION_JOB){
         /* cut off already sorted out groups of files */
-        cut_off_sorted_out_files(jp,pt);
+        cut_off_sorted_out_files(jp,&sf);
+    }
+    
+    if(jp->udo.in_place_optimization){
+        /* apply the sorted order as a permutation */
+        jp->pi.clusters_to_process = \
+            jp->pi.processed_clusters \
+            + clusters_to_optimize(jp,&sf);
+        result = optimize_in_place(jp,&sf);
+        if(result == 0) (void)save_layout(jp,&sf);
+        goto done;
     }
     
     /* do the job */
-    prb_t_init(&t,pt);
-    if(prb_t_first(&t,pt) == NULL) goto done;
+    cursor = 0;
     start_lcn = end_lcn = 0;
+    if(jp->udo.sorting_flags & UD_SORT_BY_ZONES){
+        /* place hot files right after the MFT zone, unless it lies too far */
+        if(jp->mft_zone.length && jp->mft_zone.start < jp->v_info.total_clusters / 2)
+            start_lcn = end_lcn = jp->mft_zone.start + jp->mft_zone.length;
+    }
+    /* continue the interrupted optimization if any */
+    (void)resume_optimization(jp,&sf,&cursor,&start_lcn,&end_lcn);
     while(!jp->termination_router((void *)jp)){
         winx_dbg_print_header(0,0,I"volume optimization pass #%u",jp->pi.pass_number);
+        timeline_begin(jp,"optimization pass");
         jp->pi.clusters_to_process = \
             jp->pi.processed_clusters \
             + count_clusters(jp,start_lcn) \
-            + clusters_to_optimize(jp,pt);
+            + clusters_to_optimize(jp,&sf);
         
         /* cleanup space in the beginning of the disk */
         move_files_to_back(jp,&end_lcn);
         if(jp->termination_router((void *)jp)){
             /* the pass is completed */
             jp->pi.pass_number ++;
+            timeline_end(jp,"optimization pass");
             break;
         }
         
         /* move small files back, sorted */
-        move_files_to_front(jp,&start_lcn,end_lcn,&t);
+        move_files_to_front(jp,&start_lcn,end_lcn,&sf,&cursor);
         jp->pi.pass_number ++; /* the pass is completed */
+        journal_pass(jp,&sf,cursor,start_lcn,end_lcn);
+        timeline_end(jp,"optimization pass");
         
         /* break if no more files need optimization */
-        if(prb_t_cur(&t) == NULL) break;
+        if(cursor >= sf.count) break;
         
         /* break if no repeat allowed */
         if(!(jp->udo.job_flags & UD_JOB_REPEAT)) break;
     }
     
+    /* let the next optimization skip ranges sorted out already */
+    (void)save_layout(jp,&sf);
+    
 done:
+    if(estimate_seeks){
+        itrace("mean seek distance: %I64u clusters before, %I64u clusters after",
+            seek_distance,estimate_seek_distance(jp));
+    }
     stop_timing("optimization",time,jp);
 
     /* cleanup */
     clear_currently_excluded_flag(jp);
     winx_fclose(jp->fVolume);
     jp->fVolume = NULL;
-    if(pt) prb_destroy(pt,NULL);
+    release_sorted_files(&sf);
+    release_access_order(jp);
     return result;
 }
 
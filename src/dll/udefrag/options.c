@@ -35,14 +35,19 @@
  */
 int get_options(udefrag_job_parameters *jp)
 {
-    wchar_t *buffer, *dp;
+    wchar_t *buffer, *dp, *key, *next;
     char buf[64];
     double r;
     unsigned int it;
     int i, z, index = 0;
     char *methods[] = {
         "path", "path", "size", "creation time",
-        "last modification time", "last access time"
+        "last modification time", "last access time",
+        "directory tree (depth-first)",
+        "directory tree (breadth-first)"
+    };
+    char *verification_modes[] = {
+        "immediate", "deferred", "sampled"
     };
 
     /* reset all options */
@@ -113,16 +118,30 @@ int get_options(udefrag_job_parameters *jp)
     buffer = winx_getenv(L"UD_SORTING");
     if(buffer){
         (void)_wcslwr(buffer);
-        if(!wcscmp(buffer,L"path"))
-            index = 1, jp->udo.sorting_flags |= UD_SORT_BY_PATH;
-        else if(!wcscmp(buffer,L"size"))
-            index = 2, jp->udo.sorting_flags |= UD_SORT_BY_SIZE;
-        else if(!wcscmp(buffer,L"c_time"))
-            index = 3, jp->udo.sorting_flags |= UD_SORT_BY_CREATION_TIME;
-        else if(!wcscmp(buffer,L"m_time"))
-            index = 4, jp->udo.sorting_flags |= UD_SORT_BY_MODIFICATION_TIME;
-        else if(!wcscmp(buffer,L"a_time"))
-            index = 5, jp->udo.sorting_flags |= UD_SORT_BY_ACCESS_TIME;
+        /* zones can be combined with one more key, like ZONES,SIZE */
+        for(key = buffer; key; key = next){
+            next = wcschr(key,',');
+            if(next) *next++ = 0;
+            while(*key == ' ') key ++;
+            if(!wcscmp(key,L"zones")){
+                jp->udo.sorting_flags |= UD_SORT_BY_ZONES;
+            } else if(index == 0){
+                if(!wcscmp(key,L"path"))
+                    index = 1, jp->udo.sorting_flags |= UD_SORT_BY_PATH;
+                else if(!wcscmp(key,L"size"))
+                    index = 2, jp->udo.sorting_flags |= UD_SORT_BY_SIZE;
+                else if(!wcscmp(key,L"c_time"))
+                    index = 3, jp->udo.sorting_flags |= UD_SORT_BY_CREATION_TIME;
+                else if(!wcscmp(key,L"m_time"))
+                    index = 4, jp->udo.sorting_flags |= UD_SORT_BY_MODIFICATION_TIME;
+                else if(!wcscmp(key,L"a_time"))
+                    index = 5, jp->udo.sorting_flags |= UD_SORT_BY_ACCESS_TIME;
+                else if(!wcscmp(key,L"tree"))
+                    index = 6, jp->udo.sorting_flags |= UD_SORT_BY_TREE_DFS;
+                else if(!wcscmp(key,L"tree_bfs"))
+                    index = 7, jp->udo.sorting_flags |= UD_SORT_BY_TREE_BFS;
+            }
+        }
         winx_free(buffer);
     }
     buffer = winx_getenv(L"UD_SORTING_ORDER");
@@ -132,6 +151,52 @@ int get_options(udefrag_job_parameters *jp)
             jp->udo.sorting_flags |= UD_SORT_DESCENDING;
         winx_free(buffer);
     }
+    jp->udo.hot_zone_age = DEFAULT_HOT_ZONE_AGE;
+    buffer = winx_getenv(L"UD_HOT_ZONE_AGE");
+    if(buffer){
+        jp->udo.hot_zone_age = (ULONGLONG)_wtol(buffer);
+        winx_free(buffer);
+    }
+    jp->udo.cold_zone_age = DEFAULT_COLD_ZONE_AGE;
+    buffer = winx_getenv(L"UD_COLD_ZONE_AGE");
+    if(buffer){
+        jp->udo.cold_zone_age = (ULONGLONG)_wtol(buffer);
+        winx_free(buffer);
+    }
+    if(jp->udo.cold_zone_age < jp->udo.hot_zone_age)
+        jp->udo.cold_zone_age = jp->udo.hot_zone_age;
+    buffer = winx_getenv(L"UD_SORTING_TRACE");
+    if(buffer){
+        wcsncpy(jp->udo.sorting_trace,buffer,MAX_PATH);
+        jp->udo.sorting_trace[MAX_PATH] = 0;
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_IN_PLACE_OPTIMIZATION");
+    if(buffer){
+        if(!wcscmp(buffer,L"1"))
+            jp->udo.in_place_optimization = 1;
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_INCREMENTAL_OPTIMIZATION");
+    if(buffer){
+        if(!wcscmp(buffer,L"1"))
+            jp->udo.incremental_optimization = 1;
+        winx_free(buffer);
+    }
+    
+    /* set free space consolidation targets */
+    buffer = winx_getenv(L"UD_FREE_SPACE_TARGET");
+    if(buffer){
+        (void)_snprintf(buf,sizeof(buf) - 1,"%ws",buffer);
+        buf[sizeof(buf) - 1] = 0;
+        jp->udo.free_space_target = winx_hr_to_bytes(buf);
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_FREE_SPACE_FRAGMENTS");
+    if(buffer){
+        jp->udo.free_space_fragments = (ULONGLONG)_wtol(buffer);
+        winx_free(buffer);
+    }
     
     /* set time limit */
     buffer = winx_getenv(L"UD_TIME_LIMIT");
@@ -157,6 +222,14 @@ int get_options(udefrag_job_parameters *jp)
         winx_free(buffer);
     }
 
+    /* check for timeline option */
+    buffer = winx_getenv(L"UD_TIMELINE");
+    if(buffer){
+        if(!wcscmp(buffer,L"1"))
+            jp->udo.timeline = 1;
+        winx_free(buffer);
+    }
+
     /* set debug print level */
     buffer = winx_getenv(L"UD_DBGPRINT_LEVEL");
     if(buffer){
@@ -179,6 +252,44 @@ int get_options(udefrag_job_parameters *jp)
         winx_free(buffer);
     }
     
+    /* set simulated latency of move requests */
+    buffer = winx_getenv(L"UD_DRY_RUN_LATENCY");
+    if(buffer){
+        jp->udo.dry_run_latency = max(_wtoi(buffer),0);
+        winx_free(buffer);
+    }
+    
+    /* set number of move requests kept in flight */
+    jp->udo.move_queue_depth = DEFAULT_MOVE_QUEUE_DEPTH;
+    buffer = winx_getenv(L"UD_MOVE_QUEUE_DEPTH");
+    if(buffer){
+        jp->udo.move_queue_depth = _wtoi(buffer);
+        if(jp->udo.move_queue_depth < 1)
+            jp->udo.move_queue_depth = 1;
+        if(jp->udo.move_queue_depth > MAX_MOVE_QUEUE_DEPTH)
+            jp->udo.move_queue_depth = MAX_MOVE_QUEUE_DEPTH;
+        winx_free(buffer);
+    }
+    
+    /* set verification mode of moves */
+    buffer = winx_getenv(L"UD_MOVE_VERIFICATION");
+    if(buffer){
+        (void)_wcslwr(buffer);
+        if(!wcscmp(buffer,L"deferred"))
+            jp->udo.move_verification = VERIFY_MOVES_DEFERRED;
+        else if(!wcscmp(buffer,L"sampled"))
+            jp->udo.move_verification = VERIFY_MOVES_SAMPLED;
+        winx_free(buffer);
+    }
+    
+    /* set cancellation latency target, none by default */
+    jp->udo.cancellation_latency = 0;
+    buffer = winx_getenv(L"UD_CANCELLATION_LATENCY");
+    if(buffer){
+        jp->udo.cancellation_latency = max(_wtoi(buffer),0);
+        winx_free(buffer);
+    }
+    
     /* set fragmentation threshold */
     buffer = winx_getenv(L"UD_FRAGMENTATION_THRESHOLD");
     if(buffer){
@@ -221,10 +332,30 @@ int get_options(udefrag_job_parameters *jp)
     itrace("file fragments threshold                  = %I64u",jp->udo.fragments_limit);
     itrace("files will be sorted by %s in %s order",methods[index],
         (jp->udo.sorting_flags & UD_SORT_DESCENDING) ? "descending" : "ascending");
+    if(jp->udo.sorting_flags & UD_SORT_BY_ZONES){
+        itrace("files accessed within %I64u days will be placed first",jp->udo.hot_zone_age);
+        itrace("files not accessed for %I64u days will be placed last",jp->udo.cold_zone_age);
+    }
+    if(jp->udo.sorting_trace[0])
+        itrace("files listed in %ws will be placed first",jp->udo.sorting_trace);
+    if(jp->udo.in_place_optimization)
+        itrace("files will be sorted in place");
+    if(jp->udo.incremental_optimization)
+        itrace("ranges left intact since the last optimization will be skipped");
+    (void)winx_bytes_to_hr(jp->udo.free_space_target,1,buf,sizeof(buf));
+    itrace("free space target                         = %s",buf);
+    itrace("free space fragments target               = %I64u",jp->udo.free_space_fragments);
     itrace("time limit                                = %I64u seconds",jp->udo.time_limit);
     itrace("progress refresh interval                 = %u msec",jp->udo.refresh_interval);
+    itrace("move queue depth                          = %u",jp->udo.move_queue_depth);
+    itrace("verification of moves                     = %s",
+        verification_modes[jp->udo.move_verification]);
+    itrace("cancellation latency                      = %u msec",jp->udo.cancellation_latency);
+    if(jp->udo.dry_run)
+        itrace("simulated move latency                    = %u msec",jp->udo.dry_run_latency);
     if(jp->udo.disable_reports) itrace("reports disabled");
     else itrace("reports enabled");
+    if(jp->udo.timeline) itrace("timeline enabled");
     switch(jp->udo.dbgprint_level){
     case DBG_DETAILED:
         itrace("detailed debug level set");
@@ -0,0 +1,514 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file permute.c
+ * @brief In-place volume optimization.
+ * @details The target layout is computed first: sorted
+ * files are packed one after another into the space which
+ * is either free or occupied by the files being sorted.
+ * Then files are moved straight to their targets as soon
+ * as the targets become free. When no target is free,
+ * files occupying targets get evicted to the free space
+ * beyond the layout, the only scratch space needed. So
+ * most of files are written once and the optimization
+ * works even on almost full disks.
+ * @addtogroup Optimizer
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+/* target of files not fitting the layout */
+#define NO_TARGET ((ULONGLONG) -1)
+
+/*
+* Minimal number of targets cleaned up at once
+* when all the targets are occupied. More targets
+* mean less passes, but more data written twice.
+*/
+#define MIN_TARGETS_TO_CLEAN_UP 64
+
+/* space available for the layout */
+struct layout_segment {
+    ULONGLONG lcn;
+    ULONGLONG length;
+};
+
+struct layout {
+    ULONGLONG *targets;   /* target LCN of each file of the sorted list */
+    ULONGLONG end;        /* the cluster following the layout */
+    ULONGLONG pending;    /* number of files not placed yet */
+    ULONGLONG written;    /* number of clusters written */
+    ULONGLONG placed;     /* number of clusters placed at their targets */
+    ULONGLONG evicted;    /* number of clusters moved to the scratch space */
+};
+
+#define is_to_be_placed(f) ((f)->user_defined_flags & UD_FILE_TO_BE_PLACED)
+
+/************************************************************/
+/*                   Layout computation                     */
+/************************************************************/
+
+/**
+ * @brief Appends space to the list
+ * of segments, joining adjacent ones.
+ * @return Zero for success, negative value otherwise.
+ */
+static int append_space(struct layout_segment **segments,
+    ULONGLONG *n,ULONGLONG *capacity,ULONGLONG lcn,ULONGLONG length)
+{
+    struct layout_segment *s;
+    ULONGLONG new_capacity;
+
+    if(length == 0) return 0;
+
+    if(*n && (*segments)[*n - 1].lcn + (*segments)[*n - 1].length == lcn){
+        (*segments)[*n - 1].length += length;
+        return 0;
+    }
+
+    if(*n == *capacity){
+        new_capacity = max(*capacity * 2,1024);
+        s = winx_tmalloc((size_t)new_capacity * sizeof(struct layout_segment));
+        if(s == NULL){
+            mtrace();
+            return (-1);
+        }
+        if(*segments){
+            memcpy(s,*segments,(size_t)(*n) * sizeof(struct layout_segment));
+            winx_free(*segments);
+        }
+        *segments = s;
+        *capacity = new_capacity;
+    }
+    (*segments)[*n].lcn = lcn;
+    (*segments)[*n].length = length;
+    (*n) ++;
+    return 0;
+}
+
+/**
+ * @brief Searches for the next block
+ * of files to be placed.
+ */
+static winx_blockmap *next_block(udefrag_job_parameters *jp,ULONGLONG *min_lcn)
+{
+    winx_file_info *file;
+    winx_blockmap *block;
+
+    while(1){
+        block = find_first_block(jp,min_lcn,SKIP_PARTIALLY_MOVABLE_FILES,&file);
+        if(block == NULL) return NULL;
+        if(is_to_be_placed(file) && !is_block_excluded(block))
+            return block;
+    }
+}
+
+/**
+ * @brief Builds list of contiguous segments
+ * consisting of free space and blocks of files
+ * to be placed, sorted by LCN.
+ * @return Zero for success, negative value otherwise.
+ */
+static int collect_segments(udefrag_job_parameters *jp,
+    struct layout_segment **segments,ULONGLONG *n)
+{
+    winx_volume_region *rgn;
+    winx_blockmap *block;
+    ULONGLONG capacity = 0, min_lcn = 0;
+
+    *segments = NULL, *n = 0;
+    rgn = jp->free_regions;
+    block = next_block(jp,&min_lcn);
+    while(rgn || block){
+        if(jp->termination_router((void *)jp)) return (-1);
+        if(block && (rgn == NULL || block->lcn < rgn->lcn)){
+            if(append_space(segments,n,&capacity,block->lcn,block->length) < 0)
+                return (-1);
+            block = next_block(jp,&min_lcn);
+        } else {
+            if(append_space(segments,n,&capacity,rgn->lcn,rgn->length) < 0)
+                return (-1);
+            rgn = rgn->next;
+            if(rgn == jp->free_regions) rgn = NULL;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Assigns target LCNs to
+ * files in order of the sorted list.
+ * @details Files already lying at their
+ * targets are marked as placed immediately.
+ * Files kept in place by the cut off of sorted
+ * out files get the rest of files placed around
+ * them in the sorted order; those lying behind
+ * space used up already get placed as usual.
+ */
+static void assign_targets(udefrag_job_parameters *jp,udefrag_sorted_files *sf,
+    struct layout *lay,struct layout_segment *segments,ULONGLONG n)
+{
+    winx_file_info *f;
+    ULONGLONG i, s = 0, lcn = 0, left = 0, end;
+    ULONGLONG not_fitting = 0;
+
+    if(n) lcn = segments[0].lcn, left = segments[0].length;
+    for(i = 0; i < sf->count; i++){
+        f = sf->items[i].file;
+        lay->targets[i] = NO_TARGET;
+        if(is_moved_to_front(f) && f->disp.blockmap && !is_fragmented(f)){
+            if(f->disp.blockmap->lcn >= lcn){
+                /* place the following files beyond the kept one */
+                end = f->disp.blockmap->lcn + f->disp.clusters;
+                while(s < n && segments[s].lcn + segments[s].length <= end) s++;
+                if(s < n){
+                    lcn = max(segments[s].lcn,end);
+                    left = segments[s].lcn + segments[s].length - lcn;
+                }
+                continue;
+            }
+            f->user_defined_flags &= ~(UD_FILE_MOVED_TO_FRONT | UD_FILE_IN_UNCHANGED_RANGE);
+            if(jp->already_optimized_clusters >= f->disp.clusters)
+                jp->already_optimized_clusters -= f->disp.clusters;
+            /* its space is behind the layout cursor, so it isn't needed */
+            if(can_move_entirely(f,jp))
+                f->user_defined_flags |= UD_FILE_TO_BE_PLACED;
+        }
+        if(!is_to_be_placed(f)) continue;
+
+        /* keep the order, so skip space not fitting the file */
+        while(s < n && f->disp.clusters > left){
+            if(++s < n) lcn = segments[s].lcn, left = segments[s].length;
+        }
+        if(s == n){
+            not_fitting ++;
+            continue;
+        }
+
+        lay->targets[i] = lcn;
+        lcn += f->disp.clusters;
+        left -= f->disp.clusters;
+        lay->end = lcn;
+        if(f->disp.blockmap->lcn == lay->targets[i] && !is_fragmented(f)){
+            f->user_defined_flags &= ~UD_FILE_TO_BE_PLACED;
+            f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+            jp->already_optimized_clusters += f->disp.clusters;
+        } else {
+            lay->pending ++;
+        }
+    }
+    if(not_fitting)
+        itrace("%I64u files do not fit the layout",not_fitting);
+}
+
+/************************************************************/
+/*                    Layout application                    */
+/************************************************************/
+
+/**
+ * @brief Moves files to their targets
+ * which are entirely free.
+ * @return Number of files moved,
+ * negative value indicates failure.
+ */
+static LONGLONG place_files(udefrag_job_parameters *jp,
+    udefrag_sorted_files *sf,struct layout *lay)
+{
+    struct layout_segment *free_space;
+    winx_volume_region *rgn;
+    winx_file_info *f;
+    ULONGLONG i, j, n = 0, target;
+    LONGLONG moved = 0;
+
+    /*
+    * Targets never overlap, so the snapshot of free
+    * space taken before the moves remains valid for them.
+    */
+    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
+        n ++;
+        if(rgn->next == jp->free_regions) break;
+    }
+    if(n == 0) return 0;
+    free_space = winx_tmalloc((size_t)n * sizeof(struct layout_segment));
+    if(free_space == NULL){
+        mtrace();
+        return (-1);
+    }
+    for(j = 0, rgn = jp->free_regions; j < n; j++, rgn = rgn->next){
+        free_space[j].lcn = rgn->lcn;
+        free_space[j].length = rgn->length;
+    }
+
+    /* targets grow along the list, so walk both lists at once */
+    for(i = 0, j = 0; i < sf->count; i++){
+        if(jp->termination_router((void *)jp)) break;
+        f = sf->items[i].file;
+        target = lay->targets[i];
+        if(!is_to_be_placed(f) || target == NO_TARGET) continue;
+        if(f->disp.blockmap->lcn == target && !is_fragmented(f)){
+            /* evicted right to the target */
+            f->user_defined_flags &= ~UD_FILE_TO_BE_PLACED;
+            f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+            lay->placed += f->disp.clusters;
+            lay->pending --;
+            moved ++;
+            continue;
+        }
+        while(j < n && free_space[j].lcn + free_space[j].length <= target) j++;
+        if(j == n) break;
+        if(free_space[j].lcn > target) continue;
+        if(free_space[j].lcn + free_space[j].length < target + f->disp.clusters) continue;
+
+        lay->written += f->disp.clusters;
+        if(move_file(f,f->disp.blockmap->vcn,f->disp.clusters,target,jp) >= 0)
+            lay->placed += f->disp.clusters;
+        /* don't try again on failure */
+        f->user_defined_flags &= ~UD_FILE_TO_BE_PLACED;
+        f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+        lay->pending --;
+        moved ++;
+    }
+    winx_free(free_space);
+    return moved;
+}
+
+/**
+ * @brief Moves the file occupying
+ * a target to the scratch space.
+ * @details The last free region beyond the
+ * layout fitting the file is used, so evicted
+ * files rarely get in the way again. When no
+ * region fits, the file gets split between
+ * the last regions; it will be defragmented
+ * when moved to its target.
+ * @return Positive value if the file has been
+ * evicted, zero if it cannot be evicted, negative
+ * value if no more scratch space exists or the
+ * move failed.
+ * @note Files not fitting the layout
+ * stay in the scratch space then.
+ */
+static int evict_file(udefrag_job_parameters *jp,
+    winx_file_info *f,ULONGLONG min_lcn,struct layout *lay)
+{
+    winx_volume_region *r, *rgn = NULL;
+    winx_blockmap *first, *last;
+    ULONGLONG vcn, n, left, total = 0;
+    ULONGLONG time = winx_xtime();
+
+    if(!is_to_be_placed(f)) return 0;
+    if(jp->free_regions == NULL) return (-1);
+
+    for(r = jp->free_regions->prev; r; r = r->prev){
+        if(r->lcn < min_lcn) break;
+        if(r->length >= f->disp.clusters){
+            rgn = r;
+            break;
+        }
+        total += r->length;
+        if(r->prev == jp->free_regions->prev) break;
+    }
+    jp->p_counters.searching_time += winx_xtime() - time;
+
+    if(rgn){
+        lay->written += f->disp.clusters;
+        lay->evicted += f->disp.clusters;
+        if(move_file(f,f->disp.blockmap->vcn,f->disp.clusters,rgn->lcn,jp) < 0)
+            return (-1);
+        return 1;
+    }
+
+    /* the file can be split only when it has no gaps between VCNs */
+    first = f->disp.blockmap, last = f->disp.blockmap->prev;
+    if(last->vcn + last->length - first->vcn != f->disp.clusters) return (-1);
+    if(total < f->disp.clusters) return (-1);
+
+    vcn = first->vcn, left = f->disp.clusters;
+    while(left && !jp->termination_router((void *)jp)){
+        /* regions get removed when filled up, so search them again each time */
+        rgn = NULL;
+        for(r = jp->free_regions ? jp->free_regions->prev : NULL; r; r = r->prev){
+            if(r->lcn < min_lcn) break;
+            if(r->length){
+                rgn = r;
+                break;
+            }
+            if(r->prev == jp->free_regions->prev) break;
+        }
+        if(rgn == NULL) break;
+        n = min(rgn->length,left);
+        lay->written += n;
+        lay->evicted += n;
+        if(move_file(f,vcn,n,rgn->lcn,jp) < 0) break;
+        vcn += n, left -= n;
+    }
+    return left ? (-1) : 1;
+}
+
+/**
+ * @brief Breaks the deadlock by eviction
+ * of files occupying targets of not
+ * placed files, while the scratch
+ * space is available.
+ * @details Targets are cleaned up in order
+ * of the sorted list, up to 1/16 of not
+ * placed files at once.
+ * @return Number of files evicted.
+ */
+static ULONGLONG evict_files(udefrag_job_parameters *jp,
+    udefrag_sorted_files *sf,struct layout *lay)
+{
+    winx_file_info *f, *file;
+    winx_blockmap *block;
+    ULONGLONG i, target, end, min_lcn;
+    ULONGLONG evicted = 0, targets = 0;
+    int result;
+
+    for(i = 0; i < sf->count; i++){
+        if(jp->termination_router((void *)jp)) break;
+        f = sf->items[i].file;
+        target = lay->targets[i];
+        if(!is_to_be_placed(f) || target == NO_TARGET) continue;
+        end = target + f->disp.clusters;
+        if(++targets > max(MIN_TARGETS_TO_CLEAN_UP,lay->pending / 16)) break;
+
+        /* the block starting before the target */
+        block = find_block_at(jp,target,&file);
+        if(block && block->lcn < target){
+            result = evict_file(jp,file,lay->end,lay);
+            /* try the next target then, its occupants may be smaller */
+            if(result < 0) continue;
+            if(result > 0) evicted ++;
+        }
+
+        /* blocks starting inside of the target */
+        min_lcn = target;
+        while(!jp->termination_router((void *)jp)){
+            block = find_first_block(jp,&min_lcn,SKIP_PARTIALLY_MOVABLE_FILES,&file);
+            if(block == NULL || block->lcn >= end) break;
+            result = evict_file(jp,file,lay->end,lay);
+            if(result < 0) break;
+            if(result > 0) evicted ++;
+        }
+    }
+    return evicted;
+}
+
+/************************************************************/
+/*                    The entry point                       */
+/************************************************************/
+
+/**
+ * @brief Sorts files on the disk in place.
+ * @param[in] jp the job parameters.
+ * @param[in] sf the sorted list of files;
+ * files marked as moved to front are kept
+ * at their current locations.
+ * @return Zero for success, negative value otherwise.
+ */
+int optimize_in_place(udefrag_job_parameters *jp,udefrag_sorted_files *sf)
+{
+    struct layout lay;
+    struct layout_segment *segments = NULL;
+    winx_file_info *f;
+    ULONGLONG i, n, misplaced = 0;
+    ULONGLONG time, ratio;
+    LONGLONG moved;
+    char buffer[32];
+    int result = 0;
+
+    if(sf->count == 0) return 0;
+
+    time = start_timing("in-place optimization",jp);
+    memset(&lay,0,sizeof(struct layout));
+    lay.targets = winx_tmalloc((size_t)sf->count * sizeof(ULONGLONG));
+    if(lay.targets == NULL){
+        mtrace();
+        result = (-1);
+        goto done;
+    }
+
+    /* compute the target layout */
+    for(i = 0; i < sf->count; i++){
+        f = sf->items[i].file;
+        if(!is_moved_to_front(f) && can_move_entirely(f,jp))
+            f->user_defined_flags |= UD_FILE_TO_BE_PLACED;
+    }
+    release_temp_space_regions(jp);
+    if(collect_segments(jp,&segments,&n) < 0){
+        winx_free(segments);
+        result = (-1);
+        goto done;
+    }
+    assign_targets(jp,sf,&lay,segments,n);
+    winx_free(segments);
+    winx_bytes_to_hr(lay.end * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+    itrace("%I64u files to be placed, the layout ends at %s",lay.pending,buffer);
+
+    /* apply it */
+    while(lay.pending && !jp->termination_router((void *)jp)){
+        winx_dbg_print_header(0,0,I"in-place optimization pass #%u",jp->pi.pass_number);
+        release_temp_space_regions(jp);
+        moved = place_files(jp,sf,&lay);
+        if(moved < 0){
+            result = (-1);
+            break;
+        }
+        itrace("%I64d files placed, %I64u files left",moved,lay.pending);
+        jp->pi.pass_number ++;
+        if(lay.pending && moved == 0){
+            /* all the targets are occupied */
+            n = evict_files(jp,sf,&lay);
+            itrace("%I64u files evicted to the scratch space",n);
+            if(n == 0){
+                etrace("cannot free targets of %I64u files",lay.pending);
+                break;
+            }
+        }
+    }
+
+    /* verify the result */
+    for(i = 0; i < sf->count; i++){
+        f = sf->items[i].file;
+        if(lay.targets[i] != NO_TARGET && is_moved_to_front(f)){
+            if(f->disp.blockmap == NULL || f->disp.blockmap->lcn != lay.targets[i] \
+              || is_fragmented(f)) misplaced ++;
+        }
+    }
+    if(misplaced) etrace("%I64u files are not at their targets",misplaced);
+
+    /* display amount of written data */
+    itrace("%I64u clusters placed, %I64u clusters written",lay.placed,lay.written);
+    itrace("%I64u clusters written to the scratch space",lay.evicted);
+    if(lay.placed){
+        ratio = lay.written * 100 / lay.placed;
+        itrace("%I64u.%02I64u clusters written per cluster optimized",ratio / 100,ratio % 100);
+    }
+
+done:
+    for(i = 0; i < sf->count; i++)
+        sf->items[i].file->user_defined_flags &= ~UD_FILE_TO_BE_PLACED;
+    winx_free(lay.targets);
+    stop_timing("in-place optimization",time,jp);
+    return result;
+}
+
+/** @} */
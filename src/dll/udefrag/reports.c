@@ -52,7 +52,19 @@ static void convert_to_utf8_path(char *dst,int size,wchar_t *src)
     }
 }
 
-static wchar_t *get_report_path(udefrag_job_parameters *jp)
+/**
+ * @brief Builds path of the file
+ * in the reports directory.
+ * @details The reports directory
+ * is created if it doesn't exist.
+ * @param[in] jp the job parameters.
+ * @param[in] name the file name prefix,
+ * the volume letter follows it.
+ * @param[in] ext the file name extension.
+ * @return The native path, NULL indicates failure.
+ * @note The path must be released by winx_free.
+ */
+wchar_t *get_report_path(udefrag_job_parameters *jp,wchar_t *name,wchar_t *ext)
 {
     wchar_t *instdir, *fpath;
     wchar_t *path = NULL;
@@ -72,8 +84,8 @@ static wchar_t *get_report_path(udefrag_job_parameters *jp)
                 (void)winx_create_directory(path);
                 winx_free(path);
             }
-            path = winx_swprintf(L"\\??\\%ws\\reports\\fraglist_%c.luar",
-                fpath,winx_tolower(jp->volume_letter));
+            path = winx_swprintf(L"\\??\\%ws\\reports\\%ws_%c.%ws",
+                fpath,name,winx_tolower(jp->volume_letter),ext);
             if(path == NULL)
                 etrace("not enough memory (case 2)");
             winx_free(fpath);
@@ -87,8 +99,8 @@ static wchar_t *get_report_path(udefrag_job_parameters *jp)
             (void)winx_create_directory(path);
             winx_free(path);
         }
-        path = winx_swprintf(L"\\??\\%ws\\reports\\fraglist_%c.luar",
-            instdir,winx_tolower(jp->volume_letter));
+        path = winx_swprintf(L"\\??\\%ws\\reports\\%ws_%c.%ws",
+            instdir,name,winx_tolower(jp->volume_letter),ext);
         if(path == NULL)
             etrace("not enough memory (case 4)");
         winx_free(instdir);
@@ -121,7 +133,7 @@ static int save_lua_report(udefrag_job_parameters *jp)
         return (-1);
     }
     
-    path = get_report_path(jp);
+    path = get_report_path(jp,L"fraglist",L"luar");
     if(path == NULL)
         return UDEFRAG_NO_MEM;
     
@@ -263,6 +275,132 @@ int save_fragmentation_report(udefrag_job_parameters *jp)
     return result;
 }
 
+/**
+ * @brief Writes a histogram to the JSON report.
+ */
+static void write_json_histogram(WINX_FILE *f,char *name,winx_histogram *h,int last)
+{
+    char buffer[512];
+    int i, n;
+
+    (void)_snprintf(buffer,sizeof(buffer),
+        "\t\t\"%s\": {\r\n"
+        "\t\t\t\"count\": %I64u,\r\n"
+        "\t\t\t\"sum\": %I64u,\r\n"
+        "\t\t\t\"min\": %I64u,\r\n"
+        "\t\t\t\"max\": %I64u,\r\n"
+        "\t\t\t\"mean\": %I64u,\r\n"
+        "\t\t\t\"p50\": %I64u,\r\n"
+        "\t\t\t\"p90\": %I64u,\r\n"
+        "\t\t\t\"p99\": %I64u,\r\n"
+        "\t\t\t\"buckets\": [",
+        name,h->count,h->sum,h->min,h->max,
+        h->count ? h->sum / h->count : 0,
+        winx_histogram_percentile(h,50),
+        winx_histogram_percentile(h,90),
+        winx_histogram_percentile(h,99)
+        );
+    buffer[sizeof(buffer) - 1] = 0;
+    (void)winx_fwrite(buffer,1,strlen(buffer),f);
+
+    /* skip empty buckets at the end */
+    for(n = WINX_HISTOGRAM_BUCKETS; n > 0; n--)
+        if(h->buckets[n - 1]) break;
+    for(i = 0; i < n; i++){
+        (void)_snprintf(buffer,sizeof(buffer),"%s%I64u",
+            i ? "," : "",h->buckets[i]);
+        buffer[sizeof(buffer) - 1] = 0;
+        (void)winx_fwrite(buffer,1,strlen(buffer),f);
+    }
+    (void)_snprintf(buffer,sizeof(buffer),"]\r\n\t\t}%s\r\n",last ? "" : ",");
+    buffer[sizeof(buffer) - 1] = 0;
+    (void)winx_fwrite(buffer,1,strlen(buffer),f);
+}
+
+/**
+ * @brief Saves performance counters
+ * to the reports directory in JSON format.
+ * @details Times are in milliseconds,
+ * histograms are in microseconds; bucket i
+ * of a histogram counts values in [2^(i-1), 2^i)
+ * range, bucket 0 counts zero values.
+ * @return Zero for success, negative value otherwise.
+ */
+int save_performance_report(udefrag_job_parameters *jp)
+{
+    struct performance_counters *pc = &jp->p_counters;
+    wchar_t *path;
+    WINX_FILE *f;
+    char buffer[2048];
+    winx_time tm;
+    
+    if(jp->udo.disable_reports)
+        return 0;
+    
+    path = get_report_path(jp,L"perfcounters",L"json");
+    if(path == NULL)
+        return (-1);
+    f = winx_fopen(path,"w");
+    if(f == NULL){
+        winx_free(path);
+        return (-1);
+    }
+
+    memset(&tm,0,sizeof(winx_time));
+    (void)winx_get_local_time(&tm);
+    (void)_snprintf(buffer,sizeof(buffer),
+        "{\r\n"
+        "\t\"format_version\": 1,\r\n"
+        "\t\"volume_letter\": \"%c\",\r\n"
+        "\t\"job_type\": %u,\r\n"
+        "\t\"completion_status\": %i,\r\n"
+        "\t\"current_time\": \"%04i-%02i-%02iT%02i:%02i:%02i\",\r\n"
+        "\t\"counters\": {\r\n"
+        "\t\t\"overall_time\": %I64u,\r\n"
+        "\t\t\"analysis_time\": %I64u,\r\n"
+        "\t\t\"searching_time\": %I64u,\r\n"
+        "\t\t\"moving_time\": %I64u,\r\n"
+        "\t\t\"temp_space_releasing_time\": %I64u,\r\n"
+        "\t\t\"sorting_time\": %I64u,\r\n"
+        "\t\t\"verification_time\": %I64u,\r\n"
+        "\t\t\"file_opening_time\": %I64u,\r\n"
+        "\t\t\"file_moves\": %I64u,\r\n"
+        "\t\t\"redumped_files\": %I64u,\r\n"
+        "\t\t\"mismatched_files\": %I64u,\r\n"
+        "\t\t\"file_opens\": %I64u,\r\n"
+        "\t\t\"handle_cache_hits\": %I64u,\r\n"
+        "\t\t\"max_move_latency\": %I64u,\r\n"
+        "\t\t\"progress_notifications\": %I64u,\r\n"
+        "\t\t\"max_notification_latency\": %I64u\r\n"
+        "\t},\r\n"
+        "\t\"histograms\": {\r\n",
+        jp->volume_letter,(UINT)jp->job_type,jp->pi.completion_status,
+        (int)tm.year,(int)tm.month,(int)tm.day,
+        (int)tm.hour,(int)tm.minute,(int)tm.second,
+        pc->overall_time,pc->analysis_time,pc->searching_time,
+        pc->moving_time,pc->temp_space_releasing_time,
+        pc->sorting_time,pc->verification_time,pc->file_opening_time,
+        pc->file_moves,pc->redumped_files,pc->mismatched_files,
+        pc->file_opens,pc->handle_cache_hits,pc->max_move_latency,
+        pc->progress_notifications,pc->max_notification_latency
+        );
+    buffer[sizeof(buffer) - 1] = 0;
+    (void)winx_fwrite(buffer,1,strlen(buffer),f);
+    
+    write_json_histogram(f,"move",&pc->move_latency,0);
+    write_json_histogram(f,"free_region_search",&pc->search_latency,0);
+    write_json_histogram(f,"mft_record_read",&pc->ftw_statistics.mft_record_reads,0);
+    write_json_histogram(f,"path_build",&pc->ftw_statistics.path_builds,1);
+    
+    (void)strcpy(buffer,"\t}\r\n}\r\n");
+    (void)winx_fwrite(buffer,1,strlen(buffer),f);
+
+    itrace("performance counters saved to %ws",path);
+    winx_fclose(f);
+    winx_free(path);
+    return 0;
+}
+
 /**
  * @brief Removes all fragmentation reports from the volume.
  */
@@ -289,7 +427,7 @@ void remove_fragmentation_report(udefrag_job_parameters *jp)
     }
     
     /* remove reports from the reports directory */
-    new_path = get_report_path(jp);
+    new_path = get_report_path(jp,L"fraglist",L"luar");
     if(new_path){
         (void)winx_delete_file(new_path);
         winx_path_remove_extension(new_path);
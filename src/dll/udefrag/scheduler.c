@@ -0,0 +1,405 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file scheduler.c
+ * @brief Processing of multiple volumes at once.
+ * @details Volumes residing on different physical
+ * devices are processed simultaneously, while volumes
+ * sharing the same device are processed one by one
+ * to avoid excessive head movements. All the jobs
+ * are executed by a limited pool of worker threads.
+ * @addtogroup Scheduler
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+/* volumes residing on unknown devices share this bit */
+#define UNKNOWN_DEVICE ((ULONGLONG)1 << 63)
+
+/* time to wait for a device to become idle, in milliseconds */
+#define SCHEDULER_WAIT_INTERVAL 100
+
+enum {
+    JOB_PENDING = 0,
+    JOB_RUNNING,
+    JOB_COMPLETED
+};
+
+struct _udefrag_scheduler;
+
+typedef struct _scheduled_job {
+    char volume_letter;            /* volume letter */
+    ULONGLONG devices;             /* bit mask of physical devices the volume resides on */
+    int state;                     /* one of the JOB_xxx constants */
+    int result;                    /* value returned by udefrag_start_job */
+    udefrag_progress_info pi;      /* the latest progress information */
+    struct _udefrag_scheduler *s;  /* scheduler the job belongs to */
+} scheduled_job;
+
+typedef struct _udefrag_scheduler {
+    scheduled_job *jobs;           /* array of jobs */
+    int n_jobs;                    /* number of jobs */
+    udefrag_job_type job_type;     /* type of requested jobs */
+    int flags;                     /* job flags */
+    int cluster_map_size;          /* size of the cluster map, in cells */
+    udefrag_scheduler_callback cb; /* progress update callback */
+    udefrag_terminator t;          /* termination callback */
+    void *p;                       /* user defined data passed to both callbacks */
+    winx_spin_lock *lock;          /* synchronizes access to the scheduler */
+    ULONGLONG busy_devices;        /* bit mask of devices being processed */
+    int running_workers;           /* number of running worker threads */
+    udefrag_progress_info total;   /* aggregate progress information */
+} udefrag_scheduler;
+
+/************************************************************/
+/*                   Auxiliary routines                     */
+/************************************************************/
+
+/**
+ * @brief Defines physical devices the volume resides on.
+ * @details The %UD_DEVICE_MAP environment variable
+ * can be used to override the real disposition of
+ * volumes, like UD_DEVICE_MAP=C:0;D:0;E:1 which
+ * places C: and D: on the same device. This is
+ * useful in tests involving %UD_DRY_RUN.
+ */
+static ULONGLONG get_volume_devices(char volume_letter)
+{
+    wchar_t *buffer, *s;
+    ULONGLONG devices = 0;
+    int n;
+
+    buffer = winx_getenv(L"UD_DEVICE_MAP");
+    if(buffer){
+        for(s = buffer; *s; s++){
+            if(winx_towupper(s[0]) == (wchar_t)winx_toupper(volume_letter) && s[1] == ':'){
+                n = _wtoi(s + 2);
+                devices |= (ULONGLONG)1 << min(max(n,0),62);
+            }
+            /* skip to the next entry */
+            while(*s && *s != ';') s++;
+            if(*s == 0) break;
+        }
+        winx_free(buffer);
+    }
+
+    if(devices == 0)
+        devices = winx_get_volume_disks(volume_letter);
+    return devices ? devices : UNKNOWN_DEVICE;
+}
+
+/**
+ * @brief Defines the number of worker threads.
+ * @details The %UD_PARALLEL_JOBS environment variable
+ * overrides the default value which is equal to the
+ * number of processors.
+ */
+static int get_number_of_workers(void)
+{
+    wchar_t *buffer;
+    int n = 0;
+
+    buffer = winx_getenv(L"UD_PARALLEL_JOBS");
+    if(buffer){
+        n = _wtoi(buffer);
+        winx_free(buffer);
+    }
+    if(n <= 0){
+        buffer = winx_getenv(L"NUMBER_OF_PROCESSORS");
+        if(buffer){
+            n = _wtoi(buffer);
+            winx_free(buffer);
+        }
+    }
+    return max(n,1);
+}
+
+/**
+ * @brief Recalculates the aggregate progress information.
+ * @note Must be called with the scheduler locked.
+ */
+static void update_total_progress(udefrag_scheduler *s)
+{
+    udefrag_progress_info *pi, *total = &s->total;
+    double percentage = 0;
+    int i, completed = 0;
+
+    memset(total,0,sizeof(udefrag_progress_info));
+    for(i = 0; i < s->n_jobs; i++){
+        pi = &s->jobs[i].pi;
+        total->files += pi->files;
+        total->directories += pi->directories;
+        total->compressed += pi->compressed;
+        total->fragmented += pi->fragmented;
+        total->fragments += pi->fragments;
+        total->bad_fragments += pi->bad_fragments;
+        total->total_space += pi->total_space;
+        total->free_space += pi->free_space;
+        total->mft_size += pi->mft_size;
+        total->clusters_to_process += pi->clusters_to_process;
+        total->processed_clusters += pi->processed_clusters;
+        total->moved_clusters += pi->moved_clusters;
+        total->total_moves += pi->total_moves;
+        total->fragmentation += pi->fragmentation * (double)pi->total_space;
+        if(s->jobs[i].state == JOB_COMPLETED){
+            percentage += 100.00;
+            completed ++;
+        } else if(s->jobs[i].state == JOB_RUNNING){
+            percentage += pi->percentage;
+        }
+    }
+    if(total->total_space)
+        total->fragmentation /= (double)total->total_space;
+    total->percentage = percentage / s->n_jobs;
+    total->pass_number = completed;
+    total->completion_status = (completed == s->n_jobs) ? 1 : 0;
+}
+
+/**
+ * @brief Progress callback of a single job.
+ */
+static void job_progress(udefrag_progress_info *pi, void *p)
+{
+    scheduled_job *job = (scheduled_job *)p;
+    udefrag_scheduler *s = job->s;
+    udefrag_progress_info total;
+
+    if(winx_acquire_spin_lock(s->lock,INFINITE) < 0) return;
+    memcpy(&job->pi,pi,sizeof(udefrag_progress_info));
+    update_total_progress(s);
+    memcpy(&total,&s->total,sizeof(udefrag_progress_info));
+    winx_release_spin_lock(s->lock);
+
+    /* the final progress is delivered once the job is marked completed */
+    if(pi->completion_status != 0) return;
+
+    /* a slow callback must not stall other jobs */
+    if(s->cb) s->cb(job->volume_letter,pi,&total,s->p);
+}
+
+/**
+ * @brief Termination callback of a single job.
+ */
+static int job_terminator(void *p)
+{
+    scheduled_job *job = (scheduled_job *)p;
+    udefrag_scheduler *s = job->s;
+
+    return s->t ? s->t(s->p) : 0;
+}
+
+/**
+ * @brief Searches for a job which can be started right now.
+ * @param[in] s pointer to the scheduler.
+ * @param[out] pending number of jobs waiting for execution.
+ * @return Pointer to the job, NULL if all the jobs
+ * are either in progress or waiting for a busy device.
+ * @note Must be called with the scheduler locked.
+ */
+static scheduled_job *get_next_job(udefrag_scheduler *s,int *pending)
+{
+    scheduled_job *job = NULL;
+    int i;
+
+    *pending = 0;
+    for(i = 0; i < s->n_jobs; i++){
+        if(s->jobs[i].state != JOB_PENDING) continue;
+        (*pending) ++;
+        if(job == NULL && !(s->jobs[i].devices & s->busy_devices))
+            job = &s->jobs[i];
+    }
+    return job;
+}
+
+/**
+ * @brief Worker thread executing scheduled jobs.
+ */
+static DWORD WINAPI scheduler_worker(LPVOID p)
+{
+    udefrag_scheduler *s = (udefrag_scheduler *)p;
+    scheduled_job *job;
+    udefrag_progress_info pi, total;
+    int pending, result;
+
+    while(1){
+        if(winx_acquire_spin_lock(s->lock,INFINITE) < 0) break;
+        job = get_next_job(s,&pending);
+        if(job){
+            job->state = JOB_RUNNING;
+            s->busy_devices |= job->devices;
+        }
+        winx_release_spin_lock(s->lock);
+        if(pending == 0) break;
+        if(s->t && s->t(s->p)) break;
+        if(job == NULL){
+            /* all the devices we need are busy */
+            winx_sleep(SCHEDULER_WAIT_INTERVAL);
+            continue;
+        }
+
+        itrace("%c: processing started",job->volume_letter);
+        result = udefrag_start_job(job->volume_letter,s->job_type,s->flags,
+            s->cluster_map_size,job_progress,job_terminator,(void *)job);
+        itrace("%c: processing completed with result %d",job->volume_letter,result);
+
+        if(winx_acquire_spin_lock(s->lock,INFINITE) < 0) break;
+        job->result = result;
+        job->state = JOB_COMPLETED;
+        s->busy_devices &= ~job->devices;
+        update_total_progress(s);
+        memcpy(&pi,&job->pi,sizeof(udefrag_progress_info));
+        memcpy(&total,&s->total,sizeof(udefrag_progress_info));
+        winx_release_spin_lock(s->lock);
+
+        /* deliver the final progress counting the job as completed */
+        if(s->cb) s->cb(job->volume_letter,&pi,&total,s->p);
+    }
+
+    if(winx_acquire_spin_lock(s->lock,INFINITE) == 0){
+        s->running_workers --;
+        winx_release_spin_lock(s->lock);
+    }
+    winx_exit_thread(0);
+    return 0;
+}
+
+/************************************************************/
+/*                    The entry point                       */
+/************************************************************/
+
+/**
+ * @brief Processes multiple volumes at once.
+ * @details Jobs for volumes residing on different physical
+ * devices run simultaneously, volumes sharing the same device
+ * are processed one after another. The number of jobs running
+ * at once is limited by %UD_PARALLEL_JOBS environment variable
+ * which is equal to the number of processors by default.
+ * @param[in] volume_letters zero terminated string of volume letters.
+ * @param[in] job_type one of the xxx_JOB constants, defined in udefrag.h
+ * @param[in] flags combination of UD_JOB_xxx flags defined in udefrag.h
+ * @param[in] cluster_map_size size of the cluster map of each job, in cells.
+ * @param[in] cb address of procedure to be called each time when
+ * progress information of any job updates. It receives progress
+ * information of the job as well as the aggregate progress
+ * information of all the jobs. The final call for each job comes
+ * once the job is counted as completed in the aggregate information,
+ * so the aggregate completion status becomes nonzero in the very last
+ * call. Note that it is called from multiple threads simultaneously,
+ * so it must synchronize access to its data.
+ * @param[in] t address of procedure to be called each time
+ * when any of the jobs would like to know whether it must
+ * be terminated or not. Note that it is called from multiple
+ * threads simultaneously.
+ * @param[in] p pointer to user defined data to be passed to both callbacks.
+ * @return Zero if all the jobs succeeded, otherwise
+ * an error code returned by the first failed job.
+ */
+int udefrag_start_jobs(char *volume_letters,udefrag_job_type job_type,int flags,
+    int cluster_map_size,udefrag_scheduler_callback cb,udefrag_terminator t,void *p)
+{
+    udefrag_scheduler *s;
+    char name[64];
+    int i, n, workers;
+    int result = 0;
+
+    DbgCheck1(volume_letters,-1);
+
+    n = (int)strlen(volume_letters);
+    if(n == 0) return 0;
+
+    s = winx_tmalloc(sizeof(udefrag_scheduler));
+    if(s == NULL){
+        mtrace();
+        return UDEFRAG_NO_MEM;
+    }
+    memset(s,0,sizeof(udefrag_scheduler));
+    s->jobs = winx_tmalloc(n * sizeof(scheduled_job));
+    if(s->jobs == NULL){
+        mtrace();
+        winx_free(s);
+        return UDEFRAG_NO_MEM;
+    }
+    memset(s->jobs,0,n * sizeof(scheduled_job));
+    s->n_jobs = n;
+    s->job_type = job_type;
+    s->flags = flags;
+    s->cluster_map_size = cluster_map_size;
+    s->cb = cb;
+    s->t = t;
+    s->p = p;
+
+    (void)_snprintf(name,sizeof(name) - 1,"udefrag_scheduler_%p",(void *)s);
+    name[sizeof(name) - 1] = 0;
+    s->lock = winx_init_spin_lock(name);
+    if(s->lock == NULL){
+        winx_free(s->jobs);
+        winx_free(s);
+        return (-1);
+    }
+
+    for(i = 0; i < n; i++){
+        s->jobs[i].volume_letter = winx_toupper(volume_letters[i]);
+        s->jobs[i].devices = get_volume_devices(volume_letters[i]);
+        s->jobs[i].state = JOB_PENDING;
+        s->jobs[i].s = s;
+        itrace("%c: devices = 0x%I64x",s->jobs[i].volume_letter,s->jobs[i].devices);
+    }
+
+    /* start workers */
+    workers = min(get_number_of_workers(),n);
+    itrace("%u volumes to be processed by %u workers",n,workers);
+    for(i = 0; i < workers; i++){
+        if(winx_acquire_spin_lock(s->lock,INFINITE) < 0) break;
+        s->running_workers ++;
+        winx_release_spin_lock(s->lock);
+        if(winx_create_thread(scheduler_worker,(PVOID)s) < 0){
+            (void)winx_acquire_spin_lock(s->lock,INFINITE);
+            s->running_workers --;
+            winx_release_spin_lock(s->lock);
+            break;
+        }
+    }
+
+    /* wait for completion */
+    while(1){
+        if(winx_acquire_spin_lock(s->lock,INFINITE) < 0) break;
+        workers = s->running_workers;
+        winx_release_spin_lock(s->lock);
+        if(workers == 0) break;
+        winx_sleep(SCHEDULER_WAIT_INTERVAL);
+    }
+
+    /* collect results */
+    for(i = 0; i < n; i++){
+        if(s->jobs[i].state != JOB_COMPLETED){
+            if(result == 0) result = (-1);
+        } else if(s->jobs[i].result < 0){
+            if(result == 0) result = s->jobs[i].result;
+        }
+    }
+
+    winx_destroy_spin_lock(s->lock);
+    winx_free(s->jobs);
+    winx_free(s);
+    return result;
+}
+
+/** @} */
@@ -20,10 +20,11 @@
 /**
  * @file search.c
  * @brief File blocks and free space regions searching.
- * @details We use binary search trees whenever possible
- * to speed things up. If memory allocation fails for
- * some operation on a binary tree, we destroy it and
- * use alternative searching in double linked lists.
+ * @details We use binary search whenever possible
+ * to speed things up. File blocks are kept in a flat
+ * index sorted by LCN. If memory allocation fails for
+ * some operation on the index, we destroy it and
+ * stop searching for file blocks.
  * @addtogroup Search
  * @{
  */
@@ -39,6 +40,30 @@
 /*          Free space region searching routines            */
 /************************************************************/
 
+/**
+ * @internal
+ * @brief Starts the latency measurement of the search.
+ * @details Searches are too frequent to query the
+ * precise timer twice for each of them, so their
+ * latency is collected at the detailed level only.
+ * @return Zero if the latency isn't collected.
+ */
+static ULONGLONG begin_search(udefrag_job_parameters *jp)
+{
+    if(jp->udo.dbgprint_level < DBG_DETAILED) return 0;
+    return winx_utime();
+}
+
+/**
+ * @internal
+ * @brief Accounts time spent for the search.
+ */
+static void end_search(udefrag_job_parameters *jp,ULONGLONG time,ULONGLONG utime)
+{
+    jp->p_counters.searching_time += winx_xtime() - time;
+    if(utime) winx_histogram_add(&jp->p_counters.search_latency,winx_utime() - utime);
+}
+
 /**
  * @brief Searches for free space region starting at the beginning of the volume.
  * @param[in] jp job parameters structure.
@@ -52,6 +77,7 @@ winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,
 {
     winx_volume_region *rgn;
     ULONGLONG time = winx_xtime();
+    ULONGLONG utime = begin_search(jp);
 
     if(max_length) *max_length = 0;
     for(rgn = jp->free_regions; rgn; rgn = rgn->next){
@@ -62,13 +88,13 @@ winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,
                     *max_length = rgn->length;
             }
             if(rgn->length >= min_length){
-                jp->p_counters.searching_time += winx_xtime() - time;
+                end_search(jp,time,utime);
                 return rgn;
             }
         }
         if(rgn->next == jp->free_regions) break;
     }
-    jp->p_counters.searching_time += winx_xtime() - time;
+    end_search(jp,time,utime);
     return NULL;
 }
 
@@ -85,6 +111,7 @@ winx_volume_region *find_last_free_region(udefrag_job_parameters *jp,
 {
     winx_volume_region *rgn;
     ULONGLONG time = winx_xtime();
+    ULONGLONG utime = begin_search(jp);
 
     if(max_length) *max_length = 0;
     if(jp->free_regions){
@@ -96,13 +123,13 @@ winx_volume_region *find_last_free_region(udefrag_job_parameters *jp,
                     *max_length = rgn->length;
             }
             if(rgn->length >= min_length){
-                jp->p_counters.searching_time += winx_xtime() - time;
+                end_search(jp,time,utime);
                 return rgn;
             }
             if(rgn->prev == jp->free_regions->prev) break;
         }
     }
-    jp->p_counters.searching_time += winx_xtime() - time;
+    end_search(jp,time,utime);
     return NULL;
 }
 
@@ -183,129 +210,423 @@ winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp)
 /*                    Auxiliary routines                    */
 /************************************************************/
 
+/*
+* File blocks are kept in a sorted array split
+* into chunks of limited size. Chunks are filled
+* partially when built from the scan, so that
+* subsequent insertions rarely need to split them.
+* Lookups perform a binary search over the first
+* LCN of each chunk and then inside of the chunk;
+* LCNs are stored along with blocks to avoid
+* dereferencing of block pointers.
+*/
+
+/* maximum number of blocks in a single chunk */
+#define BLOCKS_PER_CHUNK     256
+
+/* number of blocks per chunk after the bulk load */
+#define BLOCKS_PER_NEW_CHUNK (BLOCKS_PER_CHUNK * 3 / 4)
+
 /**
- * @brief Auxiliary structure used to save file blocks in binary tree.
+ * @brief Auxiliary structure used to save file blocks in the index.
  */
 struct file_block {
+    ULONGLONG lcn;
     winx_file_info *file;
     winx_blockmap *block;
 };
 
+struct block_chunk {
+    ULONG count;
+    struct file_block items[BLOCKS_PER_CHUNK];
+};
+
+struct chunk_ref {
+    ULONGLONG lcn;               /* LCN of the first block of the chunk */
+    struct block_chunk *chunk;
+};
+
+struct file_blocks_index {
+    struct chunk_ref *chunks;    /* chunks sorted by LCN */
+    ULONG n_chunks;              /* number of chunks */
+    ULONG capacity;              /* number of allocated chunk references */
+    ULONGLONG n_blocks;          /* number of blocks in the index */
+    struct file_block *bulk;     /* blocks added before the first lookup, unsorted */
+    ULONGLONG bulk_count;        /* number of blocks in bulk */
+    ULONGLONG bulk_capacity;     /* number of allocated bulk entries */
+    ULONGLONG lookups;           /* number of lookups */
+    ULONGLONG lookup_time;       /* time needed for lookups, in milliseconds */
+};
+
 /**
- * @brief Auxiliary routine used to sort file blocks in binary tree.
+ * @brief Sorts blocks by LCN by the bottom-up merge sort.
  */
-static int blocks_compare(const void *prb_a, const void *prb_b, void *prb_param)
+static void sort_blocks(struct file_block *items,struct file_block *buffer,ULONGLONG n)
 {
-    struct file_block *a, *b;
-    
-    a = (struct file_block *)prb_a;
-    b = (struct file_block *)prb_b;
-    
-    if(a->block->lcn < b->block->lcn)
+    struct file_block *src = items, *dst = buffer, *swap;
+    ULONGLONG width, i, j, k, m, e, o;
+
+    for(width = 1; width < n; width *= 2){
+        for(i = 0; i < n; i += 2 * width){
+            m = min(i + width,n);
+            e = min(i + 2 * width,n);
+            for(j = i, k = m, o = i; o < e; o++){
+                if(k >= e || (j < m && src[j].lcn <= src[k].lcn))
+                    dst[o] = src[j++];
+                else
+                    dst[o] = src[k++];
+            }
+        }
+        swap = src, src = dst, dst = swap;
+    }
+    if(src != items)
+        memcpy(items,src,(size_t)n * sizeof(struct file_block));
+}
+
+/**
+ * @brief Inserts reference to the chunk
+ * at the specified position.
+ * @return Zero for success, negative value otherwise.
+ */
+static int insert_chunk(struct file_blocks_index *fbi,ULONG position,struct block_chunk *chunk)
+{
+    struct chunk_ref *chunks;
+    ULONG capacity;
+
+    if(fbi->n_chunks == fbi->capacity){
+        capacity = max(fbi->capacity * 2,64);
+        chunks = winx_tmalloc(capacity * sizeof(struct chunk_ref));
+        if(chunks == NULL){
+            mtrace();
+            return (-1);
+        }
+        if(fbi->chunks){
+            memcpy(chunks,fbi->chunks,fbi->n_chunks * sizeof(struct chunk_ref));
+            winx_free(fbi->chunks);
+        }
+        fbi->chunks = chunks;
+        fbi->capacity = capacity;
+    }
+    memmove(&fbi->chunks[position + 1],&fbi->chunks[position],
+        (fbi->n_chunks - position) * sizeof(struct chunk_ref));
+    fbi->chunks[position].chunk = chunk;
+    fbi->chunks[position].lcn = chunk->count ? chunk->items[0].lcn : 0;
+    fbi->n_chunks ++;
+    return 0;
+}
+
+/**
+ * @brief Builds chunks from blocks
+ * collected during the volume scan.
+ * @return Zero for success, negative value otherwise.
+ */
+static int complete_bulk_load(struct file_blocks_index *fbi)
+{
+    struct file_block *buffer;
+    struct block_chunk *chunk;
+    ULONGLONG i, j, n;
+    ULONGLONG time = winx_xtime();
+
+    if(fbi->bulk == NULL) return 0;
+
+    n = fbi->bulk_count;
+    buffer = winx_tmalloc((size_t)max(n,1) * sizeof(struct file_block));
+    if(buffer == NULL){
+        mtrace();
         return (-1);
-    if(a->block->lcn == b->block->lcn)
-        return 0;
-    return 1;
+    }
+    sort_blocks(fbi->bulk,buffer,n);
+    winx_free(buffer);
+
+    /* remove duplicates */
+    for(i = 1, j = min(n,1); i < n; i++){
+        if(fbi->bulk[i].lcn == fbi->bulk[j - 1].lcn){
+            etrace("a duplicate found");
+            continue;
+        }
+        fbi->bulk[j++] = fbi->bulk[i];
+    }
+    n = j;
+
+    for(i = 0; i < n; i += BLOCKS_PER_NEW_CHUNK){
+        chunk = winx_tmalloc(sizeof(struct block_chunk));
+        if(chunk == NULL){
+            mtrace();
+            return (-1);
+        }
+        chunk->count = (ULONG)min(n - i,BLOCKS_PER_NEW_CHUNK);
+        memcpy(chunk->items,&fbi->bulk[i],chunk->count * sizeof(struct file_block));
+        if(insert_chunk(fbi,fbi->n_chunks,chunk) < 0){
+            winx_free(chunk);
+            return (-1);
+        }
+    }
+    fbi->n_blocks = n;
+
+    winx_free(fbi->bulk);
+    fbi->bulk = NULL;
+    fbi->bulk_count = fbi->bulk_capacity = 0;
+    itrace("file blocks index of %I64u blocks built in %I64u ms",
+        n,winx_xtime() - time);
+    return 0;
 }
 
 /**
- * @brief Auxiliary routine used to free memory allocated for tree items.
+ * @brief Searches for the first block
+ * at or after the specified LCN.
+ * @param[out] chunk index of the chunk.
+ * @param[out] position index of the block in chunk,
+ * may be equal to the number of blocks in it.
  */
-static void free_item (void *prb_item, void *prb_param)
+static void locate_block(struct file_blocks_index *fbi,
+    ULONGLONG lcn,ULONG *chunk,ULONG *position)
 {
-    struct file_block *item = (struct file_block *)prb_item;
-    winx_free(item);
+    struct block_chunk *c;
+    ULONG lo, hi, i;
+
+    /* find the last chunk starting at or before the lcn */
+    lo = 0, hi = fbi->n_chunks;
+    while(lo < hi){
+        i = lo + (hi - lo) / 2;
+        if(fbi->chunks[i].lcn <= lcn) lo = i + 1;
+        else hi = i;
+    }
+    *chunk = lo ? lo - 1 : 0;
+    if(fbi->n_chunks == 0){
+        *position = 0;
+        return;
+    }
+
+    /* find the first block at or after the lcn */
+    c = fbi->chunks[*chunk].chunk;
+    lo = 0, hi = c->count;
+    while(lo < hi){
+        i = lo + (hi - lo) / 2;
+        if(c->items[i].lcn < lcn) lo = i + 1;
+        else hi = i;
+    }
+    *position = lo;
+}
+
+/**
+ * @brief Releases all the memory
+ * allocated for the index.
+ */
+static void free_index(struct file_blocks_index *fbi)
+{
+    ULONG i;
+
+    for(i = 0; i < fbi->n_chunks; i++)
+        winx_free(fbi->chunks[i].chunk);
+    winx_free(fbi->chunks);
+    winx_free(fbi->bulk);
+    winx_free(fbi);
+}
+
+/**
+ * @brief Finalizes the bulk load if needed.
+ * @note Destroys the index in case of errors.
+ */
+static int prepare_index(udefrag_job_parameters *jp)
+{
+    if(jp->file_blocks == NULL) return (-1);
+    if(jp->file_blocks->bulk == NULL) return 0;
+    if(complete_bulk_load(jp->file_blocks) < 0){
+        etrace("cannot build file blocks index");
+        destroy_file_blocks_tree(jp);
+        return (-1);
+    }
+    return 0;
 }
 
 /**
  * @brief Creates and initializes
- * the binary tree of all file blocks.
+ * the index of all file blocks.
  * @return Zero for success, 
  * negative value otherwise.
  * @note jp->file_blocks must be
  * initialized by NULL or contain
- * pointer to a valid tree before 
+ * pointer to a valid index before 
  * this call.
  */
 int create_file_blocks_tree(udefrag_job_parameters *jp)
 {
     itrace("create_file_blocks_tree called");
     if(jp->file_blocks) destroy_file_blocks_tree(jp);
-    jp->file_blocks = prb_create(blocks_compare,NULL,NULL);
+    jp->file_blocks = winx_tmalloc(sizeof(struct file_blocks_index));
+    if(jp->file_blocks == NULL){
+        mtrace();
+        return (-1);
+    }
+    memset(jp->file_blocks,0,sizeof(struct file_blocks_index));
     return 0;
 }
 
 /**
  * @brief Adds a file block to
- * the binary tree of all file blocks.
+ * the index of all file blocks.
+ * @details Blocks added before the first
+ * lookup are sorted at once then.
  * @return Zero for success, 
  * negative value otherwise.
- * @note Destroys the tree in case of errors.
+ * @note Destroys the index in case of errors.
  */
 int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *file, winx_blockmap *block)
 {
-    struct file_block *fb;
-    void **p;
+    struct file_blocks_index *fbi = jp->file_blocks;
+    struct file_block *bulk;
+    struct block_chunk *c, *new_chunk;
+    ULONGLONG capacity;
+    ULONG chunk, position;
     
     if(file == NULL || block == NULL)
         return (-1);
     
-    if(jp->file_blocks == NULL)
+    if(fbi == NULL)
         return (-1);
 
-    fb = winx_malloc(sizeof *fb);
-    fb->file = file;
-    fb->block = block;
-    p = prb_probe(jp->file_blocks,(void *)fb);
+    if(fbi->n_chunks == 0 || fbi->bulk){
+        /* bulk load */
+        if(fbi->bulk_count == fbi->bulk_capacity){
+            capacity = max(fbi->bulk_capacity * 2,1024);
+            bulk = winx_tmalloc((size_t)capacity * sizeof(struct file_block));
+            if(bulk == NULL){
+                mtrace();
+                goto fail;
+            }
+            if(fbi->bulk){
+                memcpy(bulk,fbi->bulk,(size_t)fbi->bulk_count * sizeof(struct file_block));
+                winx_free(fbi->bulk);
+            }
+            fbi->bulk = bulk;
+            fbi->bulk_capacity = capacity;
+        }
+        fbi->bulk[fbi->bulk_count].lcn = block->lcn;
+        fbi->bulk[fbi->bulk_count].file = file;
+        fbi->bulk[fbi->bulk_count].block = block;
+        fbi->bulk_count ++;
+        return 0;
+    }
+
+    locate_block(fbi,block->lcn,&chunk,&position);
+    c = fbi->chunks[chunk].chunk;
     /* if a duplicate item exists... */
-    if(*p != fb){
+    if(position < c->count && c->items[position].lcn == block->lcn){
         etrace("a duplicate found");
-        winx_free(fb);
+        return 0;
+    }
+
+    /* split the full chunk */
+    if(c->count == BLOCKS_PER_CHUNK){
+        new_chunk = winx_tmalloc(sizeof(struct block_chunk));
+        if(new_chunk == NULL){
+            mtrace();
+            goto fail;
+        }
+        new_chunk->count = BLOCKS_PER_CHUNK / 2;
+        memcpy(new_chunk->items,&c->items[BLOCKS_PER_CHUNK / 2],
+            new_chunk->count * sizeof(struct file_block));
+        c->count = BLOCKS_PER_CHUNK / 2;
+        if(insert_chunk(fbi,chunk + 1,new_chunk) < 0){
+            winx_free(new_chunk);
+            goto fail;
+        }
+        if(position > c->count){
+            position -= c->count;
+            chunk ++;
+            c = new_chunk;
+        }
     }
+
+    memmove(&c->items[position + 1],&c->items[position],
+        (c->count - position) * sizeof(struct file_block));
+    c->items[position].lcn = block->lcn;
+    c->items[position].file = file;
+    c->items[position].block = block;
+    c->count ++;
+    fbi->chunks[chunk].lcn = c->items[0].lcn;
+    fbi->n_blocks ++;
     return 0;
+
+fail:
+    etrace("cannot add block to the file blocks index");
+    destroy_file_blocks_tree(jp);
+    return (-1);
 }
 
 /**
  * @brief Removes a file block from
- * the binary tree of all file blocks.
+ * the index of all file blocks.
  * @return Zero for success, 
  * negative value otherwise.
  */
 int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap *block)
 {
-    struct file_block *fb;
-    struct file_block b;
+    struct file_blocks_index *fbi;
+    struct block_chunk *c;
+    ULONG chunk, position;
     
     if(block == NULL)
         return (-1);
     
-    if(jp->file_blocks == NULL)
+    if(prepare_index(jp) < 0)
         return (-1);
 
-    b.file = NULL;
-    b.block = block;
-    fb = prb_delete(jp->file_blocks,&b);
-    if(fb == NULL){
+    fbi = jp->file_blocks;
+    locate_block(fbi,block->lcn,&chunk,&position);
+    c = fbi->n_chunks ? fbi->chunks[chunk].chunk : NULL;
+    if(c == NULL || position >= c->count || c->items[position].lcn != block->lcn){
         /* the following debugging output indicates either
            a bug, or file system inconsistency */
         etrace("failed for %p: VCN = %I64u, LCN = %I64u, LEN = %I64u",
             block, block->vcn, block->lcn, block->length);
-        /* if block does not exist in tree, we have nothing to cleanup */
+        /* if block does not exist in index, we have nothing to cleanup */
         return 0;
     }
-    winx_free(fb);
+
+    memmove(&c->items[position],&c->items[position + 1],
+        (c->count - position - 1) * sizeof(struct file_block));
+    c->count --;
+    fbi->n_blocks --;
+    if(c->count == 0){
+        winx_free(c);
+        memmove(&fbi->chunks[chunk],&fbi->chunks[chunk + 1],
+            (fbi->n_chunks - chunk - 1) * sizeof(struct chunk_ref));
+        fbi->n_chunks --;
+    } else {
+        fbi->chunks[chunk].lcn = c->items[0].lcn;
+    }
     return 0;
 }
 
 /**
- * @brief Destroys the binary
- * tree of all file blocks.
+ * @brief Destroys the index
+ * of all file blocks.
+ * @details Displays memory usage
+ * and lookup latency of the index.
  */
 void destroy_file_blocks_tree(udefrag_job_parameters *jp)
 {
+    struct file_blocks_index *fbi = jp->file_blocks;
+    ULONGLONG size, tree_size;
+    char buffer[32], tree_buffer[32];
+
     itrace("destroy_file_blocks_tree called");
-    if(jp->file_blocks){
-        prb_destroy(jp->file_blocks,free_item);
+    if(fbi){
+        size = sizeof(struct file_blocks_index) \
+            + fbi->capacity * sizeof(struct chunk_ref) \
+            + fbi->n_chunks * sizeof(struct block_chunk);
+        tree_size = fbi->n_blocks * (sizeof(struct prb_node) \
+            + sizeof(winx_file_info *) + sizeof(winx_blockmap *));
+        winx_bytes_to_hr(size,1,buffer,sizeof(buffer));
+        winx_bytes_to_hr(tree_size,1,tree_buffer,sizeof(tree_buffer));
+        itrace("file blocks index: %I64u blocks in %u chunks, %s (binary tree needs %s at least)",
+            fbi->n_blocks,fbi->n_chunks,buffer,tree_buffer);
+        if(fbi->lookups){
+            itrace("file blocks index: %I64u lookups, %I64u ms total",
+                fbi->lookups,fbi->lookup_time);
+        }
+        free_index(fbi);
         jp->file_blocks = NULL;
     }
 }
@@ -328,35 +649,34 @@ void destroy_file_blocks_tree(udefrag_job_parameters *jp)
 winx_blockmap *find_first_block(udefrag_job_parameters *jp,
     ULONGLONG *min_lcn, int flags, winx_file_info **first_file)
 {
+    struct file_blocks_index *fbi;
     winx_file_info *found_file;
     winx_blockmap *first_block;
-    winx_blockmap b;
-    struct file_block fb, *item;
-    struct prb_traverser t;
+    struct file_block *item;
+    ULONG chunk, position;
     int movable_file;
     ULONGLONG tm = winx_xtime();
     
     if(min_lcn == NULL || first_file == NULL)
         return NULL;
     
-    found_file = NULL; first_block = NULL;
-    b.lcn = *min_lcn; fb.block = &b;
-    prb_t_init(&t,jp->file_blocks);
-    item = prb_t_insert(&t,jp->file_blocks,&fb);
-    if(item == &fb){
-        /* block at min_lcn not found */
-        item = prb_t_next(&t);
-        if(prb_delete(jp->file_blocks,&fb) == NULL){
-            etrace("cannot remove block from the tree");
-            winx_flush_dbg_log(0); /* 'cause error is critical */
+    *first_file = NULL;
+    if(prepare_index(jp) < 0)
+        return NULL;
+    
+    fbi = jp->file_blocks;
+    locate_block(fbi,*min_lcn,&chunk,&position);
+    fbi->lookups ++;
+    while(!jp->termination_router((void *)jp)){
+        /* go to the next chunk if needed */
+        if(chunk >= fbi->n_chunks) break;
+        if(position >= fbi->chunks[chunk].chunk->count){
+            chunk ++, position = 0;
+            continue;
         }
-    }
-    if(item){
+        item = &fbi->chunks[chunk].chunk->items[position];
         found_file = item->file;
         first_block = item->block;
-    }
-    while(!jp->termination_router((void *)jp)){
-        if(found_file == NULL) break;
         if(flags & SKIP_PARTIALLY_MOVABLE_FILES){
             movable_file = can_move_entirely(found_file,jp);
         } else {
@@ -370,6 +690,7 @@ winx_blockmap *find_first_block(udefrag_job_parameters *jp,
                 /* desired block found */
                 *min_lcn = first_block->lcn + 1; /* the current block will be skipped later anyway in this case */
                 *first_file = found_file;
+                fbi->lookup_time += winx_xtime() - tm;
                 jp->p_counters.searching_time += winx_xtime() - tm;
                 return first_block;
             }
@@ -378,14 +699,60 @@ winx_blockmap *find_first_block(udefrag_job_parameters *jp,
         /* skip current block */
         *min_lcn = *min_lcn + 1;
         /* and go to the next one */
-        item = prb_t_next(&t);
-        if(item == NULL) break;
-        found_file = item->file;
-        first_block = item->block;
+        position ++;
     }
-    *first_file = NULL;
+    fbi->lookup_time += winx_xtime() - tm;
     jp->p_counters.searching_time += winx_xtime() - tm;
     return NULL;
 }
 
+/**
+ * @brief Searches for the file block
+ * containing the specified cluster.
+ * @param[in] jp job parameters.
+ * @param[in] lcn the cluster.
+ * @param[out] file pointer to variable receiving
+ * information about the file the block belongs to.
+ * @return Pointer to the block. NULL indicates
+ * that the cluster belongs to no file block.
+ * @note Movability of the file is not checked.
+ */
+winx_blockmap *find_block_at(udefrag_job_parameters *jp,
+    ULONGLONG lcn, winx_file_info **file)
+{
+    struct file_blocks_index *fbi;
+    struct file_block *item = NULL;
+    struct block_chunk *c;
+    ULONG chunk, position;
+    ULONGLONG tm = winx_xtime();
+
+    if(file == NULL) return NULL;
+    *file = NULL;
+    if(prepare_index(jp) < 0)
+        return NULL;
+
+    fbi = jp->file_blocks;
+    locate_block(fbi,lcn,&chunk,&position);
+    fbi->lookups ++;
+    if(fbi->n_chunks){
+        c = fbi->chunks[chunk].chunk;
+        if(position < c->count && c->items[position].lcn == lcn){
+            item = &c->items[position];
+        } else if(position > 0){
+            item = &c->items[position - 1];
+        } else if(chunk > 0){
+            c = fbi->chunks[chunk - 1].chunk;
+            item = &c->items[c->count - 1];
+        }
+        /* the preceding block may end before the cluster */
+        if(item && item->lcn + item->block->length <= lcn)
+            item = NULL;
+    }
+    fbi->lookup_time += winx_xtime() - tm;
+    jp->p_counters.searching_time += winx_xtime() - tm;
+    if(item == NULL) return NULL;
+    *file = item->file;
+    return item->block;
+}
+
 /** @} */
@@ -0,0 +1,490 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file sort.c
+ * @brief File sorting.
+ * @details Defines order of files on the disk
+ * after the optimization. Sort keys are computed
+ * once per file: an integer key (size, time or
+ * depth in the directory tree) and a case folded
+ * path, so comparisons need neither case conversion
+ * nor file attributes.
+ * Optionally files are split into hot, warm
+ * and cold zones by recency of their access;
+ * the sorting criteria apply inside each zone.
+ * Files are sorted by a stable merge sort; parts
+ * of the array are sorted by multiple threads.
+ * @addtogroup Sort
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+/* rank of files not listed in the access order trace */
+#define NOT_LISTED_RANK ((ULONG)-1)
+
+/* minimal number of files to be sorted by a single thread */
+#define MIN_FILES_PER_THREAD 16384
+
+/* time to wait for completion of sorting threads, in milliseconds */
+#define SORT_WAIT_INTERVAL 10
+
+/* number of 100-nanosecond intervals in a day */
+#define TIME_UNITS_PER_DAY ((ULONGLONG)24 * 3600 * 1000 * 1000 * 10)
+
+/*
+* Path separators used in the directory tree
+* sorting; both are less than any character
+* allowed in paths, and files of the directory
+* go before its subdirectories.
+*/
+#define FILE_SEPARATOR      1
+#define DIRECTORY_SEPARATOR 2
+
+/*
+* Values of the descending order flag. In the
+* directory tree sorting only siblings follow
+* in the descending order, while directories
+* still go before their contents.
+*/
+#define DESCENDING_ORDER    1
+#define DESCENDING_SIBLINGS 2
+
+struct sort_task {
+    udefrag_sort_item *items;   /* items to be sorted */
+    udefrag_sort_item *buffer;  /* buffer of the same size */
+    ULONGLONG n;                /* number of items */
+    int descending;             /* nonzero value forces descending order */
+    volatile LONG *running_threads; /* number of threads still running */
+};
+
+/************************************************************/
+/*                   Auxiliary routines                     */
+/************************************************************/
+
+/**
+ * @brief Compares two paths converted
+ * by get_tree_key, in descending order
+ * of siblings.
+ * @details Paths differing in separators
+ * or terminators only belong to different
+ * levels of the tree, so they keep the
+ * ascending order; paths differing in names
+ * belong to siblings.
+ */
+static int compare_siblings(wchar_t *a,wchar_t *b)
+{
+    int result;
+
+    for(; *a && *a == *b; a++, b++);
+    if(*a == *b) return 0;
+    result = (*a < *b) ? (-1) : 1;
+    if(*a <= DIRECTORY_SEPARATOR && *b <= DIRECTORY_SEPARATOR)
+        return result;
+    return -result;
+}
+
+/**
+ * @brief Compares two files.
+ * @details This routine exclusively defines rules of
+ * the file sorting on the disk. Files listed in the
+ * access order trace go first, in order of access;
+ * the rest of files is sorted by zone, then by the
+ * integer key and then by path. Zones go from hot
+ * to cold regardless of the sorting order.
+ */
+static int compare_items(udefrag_sort_item *a,udefrag_sort_item *b,int descending)
+{
+    int result;
+
+    if(a->rank != b->rank)
+        return (a->rank < b->rank) ? (-1) : 1;
+    if(a->rank != NOT_LISTED_RANK) return 0;
+    if(a->zone != b->zone)
+        return (a->zone < b->zone) ? (-1) : 1;
+
+    if(a->key != b->key){
+        result = (a->key < b->key) ? (-1) : 1;
+        /* levels of the tree go from top to bottom */
+        if(descending == DESCENDING_SIBLINGS) return result;
+    } else {
+        if(descending == DESCENDING_SIBLINGS)
+            return compare_siblings(a->path,b->path);
+        result = wcscmp(a->path,b->path);
+    }
+    return descending ? -result : result;
+}
+
+/**
+ * @brief Converts the case folded path to the key
+ * placing files of each directory contiguously,
+ * right after the directory itself.
+ * @details Directories form groups of their own,
+ * headed by the directory itself. Separators of
+ * the group path are replaced by DIRECTORY_SEPARATOR,
+ * the separator of the file name by FILE_SEPARATOR.
+ * So the path comparison lays groups out in the
+ * depth-first order; groups compared by depth
+ * first get the breadth-first order.
+ * The trailing separator of the root directory
+ * gets removed, so it heads the root group.
+ * @return Depth of the group.
+ */
+static ULONGLONG get_tree_key(wchar_t *path,int directory)
+{
+    wchar_t *last = NULL;
+    ULONGLONG depth = 0;
+
+    for(; *path; path++){
+        if(*path == '\\'){
+            *path = DIRECTORY_SEPARATOR;
+            last = path;
+            depth ++;
+        }
+    }
+    if(last){
+        if(!directory){
+            *last = FILE_SEPARATOR;
+            depth --;
+        } else if(last[1] == 0){
+            *last = 0;
+            depth --;
+        }
+    }
+    return depth;
+}
+
+/**
+ * @brief Merges two sorted sequences
+ * lying one after another.
+ */
+static void merge(udefrag_sort_item *src,ULONGLONG middle,
+    ULONGLONG n,udefrag_sort_item *dst,int descending)
+{
+    ULONGLONG i = 0, j = middle, k = 0;
+
+    while(i < middle && j < n){
+        /* take the left item on equality to keep the sort stable */
+        if(compare_items(&src[j],&src[i],descending) < 0)
+            dst[k++] = src[j++];
+        else
+            dst[k++] = src[i++];
+    }
+    while(i < middle) dst[k++] = src[i++];
+    while(j < n) dst[k++] = src[j++];
+}
+
+/**
+ * @brief Sorts items by the bottom-up merge sort.
+ * @note The buffer must be of the same size.
+ */
+static void merge_sort(udefrag_sort_item *items,
+    udefrag_sort_item *buffer,ULONGLONG n,int descending)
+{
+    udefrag_sort_item *src = items, *dst = buffer, *swap;
+    ULONGLONG width, i, m, k;
+
+    for(width = 1; width < n; width *= 2){
+        for(i = 0; i < n; i += 2 * width){
+            m = min(width,n - i);
+            k = min(2 * width,n - i);
+            merge(src + i,m,k,dst + i,descending);
+        }
+        swap = src, src = dst, dst = swap;
+    }
+    if(src != items)
+        memcpy(items,src,(size_t)n * sizeof(udefrag_sort_item));
+}
+
+static DWORD WINAPI sort_thread(LPVOID p)
+{
+    struct sort_task *task = (struct sort_task *)p;
+
+    merge_sort(task->items,task->buffer,task->n,task->descending);
+    /* the task may be released right after that */
+    (void)winx_atomic_add(task->running_threads,-1);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @brief Returns the number of processors.
+ */
+static int get_number_of_processors(void)
+{
+    wchar_t *buffer;
+    int n = 0;
+
+    buffer = winx_getenv(L"NUMBER_OF_PROCESSORS");
+    if(buffer){
+        n = _wtoi(buffer);
+        winx_free(buffer);
+    }
+    return max(n,1);
+}
+
+/**
+ * @brief Sorts parts of the array by multiple
+ * threads and merges them then.
+ * @return Number of threads used.
+ */
+static int parallel_merge_sort(udefrag_sort_item *items,
+    udefrag_sort_item *buffer,ULONGLONG n,int descending)
+{
+    struct sort_task *tasks;
+    ULONGLONG part, m, k;
+    volatile LONG running_threads = 0;
+    int n_threads, t, r, runs;
+
+    n_threads = get_number_of_processors();
+    if((ULONGLONG)n_threads > n / MIN_FILES_PER_THREAD)
+        n_threads = (int)(n / MIN_FILES_PER_THREAD);
+    if(n_threads <= 1) goto single_thread;
+
+    tasks = winx_tmalloc(n_threads * sizeof(struct sort_task));
+    if(tasks == NULL){
+        mtrace();
+        goto single_thread;
+    }
+
+    /* sort parts; the last one is sorted by the current thread */
+    part = n / n_threads;
+    for(t = 0; t < n_threads; t++){
+        tasks[t].items = items + t * part;
+        tasks[t].buffer = buffer + t * part;
+        tasks[t].n = (t == n_threads - 1) ? n - t * part : part;
+        tasks[t].descending = descending;
+        tasks[t].running_threads = &running_threads;
+        if(t == n_threads - 1) break;
+        (void)winx_atomic_add(&running_threads,1);
+        if(winx_create_thread(sort_thread,(PVOID)&tasks[t]) < 0){
+            (void)winx_atomic_add(&running_threads,-1);
+            /* sort it here then */
+            merge_sort(tasks[t].items,tasks[t].buffer,tasks[t].n,descending);
+        }
+    }
+    for(; t < n_threads; t++)
+        merge_sort(tasks[t].items,tasks[t].buffer,tasks[t].n,descending);
+
+    /* the tasks and the items must outlive all the threads */
+    while(winx_atomic_add(&running_threads,0) != 0)
+        winx_sleep(SORT_WAIT_INTERVAL);
+
+    /* merge sorted parts pairwise */
+    for(runs = n_threads; runs > 1; runs = r){
+        for(t = 0, r = 0; t < runs; t += 2, r++){
+            if(t + 1 < runs){
+                m = tasks[t].n;
+                k = m + tasks[t + 1].n;
+                merge(tasks[t].items,m,k,tasks[t].buffer,descending);
+                memcpy(tasks[t].items,tasks[t].buffer,(size_t)k * sizeof(udefrag_sort_item));
+                tasks[t].n = k;
+            }
+            tasks[r] = tasks[t];
+        }
+    }
+    winx_free(tasks);
+    return n_threads;
+
+single_thread:
+    merge_sort(items,buffer,n,descending);
+    return 1;
+}
+
+/************************************************************/
+/*                    The entry point                       */
+/************************************************************/
+
+/**
+ * @brief Defines the zone by the
+ * time of the last use of the file.
+ * @param[in] time the time of the last use.
+ * @param[in] now the current time.
+ * @param[in] jp the job parameters.
+ * @return HOT_ZONE, WARM_ZONE or COLD_ZONE.
+ * @note Files of unknown age are warm.
+ */
+ULONG get_time_zone(ULONGLONG time,ULONGLONG now,udefrag_job_parameters *jp)
+{
+    ULONGLONG days;
+
+    if(time == 0 || now == 0) return WARM_ZONE;
+
+    days = (time < now) ? (now - time) / TIME_UNITS_PER_DAY : 0;
+    if(days < jp->udo.hot_zone_age) return HOT_ZONE;
+    if(days >= jp->udo.cold_zone_age) return COLD_ZONE;
+    return WARM_ZONE;
+}
+
+/**
+ * @brief Defines the zone of the file
+ * by recency of its access or modification.
+ * @param[in] f the file.
+ * @param[in] now the current time.
+ * @param[in] jp the job parameters.
+ * @return HOT_ZONE, WARM_ZONE or COLD_ZONE.
+ */
+ULONG get_file_zone(winx_file_info *f,ULONGLONG now,udefrag_job_parameters *jp)
+{
+    /* access time updates are often disabled, so take modifications into account */
+    return get_time_zone(max(f->last_access_time,
+        f->last_modification_time),now,jp);
+}
+
+/**
+ * @brief Sorts files according to the
+ * requested sorting criteria.
+ * @param[in,out] sf the list of files; the file
+ * field of items must be filled before the call.
+ * @param[in] jp the job parameters.
+ * @return Zero for success, negative value otherwise.
+ * @note Duplicates are removed from the list.
+ */
+int sort_files(udefrag_sorted_files *sf,udefrag_job_parameters *jp)
+{
+    udefrag_sort_item *item, *buffer;
+    winx_file_info *f;
+    ULONGLONG i, j, length = 0;
+    ULONGLONG zones[COLD_ZONE + 1] = {0};
+    wchar_t *path;
+    int n_threads, descending;
+    LARGE_INTEGER now;
+    ULONGLONG time;
+
+    if(sf->count == 0) return 0;
+
+    time = winx_xtime();
+    descending = 0;
+    if(jp->udo.sorting_flags & UD_SORT_DESCENDING){
+        descending = DESCENDING_ORDER;
+        if(jp->udo.sorting_flags & (UD_SORT_BY_TREE_DFS | UD_SORT_BY_TREE_BFS))
+            descending = DESCENDING_SIBLINGS;
+    }
+    if(!NT_SUCCESS(NtQuerySystemTime(&now)))
+        now.QuadPart = 0;
+
+    /* store case folded paths one after another */
+    for(i = 0; i < sf->count; i++)
+        length += wcslen(sf->items[i].file->path) + 1;
+    sf->paths = winx_tmalloc((size_t)length * sizeof(wchar_t));
+    buffer = winx_tmalloc((size_t)sf->count * sizeof(udefrag_sort_item));
+    if(sf->paths == NULL || buffer == NULL){
+        mtrace();
+        winx_free(buffer);
+        winx_free(sf->paths);
+        sf->paths = NULL;
+        return (-1);
+    }
+
+    /* compute sort keys */
+    path = sf->paths;
+    for(i = 0; i < sf->count; i++){
+        item = &sf->items[i];
+        f = item->file;
+        item->rank = get_access_rank(f,jp);
+        if(item->rank == 0) item->rank = NOT_LISTED_RANK;
+        item->zone = HOT_ZONE;
+        if(jp->udo.sorting_flags & UD_SORT_BY_ZONES){
+            item->zone = get_file_zone(f,(ULONGLONG)now.QuadPart,jp);
+            zones[item->zone] += f->disp.clusters;
+        }
+        if(jp->udo.sorting_flags & UD_SORT_BY_SIZE)
+            item->key = f->disp.clusters;
+        else if(jp->udo.sorting_flags & UD_SORT_BY_CREATION_TIME)
+            item->key = f->creation_time;
+        else if(jp->udo.sorting_flags & UD_SORT_BY_MODIFICATION_TIME)
+            item->key = f->last_modification_time;
+        else if(jp->udo.sorting_flags & UD_SORT_BY_ACCESS_TIME)
+            item->key = f->last_access_time;
+        else
+            item->key = 0;
+        item->path = path;
+        wcscpy(path,f->path);
+        (void)winx_wcslwr(path);
+        if(jp->udo.sorting_flags & UD_SORT_BY_TREE_DFS)
+            (void)get_tree_key(path,is_directory(f));
+        else if(jp->udo.sorting_flags & UD_SORT_BY_TREE_BFS)
+            item->key = get_tree_key(path,is_directory(f));
+        path += wcslen(path) + 1;
+    }
+
+    n_threads = parallel_merge_sort(sf->items,buffer,sf->count,descending);
+    winx_free(buffer);
+
+    /* remove duplicates */
+    for(i = 1, j = 1; i < sf->count; i++){
+        if(compare_items(&sf->items[i],&sf->items[j - 1],descending) == 0){
+            etrace("a duplicate found for %ws",sf->items[i].file->path);
+            continue;
+        }
+        sf->items[j++] = sf->items[i];
+    }
+    sf->count = j;
+
+    time = winx_xtime() - time;
+    jp->p_counters.sorting_time += time;
+    itrace("%I64u files sorted in %I64u ms by %u threads",sf->count,time,n_threads);
+    if(jp->udo.sorting_flags & UD_SORT_BY_ZONES){
+        itrace("zones: %I64u hot, %I64u warm, %I64u cold clusters",
+            zones[HOT_ZONE],zones[WARM_ZONE],zones[COLD_ZONE]);
+    }
+    return 0;
+}
+
+/**
+ * @brief Sorts file positions by LCN
+ * by the bottom-up merge sort.
+ * @note The buffer must be of the same size.
+ */
+void sort_by_lcn(struct file_position *items,
+    struct file_position *buffer,ULONGLONG n)
+{
+    struct file_position *src = items, *dst = buffer, *swap;
+    ULONGLONG width, i, j, k, m, e, o;
+
+    for(width = 1; width < n; width *= 2){
+        for(i = 0; i < n; i += 2 * width){
+            m = min(i + width,n);
+            e = min(i + 2 * width,n);
+            for(j = i, k = m, o = i; o < e; o++){
+                if(k >= e || (j < m && src[j].lcn <= src[k].lcn))
+                    dst[o] = src[j++];
+                else
+                    dst[o] = src[k++];
+            }
+        }
+        swap = src, src = dst, dst = swap;
+    }
+    if(src != items)
+        memcpy(items,src,(size_t)n * sizeof(struct file_position));
+}
+
+/**
+ * @brief Releases resources
+ * allocated for the list of files.
+ */
+void release_sorted_files(udefrag_sorted_files *sf)
+{
+    winx_free(sf->items);
+    winx_free(sf->paths);
+    memset(sf,0,sizeof(udefrag_sorted_files));
+}
+
+/** @} */
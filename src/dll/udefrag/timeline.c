@@ -0,0 +1,266 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file timeline.c
+ * @brief Timeline of the job.
+ * @details When the UD_TIMELINE environment variable
+ * is set to 1, the job records spans of its stages:
+ * the disk scan, building of paths, filtering of files,
+ * passes of the defragmentation and optimization, each
+ * move and generation of reports. Spans are recorded by
+ * the job thread and by the thread delivering progress,
+ * so their interaction can be seen as well.
+ *
+ * Once the job completes, the timeline is saved in the
+ * trace event format to timeline_x.json in the reports
+ * directory. It can be opened by chrome://tracing and by
+ * other trace viewers.
+ *
+ * When the timeline is off, each routine returns right
+ * after checking a single pointer.
+ * @addtogroup Timeline
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+#define current_thread_id() \
+    ((ULONG)(DWORD_PTR)(NtCurrentTeb()->ClientId.UniqueThread))
+
+/**
+ * @brief Prepares the timeline
+ * if the user has requested it.
+ * @return Zero for success,
+ * negative value otherwise.
+ * @note Must be called before
+ * the job thread starts.
+ */
+int open_timeline(udefrag_job_parameters *jp)
+{
+    jp->timeline.events = NULL;
+    jp->timeline.count = 0;
+    jp->timeline.origin = winx_utime();
+    jp->timeline.caller_thread_id = current_thread_id();
+    jp->timeline.job_thread_id = 0;
+
+    if(!jp->udo.timeline)
+        return 0;
+
+    jp->timeline.events = winx_tmalloc(TIMELINE_CAPACITY * sizeof(struct timeline_event));
+    if(jp->timeline.events == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            TIMELINE_CAPACITY * sizeof(struct timeline_event));
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Reserves an entry for a new event.
+ * @return Pointer to the entry, NULL if
+ * the timeline is off or has no room left.
+ */
+static struct timeline_event *new_event(udefrag_job_parameters *jp)
+{
+    LONG i;
+
+    if(jp->timeline.events == NULL)
+        return NULL;
+
+    i = winx_atomic_add(&jp->timeline.count,1) - 1;
+    if(i < 0 || i >= TIMELINE_CAPACITY)
+        return NULL;
+    return &jp->timeline.events[i];
+}
+
+/**
+ * @brief Records an event of the calling thread.
+ */
+static void add_event(udefrag_job_parameters *jp,const char *name,
+    char phase,ULONGLONG start,ULONGLONG end,const char *arg_name,ULONGLONG arg)
+{
+    struct timeline_event *e;
+
+    e = new_event(jp);
+    if(e == NULL)
+        return;
+
+    e->name = name;
+    e->arg_name = arg_name;
+    e->arg = arg;
+    e->time = (start > jp->timeline.origin) ? start - jp->timeline.origin : 0;
+    e->duration = (end > start) ? end - start : 0;
+    e->thread_id = current_thread_id();
+    e->phase = phase;
+}
+
+/**
+ * @brief Opens a span on the calling thread.
+ * @note Spans of the same thread must be
+ * closed in the reverse order of opening.
+ */
+void timeline_begin(udefrag_job_parameters *jp,const char *name)
+{
+    if(jp->timeline.events == NULL)
+        return;
+
+    add_event(jp,name,'B',winx_utime(),0,NULL,0);
+}
+
+/**
+ * @brief Closes the span opened
+ * last on the calling thread.
+ */
+void timeline_end(udefrag_job_parameters *jp,const char *name)
+{
+    if(jp->timeline.events == NULL)
+        return;
+
+    add_event(jp,name,'E',winx_utime(),0,NULL,0);
+}
+
+/**
+ * @brief Records a span measured already.
+ * @param[in] jp the job parameters.
+ * @param[in] name the span name.
+ * @param[in] start winx_utime value at the beginning.
+ * @param[in] end winx_utime value at the end.
+ * @param[in] arg_name name of the argument
+ * displayed with the span, NULL if there is none.
+ * @param[in] arg value of the argument.
+ */
+void timeline_span(udefrag_job_parameters *jp,const char *name,
+    ULONGLONG start,ULONGLONG end,const char *arg_name,ULONGLONG arg)
+{
+    if(jp->timeline.events == NULL)
+        return;
+
+    add_event(jp,name,'X',start,end,arg_name,arg);
+}
+
+/**
+ * @brief Writes the name of the thread.
+ * @note Entries are separated by the caller.
+ */
+static void write_thread_name(WINX_FILE *f,ULONG pid,ULONG tid,char *name)
+{
+    char buffer[256];
+
+    (void)_snprintf(buffer,sizeof(buffer),
+        "\t\t{\"name\": \"thread_name\", \"ph\": \"M\", "
+        "\"pid\": %u, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+        (UINT)pid,(UINT)tid,name);
+    buffer[sizeof(buffer) - 1] = 0;
+    (void)winx_fwrite(buffer,1,strlen(buffer),f);
+}
+
+/**
+ * @brief Saves the timeline to the reports directory.
+ * @return Zero for success, negative value otherwise.
+ * @note Must be called after the job thread completion.
+ */
+int save_timeline(udefrag_job_parameters *jp)
+{
+    struct timeline_event *e;
+    wchar_t *path;
+    WINX_FILE *f;
+    char buffer[512];
+    char args[128];
+    ULONG pid;
+    LONG i, n;
+
+    if(jp->timeline.events == NULL)
+        return 0;
+
+    path = get_report_path(jp,L"timeline",L"json");
+    if(path == NULL)
+        return (-1);
+    f = winx_fbopen(path,"w",TIMELINE_CAPACITY);
+    if(f == NULL){
+        f = winx_fopen(path,"w");
+        if(f == NULL){
+            winx_free(path);
+            return (-1);
+        }
+    }
+
+    n = min(jp->timeline.count,TIMELINE_CAPACITY);
+    if(jp->timeline.count > n){
+        itrace("%u timeline events lost",
+            (UINT)(jp->timeline.count - n));
+    }
+
+    pid = (ULONG)(DWORD_PTR)(NtCurrentTeb()->ClientId.UniqueProcess);
+    (void)_snprintf(buffer,sizeof(buffer),
+        "{\r\n"
+        "\t\"displayTimeUnit\": \"ms\",\r\n"
+        "\t\"traceEvents\": [\r\n"
+        "\t\t{\"name\": \"process_name\", \"ph\": \"M\", "
+        "\"pid\": %u, \"tid\": 0, \"args\": {\"name\": \"%c: job\"}},\r\n",
+        (UINT)pid,jp->volume_letter);
+    buffer[sizeof(buffer) - 1] = 0;
+    (void)winx_fwrite(buffer,1,strlen(buffer),f);
+    write_thread_name(f,pid,jp->timeline.caller_thread_id,"progress delivery");
+    (void)winx_fwrite(",\r\n",1,3,f);
+    write_thread_name(f,pid,jp->timeline.job_thread_id,"job");
+
+    for(i = 0; i < n; i++){
+        e = &jp->timeline.events[i];
+        (void)winx_fwrite(",\r\n",1,3,f);
+        args[0] = 0;
+        if(e->arg_name){
+            (void)_snprintf(args,sizeof(args),
+                ", \"args\": {\"%s\": %I64u}",e->arg_name,e->arg);
+            args[sizeof(args) - 1] = 0;
+        }
+        if(e->phase == 'X'){
+            (void)_snprintf(buffer,sizeof(buffer),
+                "\t\t{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %I64u, "
+                "\"dur\": %I64u, \"pid\": %u, \"tid\": %u%s}",
+                e->name,e->time,e->duration,(UINT)pid,(UINT)e->thread_id,args);
+        } else {
+            (void)_snprintf(buffer,sizeof(buffer),
+                "\t\t{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %I64u, "
+                "\"pid\": %u, \"tid\": %u%s}",
+                e->name,e->phase,e->time,(UINT)pid,(UINT)e->thread_id,args);
+        }
+        buffer[sizeof(buffer) - 1] = 0;
+        (void)winx_fwrite(buffer,1,strlen(buffer),f);
+    }
+
+    (void)strcpy(buffer,"\r\n\t]\r\n}\r\n");
+    (void)winx_fwrite(buffer,1,strlen(buffer),f);
+
+    itrace("timeline of %u events saved to %ws",(UINT)n,path);
+    winx_fclose(f);
+    winx_free(path);
+    return 0;
+}
+
+/**
+ * @brief Releases resources of the timeline.
+ */
+void close_timeline(udefrag_job_parameters *jp)
+{
+    winx_free(jp->timeline.events);
+    jp->timeline.events = NULL;
+}
+
+/** @} */
@@ -0,0 +1,395 @@
+/*
+ *  UltraDefrag - a powerful defragmentation tool for Windows NT.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file trace.c
+ * @brief File access order traces.
+ * @details The trace lists files in order
+ * they are read, for instance during the boot
+ * or start of applications. The optimizer places
+ * listed files contiguously in that order, so
+ * they can be read with minimal head movements.
+ *
+ * Both the Prefetch layout.ini file (UTF-16)
+ * and plain text lists (ANSI) are accepted:
+ * one full path per line, section headers,
+ * comments and key=value lines are skipped.
+ * @addtogroup Trace
+ * @{
+ */
+
+#include "udefrag-internals.h"
+
+/* path listed in the trace */
+typedef struct _trace_entry {
+    wchar_t *path; /* path without the drive letter */
+    ULONG rank;    /* position in the trace, starting from one */
+} trace_entry;
+
+/************************************************************/
+/*                    Trace parsing                         */
+/************************************************************/
+
+static int trace_entries_compare(const void *prb_a, const void *prb_b, void *prb_param)
+{
+    trace_entry *a, *b;
+
+    a = (trace_entry *)prb_a;
+    b = (trace_entry *)prb_b;
+    return winx_wcsicmp(a->path,b->path);
+}
+
+/**
+ * @brief Converts the trace file contents to
+ * a null-terminated wide character string.
+ * @note The contents buffer is released.
+ * @return The converted string, NULL
+ * indicates failure.
+ */
+static wchar_t *decode_trace(unsigned char *contents,size_t size)
+{
+    wchar_t *s;
+    ULONG length;
+    NTSTATUS status;
+
+    if(size >= 2 && contents[0] == 0xFF && contents[1] == 0xFE){
+        /* UTF-16 with the byte order mark, like layout.ini */
+        s = (wchar_t *)contents;
+        s[size / sizeof(wchar_t)] = 0;
+        return s;
+    }
+
+    /* skip UTF-8 byte order mark */
+    if(size >= 3 && contents[0] == 0xEF && contents[1] == 0xBB && contents[2] == 0xBF){
+        contents[0] = contents[1] = contents[2] = ' ';
+    }
+
+    s = winx_tmalloc((size + 1) * sizeof(wchar_t));
+    if(s == NULL){
+        mtrace();
+        winx_release_file_contents(contents);
+        return NULL;
+    }
+    status = RtlMultiByteToUnicodeN(s,(ULONG)(size * sizeof(wchar_t)),
+        &length,(const CHAR *)contents,(ULONG)size);
+    winx_release_file_contents(contents);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot convert the trace to unicode");
+        winx_free(s);
+        return NULL;
+    }
+    s[length / sizeof(wchar_t)] = 0;
+    return s;
+}
+
+/**
+ * @brief Extracts path of the file residing
+ * on the volume being processed from the trace line.
+ * @return Path without the drive letter,
+ * NULL if the line must be skipped.
+ */
+static wchar_t *get_trace_path(wchar_t *line,udefrag_job_parameters *jp)
+{
+    /* skip empty lines, section headers and comments */
+    if(line[0] == 0 || line[0] == '[' || line[0] == ';' || line[0] == '#')
+        return NULL;
+
+    /* skip key=value lines, like Version=1 in layout.ini */
+    if(wcschr(line,'=')) return NULL;
+
+    if(wcsncmp(line,L"\\??\\",4) == 0) line += 4;
+
+    if(line[0] && line[1] == ':'){
+        if(winx_toupper((char)line[0]) != winx_toupper(jp->volume_letter))
+            return NULL;
+        line += 2;
+    } else if(winx_wcsistr(line,L"\\device\\") == line){
+        /* device paths cannot be resolved */
+        return NULL;
+    }
+    return (line[0] == '\\') ? line : NULL;
+}
+
+/**
+ * @brief Fills the tree of paths by entries of the trace.
+ * @param[in,out] s the trace contents; gets
+ * split into lines in place.
+ * @return Number of entries added to the tree,
+ * negative value indicates failure.
+ */
+static int parse_trace(wchar_t *s,struct prb_table *paths,
+    trace_entry **entries,udefrag_job_parameters *jp)
+{
+    wchar_t *line, *path;
+    trace_entry *e;
+    ULONG n_lines, n, i;
+    void **p;
+
+    /* count lines */
+    for(n_lines = 1, i = 0; s[i]; i++)
+        if(s[i] == '\n') n_lines ++;
+
+    e = winx_tmalloc(n_lines * sizeof(trace_entry));
+    if(e == NULL){
+        mtrace();
+        return (-1);
+    }
+    *entries = e;
+
+    n = 0;
+    for(line = s; line; line = s){
+        /* cut off the line */
+        s = wcschr(line,'\n');
+        if(s) *s++ = 0;
+        i = (ULONG)wcslen(line);
+        while(i && (line[i - 1] == '\r' || line[i - 1] == ' ' || line[i - 1] == '\t'))
+            line[--i] = 0;
+        while(line[0] == ' ' || line[0] == '\t' || line[0] == 0xFEFF) line ++;
+
+        path = get_trace_path(line,jp);
+        if(path == NULL) continue;
+
+        e[n].path = path;
+        e[n].rank = n + 1;
+        p = prb_probe(paths,(void *)&e[n]);
+        if(p == NULL){
+            mtrace();
+            return (-1);
+        }
+        /* keep the first occurrence only */
+        if(*p == &e[n]) n ++;
+    }
+    return (int)n;
+}
+
+/************************************************************/
+/*                       Test suite                         */
+/************************************************************/
+
+/*
+* Uncomment it to test parsing of the access
+* order traces. Fixture paths refer to the volume
+* being processed, so the test is best combined
+* with %UD_DRY_RUN% on a simulated volume.
+*/
+//#define TEST_ACCESS_ORDER
+
+#ifdef TEST_ACCESS_ORDER
+void test_access_order(udefrag_job_parameters *jp)
+{
+    wchar_t *fixtures[] = {
+        L"\xFEFF[OptimalLayoutFile]\r\nVersion=1\r\n"
+        L"%c:\\WINDOWS\\system32\\ntdll.dll\r\n"
+        L"%c:\\WINDOWS\\system32\\kernel32.dll\r\n"
+        L"\\DEVICE\\HARDDISKVOLUME1\\boot.ini\r\n"
+        L"%c:\\windows\\SYSTEM32\\NTDLL.DLL\r\n",
+        L"; plain text list\n"
+        L"  \\??\\%c:\\pagefile.sys  \n"
+        L"\n"
+        L"Z:\\elsewhere.txt\n"
+        L"\\relative\\path.txt\n"
+    };
+    ULONG expected[] = { 2, 2 };
+    struct prb_table *paths;
+    trace_entry *entries;
+    wchar_t *s;
+    int i, j, n;
+
+    dtrace("test of access order traces started");
+    for(i = 0; i < sizeof(fixtures) / sizeof(wchar_t *); i++){
+        s = winx_swprintf(fixtures[i],jp->volume_letter,
+            jp->volume_letter,jp->volume_letter);
+        paths = prb_create(trace_entries_compare,NULL,NULL);
+        if(s == NULL || paths == NULL){
+            mtrace();
+            winx_free(s);
+            if(paths) prb_destroy(paths,NULL);
+            break;
+        }
+        entries = NULL;
+        n = parse_trace(s,paths,&entries,jp);
+        for(j = 0; j < n; j++)
+            dtrace("fixture %u: %u. %ws",i,entries[j].rank,entries[j].path);
+        if(n != (int)expected[i]){
+            etrace("fixture %u: %u entries expected, %d parsed",i,expected[i],n);
+        } else {
+            dtrace("fixture %u: passed",i);
+        }
+        prb_destroy(paths,NULL);
+        winx_free(entries);
+        winx_free(s);
+    }
+    dtrace("test of access order traces completed");
+}
+#endif /* TEST_ACCESS_ORDER */
+
+/************************************************************/
+/*                    The entry point                       */
+/************************************************************/
+
+static int ranks_compare(const void *prb_a, const void *prb_b, void *prb_param)
+{
+    udefrag_access_rank *a, *b;
+
+    a = (udefrag_access_rank *)prb_a;
+    b = (udefrag_access_rank *)prb_b;
+
+    if(a->file < b->file) return (-1);
+    if(a->file > b->file) return 1;
+    return 0;
+}
+
+/**
+ * @brief Loads the access order trace
+ * and assigns ranks to the listed files.
+ * @details The trace is defined by
+ * the %UD_SORTING_TRACE% variable.
+ * @note Must be called after the
+ * volume analysis.
+ * @return Zero for success, negative
+ * value otherwise.
+ */
+int load_access_order(udefrag_job_parameters *jp)
+{
+    wchar_t *path, *s;
+    unsigned char *contents;
+    size_t size;
+    struct prb_table *paths;
+    trace_entry *entries = NULL;
+    trace_entry key, *e;
+    winx_file_info *f;
+    udefrag_access_rank *r;
+    ULONG n_found = 0;
+    ULONGLONG n_files = 0;
+    ULONGLONG time;
+    void **p;
+    int n;
+
+    if(jp->udo.sorting_trace[0] == 0) return 0;
+
+#ifdef TEST_ACCESS_ORDER
+    test_access_order(jp);
+#endif
+
+    time = start_timing("access order trace loading",jp);
+
+    /* read the trace */
+    path = winx_swprintf(L"\\??\\%ws",jp->udo.sorting_trace);
+    if(path == NULL){
+        mtrace();
+        return (-1);
+    }
+    contents = winx_get_file_contents(path,&size);
+    winx_free(path);
+    if(contents == NULL){
+        etrace("cannot read %ws",jp->udo.sorting_trace);
+        return (-1);
+    }
+    s = decode_trace(contents,size);
+    if(s == NULL) return (-1);
+
+    /* parse it */
+    paths = prb_create(trace_entries_compare,NULL,NULL);
+    if(paths == NULL){
+        mtrace();
+        winx_free(s);
+        return (-1);
+    }
+    n = parse_trace(s,paths,&entries,jp);
+    if(n <= 0) goto cleanup;
+
+    /*
+    * Assign ranks to the listed files. Paths are compared
+    * case insensitively, so a few files may match the same
+    * entry; therefore a rank is reserved for each file.
+    */
+    for(f = jp->filelist; f; f = f->next){
+        n_files ++;
+        if(f->next == jp->filelist) break;
+    }
+    if(n_files == 0) goto cleanup;
+    jp->access_ranks = winx_tmalloc((size_t)n_files * sizeof(udefrag_access_rank));
+    jp->access_order = prb_create(ranks_compare,NULL,NULL);
+    if(jp->access_ranks == NULL || jp->access_order == NULL){
+        mtrace();
+        release_access_order(jp);
+        n = (-1);
+        goto cleanup;
+    }
+    for(f = jp->filelist; f; f = f->next){
+        if(wcslen(f->path) > 6){
+            /* skip \??\C: prefix */
+            key.path = f->path + 6;
+            e = prb_find(paths,(void *)&key);
+            if(e){
+                r = &jp->access_ranks[n_found];
+                r->file = f;
+                r->rank = e->rank;
+                p = prb_probe(jp->access_order,(void *)r);
+                if(p == NULL){
+                    mtrace();
+                    release_access_order(jp);
+                    n = (-1);
+                    goto cleanup;
+                }
+                if(*p == r) n_found ++;
+            }
+        }
+        if(f->next == jp->filelist) break;
+    }
+    itrace("%u of %d files listed in the access order trace found",n_found,n);
+
+cleanup:
+    prb_destroy(paths,NULL);
+    winx_free(entries);
+    winx_free(s);
+    stop_timing("access order trace loading",time,jp);
+    return (n < 0) ? (-1) : 0;
+}
+
+/**
+ * @brief Returns position of the file
+ * in the access order trace, starting from one.
+ * @return Zero for files not listed in the trace.
+ */
+ULONG get_access_rank(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    udefrag_access_rank key, *r;
+
+    if(jp->access_order == NULL) return 0;
+    key.file = f;
+    r = prb_find(jp->access_order,(void *)&key);
+    return r ? r->rank : 0;
+}
+
+/**
+ * @brief Releases resources
+ * allocated by load_access_order.
+ */
+void release_access_order(udefrag_job_parameters *jp)
+{
+    if(jp->access_order){
+        prb_destroy(jp->access_order,NULL);
+        jp->access_order = NULL;
+    }
+    winx_free(jp->access_ranks);
+    jp->access_ranks = NULL;
+}
+
+/** @} */
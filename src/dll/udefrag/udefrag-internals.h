@@ -54,6 +54,43 @@
 */
 #define OPTIMIZER_MAGIC_CONSTANT_M  1
 
+/*
+* Default and maximum number of move
+* requests kept in flight simultaneously.
+*/
+#define DEFAULT_MOVE_QUEUE_DEPTH    4
+#define MAX_MOVE_QUEUE_DEPTH        64
+
+/*
+* Bounds of the amount of data moved at once
+* by a single request. When the cancellation
+* latency target is set, the actual value is
+* adjusted on the fly to keep duration of a
+* single request below the target.
+*/
+#define MIN_BYTES_AT_ONCE           (64 * 1024)
+#define MAX_BYTES_AT_ONCE           (256 * 1024 * 1024)
+
+/*
+* Verification of moves. By default each moved
+* file gets redumped immediately to compare its
+* real disposition with the calculated one.
+* Deferred verification trusts the calculated
+* disposition and redumps moved files once per
+* pass, sampled one redumps every n-th of them
+* and the rest only when a mismatch is found.
+*/
+#define VERIFY_MOVES_IMMEDIATELY    0
+#define VERIFY_MOVES_DEFERRED       1
+#define VERIFY_MOVES_SAMPLED        2
+#define VERIFICATION_SAMPLING_RATE  16
+
+/*
+* Number of file handles kept open
+* between moves of the same files.
+*/
+#define HANDLE_CACHE_SIZE           8
+
 /************************************************************/
 /*                Prototypes, constants etc.                */
 /************************************************************/
@@ -116,6 +153,24 @@
 #define UD_FILE_MFT_FILE               0x4000
 #define UD_FILE_NOT_MFT_FILE           0x8000
 
+/*
+* Auxiliary flag for in-place optimization,
+* marks files waiting for their targets.
+*/
+#define UD_FILE_TO_BE_PLACED           0x10000
+
+/*
+* Marks files lying in ranges left
+* intact since the last optimization.
+*/
+#define UD_FILE_IN_UNCHANGED_RANGE     0x20000
+
+/*
+* Marks files queued for deferred
+* verification of their disposition.
+*/
+#define UD_FILE_TO_BE_VERIFIED         0x40000
+
 #define is_excluded(f)               ((f)->user_defined_flags & UD_FILE_EXCLUDED)
 #define is_over_limit(f)             ((f)->user_defined_flags & UD_FILE_OVER_LIMIT)
 #define is_locked(f)                 ((f)->user_defined_flags & UD_FILE_LOCKED)
@@ -133,7 +188,9 @@
 
 /*
 * The UD_SORT_BY_xxx flags
-* are mutually exclusive.
+* are mutually exclusive,
+* except of UD_SORT_BY_ZONES
+* combined with any of them.
 */
 #define UD_SORT_BY_PATH               0x1
 #define UD_SORT_BY_SIZE               0x2
@@ -141,6 +198,20 @@
 #define UD_SORT_BY_MODIFICATION_TIME  0x8
 #define UD_SORT_BY_ACCESS_TIME        0x10
 #define UD_SORT_DESCENDING            0x20
+#define UD_SORT_BY_TREE_DFS           0x40
+#define UD_SORT_BY_TREE_BFS           0x80
+#define UD_SORT_BY_ZONES              0x100
+
+/*
+* Zones of the disk optimization,
+* by recency of the file access.
+*/
+#define HOT_ZONE   0
+#define WARM_ZONE  1
+#define COLD_ZONE  2
+
+#define DEFAULT_HOT_ZONE_AGE   7    /* in days */
+#define DEFAULT_COLD_ZONE_AGE  180  /* in days */
 
 typedef struct _udefrag_options {
     winx_patlist in_filter;     /* patterns for file inclusion */
@@ -152,15 +223,30 @@ typedef struct _udefrag_options {
     ULONGLONG optimizer_size_limit; /* file size threshold used in disk optimization */
     ULONGLONG fragments_limit;  /* file fragments threshold */
     ULONGLONG time_limit;       /* processing time limit, in seconds */
+    ULONGLONG free_space_target;    /* desired size of the largest free region, in bytes */
+    ULONGLONG free_space_fragments; /* desired number of free space regions */
+    ULONGLONG hot_zone_age;     /* files accessed within this number of days are hot */
+    ULONGLONG cold_zone_age;    /* files not accessed within this number of days are cold */
     int refresh_interval;       /* progress refresh interval, in milliseconds */
     int disable_reports;        /* nonzero value forces fragmentation reports to be disabled */
+    int timeline;               /* nonzero value forces the timeline of the job to be saved */
     int dbgprint_level;         /* controls amount of debugging information */
     int dry_run;                /* set %UD_DRY_RUN% variable to avoid actual data moving in tests */
+    int dry_run_latency;        /* simulated duration of a single move request in dry run, in milliseconds */
+    int move_queue_depth;       /* maximum number of move requests kept in flight */
+    int move_verification;      /* one of the VERIFY_MOVES_xxx constants */
+    int cancellation_latency;   /* maximum desired duration of a single move request, in milliseconds;
+                                   zero value disables adjustment of the amount of data moved at once */
     int job_flags;              /* flags triggering algorithm features */
     int sorting_flags;          /* flags triggering file sorting features (UD_SORT_xxx flags) */
+    int in_place_optimization;  /* nonzero value forces files to be sorted in place */
+    int incremental_optimization; /* nonzero value forces the optimized layout to be saved
+                                   and ranges left intact since then to be skipped */
     int algorithm_defined_fst;  /* nonzero value indicates that the fragment size
                                    threshold is set by algorithm and not by user */
     double fragmentation_threshold; /* fragmentation level threshold */
+    wchar_t sorting_trace[MAX_PATH + 1]; /* path of the access order trace; files
+                                   listed there are placed first, in that order */
 } udefrag_options;
 
 struct _mft_zone {
@@ -200,6 +286,25 @@ struct performance_counters {
     ULONGLONG searching_time;             /* time needed for searching */
     ULONGLONG moving_time;                /* time needed for file moves */
     ULONGLONG temp_space_releasing_time;  /* time needed to release space temporarily allocated by system */
+    ULONGLONG initial_clusters_at_once;   /* number of clusters moved at once initially */
+    ULONGLONG min_clusters_at_once;       /* minimum number of clusters moved at once */
+    ULONGLONG max_clusters_at_once;       /* maximum number of clusters moved at once */
+    ULONGLONG max_move_latency;           /* duration of the longest move request, in milliseconds */
+    ULONGLONG sorting_time;               /* time needed to sort files in optimization */
+    ULONGLONG verification_time;          /* time needed to redump moved files */
+    ULONGLONG file_moves;                 /* number of move_file calls moving anything */
+    ULONGLONG redumped_files;             /* number of redumps of moved files */
+    ULONGLONG mismatched_files;           /* number of files moved not as calculated */
+    ULONGLONG file_opening_time;          /* time needed to open and close files for moves */
+    ULONGLONG file_opens;                 /* number of files opened for moves */
+    ULONGLONG file_closes;                /* number of files closed after moves */
+    ULONGLONG handle_cache_hits;          /* number of moves reusing an open handle */
+    ULONGLONG progress_notifications;     /* number of progress updates delivered on notifications */
+    ULONGLONG notification_latency;       /* total time between progress changes and their delivery */
+    ULONGLONG max_notification_latency;   /* the longest delay of the progress delivery */
+    winx_histogram move_latency;          /* latency of move_file calls, in microseconds */
+    winx_histogram search_latency;        /* latency of free region searches, in microseconds; detailed logs only */
+    winx_ftw_statistics ftw_statistics;   /* latency of MFT reads and path builds, in microseconds */
 };
 
 #define TINY_FILE_SIZE            0 * 1024  /* < 10 KB */
@@ -218,6 +323,175 @@ struct file_counters {
     unsigned long giant_files;
 };
 
+/*
+* Fragments of a single file, stored in a flat array.
+* It is built once from the map of blocks and reused
+* until the file gets moved, so loops walking through
+* fragments of the same file allocate nothing.
+*/
+typedef struct _udefrag_fragment {
+    ULONGLONG vcn;
+    ULONGLONG lcn;
+    ULONGLONG length;
+} udefrag_fragment;
+
+struct fragment_index {
+    winx_file_info *file;           /* file the index belongs to; NULL if the index is invalid */
+    udefrag_fragment *fragments;    /* array of fragments */
+    ULONGLONG n_fragments;          /* number of fragments */
+    ULONGLONG capacity;             /* number of entries allocated */
+    ULONGLONG hits;                 /* number of requests served by the index */
+    ULONGLONG rebuilds;             /* number of times the index has been rebuilt */
+};
+
+/*
+* Table of files, mirroring the list of files
+* in columns indexed by 32-bit identifiers of
+* files kept in their user_defined_id fields.
+* Filters and counters walk through the columns
+* they need; the files column leads back to the list.
+*/
+#define FILE_TABLE_NO_ID  0xFFFFFFFF             /* no file */
+#define FILE_TABLE_NO_LCN ((ULONGLONG) -1)       /* the file has no clusters */
+
+struct file_table {
+    ULONG count;                    /* number of files */
+    ULONGLONG *clusters;            /* numbers of clusters */
+    ULONGLONG *fragments;           /* numbers of fragments */
+    ULONGLONG *first_lcn;           /* the first clusters; FILE_TABLE_NO_LCN for empty files */
+    ULONGLONG *creation_time;       /* times of the file creation */
+    ULONGLONG *modification_time;   /* times of the last modification */
+    ULONGLONG *access_time;         /* times of the last access */
+    winx_file_info **files;         /* entries of the list of files */
+    ULONG *flags;                   /* file attributes */
+    ULONG *parent;                  /* identifiers of parent directories; FILE_TABLE_NO_ID if unknown */
+    UCHAR *excluded;                /* nonzero values indicate files excluded from the processing */
+};
+
+/*
+* Queue of asynchronous move requests. Requests
+* are issued without waiting for completion of the
+* previous ones, even those of other files, unless
+* they involve the same clusters. Requests are kept
+* in flight across move_file calls until the moved
+* file gets redumped or its handle gets closed; all
+* of them get completed before the verification of
+* moves and the free space rescan.
+*/
+struct move_request {
+    winx_file_info *f;          /* file being moved */
+    ULONGLONG src_lcn;          /* the first cluster being freed */
+    ULONGLONG src_end;          /* the cluster following the last one being freed */
+    MOVEFILE_DESCRIPTOR mfd;    /* the request itself */
+    IO_STATUS_BLOCK iosb;       /* completion status */
+    HANDLE hEvent;              /* signaled on completion */
+    ULONGLONG issue_time;       /* time of the request issue */
+    ULONGLONG completion_time;  /* time of completion; zero if unknown */
+    int journal;                /* nonzero if the move completed by the request must be journaled */
+    ULONGLONG move_vcn;         /* the move to be journaled */
+    ULONGLONG move_length;
+    ULONGLONG move_target;
+};
+
+struct move_queue {
+    struct move_request *requests; /* circular buffer of requests */
+    int first;                  /* index of the oldest request in flight */
+    int count;                  /* number of requests in flight */
+    HANDLE hVolume;             /* volume handle allowing asynchronous requests */
+    winx_file_info *current;    /* file being moved by move_file right now */
+    ULONGLONG device_free_time; /* time of completion of the last completed request */
+    ULONGLONG dry_run_free_time; /* time of completion of the last simulated request */
+    double speed;               /* smoothed speed of moves, in clusters per millisecond */
+};
+
+/*
+* State of the optimization saved
+* by the journal after each pass.
+*/
+struct resume_point {
+    ULONGLONG pass_number;      /* number of passes completed */
+    ULONGLONG processed_clusters;
+    ULONGLONG cursor;           /* index of the first sorted file not moved yet */
+    ULONGLONG start_lcn;        /* LCN of the space not optimized yet */
+    ULONGLONG end_lcn;          /* end of the space cleaned up for sorted files */
+    ULONGLONG fingerprint;      /* fingerprint of sorted files preceding the cursor */
+};
+
+/*
+* Journal of moves and passes, allowing
+* interrupted jobs to be resumed.
+*/
+struct journal_record;
+
+struct journal {
+    WINX_FILE *f;               /* the journal file, NULL if journaling is off */
+    int resumable;              /* nonzero value indicates valid resume point */
+    struct resume_point resume_point; /* state saved by the interrupted job */
+    struct journal_record *moves; /* moves completed by the interrupted job */
+    ULONGLONG n_moves;          /* number of completed moves */
+};
+
+/*
+* Handles of files moved recently. The least
+* recently used one gets closed when a new
+* file needs to be opened. All the handles get
+* closed on failures and free space rescans.
+*/
+struct cached_handle {
+    winx_file_info *f;          /* the file, NULL for unused entries */
+    HANDLE hFile;               /* handle opened for moves */
+    ULONGLONG last_use;         /* value of the use counter at the last use */
+};
+
+struct handle_cache {
+    struct cached_handle entries[HANDLE_CACHE_SIZE];
+    ULONGLONG uses;             /* use counter */
+};
+
+/*
+* Files moved since the last
+* verification of dispositions.
+*/
+struct verification_queue {
+    winx_file_info **files;     /* array of files */
+    ULONGLONG count;            /* number of files */
+    ULONGLONG capacity;         /* number of allocated entries */
+};
+
+/*
+* Position of the file in the access order trace.
+*/
+typedef struct _udefrag_access_rank {
+    winx_file_info *file;
+    ULONG rank;                 /* position in the trace, starting from one */
+} udefrag_access_rank;
+
+/*
+* Timeline of the job, saved in the trace
+* event format understood by trace viewers.
+* Events are appended without locks by all
+* threads; those not fitting the array get lost.
+*/
+#define TIMELINE_CAPACITY 0x40000 /* maximum number of events */
+
+struct timeline_event {
+    const char *name;           /* name of the span; must be a static string */
+    const char *arg_name;       /* name of the argument, NULL if there is none */
+    ULONGLONG arg;              /* value of the argument */
+    ULONGLONG time;             /* time of the event, in microseconds since the job launch */
+    ULONGLONG duration;         /* duration of complete events, in microseconds */
+    ULONG thread_id;            /* the thread recording the event */
+    char phase;                 /* B - span begins, E - span ends, X - complete span */
+};
+
+struct timeline {
+    struct timeline_event *events; /* array of events, NULL if the timeline is off */
+    volatile LONG count;        /* number of events recorded, including lost ones */
+    ULONGLONG origin;           /* winx_utime value at the job launch */
+    ULONG caller_thread_id;     /* the thread which started the job */
+    ULONG job_thread_id;        /* the thread doing the job */
+};
+
 typedef int  (*udefrag_termination_router)(void /*udefrag_job_parameters*/ *p);
 
 typedef struct _udefrag_job_parameters {
@@ -229,12 +503,24 @@ typedef struct _udefrag_job_parameters {
     udefrag_termination_router termination_router;  /* address of procedure triggering job termination */
     ULONGLONG start_time;                       /* time of the job launch */
     ULONGLONG progress_refresh_time;            /* time of the last progress refresh */
+    HANDLE progress_event;                      /* set by the job thread to get the progress delivered */
+    int progress_pending;                       /* nonzero value indicates undelivered progress changes */
+    ULONGLONG progress_request_time;            /* time of the first undelivered progress change */
+    HANDLE completion_event;                    /* set by the job thread once the job completes */
+    int job_thread_done;                        /* the job thread touches nothing after setting it */
+    int volume_claimed;                         /* nonzero value indicates that the job owns the volume */
+    ULONGLONG notification_latency;             /* latency of the last notification accepted */
+    ULONGLONG deadline;                         /* time when the job must be terminated; zero if unlimited */
+    int cancel_requested;                       /* set by udefrag_cancel_job */
+    volatile LONG progress_sequence;            /* odd while the progress snapshot is being updated */
+    udefrag_progress_info progress_snapshot;    /* the last published progress information */
     udefrag_options udo;                        /* job options */
     udefrag_progress_info pi;                   /* progress counters */
     winx_volume_information v_info;             /* basic volume information */
     file_system_type fs_type;                   /* type of volume file system */
     int is_fat;                                 /* nonzero value indicates that the file system is a kind of FAT */
     winx_file_info *filelist;                   /* list of files */
+    struct file_table file_table;               /* columns of the list of files */
     struct prb_table *fragmented_files;         /* list of fragmented files; does not contain filtered out files */
     winx_volume_region *free_regions;           /* list of free space regions */
     unsigned long free_regions_count;           /* number of free space regions */
@@ -242,19 +528,29 @@ typedef struct _udefrag_job_parameters {
     cmap cluster_map;                           /* cluster map internal data */
     WINX_FILE *fVolume;                         /* handle of the volume, used by file moving routines */
     struct performance_counters p_counters;     /* performance counters */
-    struct prb_table *file_blocks;              /* pointer to binary tree of all file blocks found on the volume */
+    struct file_blocks_index *file_blocks;      /* index of all file blocks found on the volume, sorted by LCN */
     struct file_counters f_counters;            /* file counters */
     NTSTATUS last_move_status;                  /* status of the last move file operation; zero by default */
     ULONGLONG already_optimized_clusters;       /* number of clusters needing no sorting in optimization */
     int progress_trigger;                       /* a trigger used for debugging purposes */
     struct _mft_zone mft_zone;                  /* disposition of the mft zone; as it is before the volume processing */
     int win_version;                            /* Windows version */
+    struct fragment_index fragment_index;       /* fragments of the file processed last */
+    struct move_queue move_queue;               /* move requests in flight */
+    struct verification_queue verification_queue; /* moved files waiting for verification */
+    struct handle_cache handle_cache;           /* handles of files moved recently */
+    struct journal journal;                     /* journal of moves and passes */
+    struct timeline timeline;                   /* spans of the job stages, if requested */
+    struct prb_table *access_order;             /* ranks of files listed in the access order trace */
+    struct _udefrag_access_rank *access_ranks;  /* array of ranks referenced by the access_order tree */
 } udefrag_job_parameters;
 
 int get_options(udefrag_job_parameters *jp);
 void release_options(udefrag_job_parameters *jp);
 
+wchar_t *get_report_path(udefrag_job_parameters *jp,wchar_t *name,wchar_t *ext);
 int save_fragmentation_report(udefrag_job_parameters *jp);
+int save_performance_report(udefrag_job_parameters *jp);
 void remove_fragmentation_report(udefrag_job_parameters *jp);
 
 void dbg_print_file_counters(udefrag_job_parameters *jp);
@@ -273,6 +569,7 @@ int analyze(udefrag_job_parameters *jp);
 int defragment(udefrag_job_parameters *jp);
 int optimize(udefrag_job_parameters *jp);
 int optimize_mft(udefrag_job_parameters *jp);
+int consolidate_free_space(udefrag_job_parameters *jp);
 void destroy_lists(udefrag_job_parameters *jp);
 int check_fragmentation_level(udefrag_job_parameters *jp);
 
@@ -294,15 +591,29 @@ int exclude_by_size(winx_file_info *f,udefrag_job_parameters *jp);
 int expand_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp);
 void truncate_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp);
 winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments);
-void release_fragments_list(winx_blockmap **fragments);
+void release_fragments_list(winx_file_info *f,winx_blockmap **fragments);
+udefrag_fragment *get_fragment_index(winx_file_info *f,
+    ULONGLONG *n_fragments,udefrag_job_parameters *jp);
+void invalidate_fragment_index(winx_file_info *f,udefrag_job_parameters *jp);
+void release_fragment_index(udefrag_job_parameters *jp);
 void clear_currently_excluded_flag(udefrag_job_parameters *jp);
 
+int build_file_table(udefrag_job_parameters *jp);
+void update_file_table(winx_file_info *f,udefrag_job_parameters *jp);
+void release_file_table(udefrag_job_parameters *jp);
+int has_file_table(udefrag_job_parameters *jp);
+
 int move_file(winx_file_info *f,
               ULONGLONG vcn,
               ULONGLONG length,
               ULONGLONG target,
               udefrag_job_parameters *jp
               );
+void complete_move_requests(udefrag_job_parameters *jp);
+void destroy_move_queue(udefrag_job_parameters *jp);
+void close_cached_handles(udefrag_job_parameters *jp);
+void verify_moved_files(udefrag_job_parameters *jp);
+void destroy_verification_queue(udefrag_job_parameters *jp);
 int can_move(winx_file_info *f,udefrag_job_parameters *jp);
 int can_move_entirely(winx_file_info *f,udefrag_job_parameters *jp);
 
@@ -321,12 +632,79 @@ winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp);
     ULONGLONG start_lcn, ULONGLONG min_length, int preferred_position);
 */
 
+/*
+* File sorting in the optimization.
+*/
+typedef struct _udefrag_sort_item {
+    ULONG rank;                 /* position in the access order trace */
+    ULONG zone;                 /* HOT_ZONE, WARM_ZONE or COLD_ZONE */
+    ULONGLONG key;              /* size or time, depending on the sorting criteria */
+    wchar_t *path;              /* case folded path */
+    winx_file_info *file;
+} udefrag_sort_item;
+
+typedef struct _udefrag_sorted_files {
+    udefrag_sort_item *items;   /* array of files */
+    ULONGLONG count;            /* number of files */
+    wchar_t *paths;             /* storage of case folded paths */
+} udefrag_sorted_files;
+
+/*
+* Auxiliary structure used
+* to sort files by their position.
+*/
+struct file_position {
+    ULONGLONG lcn;    /* the first cluster of the file */
+    ULONGLONG index;  /* index of the file in the sorted list */
+};
+
+int sort_files(udefrag_sorted_files *sf,udefrag_job_parameters *jp);
+void sort_by_lcn(struct file_position *items,struct file_position *buffer,ULONGLONG n);
+ULONG get_time_zone(ULONGLONG time,ULONGLONG now,udefrag_job_parameters *jp);
+ULONG get_file_zone(winx_file_info *f,ULONGLONG now,udefrag_job_parameters *jp);
+void release_sorted_files(udefrag_sorted_files *sf);
+
+int optimize_in_place(udefrag_job_parameters *jp,udefrag_sorted_files *sf);
+
+/* FNV-1a hash parameters */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+ULONGLONG hash_bytes(ULONGLONG hash,const void *data,size_t size);
+ULONGLONG hash_value(ULONGLONG hash,ULONGLONG value);
+ULONGLONG get_options_fingerprint(udefrag_job_parameters *jp);
+int cut_off_unchanged_ranges(udefrag_job_parameters *jp,udefrag_sorted_files *sf);
+int save_layout(udefrag_job_parameters *jp,udefrag_sorted_files *sf);
+
+int open_journal(udefrag_job_parameters *jp);
+void journal_move(udefrag_job_parameters *jp,winx_file_info *f,
+    ULONGLONG vcn,ULONGLONG length,ULONGLONG target,int completed);
+void journal_pass(udefrag_job_parameters *jp,udefrag_sorted_files *sf,
+    ULONGLONG cursor,ULONGLONG start_lcn,ULONGLONG end_lcn);
+int resume_optimization(udefrag_job_parameters *jp,udefrag_sorted_files *sf,
+    ULONGLONG *cursor,ULONGLONG *start_lcn,ULONGLONG *end_lcn);
+void close_journal(udefrag_job_parameters *jp,int completed);
+
+int open_timeline(udefrag_job_parameters *jp);
+void timeline_begin(udefrag_job_parameters *jp,const char *name);
+void timeline_end(udefrag_job_parameters *jp,const char *name);
+void timeline_span(udefrag_job_parameters *jp,const char *name,
+    ULONGLONG start,ULONGLONG end,const char *arg_name,ULONGLONG arg);
+int save_timeline(udefrag_job_parameters *jp);
+void close_timeline(udefrag_job_parameters *jp);
+
+int load_access_order(udefrag_job_parameters *jp);
+ULONG get_access_rank(winx_file_info *f,udefrag_job_parameters *jp);
+void release_access_order(udefrag_job_parameters *jp);
+
 int create_file_blocks_tree(udefrag_job_parameters *jp);
 int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *file, winx_blockmap *block);
 int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap *block);
 void destroy_file_blocks_tree(udefrag_job_parameters *jp);
 winx_blockmap *find_first_block(udefrag_job_parameters *jp,
     ULONGLONG *min_lcn, int flags, winx_file_info **first_file);
+winx_blockmap *find_block_at(udefrag_job_parameters *jp,
+    ULONGLONG lcn, winx_file_info **file);
 
 /* flags for the find_first_block routine */
 enum {
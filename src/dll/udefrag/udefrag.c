@@ -100,49 +100,84 @@ void udefrag_unload_library(void)
     winx_unload_library();
 }
 
+/************************************************************/
+/*                   Progress snapshots                     */
+/************************************************************/
+
 /**
- * @brief Delivers progress information to the caller.
+ * @brief Publishes the progress
+ * information for other threads.
+ * @details Called by the job thread only.
+ * The snapshot is protected by the sequence
+ * counter which is odd while the snapshot
+ * is being updated, so readers never see
+ * torn 64-bit counters. Atomic operations
+ * on the counter order the copying as well.
+ */
+static void publish_progress(udefrag_job_parameters *jp)
+{
+    (void)winx_atomic_add(&jp->progress_sequence,1);
+    memcpy(&jp->progress_snapshot,&jp->pi,sizeof(udefrag_progress_info));
+    (void)winx_atomic_add(&jp->progress_sequence,1);
+}
+
+/**
+ * @brief Retrieves the last published
+ * snapshot of the progress information.
+ * @details Retries if the snapshot
+ * has been updated while being copied.
+ */
+static void read_progress_snapshot(udefrag_job_parameters *jp,udefrag_progress_info *pi)
+{
+    LONG sequence;
+
+    for(;;){
+        sequence = winx_atomic_add(&jp->progress_sequence,0);
+        if(sequence & 1){
+            /* let the job thread complete the update */
+            winx_sleep(0);
+            continue;
+        }
+        memcpy(pi,&jp->progress_snapshot,sizeof(udefrag_progress_info));
+        if(sequence == winx_atomic_add(&jp->progress_sequence,0)) break;
+    }
+}
+
+/**
+ * @brief Retrieves the progress information
+ * and prepares it for delivery to the caller.
  * @note 
- * - completion_status parameter becomes delivered to the caller
- * instead of the appropriate field of jp->pi structure.
  * - If cluster map cell is occupied entirely by MFT zone
  * it will be drawn in light magenta if no files exist there.
  * Otherwise, such a cell will be drawn in different color
  * indicating that something still exists inside the zone.
  */
-static void deliver_progress_info(udefrag_job_parameters *jp,int completion_status)
+static void get_progress_info(udefrag_job_parameters *jp,udefrag_progress_info *pi)
 {
-    udefrag_progress_info pi;
     double x, y;
-    int i, k, index, p1, p2;
+    int i, k, index;
     int mft_zone_detected;
     int free_cell_detected;
     ULONGLONG maximum, n;
     
-    if(jp->cb == NULL)
-        return;
-
-    /* make a copy of jp->pi */
-    memcpy(&pi,&jp->pi,sizeof(udefrag_progress_info));
-    
-    /* replace completion status */
-    pi.completion_status = completion_status;
+    read_progress_snapshot(jp,pi);
+    pi->notification_latency = jp->notification_latency;
     
     /* calculate progress percentage */
-    x = (double)pi.processed_clusters;
-    y = (double)pi.clusters_to_process;
-    if(y == 0) pi.percentage = 0.00;
-    else pi.percentage = (x / y) * 100.00;
+    x = (double)pi->processed_clusters;
+    y = (double)pi->clusters_to_process;
+    if(y == 0) pi->percentage = 0.00;
+    else pi->percentage = (x / y) * 100.00;
     
     /* calculate fragmentation percentage */
-    x = (double)pi.bad_fragments;
-    y = (double)pi.fragments;
-    if(y == 0) pi.fragmentation = 0.00;
-    else pi.fragmentation = (x / y) * 100.00;
+    x = (double)pi->bad_fragments;
+    y = (double)pi->fragments;
+    if(y == 0) pi->fragmentation = 0.00;
+    else pi->fragmentation = (x / y) * 100.00;
     
     /* refill cluster map */
-    if(jp->pi.cluster_map && jp->cluster_map.array \
-      && jp->pi.cluster_map_size == jp->cluster_map.map_size){
+    if(pi->cluster_map && jp->cluster_map.array \
+      && pi->cluster_map_size == jp->cluster_map.map_size){
         for(i = 0; i < jp->cluster_map.map_size; i++){
             /* check for mft zone to apply special rules there */
             mft_zone_detected = free_cell_detected = 0;
@@ -158,7 +193,7 @@ static void deliver_progress_info(udefrag_job_parameters *jp,int completion_stat
             if(jp->cluster_map.array[i][FREE_SPACE] >= maximum)
                 free_cell_detected = 1;
             if(mft_zone_detected && free_cell_detected){
-                jp->pi.cluster_map[i] = MFT_ZONE_SPACE;
+                pi->cluster_map[i] = MFT_ZONE_SPACE;
             } else {
                 maximum = jp->cluster_map.array[i][0];
                 index = 0;
@@ -172,15 +207,37 @@ static void deliver_progress_info(udefrag_job_parameters *jp,int completion_stat
                     }
                 }
                 if(maximum == 0)
-                    jp->pi.cluster_map[i] = DEFAULT_COLOR;
+                    pi->cluster_map[i] = DEFAULT_COLOR;
                 else
-                    jp->pi.cluster_map[i] = (char)index;
+                    pi->cluster_map[i] = (char)index;
             }
         }
     }
+}
+
+/**
+ * @brief Delivers progress information to the caller.
+ * @note completion_status parameter becomes delivered
+ * to the caller instead of the appropriate field
+ * of the progress information.
+ */
+static void deliver_progress_info(udefrag_job_parameters *jp,int completion_status)
+{
+    udefrag_progress_info pi;
+    int p1, p2;
+    
+    if(jp->cb == NULL)
+        return;
+
+    get_progress_info(jp,&pi);
+    
+    /* replace completion status */
+    pi.completion_status = completion_status;
     
     /* deliver information to the caller */
+    timeline_begin(jp,"progress delivery");
     jp->cb(&pi,jp->p);
+    timeline_end(jp,"progress delivery");
     jp->progress_refresh_time = winx_xtime();
     if(jp->udo.dbgprint_level >= DBG_PARANOID)
         winx_dbg_print_header(0x20,0,D"progress update");
@@ -198,6 +255,94 @@ static void deliver_progress_info(udefrag_job_parameters *jp,int completion_stat
     }
 }
 
+/************************************************************/
+/*                 Progress notifications                   */
+/************************************************************/
+
+/**
+ * @brief Notifies the caller's thread
+ * about a change of the progress.
+ * @details Called by the job thread.
+ * Notifications are coalesced: the event
+ * is set once until the progress gets
+ * delivered.
+ */
+static void notify_progress(udefrag_job_parameters *jp)
+{
+    publish_progress(jp);
+    if(jp->progress_event == NULL || jp->progress_pending)
+        return;
+
+    jp->progress_request_time = winx_xtime();
+    jp->progress_pending = 1;
+    (void)NtSetEvent(jp->progress_event,NULL);
+}
+
+/**
+ * @brief Waits until the progress
+ * needs to be delivered to the caller.
+ * @details Sleeps until the job thread notifies
+ * about a change, then lets further changes accumulate
+ * until refresh_interval milliseconds pass since
+ * the previous delivery. The job completion
+ * interrupts waiting immediately.
+ */
+static void wait_for_progress(udefrag_job_parameters *jp)
+{
+    LARGE_INTEGER interval;
+    ULONGLONG elapsed;
+
+    if(jp->progress_event == NULL){
+        /* poll as we have no way to be notified */
+        winx_sleep(jp->udo.refresh_interval);
+        return;
+    }
+
+    /* wait for a change */
+    (void)NtWaitForSingleObject(jp->progress_event,FALSE,NULL);
+
+    /* coalesce subsequent changes */
+    while(jp->pi.completion_status == 0){
+        elapsed = winx_xtime() - jp->progress_refresh_time;
+        if(elapsed >= (ULONGLONG)jp->udo.refresh_interval) break;
+        interval.QuadPart = -((LONGLONG)(jp->udo.refresh_interval - elapsed) * 10000);
+        (void)NtWaitForSingleObject(jp->progress_event,FALSE,&interval);
+    }
+}
+
+/**
+ * @brief Accepts the notification
+ * and measures its latency.
+ * @note Must be called before
+ * the progress delivery.
+ */
+static void accept_notification(udefrag_job_parameters *jp)
+{
+    ULONGLONG latency;
+
+    if(!jp->progress_pending){
+        jp->notification_latency = 0;
+        return;
+    }
+    latency = winx_xtime() - jp->progress_request_time;
+    jp->progress_pending = 0;
+    jp->notification_latency = latency;
+    jp->p_counters.progress_notifications ++;
+    jp->p_counters.notification_latency += latency;
+    if(latency > jp->p_counters.max_notification_latency)
+        jp->p_counters.max_notification_latency = latency;
+}
+
+/**
+ */
+static int killer(void *p)
+{
+    winx_dbg_print_header(0,0,I"*");
+    winx_dbg_print_header(0x20,0,I"termination requested by caller");
+    winx_dbg_print_header(0,0,I"*");
+    return 1;
+}
+
 /**
  */
 static int terminator(void *p)
@@ -205,6 +350,28 @@ static int terminator(void *p)
     udefrag_job_parameters *jp = (udefrag_job_parameters *)p;
     int result;
 
+    /*
+    * The job thread asks us after each step,
+    * so the progress has changed probably.
+    */
+    notify_progress(jp);
+
+    if(jp->cancel_requested){
+        winx_dbg_print_header(0,0,I"*");
+        winx_dbg_print_header(0x20,0,I"job cancelled");
+        winx_dbg_print_header(0,0,I"*");
+        jp->termination_router = killer;
+        return 1;
+    }
+
+    if(jp->deadline && winx_xtime() >= jp->deadline){
+        winx_dbg_print_header(0,0,I"*");
+        winx_dbg_print_header(0x20,0,I"time limit exceeded");
+        winx_dbg_print_header(0,0,I"*");
+        jp->termination_router = killer;
+        return 1;
+    }
+
     /* ask caller */
     if(jp->t){
         result = jp->t(jp->p);
@@ -220,16 +387,6 @@ static int terminator(void *p)
     return 0;
 }
 
-/**
- */
-static int killer(void *p)
-{
-    winx_dbg_print_header(0,0,I"*");
-    winx_dbg_print_header(0x20,0,I"termination requested by caller");
-    winx_dbg_print_header(0,0,I"*");
-    return 1;
-}
-
 /**
  */
 static DWORD WINAPI start_job(LPVOID p)
@@ -238,15 +395,20 @@ static DWORD WINAPI start_job(LPVOID p)
     char *action = "Analysis";
     int result = 0;
 
+    jp->timeline.job_thread_id = (ULONG)(DWORD_PTR)(NtCurrentTeb()->ClientId.UniqueThread);
+    
     /* check job flags */
     if(jp->udo.job_flags & UD_JOB_REPEAT)
         itrace("repeat action until nothing left to move");
+    if(jp->udo.job_flags & UD_JOB_RESUME)
+        itrace("resume the interrupted job if any");
     
     /* do the job */
     if(jp->job_type == DEFRAGMENTATION_JOB) action = "Defragmentation";
     else if(jp->job_type == FULL_OPTIMIZATION_JOB) action = "Full optimization";
     else if(jp->job_type == QUICK_OPTIMIZATION_JOB) action = "Quick optimization";
     else if(jp->job_type == MFT_OPTIMIZATION_JOB) action = "MFT optimization";
+    else if(jp->job_type == FREE_SPACE_CONSOLIDATION_JOB) action = "Free space consolidation";
     winx_dbg_print_header(0,0,I"%s of disk %c: started",action,jp->volume_letter);
     remove_fragmentation_report(jp);
     (void)winx_vflush(jp->volume_letter); /* flush all file buffers */
@@ -254,7 +416,8 @@ static DWORD WINAPI start_job(LPVOID p)
     /* speedup file searching in optimization */
     if(jp->job_type == FULL_OPTIMIZATION_JOB \
       || jp->job_type == QUICK_OPTIMIZATION_JOB \
-      || jp->job_type == MFT_OPTIMIZATION_JOB)
+      || jp->job_type == MFT_OPTIMIZATION_JOB \
+      || jp->job_type == FREE_SPACE_CONSOLIDATION_JOB)
         create_file_blocks_tree(jp);
 
     switch(jp->job_type){
@@ -271,21 +434,44 @@ static DWORD WINAPI start_job(LPVOID p)
     case MFT_OPTIMIZATION_JOB:
         result = optimize_mft(jp);
         break;
+    case FREE_SPACE_CONSOLIDATION_JOB:
+        result = consolidate_free_space(jp);
+        break;
     default:
         result = 0;
         break;
     }
 
+    timeline_begin(jp,"verification");
+    verify_moved_files(jp);
+    timeline_end(jp,"verification");
     destroy_file_blocks_tree(jp);
+    release_fragment_index(jp);
+    destroy_move_queue(jp);
+    destroy_verification_queue(jp);
+    close_cached_handles(jp);
+    close_journal(jp,result >= 0 && !jp->termination_router((void *)jp));
     if(jp->job_type != ANALYSIS_JOB)
         release_temp_space_regions(jp);
+    timeline_begin(jp,"report generation");
     (void)save_fragmentation_report(jp);
+    timeline_end(jp,"report generation");
     
     /* now it is safe to adjust the completion status */
     jp->pi.completion_status = result;
     if(jp->pi.completion_status == 0)
     jp->pi.completion_status ++; /* success */
     
+    /* deliver the final progress immediately */
+    publish_progress(jp);
+    jp->progress_request_time = winx_xtime();
+    jp->progress_pending = 1;
+    if(jp->progress_event)
+        (void)NtSetEvent(jp->progress_event,NULL);
+    if(jp->completion_event)
+        (void)NtSetEvent(jp->completion_event,NULL);
+    jp->job_thread_done = 1;
+    
     winx_exit_thread(0); /* 8k/12k memory leak here? */
     return 0;
 }
@@ -296,56 +482,111 @@ static DWORD WINAPI start_job(LPVOID p)
  */
 void destroy_lists(udefrag_job_parameters *jp)
 {
+    release_file_table(jp);
     winx_scan_disk_release(jp->filelist);
     winx_release_free_volume_regions(jp->free_regions);
     if(jp->fragmented_files) prb_destroy(jp->fragmented_files,NULL);
+    /* return slabs of the pools, unless other jobs still use them */
+    winx_trim_pools();
 }
 
+/*
+* Jobs running on the same volume would share
+* the fragmentation report, the journal and
+* the layout files, so each volume may be
+* owned by a single job at once.
+*/
+static volatile LONG busy_volumes[MAX_DOS_DRIVES];
+
 /**
- * @brief Starts disk analysis/defragmentation/optimization job.
- * @param[in] volume_letter the volume letter.
- * @param[in] job_type one of the xxx_JOB constants, defined in udefrag.h
- * @param[in] flags combination of UD_JOB_xxx and UD_PREVIEW_xxx flags defined in udefrag.h
- * @param[in] cluster_map_size size of the cluster map, in cells.
- * Zero value forces to avoid cluster map use.
- * @param[in] cb address of procedure to be called each time when
- * progress information updates, but no more frequently than
- * specified in UD_REFRESH_INTERVAL environment variable.
- * @param[in] t address of procedure to be called each time
- * when requested job would like to know whether it must be terminated or not.
- * Nonzero value, returned by terminator, forces the job to be terminated.
- * @param[in] p pointer to user defined data to be passed to both callbacks.
+ * @internal
+ * @brief Claims the volume for the job.
+ * @return Zero for success, negative
+ * value if another job owns the volume.
+ */
+static int claim_volume(udefrag_job_parameters *jp)
+{
+    int i = jp->volume_letter - 'A';
+
+    /* invalid letters are rejected by the job itself */
+    if(i < 0 || i >= MAX_DOS_DRIVES) return 0;
+    if(winx_atomic_compare_exchange(&busy_volumes[i],1,0) != 0){
+        etrace("disk %c: is processed by another job",jp->volume_letter);
+        return (-1);
+    }
+    jp->volume_claimed = 1;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Releases the volume claimed by the job.
+ */
+static void release_volume(udefrag_job_parameters *jp)
+{
+    if(jp->volume_claimed){
+        (void)winx_atomic_exchange(&busy_volumes[jp->volume_letter - 'A'],0);
+        jp->volume_claimed = 0;
+    }
+}
+
+/**
+ * @internal
+ * @brief Creates an event the job
+ * thread uses to wake up the caller.
+ * @details The name includes address
+ * of the job parameters since many
+ * jobs may run in the same process.
+ * @return The event handle,
+ * NULL indicates failure.
+ */
+static HANDLE create_job_event(udefrag_job_parameters *jp,char *name,int type)
+{
+    wchar_t *event_name;
+    unsigned int id;
+    HANDLE h = NULL;
+
+    id = (unsigned int)(DWORD_PTR)(NtCurrentTeb()->ClientId.UniqueProcess);
+    event_name = winx_swprintf(L"\\udefrag_%hs_%u_%p",name,id,(void *)jp);
+    if(event_name == NULL){
+        mtrace();
+        return NULL;
+    }
+    if(winx_create_event(event_name,type,&h) != 0)
+        h = NULL;
+    winx_free(event_name);
+    return h;
+}
+
+/**
+ * @brief Prepares the job and runs it in a separate thread.
  * @return Zero for success, negative value otherwise.
- * @note Callback procedures should complete as quickly
- * as possible to avoid slowdown of the volume processing.
+ * @note end_job must be called in any case.
  */
-int udefrag_start_job(char volume_letter,udefrag_job_type job_type,int flags,
-        int cluster_map_size,udefrag_progress_callback cb,udefrag_terminator t,void *p)
+static int begin_job(udefrag_job_parameters *jp,char volume_letter,
+        udefrag_job_type job_type,int flags,int cluster_map_size,
+        udefrag_progress_callback cb,udefrag_terminator t,void *p)
 {
-    udefrag_job_parameters jp;
-    ULONGLONG time = 0;
-    int use_limit = 0;
-    int result;
     int win_version = winx_get_os_version();
     
     /* initialize the job */
-    dbg_print_header(&jp);
+    dbg_print_header(jp);
 
     /* convert volume letter to uppercase */
     volume_letter = winx_toupper(volume_letter);
     
-    memset(&jp,0,sizeof(udefrag_job_parameters));
-    jp.win_version = winx_get_os_version();
-    jp.filelist = NULL;
-    jp.fragmented_files = NULL;
-    jp.free_regions = NULL;
-    jp.progress_refresh_time = 0;
+    memset(jp,0,sizeof(udefrag_job_parameters));
+    jp->win_version = winx_get_os_version();
+    jp->filelist = NULL;
+    jp->fragmented_files = NULL;
+    jp->free_regions = NULL;
+    jp->progress_refresh_time = 0;
     
-    jp.volume_letter = volume_letter;
-    jp.job_type = job_type;
-    jp.cb = cb;
-    jp.t = t;
-    jp.p = p;
+    jp->volume_letter = volume_letter;
+    jp->job_type = job_type;
+    jp->cb = cb;
+    jp->t = t;
+    jp->p = p;
 
     /*
     * We deliver the progress information from
@@ -353,20 +594,26 @@ int udefrag_start_job(char volume_letter,udefrag_job_type job_type,int flags,
     * to terminate the job or not here. This 
     * multi-threaded technique works quite smoothly.
     */
-    jp.termination_router = terminator;
+    jp->termination_router = terminator;
 
-    jp.start_time = jp.p_counters.overall_time = winx_xtime();
-    jp.pi.completion_status = 0;
+    jp->start_time = jp->p_counters.overall_time = winx_xtime();
+    jp->pi.completion_status = 0;
     
-    if(get_options(&jp) < 0)
-        goto done;
+    if(claim_volume(jp) < 0){
+        jp->pi.completion_status = UDEFRAG_VOLUME_BUSY;
+        return (-1);
+    }
     
-    jp.udo.job_flags = flags;
+    if(get_options(jp) < 0)
+        return (-1);
+    
+    jp->udo.job_flags = flags;
 
-    if(allocate_map(cluster_map_size,&jp) < 0){
-        release_options(&jp);
-        goto done;
+    if(allocate_map(cluster_map_size,jp) < 0){
+        release_options(jp);
+        return (-1);
     }
+    publish_progress(jp);
     
     /* set additional privileges for Vista and above */
     if(win_version >= WINDOWS_VISTA){
@@ -376,68 +623,271 @@ int udefrag_start_job(char volume_letter,udefrag_job_type job_type,int flags,
             (void)winx_enable_privilege(SE_MANAGE_VOLUME_PRIVILEGE);
     }
     
-    /* run the job in separate thread */
-    if(winx_create_thread(start_job,(PVOID)&jp) < 0){
-        free_map(&jp);
-        release_options(&jp);
-        goto done;
-    }
-
     /*
-    * Call specified callback every refresh_interval milliseconds.
+    * Terminate the job when the time limit exceeds.
     * http://sourceforge.net/tracker/index.php?func=
     * detail&aid=2886353&group_id=199532&atid=969873
     */
-    if(jp.udo.time_limit){
-        time = jp.udo.time_limit * 1000;
-        if(time / 1000 == jp.udo.time_limit){
+    if(jp->udo.time_limit && jp->start_time){
+        if((jp->udo.time_limit * 1000) / 1000 == jp->udo.time_limit){
             /* no overflow occured */
-            use_limit = 1;
+            jp->deadline = jp->start_time + jp->udo.time_limit * 1000;
         } else {
             /* Windows will die sooner */
         }
     }
-    do {
-        winx_sleep(jp.udo.refresh_interval);
-        deliver_progress_info(&jp,0); /* status = running */
-        if(use_limit){
-            if(time <= jp.udo.refresh_interval){
-                /* time limit exceeded */
-                winx_dbg_print_header(0,0,I"*");
-                winx_dbg_print_header(0x20,0,I"time limit exceeded");
-                winx_dbg_print_header(0,0,I"*");
-                jp.termination_router = killer;
-            } else {
-                if(jp.start_time){
-                    if(winx_xtime() - jp.start_time > jp.udo.time_limit * 1000)
-                        time = 0;
-                } else {
-                    /* this method gives not so fine results, but requires no winx_xtime calls */
-                    time -= jp.udo.refresh_interval; 
-                }
-            }
-        }
-    } while(jp.pi.completion_status == 0);
+    
+    /*
+    * Let the job thread wake us up on progress changes.
+    * Coalescing of notifications needs the timer, so
+    * we fall back to polling if it is not available.
+    * The job completion is signaled separately, so
+    * udefrag_wait_job sleeps through the progress.
+    */
+    if(jp->start_time){
+        jp->progress_event = create_job_event(jp,"progress",SynchronizationEvent);
+        jp->completion_event = create_job_event(jp,"completion",NotificationEvent);
+    }
+    
+    /* the timeline is optional, so failures are ignored */
+    (void)open_timeline(jp);
+    
+    /* run the job in separate thread */
+    if(winx_create_thread(start_job,(PVOID)jp) < 0){
+        close_timeline(jp);
+        winx_destroy_event(jp->progress_event);
+        winx_destroy_event(jp->completion_event);
+        jp->progress_event = NULL;
+        jp->completion_event = NULL;
+        free_map(jp);
+        release_options(jp);
+        return (-1);
+    }
+    return 0;
+}
 
-    /* cleanup */
-    deliver_progress_info(&jp,jp.pi.completion_status);
-    destroy_lists(&jp);
-    free_map(&jp);
-    release_options(&jp);
+/**
+ * @brief Releases resources of the job.
+ * @param[in] jp the job parameters.
+ * @param[in] started nonzero value indicates
+ * that begin_job has succeeded, so the job
+ * thread needs to be completed before.
+ * @return Zero for success, negative value otherwise.
+ */
+static int end_job(udefrag_job_parameters *jp,int started)
+{
+    int result;
+
+    jp->p_counters.overall_time = winx_xtime() - jp->p_counters.overall_time;
+    if(started){
+        /* the job thread may be setting the event still */
+        while(!jp->job_thread_done) winx_sleep(0);
+        winx_destroy_event(jp->progress_event);
+        winx_destroy_event(jp->completion_event);
+        jp->progress_event = NULL;
+        jp->completion_event = NULL;
+
+        (void)save_performance_report(jp);
+        (void)save_timeline(jp);
+        close_timeline(jp);
+        destroy_lists(jp);
+        free_map(jp);
+        release_options(jp);
+    }
+    release_volume(jp);
     
-done:
-    jp.p_counters.overall_time = winx_xtime() - jp.p_counters.overall_time;
-    dbg_print_performance_counters(&jp);
-    dbg_print_footer(&jp);
+    dbg_print_performance_counters(jp);
+    dbg_print_footer(jp);
 
     /* cleanup */
     winx_flush_dbg_log(0);
     
-    result = jp.pi.completion_status;
+    result = jp->pi.completion_status;
     if(result < 0) return result;
     return (result > 0) ? 0 : (-1);
 }
 
+/**
+ * @brief Starts disk analysis/defragmentation/optimization job.
+ * @param[in] volume_letter the volume letter.
+ * @param[in] job_type one of the xxx_JOB constants, defined in udefrag.h
+ * @param[in] flags combination of UD_JOB_xxx and UD_PREVIEW_xxx flags defined in udefrag.h
+ * @param[in] cluster_map_size size of the cluster map, in cells.
+ * Zero value forces to avoid cluster map use.
+ * @param[in] cb address of procedure to be called each time when
+ * progress information updates, but no more frequently than
+ * specified in UD_REFRESH_INTERVAL environment variable.
+ * @param[in] t address of procedure to be called each time
+ * when requested job would like to know whether it must be terminated or not.
+ * Nonzero value, returned by terminator, forces the job to be terminated.
+ * @param[in] p pointer to user defined data to be passed to both callbacks.
+ * @return Zero for success, negative value otherwise.
+ * @note Callback procedures should complete as quickly
+ * as possible to avoid slowdown of the volume processing.
+ */
+int udefrag_start_job(char volume_letter,udefrag_job_type job_type,int flags,
+        int cluster_map_size,udefrag_progress_callback cb,udefrag_terminator t,void *p)
+{
+    udefrag_job_parameters jp;
+    
+    if(begin_job(&jp,volume_letter,job_type,flags,
+      cluster_map_size,cb,t,p) < 0)
+        return end_job(&jp,0);
+
+    /*
+    * Call specified callback on progress changes, but
+    * no more frequently than every refresh_interval
+    * milliseconds. The job completion is delivered
+    * immediately.
+    */
+    for(;;){
+        wait_for_progress(&jp);
+        if(jp.pi.completion_status) break;
+        accept_notification(&jp);
+        deliver_progress_info(&jp,0); /* status = running */
+    }
+
+    /* the final progress is published right after the completion */
+    while(!jp.job_thread_done) winx_sleep(0);
+    accept_notification(&jp);
+    deliver_progress_info(&jp,jp.pi.completion_status);
+    return end_job(&jp,1);
+}
+
+/************************************************************/
+/*                 Handle based interface                   */
+/************************************************************/
+
+/**
+ * @brief Starts disk analysis/defragmentation/optimization
+ * job and returns immediately.
+ * @details Unlike udefrag_start_job, needs no callbacks:
+ * progress can be queried by udefrag_query_job at any time
+ * from any thread. Many jobs can run at once,
+ * one per disk.
+ * @param[in] volume_letter the volume letter.
+ * @param[in] job_type one of the xxx_JOB constants, defined in udefrag.h
+ * @param[in] flags combination of UD_JOB_xxx flags defined in udefrag.h
+ * @param[in] cluster_map_size size of the cluster map, in cells.
+ * Zero value forces to avoid cluster map use.
+ * @param[out] ph pointer to the job handle.
+ * @return Zero for success, negative value otherwise.
+ * @note The handle must be released by udefrag_release_job.
+ */
+int udefrag_begin_job(char volume_letter,udefrag_job_type job_type,int flags,
+        int cluster_map_size,udefrag_job_handle *ph)
+{
+    udefrag_job_parameters *jp;
+    int result;
+
+    DbgCheck1(ph,-1);
+    *ph = NULL;
+
+    jp = winx_tmalloc(sizeof(udefrag_job_parameters));
+    if(jp == NULL){
+        mtrace();
+        return UDEFRAG_NO_MEM;
+    }
+    if(begin_job(jp,volume_letter,job_type,flags,
+      cluster_map_size,NULL,NULL,NULL) < 0){
+        result = end_job(jp,0);
+        winx_free(jp);
+        return result;
+    }
+    *ph = (udefrag_job_handle)jp;
+    return 0;
+}
+
+/**
+ * @brief Retrieves a consistent snapshot
+ * of the progress information.
+ * @param[in] h the job handle.
+ * @param[out] pi the progress information.
+ * Its completion_status field is nonzero
+ * once the job completes.
+ * @note The cluster_map field points to the
+ * buffer being valid until the job release.
+ * The cluster map is refilled on each call,
+ * so it should not be queried from many
+ * threads at once.
+ * @return Zero for success, negative value otherwise.
+ */
+int udefrag_query_job(udefrag_job_handle h,udefrag_progress_info *pi)
+{
+    udefrag_job_parameters *jp = (udefrag_job_parameters *)h;
+
+    DbgCheck2(h,pi,-1);
+    get_progress_info(jp,pi);
+    return 0;
+}
+
+/**
+ * @brief Waits for the job completion.
+ * @param[in] h the job handle.
+ * @param[in] msec the maximum time to wait,
+ * in milliseconds; INFINITE is allowed.
+ * @return Nonzero value if the job
+ * has completed, zero otherwise.
+ */
+int udefrag_wait_job(udefrag_job_handle h,int msec)
+{
+    udefrag_job_parameters *jp = (udefrag_job_parameters *)h;
+    LARGE_INTEGER interval;
+    ULONGLONG deadline = 0, now;
+
+    DbgCheck1(h,0);
+    if(msec != INFINITE)
+        deadline = winx_xtime() + msec;
+
+    while(jp->pi.completion_status == 0){
+        now = winx_xtime();
+        if(deadline && now >= deadline) return 0;
+        if(jp->completion_event == NULL){
+            /* poll as we have no way to be notified */
+            winx_sleep(jp->udo.refresh_interval);
+        } else if(deadline){
+            interval.QuadPart = -((LONGLONG)(deadline - now) * 10000);
+            (void)NtWaitForSingleObject(jp->completion_event,FALSE,&interval);
+        } else {
+            (void)NtWaitForSingleObject(jp->completion_event,FALSE,NULL);
+        }
+    }
+
+    /* the final progress is published right after the completion */
+    while(!jp->job_thread_done) winx_sleep(0);
+    return 1;
+}
+
+/**
+ * @brief Requests the job termination.
+ * @details Returns immediately; the job
+ * terminates as soon as possible then.
+ */
+void udefrag_cancel_job(udefrag_job_handle h)
+{
+    udefrag_job_parameters *jp = (udefrag_job_parameters *)h;
+
+    if(jp) jp->cancel_requested = 1;
+}
+
+/**
+ * @brief Waits for the job completion
+ * and releases all its resources.
+ * @return Zero for success, negative value
+ * otherwise, like udefrag_start_job.
+ */
+int udefrag_release_job(udefrag_job_handle h)
+{
+    udefrag_job_parameters *jp = (udefrag_job_parameters *)h;
+    int result;
+
+    DbgCheck1(h,-1);
+    (void)udefrag_wait_job(h,INFINITE);
+    result = end_job(jp,1);
+    winx_free(jp);
+    return result;
+}
+
 /**
  * @brief Retrieves default formatted results 
  * of the completed disk defragmentation job.
@@ -528,10 +978,46 @@ char *udefrag_get_error_description(int error_code)
                "because the file system driver does not support FSCTL_MOVE_FILE.";
     case UDEFRAG_DIRTY_VOLUME:
         return "Disk is dirty, run CHKDSK to repair it.";
+    case UDEFRAG_VOLUME_BUSY:
+        return "Disk is being processed by another job.";
     }
     return "";
 }
 
+/**
+ * @brief Retrieves memory usage of the process
+ * broken down by subsystems: names and paths of
+ * files, file blocks, binary trees, the cluster map
+ * and so on.
+ * @param[out] mu array receiving the memory usage;
+ * the first entry describes all the subsystems together.
+ * @param[in] count number of entries in the array.
+ * @return Number of entries filled in.
+ * @note Peak values are collected since the
+ * library initialization, by all the jobs.
+ * Peaks of the first entry sum up peaks of
+ * the subsystems, so they are upper bounds.
+ */
+int udefrag_get_memory_usage(udefrag_memory_usage *mu,int count)
+{
+    winx_heap_statistics hs;
+    winx_heap_usage *u;
+    int i;
+    
+    DbgCheck1(mu,-1);
+    
+    winx_get_heap_statistics(&hs);
+    for(i = 0; i < count && i <= WINX_HEAP_TAGS; i++){
+        u = (i == 0) ? &hs.total : &hs.tags[i - 1];
+        mu[i].subsystem = u->name;
+        mu[i].bytes = u->bytes;
+        mu[i].peak_bytes = u->peak_bytes;
+        mu[i].blocks = u->blocks;
+        mu[i].peak_blocks = u->peak_blocks;
+    }
+    return i;
+}
+
 /**
  * @internal
  * @brief Writes a header to the log file.
@@ -42,6 +42,7 @@ extern "C" {
 #define UDEFRAG_REMOVABLE         (-8)
 #define UDEFRAG_UDF_DEFRAG        (-9)
 #define UDEFRAG_DIRTY_VOLUME      (-12)
+#define UDEFRAG_VOLUME_BUSY       (-13)
 
 #define DEFAULT_REFRESH_INTERVAL 100
 
@@ -71,7 +72,8 @@ typedef enum {
     DEFRAGMENTATION_JOB,
     FULL_OPTIMIZATION_JOB,
     QUICK_OPTIMIZATION_JOB,
-    MFT_OPTIMIZATION_JOB
+    MFT_OPTIMIZATION_JOB,
+    FREE_SPACE_CONSOLIDATION_JOB
 } udefrag_job_type;
 
 typedef enum {
@@ -87,6 +89,8 @@ typedef enum {
 * in the past for experimental options
 */
 #define UD_JOB_CONTEXT_MENU_HANDLER       0x10
+/* continue the job interrupted before, if any */
+#define UD_JOB_RESUME                     0x20
 
 /*
 * MFT_ZONE_SPACE has special meaning - 
@@ -134,6 +138,7 @@ typedef struct _udefrag_progress_info {
     int cluster_map_size;             /* size of the cluster map buffer, in bytes */
     ULONGLONG moved_clusters;         /* number of moved clusters */
     ULONGLONG total_moves;            /* number of moves by move_files_to_front/back functions */
+    ULONGLONG notification_latency;   /* time passed since the progress change till its delivery, in milliseconds */
 } udefrag_progress_info;
 
 typedef void  (*udefrag_progress_callback)(udefrag_progress_info *pi, void *p);
@@ -142,11 +147,37 @@ typedef int   (*udefrag_terminator)(void *p);
 int udefrag_start_job(char volume_letter,udefrag_job_type job_type,int flags,
     int cluster_map_size,udefrag_progress_callback cb,udefrag_terminator t,void *p);
 
+/* handle of a job started by udefrag_begin_job */
+typedef void *udefrag_job_handle;
+
+int udefrag_begin_job(char volume_letter,udefrag_job_type job_type,int flags,
+    int cluster_map_size,udefrag_job_handle *ph);
+int udefrag_query_job(udefrag_job_handle h,udefrag_progress_info *pi);
+int udefrag_wait_job(udefrag_job_handle h,int msec);
+void udefrag_cancel_job(udefrag_job_handle h);
+int udefrag_release_job(udefrag_job_handle h);
+
+typedef void  (*udefrag_scheduler_callback)(char volume_letter,
+    udefrag_progress_info *pi, udefrag_progress_info *total, void *p);
+
+int udefrag_start_jobs(char *volume_letters,udefrag_job_type job_type,int flags,
+    int cluster_map_size,udefrag_scheduler_callback cb,udefrag_terminator t,void *p);
+
 char *udefrag_get_results(udefrag_progress_info *pi);
 void udefrag_release_results(char *results);
 
 char *udefrag_get_error_description(int error_code);
 
+typedef struct _udefrag_memory_usage {
+    char *subsystem;                  /* name of the subsystem; "total" for the first entry */
+    ULONGLONG bytes;                  /* amount of memory in use, in bytes */
+    ULONGLONG peak_bytes;             /* the maximum amount of memory used, in bytes */
+    ULONGLONG blocks;                 /* number of memory blocks in use */
+    ULONGLONG peak_blocks;            /* the maximum number of memory blocks used */
+} udefrag_memory_usage;
+
+int udefrag_get_memory_usage(udefrag_memory_usage *mu,int count);
+
 int udefrag_set_log_file_path(void);
 
 #if defined(__cplusplus)
@@ -0,0 +1,190 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file arena.c
+ * @brief Arenas.
+ * @details An arena hands out blocks cut from
+ * big chunks of memory and releases all of them
+ * at once, so millions of small objects cost a
+ * handful of heap allocations. Blocks released
+ * individually are kept in free lists by size
+ * and handed out again, which suits objects
+ * replaced over and over, like maps of file blocks.
+ *
+ * Arenas are not synchronized: each one
+ * must be used by a single thread at once.
+ * @addtogroup Arenas
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+
+/* all the blocks are aligned on this boundary */
+#define ARENA_ALIGNMENT sizeof(ULONGLONG)
+#define align_size(n) (((n) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+/*
+* Chunks are chained through the header
+* of the same size as the block alignment.
+*/
+typedef union _arena_chunk {
+    union _arena_chunk *next;
+    ULONGLONG alignment;
+} arena_chunk;
+
+/* released blocks are chained through their first bytes */
+typedef struct _arena_free_block {
+    struct _arena_free_block *next;
+} arena_free_block;
+
+/**
+ * @brief Initializes an arena.
+ * @param[out] a the arena.
+ * @param[in] chunk_size size of chunks
+ * the blocks are cut from, in bytes.
+ * @param[in] tag one of the WINX_HEAP_TAG_xxx
+ * constants the chunks are accounted for.
+ * @note No memory is allocated until
+ * the first block is requested.
+ */
+void winx_arena_init(winx_arena *a,size_t chunk_size,int tag)
+{
+    if(a == NULL)
+        return;
+
+    memset(a,0,sizeof(winx_arena));
+    a->chunk_size = max(chunk_size,WINX_ARENA_MIN_CHUNK_SIZE);
+    a->tag = tag;
+}
+
+/**
+ * @internal
+ * @brief Allocates a new chunk and
+ * adds it to the list of chunks.
+ * @return Address of the chunk space.
+ */
+static char *add_chunk(winx_arena *a,size_t size)
+{
+    arena_chunk *chunk;
+
+    chunk = winx_malloc_tagged(sizeof(arena_chunk) + size,a->tag);
+    chunk->next = (arena_chunk *)a->chunks;
+    a->chunks = (void *)chunk;
+    a->chunk_count ++;
+    return (char *)(chunk + 1);
+}
+
+/**
+ * @brief Allocates a block from an arena.
+ * @param[in] a the arena.
+ * @param[in] size the block size, in bytes.
+ * @return Address of the block. If there is not enough
+ * memory, the killer registered by winx_set_killer
+ * is called, as winx_malloc does.
+ * @note Blocks bigger than a quarter of the chunk
+ * get chunks of their own, to waste no space.
+ */
+void *winx_arena_alloc(winx_arena *a,size_t size)
+{
+    arena_free_block *block;
+    size_t i;
+    char *p;
+
+    if(a == NULL)
+        return NULL;
+
+    size = align_size(max(size,sizeof(arena_free_block)));
+
+    /* reuse a released block if possible */
+    i = size / ARENA_ALIGNMENT - 1;
+    if(i < WINX_ARENA_SIZE_CLASSES && a->free_lists[i]){
+        block = (arena_free_block *)a->free_lists[i];
+        a->free_lists[i] = (void *)block->next;
+        a->recycled_bytes -= size;
+        return (void *)block;
+    }
+
+    if(size > a->chunk_size / 4)
+        return (void *)add_chunk(a,size);
+
+    if(size > a->free_bytes){
+        a->free_space = add_chunk(a,a->chunk_size);
+        a->free_bytes = a->chunk_size;
+    }
+    p = a->free_space;
+    a->free_space += size;
+    a->free_bytes -= size;
+    return (void *)p;
+}
+
+/**
+ * @brief Releases a block allocated from an arena.
+ * @param[in] a the arena.
+ * @param[in] p the block.
+ * @param[in] size the block size, in bytes; may
+ * be less than the size requested on allocation.
+ * @note Small blocks are kept for reuse,
+ * big ones stay in the arena till its release.
+ */
+void winx_arena_free(winx_arena *a,void *p,size_t size)
+{
+    arena_free_block *block = (arena_free_block *)p;
+    size_t i;
+
+    if(a == NULL || p == NULL)
+        return;
+
+    size = align_size(max(size,sizeof(arena_free_block)));
+    i = size / ARENA_ALIGNMENT - 1;
+    if(i >= WINX_ARENA_SIZE_CLASSES)
+        return;
+
+    block->next = (arena_free_block *)a->free_lists[i];
+    a->free_lists[i] = (void *)block;
+    a->recycled_bytes += size;
+}
+
+/**
+ * @brief Releases all the memory
+ * allocated from an arena at once.
+ * @note The arena stays initialized
+ * and may be used again.
+ */
+void winx_arena_release(winx_arena *a)
+{
+    arena_chunk *chunk, *next;
+
+    if(a == NULL)
+        return;
+
+    for(chunk = (arena_chunk *)a->chunks; chunk; chunk = next){
+        next = chunk->next;
+        winx_free(chunk);
+    }
+    a->chunks = NULL;
+    a->chunk_count = 0;
+    a->free_space = NULL;
+    a->free_bytes = 0;
+    a->recycled_bytes = 0;
+    memset(a->free_lists,0,sizeof(a->free_lists));
+}
+
+/** @} */
@@ -319,15 +319,24 @@ int winx_ioctl(WINX_FILE *f,
 
 /**
  * @brief fflush() native equivalent.
+ * @details Writes the buffered data
+ * first, if any.
  * @return Zero for success, negative value otherwise.
  */
 int winx_fflush(WINX_FILE *f)
 {
     NTSTATUS status;
     IO_STATUS_BLOCK iosb;
+    size_t result;
     
     DbgCheck1(f,-1);
 
+    if(f->io_buffer && f->io_buffer_offset){
+        result = winx_fwrite_helper(f->io_buffer,1,f->io_buffer_offset,f);
+        f->io_buffer_offset = 0;
+        if(result == 0) return (-1);
+    }
+
     status = NtFlushBuffersFile(f->hFile,&iosb);
     if(!NT_SUCCESS(status)){
         strace(status,"cannot flush file buffers");
@@ -654,6 +663,39 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle)
     return status;
 }
 
+/**
+ * @brief Opens a volume for asynchronous
+ * defragmentation related actions.
+ * @details In contrast with winx_vopen,
+ * the handle allows to keep multiple
+ * FSCTL_MOVE_FILE requests in flight.
+ * Each request needs its own event then.
+ * @param[in] volume_letter the volume letter.
+ * @param[out] phandle pointer to variable receiving the volume handle.
+ * @return NTSTATUS code.
+ * @note The handle must be closed by winx_defrag_fclose.
+ */
+NTSTATUS winx_defrag_vopen(char volume_letter,HANDLE *phandle)
+{
+    UNICODE_STRING us;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+    wchar_t path[] = L"\\??\\A:";
+
+    if(phandle == NULL)
+        return STATUS_INVALID_PARAMETER;
+
+    path[4] = winx_toupper(volume_letter);
+    RtlInitUnicodeString(&us,path);
+    InitializeObjectAttributes(&oa,&us,0,NULL,NULL);
+    status = NtCreateFile(phandle,FILE_GENERIC_READ,&oa,&iosb,NULL,0,
+                FILE_SHARE_READ | FILE_SHARE_WRITE,FILE_OPEN,0,NULL,0);
+    if(status != STATUS_SUCCESS)
+        *phandle = NULL;
+    return status;
+}
+
 /**
  * @brief Closes a file opened
  * by winx_defrag_fopen.
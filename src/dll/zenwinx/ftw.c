@@ -49,10 +49,229 @@
  */
 #define LLINVALID ((ULONGLONG) -1)
 
+/**
+ * @internal
+ * @brief Sizes of chunks of the scan storage.
+ */
+#define FILE_STORAGE_CHUNK_SIZE     (256 * 1024)
+#define BLOCKMAP_STORAGE_CHUNK_SIZE (64 * 1024)
+
+/**
+ * @internal
+ * @brief Memory of files found by a single scan.
+ * @details Entries of the file list, their names,
+ * paths and maps of blocks are cut from arenas,
+ * so the scan with millions of files found costs
+ * a few hundreds of heap allocations and the list
+ * is released at once. Entries removed from the list
+ * and maps of blocks replaced after moves of files
+ * are recycled through free lists of the arenas.
+ *
+ * The list and the maps of its blocks must be
+ * modified by a single thread at once.
+ */
+struct _winx_file_storage {
+    winx_arena files;  /* winx_file_info structures */
+    winx_arena names;  /* names and paths of files */
+    winx_arena blocks; /* winx_blockmap structures */
+};
+
+/* blockmaps of files having no storage */
+extern winx_pool winx_blockmap_pool;
+
 /* external functions prototypes */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data);
+    ftw_terminator t, void *user_defined_data, winx_ftw_statistics *stats);
+
+/**
+ * @internal
+ * @brief Creates storage for a new scan.
+ * @return Address of the storage, NULL
+ * indicates failure. In this case files
+ * should be allocated from the heap.
+ */
+winx_file_storage *ftw_create_storage(void)
+{
+    winx_file_storage *s;
+    
+    s = winx_malloc(sizeof(winx_file_storage));
+    if(s == NULL) return NULL;
+    
+    winx_arena_init(&s->files,FILE_STORAGE_CHUNK_SIZE,WINX_HEAP_TAG_FILE_INFO);
+    winx_arena_init(&s->names,FILE_STORAGE_CHUNK_SIZE,WINX_HEAP_TAG_PATH);
+    winx_arena_init(&s->blocks,BLOCKMAP_STORAGE_CHUNK_SIZE,WINX_HEAP_TAG_BLOCKMAP);
+    return s;
+}
+
+/**
+ * @internal
+ * @brief Releases all the files
+ * found by a scan at once.
+ * @param[in] filelist the list of files.
+ * @param[in] s the storage of the scan,
+ * NULL if files are allocated from the heap.
+ */
+void ftw_release_scan(winx_file_info *filelist,winx_file_storage *s)
+{
+    if(s == NULL){
+        winx_ftw_release(filelist);
+        return;
+    }
+    
+    itrace("releasing %u + %u + %u chunks of the scan",
+        (UINT)s->files.chunk_count,(UINT)s->names.chunk_count,
+        (UINT)s->blocks.chunk_count);
+    winx_arena_release(&s->files);
+    winx_arena_release(&s->names);
+    winx_arena_release(&s->blocks);
+    winx_free(s);
+}
+
+/**
+ * @internal
+ * @brief Inserts a new file as
+ * the head of the file list.
+ * @return Address of the new entry;
+ * all its fields are reset to zero
+ * except of the storage pointer.
+ */
+winx_file_info *ftw_add_file(winx_file_info **filelist,winx_file_storage *s)
+{
+    winx_file_info *f;
+    
+    if(s == NULL){
+        f = (winx_file_info *)winx_list_insert_tagged((list_entry **)(void *)filelist,
+            NULL,sizeof(winx_file_info),WINX_HEAP_TAG_FILE_INFO);
+        if(f == NULL) return NULL;
+        memset((char *)f + sizeof(list_entry),0,sizeof(winx_file_info) - sizeof(list_entry));
+        return f;
+    }
+    
+    f = winx_arena_alloc(&s->files,sizeof(winx_file_info));
+    if(f == NULL) return NULL;
+    memset(f,0,sizeof(winx_file_info));
+    f->internal.storage = s;
+    winx_list_link((list_entry **)(void *)filelist,NULL,(list_entry *)f);
+    return f;
+}
+
+/**
+ * @internal
+ * @brief Allocates memory for
+ * the name or path of the file.
+ * @param[in] f the file.
+ * @param[in] length the length of the
+ * string, including the terminal zero.
+ * @return Address of the string,
+ * NULL indicates failure.
+ */
+wchar_t *ftw_alloc_name(winx_file_info *f,size_t length)
+{
+    if(f->internal.storage == NULL)
+        return winx_tmalloc_tagged(length * sizeof(wchar_t),WINX_HEAP_TAG_PATH);
+    
+    return winx_arena_alloc(&f->internal.storage->names,length * sizeof(wchar_t));
+}
+
+/**
+ * @internal
+ * @brief Releases the name or path
+ * allocated by ftw_alloc_name.
+ */
+void ftw_free_name(winx_file_info *f,wchar_t *name)
+{
+    if(name == NULL) return;
+    
+    if(f->internal.storage == NULL){
+        winx_free(name);
+        return;
+    }
+    
+    winx_arena_free(&f->internal.storage->names,
+        name,(wcslen(name) + 1) * sizeof(wchar_t));
+}
+
+/**
+ * @internal
+ * @brief Removes the file from the file list
+ * and releases all the memory allocated for it.
+ */
+void ftw_remove_file(winx_file_info **filelist,winx_file_info *f)
+{
+    winx_file_storage *s = f->internal.storage;
+    
+    ftw_free_name(f,f->name);
+    ftw_free_name(f,f->path);
+    winx_blockmap_destroy(f,&f->disp.blockmap);
+    
+    if(s == NULL){
+        winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        return;
+    }
+    
+    winx_list_unlink((list_entry **)(void *)filelist,(list_entry *)f);
+    winx_arena_free(&s->files,f,sizeof(winx_file_info));
+}
+
+/**
+ * @brief Inserts a block to the map of file blocks.
+ * @details Allocates the block from the storage
+ * of the scan found the file, if there is one,
+ * otherwise from the pool of blockmaps.
+ * @param[in] f the file. For copies of the file
+ * list entries it must be the copy itself.
+ * @param[in,out] phead pointer to the map head.
+ * @param[in] prev the block preceeding to the new
+ * block, NULL forces to insert the new head.
+ * @return Address of the inserted block. In case of
+ * allocation failure the killer registered by
+ * winx_set_killer is called and NULL is returned then.
+ */
+winx_blockmap *winx_blockmap_insert(winx_file_info *f,winx_blockmap **phead,winx_blockmap *prev)
+{
+    winx_blockmap *block;
+    
+    if(f == NULL || f->internal.storage == NULL){
+        return (winx_blockmap *)winx_list_insert_pooled((list_entry **)(void *)phead,
+            (list_entry *)prev,&winx_blockmap_pool);
+    }
+    
+    block = winx_arena_alloc(&f->internal.storage->blocks,sizeof(winx_blockmap));
+    if(block == NULL) return NULL;
+    winx_list_link((list_entry **)(void *)phead,(list_entry *)prev,(list_entry *)block);
+    return block;
+}
+
+/**
+ * @brief Destroys a map of file blocks
+ * inserted by winx_blockmap_insert.
+ * @param[in] f the file the map belongs to.
+ * @param[in,out] phead pointer to the map head.
+ * @note Blocks of the scan storage are
+ * recycled for maps created later.
+ */
+void winx_blockmap_destroy(winx_file_info *f,winx_blockmap **phead)
+{
+    winx_blockmap *block, *next, *head;
+    
+    if(f == NULL || f->internal.storage == NULL){
+        winx_list_destroy_pooled((list_entry **)(void *)phead,&winx_blockmap_pool);
+        return;
+    }
+    
+    head = *phead;
+    if(head == NULL) return;
+    
+    block = head;
+    do {
+        next = block->next;
+        winx_arena_free(&f->internal.storage->blocks,block,sizeof(winx_blockmap));
+        block = next;
+    } while(next != head);
+    
+    *phead = NULL;
+}
 
 /**
  * @internal
@@ -103,7 +322,7 @@ void validate_blockmap(winx_file_info *f)
                     b1->vcn, b1->lcn, b1->length);
                 if(b1->next == f->disp.blockmap) break;
             }
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+            winx_blockmap_destroy(f,&f->disp.blockmap);
         }
     }
 #endif
@@ -148,7 +367,7 @@ int winx_ftw_dump_file(winx_file_info *f,
     /* reset disposition related fields */
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_blockmap_destroy(f,&f->disp.blockmap);
     
     /* open the file */
     status = winx_defrag_fopen(f,WINX_OPEN_FOR_DUMP,&hFile);
@@ -158,7 +377,7 @@ int winx_ftw_dump_file(winx_file_info *f,
     }
     
     /* allocate memory */
-    filemap = winx_malloc(FILE_MAP_SIZE);
+    filemap = winx_malloc_tagged(FILE_MAP_SIZE,WINX_HEAP_TAG_BUFFER);
     
     /* dump the file */
     startVcn = 0;
@@ -207,8 +426,7 @@ int winx_ftw_dump_file(winx_file_info *f,
                 goto dump_failed;
             }
             
-            block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-                (list_entry *)block,sizeof(winx_blockmap));
+            block = winx_blockmap_insert(f,&f->disp.blockmap,block);
             block->lcn = filemap->Pair[i].Lcn;
             block->length = filemap->Pair[i].Vcn - startVcn;
             block->vcn = startVcn;
@@ -240,7 +458,7 @@ cleanup:
 empty_map_detected:
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_blockmap_destroy(f,&f->disp.blockmap);
     winx_free(filemap);
     winx_defrag_fclose(hFile);
     return 0;
@@ -248,7 +466,7 @@ empty_map_detected:
 dump_failed:
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_blockmap_destroy(f,&f->disp.blockmap);
     winx_free(filemap);
     winx_defrag_fclose(hFile);
     return (-1);
@@ -263,7 +481,7 @@ dump_failed:
 static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
     ftw_terminator t, void *user_defined_data,
-    winx_file_info **filelist,
+    winx_file_info **filelist, winx_file_storage *s,
     FILE_BOTH_DIR_INFORMATION *file_entry)
 {
     winx_file_info *f;
@@ -279,15 +497,15 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     }
     
     /* insert new item to the file list */
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)filelist,
-        NULL,sizeof(winx_file_info));
+    f = ftw_add_file(filelist,s);
+    if(f == NULL) return NULL;
     
     /* extract filename */
-    f->name = winx_tmalloc(file_entry->FileNameLength + sizeof(wchar_t));
+    f->name = ftw_alloc_name(f,file_entry->FileNameLength / sizeof(wchar_t) + 1);
     if(f->name == NULL){
         etrace("cannot allocate %u bytes of memory",
             file_entry->FileNameLength + sizeof(wchar_t));
-        winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        ftw_remove_file(filelist,f);
         return NULL;
     }
     memset(f->name,0,file_entry->FileNameLength + sizeof(wchar_t));
@@ -302,12 +520,11 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     length += (int)wcslen(f->name) + 1;
     if(!is_rootdir)
         length ++;
-    f->path = winx_tmalloc(length * sizeof(wchar_t));
+    f->path = ftw_alloc_name(f,length);
     if(f->path == NULL){
         etrace("cannot allocate %u bytes of memory",
             length * sizeof(wchar_t));
-        winx_free(f->name);
-        winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        ftw_remove_file(filelist,f);
         return NULL;
     }
     if(is_rootdir)
@@ -327,18 +544,12 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     
     //trace(D"%ws",f->path);
     
-    /* reset internal data fields */
-    memset(&f->internal,0,sizeof(winx_file_internal_info));
-    
-    /* reset file disposition */
-    memset(&f->disp,0,sizeof(winx_file_disposition));
+    /* internal data fields and file disposition are reset by ftw_add_file */
 
     /* get file disposition if requested */
     if(flags & WINX_FTW_DUMP_FILES){
         if(winx_ftw_dump_file(f,t,user_defined_data) < 0){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+            ftw_remove_file(filelist,f);
             return NULL;
         }
     }    
@@ -354,7 +565,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
 static int ftw_add_root_directory(wchar_t *path, int flags,
     ftw_filter_callback fcb, ftw_progress_callback pcb, 
     ftw_terminator t, void *user_defined_data,
-    winx_file_info **filelist)
+    winx_file_info **filelist, winx_file_storage *s)
 {
     winx_file_info *f;
     int length;
@@ -372,16 +583,24 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
     }
     
     /* insert new item to the file list */
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)filelist,
-        NULL,sizeof(winx_file_info));
+    f = ftw_add_file(filelist,s);
+    if(f == NULL) return (-1);
     
     /* build path */
     length = (int)wcslen(path) + 1;
-    f->path = winx_malloc(length * sizeof(wchar_t));
+    f->path = ftw_alloc_name(f,length);
+    if(f->path == NULL){
+        ftw_remove_file(filelist,f);
+        return (-1);
+    }
     wcscpy(f->path,path);
     
     /* save . filename */
-    f->name = winx_malloc(2 * sizeof(wchar_t));
+    f->name = ftw_alloc_name(f,2);
+    if(f->name == NULL){
+        ftw_remove_file(filelist,f);
+        return (-1);
+    }
     f->name[0] = '.';
     f->name[1] = 0;
     
@@ -413,18 +632,10 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
     /* reset user defined flags */
     f->user_defined_flags = 0;
     
-    /* reset internal data fields */
-    memset(&f->internal,0,sizeof(winx_file_internal_info));
-    
-    /* reset file disposition */
-    memset(&f->disp,0,sizeof(winx_file_disposition));
-
     /* get file disposition if requested */
     if(flags & WINX_FTW_DUMP_FILES){
         if(winx_ftw_dump_file(f,t,user_defined_data) < 0){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+            ftw_remove_file(filelist,f);
             return (-1);
         }
     }
@@ -480,7 +691,7 @@ static HANDLE ftw_open_directory(wchar_t *path)
 static int ftw_helper(wchar_t *path, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb,
         ftw_terminator t, void *user_defined_data,
-        winx_file_info **filelist)
+        winx_file_info **filelist, winx_file_storage *s)
 {
     FILE_BOTH_DIR_INFORMATION *file_listing, *file_entry;
     HANDLE hDir;
@@ -495,7 +706,7 @@ static int ftw_helper(wchar_t *path, int flags,
         return 0; /* directory is locked by system, skip it */
     
     /* allocate memory */
-    file_listing = winx_malloc(FILE_LISTING_SIZE);
+    file_listing = winx_malloc_tagged(FILE_LISTING_SIZE,WINX_HEAP_TAG_BUFFER);
     
     /* reset buffer */
     memset((void *)file_listing,0,FILE_LISTING_SIZE);
@@ -545,7 +756,7 @@ static int ftw_helper(wchar_t *path, int flags,
         
         /* add entry to the file list */
         f = ftw_add_entry_to_filelist(path,flags,fcb,pcb,t,
-                user_defined_data,filelist,file_entry);
+                user_defined_data,filelist,s,file_entry);
         if(f == NULL){
             winx_free(file_listing);
             NtClose(hDir);
@@ -574,7 +785,7 @@ static int ftw_helper(wchar_t *path, int flags,
         if(is_directory(f) && (flags & WINX_FTW_RECURSIVE) && !skip_children){
             /* don't follow reparse points! */
             if(!is_reparse_point(f)){
-                result = ftw_helper(f->path,flags,fcb,pcb,t,user_defined_data,filelist);
+                result = ftw_helper(f->path,flags,fcb,pcb,t,user_defined_data,filelist,s);
                 if(result < 0){
                     winx_free(file_listing);
                     NtClose(hDir);
@@ -602,10 +813,7 @@ static void ftw_remove_resident_streams(winx_file_info **filelist)
         head = *filelist;
         next = f->next;
         if(f->disp.fragments == 0){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+            ftw_remove_file(filelist,f);
         }
         if(*filelist == NULL) break;
         if(next == head) break;
@@ -631,10 +839,7 @@ static void ftw_remove_invalid_streams(winx_file_info **filelist)
             invalid_entry = 1;
         }
         if(invalid_entry){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+            ftw_remove_file(filelist,f);
         }
         if(*filelist == NULL) break;
         if(next == head) break;
@@ -728,6 +933,7 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
         ftw_terminator t, void *user_defined_data)
 {
     winx_file_info *filelist = NULL;
+    winx_file_storage *s;
     
     DbgCheck1(path,NULL);
     
@@ -739,10 +945,11 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
         }
     }
     
-    if(ftw_helper(path,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    s = ftw_create_storage();
+    if(ftw_helper(path,flags,fcb,pcb,t,user_defined_data,&filelist,s) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy list */
-        winx_ftw_release(filelist);
+        ftw_release_scan(filelist,s);
         return NULL;
     }
       
@@ -751,6 +958,10 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
     
     /* get rid of invalid entries */
     ftw_remove_invalid_streams(&filelist);
+    
+    /* the storage is released along with the list */
+    if(filelist == NULL && s != NULL)
+        ftw_release_scan(NULL,s);
     return filelist;
 }
 
@@ -765,12 +976,18 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
  * Windows file cache makes access even faster.
  * UDF has been never tested in direct mode
  * because of its highly complicated standard.
+ *
+ * If stats parameter is not NULL, latency
+ * of reading of MFT records and of building
+ * of full paths is added there. Other file
+ * systems gather no statistics currently.
  */
 winx_file_info *winx_scan_disk(char volume_letter, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,
-        void *user_defined_data)
+        void *user_defined_data, winx_ftw_statistics *stats)
 {
     winx_file_info *filelist = NULL;
+    winx_file_storage *s;
     wchar_t rootpath[] = L"\\??\\A:\\";
     winx_volume_information v;
     ULONGLONG time;
@@ -792,27 +1009,29 @@ winx_file_info *winx_scan_disk(char volume_letter, int flags,
     if(winx_get_volume_information(volume_letter,&v) >= 0){
         itrace("file system is %s",v.fs_name);
         if(!strcmp(v.fs_name,"NTFS")){
-            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,user_defined_data);
+            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,user_defined_data,stats);
+            s = filelist ? filelist->internal.storage : NULL;
             goto cleanup;
         }
     }
     
     /* collect information about root directory */
+    s = ftw_create_storage();
     rootpath[4] = (wchar_t)volume_letter;
-    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist,s) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy list */
-        winx_ftw_release(filelist);
+        ftw_release_scan(filelist,s);
         filelist = NULL;
         goto done;
     }
 
     /* collect information about entire directory tree */
     flags |= WINX_FTW_RECURSIVE;
-    if(ftw_helper(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ftw_helper(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist,s) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy list */
-        winx_ftw_release(filelist);
+        ftw_release_scan(filelist,s);
         filelist = NULL;
         goto done;
     }
@@ -822,6 +1041,10 @@ cleanup:
         ftw_remove_resident_streams(&filelist);
     /* get rid of invalid entries */
     ftw_remove_invalid_streams(&filelist);
+    
+    /* the storage is released along with the list */
+    if(filelist == NULL && s != NULL)
+        ftw_release_scan(NULL,s);
         
 done:
     winx_dbg_print_header(0,0,I"winx_scan_disk completed in %I64u ms",
@@ -835,16 +1058,24 @@ done:
  * or winx_scan_disk.
  * @param[in] filelist pointer
  * to list of files.
+ * @note Lists having storage of the scan
+ * are released at once, without walking
+ * through the files.
  */
 void winx_ftw_release(winx_file_info *filelist)
 {
     winx_file_info *f;
 
+    if(filelist && filelist->internal.storage){
+        ftw_release_scan(filelist,filelist->internal.storage);
+        return;
+    }
+
     /* walk through list of files and free allocated memory */
     for(f = filelist; f != NULL; f = f->next){
         winx_free(f->name);
         winx_free(f->path);
-        winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+        winx_blockmap_destroy(f,&f->disp.blockmap);
         if(f->next == filelist) break;
     }
     winx_list_destroy((list_entry **)(void *)&filelist);
@@ -84,6 +84,8 @@ typedef struct _mft_scan_parameters {
     unsigned long processed_attr_list_entries; /* just for debugging purposes */
     unsigned long errors;       /* number of critical errors preventing gathering complete information */
     winx_file_info **filelist;  /* list of files */
+    winx_file_storage *storage; /* memory of the list, NULL if it is in the heap */
+    winx_ftw_statistics *stats; /* latency statistics, NULL if not needed */
 } mft_scan_parameters;
 
 /* structure used in binary search */
@@ -105,6 +107,12 @@ static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan
 static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_parameters *sp);
 
 void validate_blockmap(winx_file_info *f);
+winx_file_storage *ftw_create_storage(void);
+void ftw_release_scan(winx_file_info *filelist,winx_file_storage *s);
+winx_file_info *ftw_add_file(winx_file_info **filelist,winx_file_storage *s);
+wchar_t *ftw_alloc_name(winx_file_info *f,size_t length);
+void ftw_free_name(winx_file_info *f,wchar_t *name);
+void ftw_remove_file(winx_file_info **filelist,winx_file_info *f);
 
 /*
 **************************************************
@@ -167,6 +175,19 @@ static int ftw_ntfs_check_for_termination(mft_scan_parameters *sp)
     return sp->t(sp->user_defined_data);
 }
 
+/**
+ * @brief winx_wcsdup analog, but allocating
+ * the copy from the storage of the file.
+ */
+static wchar_t *copy_name(winx_file_info *f,const wchar_t *s)
+{
+    wchar_t *cp;
+    
+    cp = ftw_alloc_name(f,wcslen(s) + 1);
+    if(cp) wcscpy(cp,s);
+    return cp;
+}
+
 /**
  * @note
  * - lsn, buffer, length must be valid before this call
@@ -205,7 +226,9 @@ static NTSTATUS get_file_record(ULONGLONG mft_id,
     NTFS_FILE_RECORD_INPUT_BUFFER nfrib;
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
+    ULONGLONG time = 0;
 
+    if(sp->stats) time = winx_utime();
     nfrib.FileReferenceNumber = mft_id;
 
     /* required by x64 system, otherwise it trashes stack */
@@ -228,6 +251,8 @@ static NTSTATUS get_file_record(ULONGLONG mft_id,
 #ifdef TEST_NTFS_SCANNER
     randomize_file_record_data((char *)(void *)nfrob,sp->ml.file_record_buffer_size);
 #endif
+    if(sp->stats)
+        winx_histogram_add(&sp->stats->mft_record_reads,winx_utime() - time);
     return status;
 }
 
@@ -404,7 +429,7 @@ static int get_number_of_file_records(mft_scan_parameters *sp)
     sp->ml.number_of_file_records = 0;
     
     /* allocate memory */
-    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    nfrob = winx_tmalloc_tagged(sp->ml.file_record_buffer_size,WINX_HEAP_TAG_BUFFER);
     if(nfrob == NULL){
         etrace("cannot allocate %u bytes of memory",
             sp->ml.file_record_buffer_size);
@@ -635,7 +660,7 @@ static void analyze_attribute_from_mft_record(ULONGLONG mft_id,ATTRIBUTE_TYPE at
     }
     
     /* allocate memory for a single mft record */
-    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    nfrob = winx_tmalloc_tagged(sp->ml.file_record_buffer_size,WINX_HEAP_TAG_BUFFER);
     if(nfrob == NULL){
         etrace("cannot allocate %u bytes of memory",
             sp->ml.file_record_buffer_size);
@@ -952,7 +977,7 @@ static void analyze_non_resident_attribute_list(winx_file_info *f,ULONGLONG list
     cluster_size = sp->ml.cluster_size;
     clusters_to_read = list_size / cluster_size;
     if(list_size % cluster_size) clusters_to_read ++;
-    cluster = (char *)winx_tmalloc((SIZE_T)(cluster_size * clusters_to_read));
+    cluster = (char *)winx_tmalloc_tagged((SIZE_T)(cluster_size * clusters_to_read),WINX_HEAP_TAG_BUFFER);
     if(!cluster){
         etrace("cannot allocate %I64u bytes of memory",
             cluster_size * clusters_to_read);
@@ -1047,27 +1072,24 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
         if(f->next == *sp->filelist) break;
     }
     
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)sp->filelist,NULL,sizeof(winx_file_info));
+    f = ftw_add_file(sp->filelist,sp->storage);
+    if(f == NULL){
+        sp->errors ++;
+        return NULL;
+    }
 
-    /* initialize structure */
-    f->name = winx_wcsdup(attr_name);
+    /* initialize structure; other fields are reset by ftw_add_file */
+    f->name = copy_name(f,attr_name);
     if(f->name == NULL){
         etrace("cannot allocate %u bytes of memory",
             (wcslen(attr_name) + 1) * sizeof(wchar_t));
-        winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
+        ftw_remove_file(sp->filelist,f);
         sp->errors ++;
         return NULL;
     }
     
-    f->path = NULL;
-    f->flags = 0;
-    f->user_defined_flags = 0;
-    memset(&f->disp,0,sizeof(winx_file_disposition));
     f->internal.BaseMftId = sp->mfi.BaseMftId;
     f->internal.ParentDirectoryMftId = FILE_root;
-    f->creation_time = 0;
-    f->last_modification_time = 0;
-    f->last_access_time = 0;
     return f;
 }
 
@@ -1077,8 +1099,7 @@ static void process_run(winx_file_info *f,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG
     
     /* add information to f->disp */
     if(f->disp.blockmap) prev_block = f->disp.blockmap->prev;
-    block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-        (list_entry *)prev_block,sizeof(winx_blockmap));
+    block = winx_blockmap_insert(f,&f->disp.blockmap,prev_block);
     
     block->vcn = vcn;
     block->lcn = lcn;
@@ -1243,7 +1264,13 @@ static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
     int length;
     
     length = (int)wcslen(f->name) + (int)wcslen(sp->mfi.Name) + 1;
-    new_name = winx_malloc((length + 1) * sizeof(wchar_t));
+    new_name = ftw_alloc_name(f,length + 1);
+    if(new_name == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (length + 1) * sizeof(wchar_t));
+        sp->errors ++;
+        return (-1);
+    }
     
     if(f->name[0]) /* stream name is not empty */
         _snwprintf(new_name,length + 1,L"%ws:%ws",sp->mfi.Name,f->name);
@@ -1251,7 +1278,7 @@ static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
         wcsncpy(new_name,sp->mfi.Name,length);
     new_name[length] = 0;
     
-    winx_free(f->name);
+    ftw_free_name(f,f->name);
     f->name = new_name;
     return 0;
 }
@@ -1367,7 +1394,7 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
             f->internal.ParentDirectoryMftId = sp->mfi.ParentDirectoryMftId;
             /* add filename to the name of the stream */
             if(update_stream_name(f,sp) < 0){
-                winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
+                ftw_remove_file(sp->filelist,f);
                 if(*sp->filelist == NULL) break;
                 if(*sp->filelist != head){
                     head = *sp->filelist;
@@ -1519,7 +1546,7 @@ static void build_file_path(winx_file_info *f,file_entry *f_array,
     }
     
     /* update f->path */
-    f->path = winx_wcsdup(src);
+    f->path = copy_name(f,src);
     if(f->path == NULL){
         etrace("cannot allocate %u bytes of memory",
             (wcslen(src) + 1) * sizeof(wchar_t));
@@ -1542,10 +1569,11 @@ static int build_full_paths(mft_scan_parameters *sp)
     unsigned long n_entries = 0;
     winx_file_info *f;
     ULONG i;
-    ULONGLONG time;
+    ULONGLONG time, path_time;
     
     itrace("build_full_paths started...");
     time = winx_xtime();
+    if(sp->stats) sp->stats->path_building_start = winx_utime();
     
     /* allocate memory */
     p = winx_malloc(sizeof(path_parts));
@@ -1585,13 +1613,20 @@ static int build_full_paths(mft_scan_parameters *sp)
     
     for(f = *sp->filelist; f != NULL; f = f->next){
         if(ftw_ntfs_check_for_termination(sp)) break;
-        build_file_path(f,f_array,n_entries,p,sp);
+        if(sp->stats){
+            path_time = winx_utime();
+            build_file_path(f,f_array,n_entries,p,sp);
+            winx_histogram_add(&sp->stats->path_builds,winx_utime() - path_time);
+        } else {
+            build_file_path(f,f_array,n_entries,p,sp);
+        }
         if(f->next == *sp->filelist) break;
     }
     
     /* free allocated resources */
     winx_free(f_array);
     winx_free(p);
+    if(sp->stats) sp->stats->path_building_end = winx_utime();
     itrace("build_full_paths completed in %I64u ms",winx_xtime() - time);
     return 0;
 }
@@ -1633,7 +1668,7 @@ fail:
     }
 
     /* allocate memory */
-    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    nfrob = winx_tmalloc_tagged(sp->ml.file_record_buffer_size,WINX_HEAP_TAG_BUFFER);
     if(nfrob == NULL){
         etrace("cannot allocate %u bytes of memory",
             sp->ml.file_record_buffer_size);
@@ -1702,7 +1737,8 @@ fail:
 static int ntfs_scan_disk_helper(char volume_letter,
     int flags, ftw_filter_callback fcb,
     ftw_progress_callback pcb, ftw_terminator t,
-    void *user_defined_data, winx_file_info **filelist)
+    void *user_defined_data, winx_ftw_statistics *stats,
+    winx_file_info **filelist, winx_file_storage *storage)
 {
     wchar_t path[] = L"\\??\\A:";
     int result;
@@ -1710,6 +1746,7 @@ static int ntfs_scan_disk_helper(char volume_letter,
     winx_file_info *f;
     
     sp.filelist = filelist;
+    sp.storage = storage;
     sp.volume_letter = volume_letter;
     sp.processed_attr_list_entries = 0;
     sp.errors = 0;
@@ -1718,6 +1755,7 @@ static int ntfs_scan_disk_helper(char volume_letter,
     sp.pcb = pcb;
     sp.t = t;
     sp.user_defined_data = user_defined_data;
+    sp.stats = stats;
     
     /* open the volume for read access */
     path[4] = winx_toupper(volume_letter);
@@ -1733,12 +1771,14 @@ static int ntfs_scan_disk_helper(char volume_letter,
     }
     
     /* call filter callback for each file found */
+    if(stats) stats->filtering_start = winx_utime();
     for(f = *filelist; f != NULL; f = f->next){
         if(ftw_ntfs_check_for_termination(&sp)) break;
         validate_blockmap(f);
         if(fcb) (void)fcb(f,sp.user_defined_data);
         if(f->next == *filelist) break;
     }
+    if(stats) stats->filtering_end = winx_utime();
     
     winx_fclose(sp.f_volume);
     
@@ -1757,17 +1797,22 @@ static int ntfs_scan_disk_helper(char volume_letter,
  */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data)
+    ftw_terminator t, void *user_defined_data, winx_ftw_statistics *stats)
 {
     winx_file_info *filelist = NULL;
+    winx_file_storage *s;
     
-    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    s = ftw_create_storage();
+    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,user_defined_data,stats,&filelist,s) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy list */
-        winx_ftw_release(filelist);
+        ftw_release_scan(filelist,s);
         return NULL;
     }
-        
+    
+    /* the storage is released along with the list */
+    if(filelist == NULL && s != NULL)
+        ftw_release_scan(NULL,s);
     return filelist;
 }
 
@@ -0,0 +1,105 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file histogram.c
+ * @brief Latency histograms.
+ * @details Values are counted in buckets
+ * of exponentially growing width, so a fixed
+ * number of buckets covers the entire range
+ * from microseconds to hours with accuracy
+ * sufficient for percentiles.
+ * @addtogroup Histograms
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+
+/**
+ * @brief Adds a value to the histogram.
+ * @note The histogram must be
+ * zeroed before the first use.
+ */
+void winx_histogram_add(winx_histogram *h,ULONGLONG value)
+{
+    ULONGLONG v;
+    int i;
+
+    if(h == NULL) return;
+    
+    for(i = 0, v = value; v && i < WINX_HISTOGRAM_BUCKETS - 1; i++) v >>= 1;
+    h->buckets[i] ++;
+    if(h->count == 0 || value < h->min) h->min = value;
+    if(value > h->max) h->max = value;
+    h->count ++;
+    h->sum += value;
+}
+
+/**
+ * @brief Adds all the values
+ * of one histogram to another.
+ */
+void winx_histogram_merge(winx_histogram *dst,winx_histogram *src)
+{
+    int i;
+
+    if(dst == NULL || src == NULL) return;
+    
+    if(src->count == 0) return;
+    for(i = 0; i < WINX_HISTOGRAM_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    if(dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if(src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+}
+
+/**
+ * @brief Estimates a percentile of the histogram.
+ * @param[in] h the histogram.
+ * @param[in] percentile the percentile, 0 to 100.
+ * @return The upper bound of the bucket containing
+ * the percentile, but not more than the biggest
+ * value. Zero for empty histograms.
+ */
+ULONGLONG winx_histogram_percentile(winx_histogram *h,int percentile)
+{
+    ULONGLONG rank, n = 0, bound;
+    int i;
+
+    DbgCheck1(h,0);
+    
+    if(h->count == 0) return 0;
+    if(percentile <= 0) return h->min;
+    if(percentile >= 100) return h->max;
+    
+    /* the rank of the value, 1 based */
+    rank = (h->count * percentile + 99) / 100;
+    for(i = 0; i < WINX_HISTOGRAM_BUCKETS; i++){
+        n += h->buckets[i];
+        if(n >= rank) break;
+    }
+    if(i == 0) return 0;
+    if(i >= WINX_HISTOGRAM_BUCKETS - 1) return h->max;
+    bound = ((ULONGLONG)1 << i) - 1;
+    return min(bound,h->max);
+}
+
+/** @} */
@@ -38,6 +38,17 @@
  * this routine calls the killer registered by winx_set_killer and returns NULL then.
  */
 list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size)
+{
+    return winx_list_insert_tagged(phead,prev,size,WINX_HEAP_TAG_LIST);
+}
+
+/**
+ * @brief winx_list_insert analog, but
+ * accounting memory of the item for the
+ * subsystem specified by the last parameter.
+ * @param[in] tag one of the WINX_HEAP_TAG_xxx constants.
+ */
+list_entry *winx_list_insert_tagged(list_entry **phead,list_entry *prev,long size,int tag)
 {
     list_entry *new_item;
     
@@ -49,27 +60,64 @@ list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size)
     if(size < sizeof(list_entry))
         return NULL;
 
-    new_item = (list_entry *)winx_malloc(size);
+    new_item = (list_entry *)winx_malloc_tagged(size,tag);
+    if(new_item == NULL)
+        return NULL;
+
+    winx_list_link(phead,prev,new_item);
+    return new_item;
+}
 
+/**
+ * @brief winx_list_insert analog, but allocating
+ * the item from the pool specified by the last parameter.
+ * @details Items of the list must be released by
+ * winx_list_remove_pooled and winx_list_destroy_pooled.
+ * The size of the item is defined by the pool.
+ */
+list_entry *winx_list_insert_pooled(list_entry **phead,list_entry *prev,winx_pool *pool)
+{
+    list_entry *new_item;
+    
+    if(pool->object_size < sizeof(list_entry))
+        return NULL;
+
+    new_item = (list_entry *)winx_pool_alloc(pool);
+    if(new_item == NULL)
+        return NULL;
+
+    winx_list_link(phead,prev,new_item);
+    return new_item;
+}
+
+/**
+ * @brief Links an item allocated
+ * by the caller to a double linked list.
+ * @param[in,out] phead pointer to a variable pointing to the list head.
+ * @param[in] prev pointer to an item preceeding to the new item.
+ * If this parameter is NULL, the new head will be inserted.
+ * @param[in] item pointer to the item to be linked.
+ */
+void winx_list_link(list_entry **phead,list_entry *prev,list_entry *item)
+{
     /* is list empty? */
     if(*phead == NULL){
-        *phead = new_item;
-        new_item->prev = new_item->next = new_item;
-        return new_item;
+        *phead = item;
+        item->prev = item->next = item;
+        return;
     }
 
     /* insert as the new head? */
     if(prev == NULL){
         prev = (*phead)->prev;
-        *phead = new_item;
+        *phead = item;
     }
 
     /* insert after the item specified by prev argument */
-    new_item->prev = prev;
-    new_item->next = prev->next;
-    new_item->prev->next = new_item;
-    new_item->next->prev = new_item;
-    return new_item;
+    item->prev = prev;
+    item->next = prev->next;
+    item->prev->next = item;
+    item->next->prev = item;
 }
 
 /**
@@ -91,9 +139,33 @@ void winx_list_remove(list_entry **phead,list_entry *item)
     /* is list empty? */
     if(*phead == NULL) return;
 
+    winx_list_unlink(phead,item);
+    winx_free(item);
+}
+
+/**
+ * @brief winx_list_remove analog
+ * for items allocated from the pool.
+ */
+void winx_list_remove_pooled(list_entry **phead,list_entry *item,winx_pool *pool)
+{
+    if(item == NULL) return;
+    if(*phead == NULL) return;
+
+    winx_list_unlink(phead,item);
+    winx_pool_free(pool,item);
+}
+
+/**
+ * @brief Unlinks an item from a double linked
+ * list without releasing its memory.
+ * @param[in,out] phead pointer to a variable pointing to the list head.
+ * @param[in] item pointer to the item to be unlinked.
+ */
+void winx_list_unlink(list_entry **phead,list_entry *item)
+{
     /* remove alone first item? */
     if(item == *phead && item->next == *phead){
-        winx_free(item);
         *phead = NULL;
         return;
     }
@@ -104,7 +176,6 @@ void winx_list_remove(list_entry **phead,list_entry *item)
     }
     item->prev->next = item->next;
     item->next->prev = item->prev;
-    winx_free(item);
 }
 
 /**
@@ -132,4 +203,27 @@ void winx_list_destroy(list_entry **phead)
     *phead = NULL;
 }
 
+/**
+ * @brief winx_list_destroy analog
+ * for items allocated from the pool.
+ */
+void winx_list_destroy_pooled(list_entry **phead,winx_pool *pool)
+{
+    list_entry *item, *next, *head;
+    
+    /* is list empty? */
+    if(*phead == NULL) return;
+
+    head = *phead;
+    item = head;
+
+    do {
+        next = item->next;
+        winx_pool_free(pool,item);
+        item = next;
+    } while (next != head);
+
+    *phead = NULL;
+}
+
 /** @} */
@@ -22,6 +22,10 @@
  * @brief Locks.
  * @details Spin locks are intended for thread-safe
  * synchronization of access to shared data.
+ * Atomic operations serve counters and flags
+ * shared between threads; they are built on
+ * compiler intrinsics, so neither zenwinx nor
+ * its callers need kernel32 for them.
  * @addtogroup Locks
  * @{
  */
@@ -29,6 +33,21 @@
 #include "ntndk.h"
 #include "zenwinx.h"
 
+#if defined(_MSC_VER)
+long _InterlockedExchangeAdd(long volatile *target,long value);
+long _InterlockedExchange(long volatile *target,long value);
+long _InterlockedCompareExchange(long volatile *target,long exchange,long comparand);
+#pragma intrinsic(_InterlockedExchangeAdd)
+#pragma intrinsic(_InterlockedExchange)
+#pragma intrinsic(_InterlockedCompareExchange)
+#if defined(_WIN64)
+__int64 _InterlockedExchangeAdd64(__int64 volatile *target,__int64 value);
+__int64 _InterlockedCompareExchange64(__int64 volatile *target,__int64 exchange,__int64 comparand);
+#pragma intrinsic(_InterlockedExchangeAdd64)
+#pragma intrinsic(_InterlockedCompareExchange64)
+#endif
+#endif
+
 /*
 * winx_acquire_spin_lock and winx_release_spin_lock
 * are used in debugging routines, therefore winx_dbg_xxx
@@ -139,4 +158,85 @@ void winx_destroy_spin_lock(winx_spin_lock *sl)
     }
 }
 
+/**
+ * @brief Atomically adds a value to a variable.
+ * @param[in,out] target pointer to the variable.
+ * @param[in] value the value to be added.
+ * @return The resulting value of the variable.
+ * @note Acts as a full memory barrier.
+ */
+LONG winx_atomic_add(volatile LONG *target,LONG value)
+{
+#if defined(_MSC_VER)
+    return _InterlockedExchangeAdd(target,value) + value;
+#else
+    return __sync_add_and_fetch(target,value);
+#endif
+}
+
+/**
+ * @brief Atomically replaces a variable.
+ * @param[in,out] target pointer to the variable.
+ * @param[in] value the new value of the variable.
+ * @return The previous value of the variable.
+ * @note Acts as a full memory barrier.
+ */
+LONG winx_atomic_exchange(volatile LONG *target,LONG value)
+{
+#if defined(_MSC_VER)
+    return _InterlockedExchange(target,value);
+#else
+    return __sync_lock_test_and_set(target,value);
+#endif
+}
+
+/**
+ * @brief Atomically replaces a variable
+ * if it holds the expected value.
+ * @param[in,out] target pointer to the variable.
+ * @param[in] value the new value of the variable.
+ * @param[in] expected the expected value.
+ * @return The previous value of the variable;
+ * equals to the expected value on success.
+ * @note Acts as a full memory barrier.
+ */
+LONG winx_atomic_compare_exchange(volatile LONG *target,LONG value,LONG expected)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchange(target,value,expected);
+#else
+    return __sync_val_compare_and_swap(target,expected,value);
+#endif
+}
+
+/**
+ * @brief winx_atomic_add analog
+ * for variables of the pointer size.
+ */
+ULONG_PTR winx_atomic_add_ptr(volatile ULONG_PTR *target,ULONG_PTR value)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    return (ULONG_PTR)_InterlockedExchangeAdd64((volatile __int64 *)target,(__int64)value) + value;
+#elif defined(_MSC_VER)
+    return (ULONG_PTR)_InterlockedExchangeAdd((volatile long *)target,(long)value) + value;
+#else
+    return __sync_add_and_fetch(target,value);
+#endif
+}
+
+/**
+ * @brief winx_atomic_compare_exchange analog
+ * for variables of the pointer size.
+ */
+ULONG_PTR winx_atomic_compare_exchange_ptr(volatile ULONG_PTR *target,ULONG_PTR value,ULONG_PTR expected)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    return (ULONG_PTR)_InterlockedCompareExchange64((volatile __int64 *)target,(__int64)value,(__int64)expected);
+#elif defined(_MSC_VER)
+    return (ULONG_PTR)_InterlockedCompareExchange((volatile long *)target,(long)value,(long)expected);
+#else
+    return __sync_val_compare_and_swap(target,expected,value);
+#endif
+}
+
 /** @} */
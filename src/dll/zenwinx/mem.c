@@ -33,6 +33,53 @@ HANDLE hGlobalHeap = NULL;
 char *reserved_memory = NULL;
 winx_killer killer = default_killer;
 
+/*
+* Each block is preceded by a header keeping
+* its size and tag, so the block can be
+* accounted on release. Fields of the natural
+* size keep the natural alignment of blocks.
+*/
+typedef struct _heap_block_header {
+    SIZE_T size;  /* size requested, in bytes */
+    SIZE_T tag;   /* one of the WINX_HEAP_TAG_xxx constants */
+} heap_block_header;
+
+/*
+* Counters are updated by atomic operations,
+* so no locks are needed. Each tag has its own
+* counters; totals are summed up on request
+* to keep allocations away of a counter
+* shared by all the threads. Numbers of blocks
+* in use are derived from numbers of allocations
+* and releases, so each allocation and release
+* costs two atomic additions, unless it raises
+* the peak values. The counters have the pointer
+* size, so they wrap around together with the
+* address space and the differences stay correct;
+* releases subtract sizes of blocks that way.
+*/
+struct heap_counters {
+    volatile ULONG_PTR bytes;
+    volatile ULONG_PTR peak_bytes;
+    volatile ULONG_PTR peak_blocks;
+    volatile ULONG_PTR allocations;
+    volatile ULONG_PTR releases;
+};
+
+static struct heap_counters heap_counters[WINX_HEAP_TAGS];
+
+static char *heap_tag_names[WINX_HEAP_TAGS] = {
+    "miscellaneous",
+    "file information",
+    "names and paths",
+    "file blocks",
+    "tree nodes",
+    "free space regions",
+    "list entries",
+    "buffers",
+    "cluster map"
+};
+
 /**
  * @brief Aborts the application in the out of memory condition case
  * when no custom killer is set by the winx_set_killer routine.
@@ -58,16 +105,60 @@ void winx_set_killer(winx_killer k)
     killer = k;
 }
 
+/**
+ * @internal
+ * @brief Raises the peak value
+ * if the current one exceeds it.
+ */
+static void update_peak(volatile ULONG_PTR *peak,ULONG_PTR value)
+{
+    ULONG_PTR old_peak;
+    
+    for(old_peak = *peak; value > old_peak; old_peak = *peak){
+        if(winx_atomic_compare_exchange_ptr(peak,value,old_peak) == old_peak)
+            break;
+    }
+}
+
+/**
+ * @internal
+ * @brief Adjusts counters of the tag.
+ * @param[in] tag the tag of the block.
+ * @param[in] size size of the block.
+ * @param[in] release nonzero value indicates
+ * that the block is being released.
+ */
+static void account_block(SIZE_T tag,ULONG_PTR size,int release)
+{
+    struct heap_counters *c = &heap_counters[tag];
+    ULONG_PTR b, r, n;
+    
+    if(release){
+        (void)winx_atomic_add_ptr(&c->bytes,(ULONG_PTR)0 - size);
+        (void)winx_atomic_add_ptr(&c->releases,1);
+        return;
+    }
+    b = winx_atomic_add_ptr(&c->bytes,size);
+    /* releases read before can never outnumber the allocations */
+    r = c->releases;
+    n = winx_atomic_add_ptr(&c->allocations,1) - r;
+    update_peak(&c->peak_bytes,b);
+    update_peak(&c->peak_blocks,n);
+}
+
 /**
  * @brief Allocates a block of memory from a global growable heap.
  * @param size the size of the block to be allocated, in bytes.
  * Note that the allocated block may be bigger than the requested size.
  * @param flags combination of MALLOC_XXX flags defined in zenwinx.h file.
+ * MALLOC_TAG(tag) defines the subsystem the block is accounted for;
+ * untagged blocks are accounted as miscellaneous.
  * @return A pointer to the allocated block. NULL indicates failure.
  */
 void *winx_heap_alloc(size_t size,int flags)
 {
-    void *p = NULL;
+    heap_block_header *p = NULL;
+    SIZE_T tag = MALLOC_GET_TAG(flags);
 
     /*
     * Avoid winx_dbg_xxx calls here
@@ -75,16 +166,23 @@ void *winx_heap_alloc(size_t size,int flags)
     */
     
     if(!hGlobalHeap) return NULL;
+    if(size > (size_t)-1 - sizeof(heap_block_header)) return NULL;
+    if(tag >= WINX_HEAP_TAGS) tag = WINX_HEAP_TAG_MISC;
 
-    if(!(flags & MALLOC_ABORT_ON_FAILURE))
-        return RtlAllocateHeap(hGlobalHeap,0,size);
-    
-    do {
-        p = RtlAllocateHeap(hGlobalHeap,0,size);
-        if(!p) if(!killer(size)) break;
-    } while(!p);
+    if(!(flags & MALLOC_ABORT_ON_FAILURE)){
+        p = RtlAllocateHeap(hGlobalHeap,0,size + sizeof(heap_block_header));
+    } else {
+        do {
+            p = RtlAllocateHeap(hGlobalHeap,0,size + sizeof(heap_block_header));
+            if(!p) if(!killer(size)) break;
+        } while(!p);
+    }
+    if(!p) return NULL;
     
-    return p;
+    p->size = size;
+    p->tag = tag;
+    account_block(tag,(ULONG_PTR)size,0);
+    return (void *)(p + 1);
 }
 
 /**
@@ -93,12 +191,56 @@ void *winx_heap_alloc(size_t size,int flags)
  */
 void winx_heap_free(void *addr)
 {
+    heap_block_header *p;
+    
     /*
     * Avoid winx_dbg_xxx calls here
     * to avoid recursion.
     */
-    if(hGlobalHeap && addr)
-        (void)RtlFreeHeap(hGlobalHeap,0,addr);
+    if(hGlobalHeap && addr){
+        p = (heap_block_header *)addr - 1;
+        account_block(p->tag,(ULONG_PTR)p->size,1);
+        (void)RtlFreeHeap(hGlobalHeap,0,p);
+    }
+}
+
+/**
+ * @brief Retrieves statistics of the memory use.
+ * @param[out] hs pointer to the structure receiving
+ * current and peak amounts of memory allocated for each
+ * tag and for all of them, since the library initialization.
+ * @note Counters are read one by one while other
+ * threads may allocate memory, so they may disagree
+ * a bit. Peaks of different tags are reached at
+ * different times, so peaks of the totals are
+ * their upper bounds only.
+ */
+void winx_get_heap_statistics(winx_heap_statistics *hs)
+{
+    struct heap_counters *c;
+    winx_heap_usage *u;
+    int i;
+    
+    if(hs == NULL)
+        return;
+    
+    memset(&hs->total,0,sizeof(winx_heap_usage));
+    hs->total.name = "total";
+    for(i = 0; i < WINX_HEAP_TAGS; i++){
+        c = &heap_counters[i];
+        u = &hs->tags[i];
+        u->name = heap_tag_names[i];
+        u->bytes = (ULONG_PTR)c->bytes;
+        u->peak_bytes = (ULONG_PTR)c->peak_bytes;
+        u->allocations = (ULONG_PTR)c->allocations;
+        u->blocks = (ULONG_PTR)(c->allocations - c->releases);
+        u->peak_blocks = (ULONG_PTR)c->peak_blocks;
+        hs->total.bytes += u->bytes;
+        hs->total.peak_bytes += u->peak_bytes;
+        hs->total.blocks += u->blocks;
+        hs->total.peak_blocks += u->peak_blocks;
+        hs->total.allocations += u->allocations;
+    }
 }
 
 /**
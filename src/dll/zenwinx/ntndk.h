@@ -857,6 +857,20 @@ typedef struct _DISK_GEOMETRY {
     DWORD BytesPerSector;
 } DISK_GEOMETRY;
 
+#define IOCTL_VOLUME_BASE                     ((DWORD)'V')
+#define IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS  CTL_CODE(IOCTL_VOLUME_BASE, 0, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _DISK_EXTENT {
+    DWORD DiskNumber;
+    LARGE_INTEGER StartingOffset;
+    LARGE_INTEGER ExtentLength;
+} DISK_EXTENT;
+
+typedef struct _VOLUME_DISK_EXTENTS {
+    DWORD NumberOfDiskExtents;
+    DISK_EXTENT Extents[1];
+} VOLUME_DISK_EXTENTS;
+
 typedef enum _SYSTEM_INFORMATION_CLASS {
     SystemBasicInformation = 0,
     SystemCpuInformation = 1,
@@ -1327,6 +1341,7 @@ VOID        NTAPI    RtlFreeUnicodeString(PUNICODE_STRING);
 NTSTATUS    NTAPI    RtlGetVersion(OSVERSIONINFOW *);
 VOID        NTAPI    RtlInitAnsiString(PANSI_STRING,PCSZ);
 VOID        NTAPI    RtlInitUnicodeString(PUNICODE_STRING,PCWSTR);
+NTSTATUS    NTAPI    RtlMultiByteToUnicodeN(PWSTR,ULONG,PULONG,const CHAR *,ULONG);
 PRTL_USER_PROCESS_PARAMETERS NTAPI RtlNormalizeProcessParams(RTL_USER_PROCESS_PARAMETERS*);
 ULONG       NTAPI    RtlNtStatusToDosError(NTSTATUS);
 NTSTATUS    NTAPI    RtlQueryEnvironmentVariable_U(PWSTR,PUNICODE_STRING,PUNICODE_STRING);
@@ -0,0 +1,400 @@
+/*
+ *  ZenWINX - WIndows Native eXtended library.
+ *  Copyright (c) 2007-2015 Dmitri Arkhangelski (dmitriar@gmail.com).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/**
+ * @file pool.c
+ * @brief Pools of objects of fixed size.
+ * @details A pool cuts objects from slabs of 64 KB
+ * and keeps released objects in free lists to hand
+ * them out again, so the hottest small objects, like
+ * free volume regions and nodes of binary trees, don't
+ * go through the heap on each insertion and removal.
+ *
+ * Free lists are held by caches selected by the
+ * identifier of the calling thread. Each thread
+ * gets its own cache unless there are more threads
+ * than caches, so threads processing different volumes
+ * at once rarely wait for each other. Objects released
+ * by another thread simply move to its cache. Counters
+ * are kept by caches as well, so allocations touch no
+ * data shared by all the threads.
+ *
+ * Slabs are returned to the heap by winx_trim_pools
+ * once all the objects of the pool are released.
+ * @addtogroup Pools
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+#include "prb.h"
+
+/*
+* Uncomment it to compare the pools against
+* the heap on the library initialization.
+*/
+//#define TEST_POOLS
+
+/* size of slabs the objects are cut from */
+#define POOL_SLAB_SIZE (64 * 1024)
+
+/* all the objects are aligned on this boundary */
+#define POOL_ALIGNMENT sizeof(ULONGLONG)
+
+#define current_thread_id() \
+    ((ULONG)(DWORD_PTR)(NtCurrentTeb()->ClientId.UniqueThread))
+
+/*
+* Slabs are chained through the header
+* of the same size as the object alignment.
+*/
+typedef union _pool_slab {
+    union _pool_slab *next;
+    ULONGLONG alignment;
+} pool_slab;
+
+/* released objects are chained through their first bytes */
+typedef struct _pool_object {
+    struct _pool_object *next;
+} pool_object;
+
+/* nodes and tables of binary trees share the same pool */
+#define TREE_OBJECT_SIZE \
+    max(sizeof(struct prb_node),sizeof(struct prb_table))
+
+/*
+* Pools of the library; they are used by
+* routines of ftw.c, volume.c and prb.c.
+*/
+winx_pool winx_blockmap_pool = WINX_POOL_INITIALIZER(
+    "blockmaps",sizeof(winx_blockmap),WINX_HEAP_TAG_BLOCKMAP);
+winx_pool winx_region_pool = WINX_POOL_INITIALIZER(
+    "volume regions",sizeof(winx_volume_region),WINX_HEAP_TAG_REGION);
+winx_pool winx_tree_pool = WINX_POOL_INITIALIZER(
+    "tree nodes",TREE_OBJECT_SIZE,WINX_HEAP_TAG_TREE);
+
+static winx_pool *pools[] = {
+    &winx_blockmap_pool,
+    &winx_region_pool,
+    &winx_tree_pool
+};
+
+#define N_POOLS (sizeof(pools) / sizeof(winx_pool *))
+
+/**
+ * @internal
+ * @brief Acquires a lock of the pool.
+ * @details Locks are held for a few
+ * instructions, so the waiting thread
+ * just yields its time slice.
+ */
+static void acquire_lock(volatile LONG *lock)
+{
+    while(winx_atomic_compare_exchange(lock,1,0) != 0)
+        winx_sleep(0);
+}
+
+/**
+ * @internal
+ * @brief Releases a lock of the pool.
+ */
+static void release_lock(volatile LONG *lock)
+{
+    (void)winx_atomic_exchange(lock,0);
+}
+
+/**
+ * @internal
+ * @brief Returns the cache
+ * of the calling thread.
+ */
+static winx_pool_cache *get_cache(winx_pool *pool)
+{
+    /* identifiers of threads are multiples of four */
+    return &pool->caches[(current_thread_id() >> 2) % WINX_POOL_CACHES];
+}
+
+/**
+ * @internal
+ * @brief Counts objects of the pool in use.
+ * @note Caches must be locked to get
+ * the exact number.
+ */
+static LONG count_objects_in_use(winx_pool *pool)
+{
+    LONG n = 0;
+    int i;
+
+    for(i = 0; i < WINX_POOL_CACHES; i++)
+        n += pool->caches[i].c.in_use;
+    return n;
+}
+
+/**
+ * @internal
+ * @brief Cuts a new slab into objects
+ * and adds them to the cache.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int add_slab(winx_pool *pool,winx_pool_cache *cache)
+{
+    pool_slab *slab;
+    pool_object *object;
+    size_t size, i, n;
+
+    size = (pool->object_size + POOL_ALIGNMENT - 1) & ~(POOL_ALIGNMENT - 1);
+    n = POOL_SLAB_SIZE / size;
+
+    slab = winx_malloc_tagged(sizeof(pool_slab) + n * size,pool->tag);
+    if(slab == NULL) return (-1);
+
+    acquire_lock(&pool->lock);
+    slab->next = (pool_slab *)pool->slabs;
+    pool->slabs = (void *)slab;
+    pool->slab_count ++;
+    release_lock(&pool->lock);
+
+    /* objects are handed out in order of their addresses */
+    for(i = n; i > 0; i--){
+        object = (pool_object *)((char *)(slab + 1) + (i - 1) * size);
+        object->next = (pool_object *)cache->c.free_list;
+        cache->c.free_list = (void *)object;
+    }
+    return 0;
+}
+
+/**
+ * @brief Allocates an object from the pool.
+ * @param[in] pool the pool.
+ * @return Address of the object, NULL
+ * indicates failure. The object is
+ * not initialized.
+ * @note If there is not enough memory, the
+ * killer registered by winx_set_killer is
+ * called, as winx_malloc does, and NULL
+ * is returned then.
+ */
+void *winx_pool_alloc(winx_pool *pool)
+{
+    winx_pool_cache *cache;
+    pool_object *object;
+
+    if(pool == NULL)
+        return NULL;
+
+    cache = get_cache(pool);
+    acquire_lock(&cache->c.lock);
+    if(cache->c.free_list == NULL){
+        if(add_slab(pool,cache) < 0){
+            release_lock(&cache->c.lock);
+            return NULL;
+        }
+    }
+    object = (pool_object *)cache->c.free_list;
+    cache->c.free_list = (void *)object->next;
+    cache->c.in_use ++;
+    cache->c.allocations ++;
+    release_lock(&cache->c.lock);
+    return (void *)object;
+}
+
+/**
+ * @brief Releases an object allocated
+ * by winx_pool_alloc from the same pool.
+ */
+void winx_pool_free(winx_pool *pool,void *p)
+{
+    winx_pool_cache *cache;
+    pool_object *object = (pool_object *)p;
+
+    if(pool == NULL || p == NULL)
+        return;
+
+    cache = get_cache(pool);
+    acquire_lock(&cache->c.lock);
+    object->next = (pool_object *)cache->c.free_list;
+    cache->c.free_list = (void *)object;
+    cache->c.in_use --;
+    release_lock(&cache->c.lock);
+}
+
+/**
+ * @brief Returns slabs of the pool to the
+ * heap if all its objects are released.
+ * @return Nonzero value if the slabs
+ * have been released, zero otherwise.
+ */
+int winx_pool_trim(winx_pool *pool)
+{
+    pool_slab *slab, *next;
+    ULONGLONG allocations = 0;
+    int i, released = 0;
+
+    if(pool == NULL)
+        return 0;
+
+    /* stop allocations in all the caches */
+    for(i = 0; i < WINX_POOL_CACHES; i++)
+        acquire_lock(&pool->caches[i].c.lock);
+
+    if(count_objects_in_use(pool) == 0 && pool->slabs != NULL){
+        for(i = 0; i < WINX_POOL_CACHES; i++)
+            allocations += pool->caches[i].c.allocations;
+        dtrace("%s pool: %I64u allocations served by %u slabs",
+            pool->name,allocations,(UINT)pool->slab_count);
+        acquire_lock(&pool->lock);
+        for(slab = (pool_slab *)pool->slabs; slab; slab = next){
+            next = slab->next;
+            winx_free(slab);
+        }
+        pool->slabs = NULL;
+        pool->slab_count = 0;
+        release_lock(&pool->lock);
+        for(i = 0; i < WINX_POOL_CACHES; i++)
+            pool->caches[i].c.free_list = NULL;
+        released = 1;
+    }
+
+    for(i = WINX_POOL_CACHES - 1; i >= 0; i--)
+        release_lock(&pool->caches[i].c.lock);
+    return released;
+}
+
+/**
+ * @brief Returns slabs of all the pools
+ * of the library having no objects in use
+ * to the heap.
+ * @note Intended to be called once
+ * the job releases its data.
+ */
+void winx_trim_pools(void)
+{
+    int i;
+
+    for(i = 0; i < N_POOLS; i++)
+        (void)winx_pool_trim(pools[i]);
+}
+
+/**
+ * @internal
+ * @brief Forgets all the pools of the library.
+ * @note Must be called before the destruction
+ * of the global heap. Objects still in use are
+ * released along with the heap.
+ */
+void winx_destroy_pools(void)
+{
+    LONG n;
+    int i, j;
+
+    for(i = 0; i < N_POOLS; i++){
+        n = count_objects_in_use(pools[i]);
+        if(n){
+            etrace("%s pool: %d objects are still in use",
+                pools[i]->name,(int)n);
+        }
+        for(j = 0; j < WINX_POOL_CACHES; j++)
+            pools[i]->caches[j].c.in_use = 0;
+        (void)winx_pool_trim(pools[i]);
+        for(j = 0; j < WINX_POOL_CACHES; j++)
+            pools[i]->caches[j].c.free_list = NULL;
+        pools[i]->slabs = NULL;
+        pools[i]->slab_count = 0;
+    }
+}
+
+#ifdef TEST_POOLS
+
+#define TEST_POOLS_BATCH    1024
+#define TEST_POOLS_BATCHES  256
+
+/**
+ * @internal
+ * @brief Allocates and releases batches of
+ * objects either from the pool or from the heap.
+ * @details Latency of allocations and releases
+ * is collected per batch, in nanoseconds per object.
+ */
+static void benchmark_pool(winx_pool *pool,int use_heap,
+    winx_histogram *allocs,winx_histogram *frees,ULONGLONG *total_time)
+{
+    void *objects[TEST_POOLS_BATCH];
+    ULONGLONG t0, t1, t2;
+    int i, j;
+
+    for(i = 0; i < TEST_POOLS_BATCHES; i++){
+        t0 = winx_utime();
+        for(j = 0; j < TEST_POOLS_BATCH; j++){
+            if(use_heap) objects[j] = winx_malloc_tagged(pool->object_size,pool->tag);
+            else objects[j] = winx_pool_alloc(pool);
+        }
+        t1 = winx_utime();
+        /* release in reverse order, as lists are usually destroyed from the head */
+        for(j = TEST_POOLS_BATCH - 1; j >= 0; j--){
+            if(use_heap) winx_free(objects[j]);
+            else winx_pool_free(pool,objects[j]);
+        }
+        t2 = winx_utime();
+        winx_histogram_add(allocs,(t1 - t0) * 1000 / TEST_POOLS_BATCH);
+        winx_histogram_add(frees,(t2 - t1) * 1000 / TEST_POOLS_BATCH);
+        *total_time += t2 - t0;
+    }
+}
+
+#endif /* TEST_POOLS */
+
+/**
+ * @internal
+ * @brief Compares the pools against the heap.
+ * @details Results are saved to the debugging log:
+ * the allocation rate, in operations per second,
+ * and the median and 99th percentile of latency
+ * of allocations and releases.
+ * @note Does nothing unless TEST_POOLS is defined.
+ */
+void winx_test_pools(void)
+{
+#ifdef TEST_POOLS
+    winx_histogram allocs, frees;
+    ULONGLONG time, rate;
+    char *path[] = { "pool", "heap" };
+    int i, use_heap;
+
+    dtrace("test of pools started");
+    for(i = 0; i < N_POOLS; i++){
+        for(use_heap = 0; use_heap < 2; use_heap++){
+            memset(&allocs,0,sizeof(winx_histogram));
+            memset(&frees,0,sizeof(winx_histogram));
+            time = 0;
+            benchmark_pool(pools[i],use_heap,&allocs,&frees,&time);
+            rate = (ULONGLONG)TEST_POOLS_BATCH * TEST_POOLS_BATCHES * 2 * 1000000 / max(time,1);
+            dtrace("%s of %u bytes, %s: %I64u ops/s, "
+                "alloc p50/p99 = %I64u/%I64u ns, free p50/p99 = %I64u/%I64u ns",
+                pools[i]->name,(UINT)pools[i]->object_size,path[use_heap],rate,
+                winx_histogram_percentile(&allocs,50),winx_histogram_percentile(&allocs,99),
+                winx_histogram_percentile(&frees,50),winx_histogram_percentile(&frees,99));
+        }
+        (void)winx_pool_trim(pools[i]);
+    }
+    dtrace("test of pools completed");
+#endif /* TEST_POOLS */
+}
+
+/** @} */
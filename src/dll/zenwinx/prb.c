@@ -39,8 +39,11 @@
 #include "prb.h"
 #include "ntndk.h"
 #include "zenwinx.h"
-#define malloc winx_malloc
-#define free winx_free
+
+/* nodes and tables are cut from the pool of the same size */
+extern winx_pool winx_tree_pool;
+#define malloc(n) ((n) <= winx_tree_pool.object_size ? winx_pool_alloc(&winx_tree_pool) : NULL)
+#define free(p) winx_pool_free(&winx_tree_pool,p)
 
 /* Creates and returns a new table
    with comparison function |compare| using parameter |param|
@@ -889,7 +892,8 @@ prb_free (struct libavl_allocator *allocator, void *block)
   free (block);
 }
 
-/* Default memory allocator that uses |malloc()| and |free()|. */
+/* Default memory allocator that uses |malloc()| and |free()|,
+   that is, the pool of tree nodes. */
 struct libavl_allocator prb_allocator_default =
   {
     prb_malloc,
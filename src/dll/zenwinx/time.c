@@ -164,6 +164,37 @@ ULONGLONG winx_xtime(void)
     return xtime;
 }
 
+/**
+ * @brief winx_xtime analog, but
+ * returns time in microseconds.
+ * @return Time, in microseconds.
+ * Zero indicates failure.
+ * @note Intended for measuring latency
+ * of short operations.
+ */
+ULONGLONG winx_utime(void)
+{
+    NTSTATUS status;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    ULONGLONG utime;
+    
+    status = NtQueryPerformanceCounter(&counter,&frequency);
+    if(!NT_SUCCESS(status) || !frequency.QuadPart){
+        /* winx_xtime logs the failure */
+        return 0;
+    }
+    utime = 1000 * 1000 * counter.QuadPart;
+    if(utime / (1000 * 1000) != counter.QuadPart){
+        /* overflow occured; let's divide first */
+        utime = 1000 * 1000 * (counter.QuadPart / frequency.QuadPart) + \
+            (1000 * 1000 * (counter.QuadPart % frequency.QuadPart)) / frequency.QuadPart;
+    } else {
+        utime /= frequency.QuadPart;
+    }
+    return utime;
+}
+
 /**
  * @brief Retrieves the current system time
  * (UTC) in a human understandable format.
@@ -27,6 +27,12 @@
 #include "ntndk.h"
 #include "zenwinx.h"
 
+/* free regions are cut from the pool */
+extern winx_pool winx_region_pool;
+
+/* more extents are rarely met even on spanned volumes */
+#define MAX_VOLUME_DISK_EXTENTS 32
+
 /**
  * @internal
  * @brief Opens root directory of the volume.
@@ -461,6 +467,42 @@ int winx_vflush(char volume_letter)
     return result;
 }
 
+/**
+ * @brief Defines physical devices the volume resides on.
+ * @param[in] volume_letter the volume letter.
+ * @return Bit mask of numbers of the physical disks
+ * containing the volume; disk N corresponds to
+ * bit N, disks numbered above 62 share bit 62.
+ * Zero indicates that the devices cannot be defined,
+ * like for network drives and some virtual disks.
+ * @note Volumes spanned across several disks
+ * have several bits set.
+ */
+ULONGLONG winx_get_volume_disks(char volume_letter)
+{
+    struct {
+        VOLUME_DISK_EXTENTS vde;
+        DISK_EXTENT extents[MAX_VOLUME_DISK_EXTENTS - 1];
+    } buffer;
+    WINX_FILE *f;
+    ULONGLONG disks = 0;
+    DWORD i, n;
+    
+    f = winx_vopen(volume_letter);
+    if(f == NULL) return 0;
+    
+    if(winx_ioctl(f,IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS,
+      "winx_get_volume_disks: disk extents request",
+      NULL,0,&buffer,sizeof(buffer),NULL) >= 0){
+        n = min(buffer.vde.NumberOfDiskExtents,MAX_VOLUME_DISK_EXTENTS);
+        for(i = 0; i < n; i++){
+            disks |= (ULONGLONG)1 << min(buffer.vde.Extents[i].DiskNumber,62);
+        }
+    }
+    winx_fclose(f);
+    return disks;
+}
+
 /**
  * @brief Retrieves the list of free regions on the volume.
  * @param[in] volume_letter the volume letter.
@@ -499,7 +541,7 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
     volume_letter = winx_toupper(volume_letter);
     
     /* allocate memory */
-    bitmap = winx_malloc(BITMAPSIZE);
+    bitmap = winx_malloc_tagged(BITMAPSIZE,WINX_HEAP_TAG_BUFFER);
     
     /* open volume */
     f = winx_vopen(volume_letter);
@@ -527,7 +569,7 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
             if(flags & WINX_GVR_ALLOW_PARTIAL_SCAN){
                 return rlist;
             } else {
-                winx_list_destroy((list_entry **)(void *)&rlist);
+                winx_list_destroy_pooled((list_entry **)(void *)&rlist,&winx_region_pool);
                 return NULL;
             }
         }
@@ -543,8 +585,8 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
                 /* cluster isn't free */
                 if(free_rgn_start != LLINVALID){
                     /* add free region to the list */
-                    rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-                        (list_entry *)rgn,sizeof(winx_volume_region));
+                    rgn = (winx_volume_region *)winx_list_insert_pooled((list_entry **)(void *)&rlist,
+                        (list_entry *)rgn,&winx_region_pool);
                     rgn->lcn = free_rgn_start;
                     rgn->length = start + i - free_rgn_start;
                     if(cb != NULL){
@@ -562,8 +604,8 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
 
     if(free_rgn_start != LLINVALID){
         /* add free region to the list */
-        rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-            (list_entry *)rgn,sizeof(winx_volume_region));
+        rgn = (winx_volume_region *)winx_list_insert_pooled((list_entry **)(void *)&rlist,
+            (list_entry *)rgn,&winx_region_pool);
         rgn->lcn = free_rgn_start;
         rgn->length = start + i - free_rgn_start;
         if(cb != NULL){
@@ -614,8 +656,8 @@ winx_volume_region *winx_add_volume_region(winx_volume_region *rlist,
             rprev->length += length;
             if(rprev->lcn + rprev->length == rprev->next->lcn){
                 rprev->length += rprev->next->length;
-                winx_list_remove((list_entry **)(void *)&rlist,
-                    (list_entry *)rprev->next);
+                winx_list_remove_pooled((list_entry **)(void *)&rlist,
+                    (list_entry *)rprev->next,&winx_region_pool);
             }
             return rlist;
         }
@@ -632,8 +674,8 @@ winx_volume_region *winx_add_volume_region(winx_volume_region *rlist,
         }
     }
     
-    r = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-        (list_entry *)rprev,sizeof(winx_volume_region));
+    r = (winx_volume_region *)winx_list_insert_pooled((list_entry **)(void *)&rlist,
+        (list_entry *)rprev,&winx_region_pool);
     r->lcn = lcn;
     r->length = length;
     return rlist;
@@ -667,8 +709,8 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
                 *        |-r-|
                 */
                 remaining_clusters -= r->length;
-                winx_list_remove((list_entry **)(void *)&rlist,
-                    (list_entry *)r);
+                winx_list_remove_pooled((list_entry **)(void *)&rlist,
+                    (list_entry *)r,&winx_region_pool);
                 goto next_region;
             }
             if(r->lcn < lcn && (r->lcn + r->length) > lcn && \
@@ -689,8 +731,8 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
                 */
                 new_lcn = lcn + length;
                 new_length = r->lcn + r->length - (lcn + length);
-                winx_list_remove((list_entry **)(void *)&rlist,
-                    (list_entry *)r);
+                winx_list_remove_pooled((list_entry **)(void *)&rlist,
+                    (list_entry *)r,&winx_region_pool);
                 rlist = winx_add_volume_region(rlist,new_lcn,new_length);
                 goto next_region;
             }
@@ -720,7 +762,7 @@ next_region:
  */
 void winx_release_free_volume_regions(winx_volume_region *rlist)
 {
-    winx_list_destroy((list_entry **)(void *)&rlist);
+    winx_list_destroy_pooled((list_entry **)(void *)&rlist,&winx_region_pool);
 }
 
 /** @} */
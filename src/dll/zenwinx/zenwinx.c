@@ -32,6 +32,8 @@ int winx_create_global_heap(void);
 void winx_destroy_global_heap(void);
 int winx_dbg_init(void);
 void winx_dbg_close(void);
+void winx_destroy_pools(void);
+void winx_test_pools(void);
 void MarkWindowsBootAsSuccessful(void);
 char *winx_get_status_description(unsigned long status);
 void kb_close(void);
@@ -50,6 +52,7 @@ int winx_init_library(void)
         return (-1);
     if(winx_dbg_init() < 0)
         return (-1);
+    winx_test_pools();
     return 0;
 }
 
@@ -62,6 +65,7 @@ int winx_init_library(void)
 void winx_unload_library(void)
 {
     winx_dbg_close();
+    winx_destroy_pools();
     winx_destroy_global_heap();
 }
 
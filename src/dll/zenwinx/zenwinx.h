@@ -187,9 +187,13 @@ typedef struct _winx_file_disposition {
     winx_blockmap *blockmap;           /* map of blocks */
 } winx_file_disposition;
 
+/* memory of files found by a single scan; opaque */
+typedef struct _winx_file_storage winx_file_storage;
+
 typedef struct _winx_file_internal_info {
     ULONGLONG BaseMftId;
     ULONGLONG ParentDirectoryMftId;
+    winx_file_storage *storage; /* storage of the scan, NULL for entries allocated from the heap */
 } winx_file_internal_info;
 
 /*
@@ -204,12 +208,42 @@ typedef struct _winx_file_info {
     unsigned long flags;               /* combination of FILE_ATTRIBUTE_xxx flags defined in winnt.h */
     winx_file_disposition disp;        /* information about file fragments and their disposition */
     unsigned long user_defined_flags;  /* combination of flags defined by the caller */
+    unsigned long user_defined_id;     /* identifier assigned by the caller */
     winx_file_internal_info internal;  /* internal information used by ftw_scan_disk support routines */
     ULONGLONG creation_time;           /* the file creation time */
     ULONGLONG last_modification_time;  /* the time of the last file modification */
     ULONGLONG last_access_time;        /* the time of the last file access */
 } winx_file_info;
 
+/*
+* Latency histogram; bucket 0 counts zero values,
+* bucket i counts values in [2^(i-1), 2^i) range;
+* the last bucket counts all bigger values as well.
+*/
+#define WINX_HISTOGRAM_BUCKETS 32
+
+typedef struct _winx_histogram {
+    ULONGLONG buckets[WINX_HISTOGRAM_BUCKETS];
+    ULONGLONG count;                   /* number of values */
+    ULONGLONG sum;                     /* sum of values */
+    ULONGLONG min;                     /* the least value */
+    ULONGLONG max;                     /* the biggest value */
+} winx_histogram;
+
+/*
+* Statistics gathered by winx_scan_disk, in microseconds;
+* bounds of the stages are winx_utime values, zero when
+* the stage has not been passed.
+*/
+typedef struct _winx_ftw_statistics {
+    winx_histogram mft_record_reads;   /* reading of single MFT records */
+    winx_histogram path_builds;        /* building of full paths of files */
+    ULONGLONG path_building_start;     /* bounds of the path building stage */
+    ULONGLONG path_building_end;
+    ULONGLONG filtering_start;         /* bounds of the filtering stage */
+    ULONGLONG filtering_end;
+} winx_ftw_statistics;
+
 typedef int  (*ftw_filter_callback)(winx_file_info *f,void *user_defined_data);
 typedef void (*ftw_progress_callback)(winx_file_info *f,void *user_defined_data);
 typedef int  (*ftw_terminator)(void *user_defined_data);
@@ -218,19 +252,24 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
 
 winx_file_info *winx_scan_disk(char volume_letter, int flags,
-        ftw_filter_callback fcb,ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
+        ftw_filter_callback fcb,ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data,
+        winx_ftw_statistics *stats);
 
 void winx_ftw_release(winx_file_info *filelist);
 #define winx_scan_disk_release(f) winx_ftw_release(f)
 
 int winx_ftw_dump_file(winx_file_info *f,ftw_terminator t,void *user_defined_data);
 
+winx_blockmap *winx_blockmap_insert(winx_file_info *f,winx_blockmap **phead,winx_blockmap *prev);
+void winx_blockmap_destroy(winx_file_info *f,winx_blockmap **phead);
+
 #define WINX_OPEN_FOR_DUMP       0x1 /* open for FSCTL_GET_RETRIEVAL_POINTERS */
 #define WINX_OPEN_FOR_BASIC_INFO 0x2 /* open for NtQueryInformationFile(FILE_BASIC_INFORMATION) */
 #define WINX_OPEN_FOR_MOVE       0x4 /* open for FSCTL_MOVE_FILE */
 
 #ifdef _NTNDK_H_
 NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle);
+NTSTATUS winx_defrag_vopen(char volume_letter,HANDLE *phandle);
 void winx_defrag_fclose(HANDLE h);
 #endif
 
@@ -253,9 +292,19 @@ typedef struct _list_entry {
 } list_entry;
 
 list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size);
+list_entry *winx_list_insert_tagged(list_entry **phead,list_entry *prev,long size,int tag);
 void winx_list_remove(list_entry **phead,list_entry *item);
 void winx_list_destroy(list_entry **phead);
 
+/* pooled items; pools are defined in pool.c section */
+struct _winx_pool;
+list_entry *winx_list_insert_pooled(list_entry **phead,list_entry *prev,struct _winx_pool *pool);
+void winx_list_remove_pooled(list_entry **phead,list_entry *item,struct _winx_pool *pool);
+void winx_list_destroy_pooled(list_entry **phead,struct _winx_pool *pool);
+
+void winx_list_link(list_entry **phead,list_entry *prev,list_entry *item);
+void winx_list_unlink(list_entry **phead,list_entry *item);
+
 /* lock.c */
 typedef struct _winx_spin_lock {
     HANDLE hEvent;
@@ -266,12 +315,51 @@ int winx_acquire_spin_lock(winx_spin_lock *sl,int msec);
 int winx_release_spin_lock(winx_spin_lock *sl);
 void winx_destroy_spin_lock(winx_spin_lock *sl);
 
+LONG winx_atomic_add(volatile LONG *target,LONG value);
+LONG winx_atomic_exchange(volatile LONG *target,LONG value);
+LONG winx_atomic_compare_exchange(volatile LONG *target,LONG value,LONG expected);
+ULONG_PTR winx_atomic_add_ptr(volatile ULONG_PTR *target,ULONG_PTR value);
+ULONG_PTR winx_atomic_compare_exchange_ptr(volatile ULONG_PTR *target,ULONG_PTR value,ULONG_PTR expected);
+
 /* mem.c */
 void *winx_heap_alloc(size_t size,int flags);
 void winx_heap_free(void *addr);
 
 /* flags for winx_heap_alloc */
 #define MALLOC_ABORT_ON_FAILURE 0x1
+#define MALLOC_TAG(tag)         ((tag) << 8)
+#define MALLOC_GET_TAG(flags)   (((flags) >> 8) & 0xff)
+
+/*
+* Tags define subsystems the memory
+* is accounted for by winx_heap_alloc.
+*/
+#define WINX_HEAP_TAG_MISC          0 /* untagged blocks */
+#define WINX_HEAP_TAG_FILE_INFO     1 /* winx_file_info structures */
+#define WINX_HEAP_TAG_PATH          2 /* names and paths of files */
+#define WINX_HEAP_TAG_BLOCKMAP      3 /* winx_blockmap structures */
+#define WINX_HEAP_TAG_TREE          4 /* nodes of binary trees */
+#define WINX_HEAP_TAG_REGION        5 /* winx_volume_region structures */
+#define WINX_HEAP_TAG_LIST          6 /* entries of other lists */
+#define WINX_HEAP_TAG_BUFFER        7 /* buffers of disk reads */
+#define WINX_HEAP_TAG_CLUSTER_MAP   8 /* cluster map of the engine */
+#define WINX_HEAP_TAGS              9
+
+typedef struct _winx_heap_usage {
+    char *name;                /* name of the tag */
+    ULONGLONG bytes;           /* amount of memory in use, in bytes */
+    ULONGLONG peak_bytes;      /* the maximum amount of memory used */
+    ULONGLONG blocks;          /* number of blocks in use */
+    ULONGLONG peak_blocks;     /* the maximum number of blocks used */
+    ULONGLONG allocations;     /* number of blocks allocated totally */
+} winx_heap_usage;
+
+typedef struct _winx_heap_statistics {
+    winx_heap_usage tags[WINX_HEAP_TAGS];
+    winx_heap_usage total;
+} winx_heap_statistics;
+
+void winx_get_heap_statistics(winx_heap_statistics *hs);
 
 /*
 * If a small amount of memory is needed,
@@ -292,11 +380,72 @@ void winx_heap_free(void *addr);
 /* this form is tolerant for allocation failures */
 #define winx_tmalloc(n) winx_heap_alloc(n,0)
 
+/* the same, but accounted for the specified subsystem */
+#define winx_malloc_tagged(n,tag) winx_heap_alloc(n,MALLOC_ABORT_ON_FAILURE | MALLOC_TAG(tag))
+#define winx_tmalloc_tagged(n,tag) winx_heap_alloc(n,MALLOC_TAG(tag))
+
 #define winx_free winx_heap_free
 
 typedef int (*winx_killer)(size_t n);
 void winx_set_killer(winx_killer k);
 
+/* arena.c */
+#define WINX_ARENA_SIZE_CLASSES     64 /* released blocks up to 512 bytes are reused */
+#define WINX_ARENA_MIN_CHUNK_SIZE   0x1000
+
+typedef struct _winx_arena {
+    void *chunks;               /* list of chunks allocated */
+    ULONG chunk_count;          /* number of chunks allocated */
+    char *free_space;           /* free space of the current chunk */
+    size_t free_bytes;          /* size of the free space, in bytes */
+    size_t chunk_size;          /* size of regular chunks, in bytes */
+    size_t recycled_bytes;      /* total size of blocks kept for reuse */
+    int tag;                    /* tag the chunks are accounted for */
+    void *free_lists[WINX_ARENA_SIZE_CLASSES]; /* released blocks, by size */
+} winx_arena;
+
+void winx_arena_init(winx_arena *a,size_t chunk_size,int tag);
+void *winx_arena_alloc(winx_arena *a,size_t size);
+void winx_arena_free(winx_arena *a,void *p,size_t size);
+void winx_arena_release(winx_arena *a);
+
+/* pool.c */
+#define WINX_POOL_CACHES            16
+#define WINX_POOL_CACHE_LINE        64
+
+/*
+* Counters of caches are protected by their locks.
+* Objects may be released to another cache, so
+* only the sum of in_use counters is meaningful.
+* The union pads each cache to the full line.
+*/
+typedef union _winx_pool_cache {
+    struct {
+        volatile LONG lock;     /* nonzero if the cache is in use */
+        void *free_list;        /* objects ready to be handed out */
+        LONG in_use;            /* objects allocated minus objects released */
+        ULONGLONG allocations;  /* number of objects allocated totally */
+    } c;
+    char padding[WINX_POOL_CACHE_LINE];
+} winx_pool_cache;
+
+typedef struct _winx_pool {
+    char *name;                 /* name of the pool */
+    size_t object_size;         /* size of objects, in bytes */
+    int tag;                    /* tag the slabs are accounted for */
+    volatile LONG lock;         /* protects the list of slabs */
+    void *slabs;                /* list of slabs allocated */
+    ULONG slab_count;           /* number of slabs allocated */
+    winx_pool_cache caches[WINX_POOL_CACHES]; /* caches of threads */
+} winx_pool;
+
+#define WINX_POOL_INITIALIZER(name,size,tag) { name, size, tag }
+
+void *winx_pool_alloc(winx_pool *pool);
+void winx_pool_free(winx_pool *pool,void *p);
+int winx_pool_trim(winx_pool *pool);
+void winx_trim_pools(void);
+
 /* misc.c */
 void winx_sleep(int msec);
 
@@ -454,6 +603,12 @@ ULONGLONG winx_str2time(char *string);
 int winx_time2str(ULONGLONG time,char *buffer,int size);
 ULONGLONG winx_xtime(void);
 #define winx_xtime_nsec() (winx_xtime() * 1000 * 1000)
+ULONGLONG winx_utime(void);
+
+/* histogram.c */
+void winx_histogram_add(winx_histogram *h,ULONGLONG value);
+void winx_histogram_merge(winx_histogram *dst,winx_histogram *src);
+ULONGLONG winx_histogram_percentile(winx_histogram *h,int percentile);
 
 typedef struct _winx_time {
     short year;        // range [1601...]
@@ -519,6 +674,7 @@ typedef struct _winx_volume_information {
 int winx_get_volume_information(char volume_letter,winx_volume_information *v);
 WINX_FILE *winx_vopen(char volume_letter);
 int winx_vflush(char volume_letter);
+ULONGLONG winx_get_volume_disks(char volume_letter);
 
 /* winx_get_free_volume_regions flags */
 #define WINX_GVR_ALLOW_PARTIAL_SCAN  0x1
@@ -172,11 +172,10 @@ void RedrawProgress(udefrag_progress_info *pi)
 }
 
 /**
- * @brief Updates progress information
- * on the screen and raises a job termination
+ * @brief Raises a job termination
  * when Esc\Break keys are pressed.
  */
-void update_progress(udefrag_progress_info *pi, void *p)
+static void check_break_keys(void)
 {
     KBD_RECORD kbd_rec;
     int escape_detected = 0;
@@ -198,6 +197,16 @@ void update_progress(udefrag_progress_info *pi, void *p)
         if(escape_detected || break_detected)
             abort_flag = 1;
     }
+}
+
+/**
+ * @brief Updates progress information
+ * on the screen and raises a job termination
+ * when Esc\Break keys are pressed.
+ */
+void update_progress(udefrag_progress_info *pi, void *p)
+{
+    check_break_keys();
     RedrawProgress(pi);
 }
 
@@ -250,6 +259,10 @@ void ProcessVolume(char letter)
         winx_printf("optimize mft on %c: ...\n",letter);
         message = "MFT optimization";
         break;
+    case FREE_SPACE_CONSOLIDATION_JOB:
+        winx_printf("consolidate free space on %c: ...\n",letter);
+        message = "Free space consolidation";
+        break;
     }
     /* display the time limit if possible */
     buffer = winx_getenv(L"UD_TIME_LIMIT");
@@ -267,6 +280,123 @@ void ProcessVolume(char letter)
     }
 }
 
+/**
+ * @brief Updates the aggregate progress
+ * of multiple jobs on the screen.
+ * @note Called by multiple threads.
+ */
+static void update_total_progress(char letter,udefrag_progress_info *pi,
+    udefrag_progress_info *total,void *p)
+{
+    winx_spin_lock *lock = (winx_spin_lock *)p;
+    char s[MAX_LINE_WIDTH + 1];
+    char format[16];
+    char *results;
+    int p1, p2;
+
+    if(winx_acquire_spin_lock(lock,INFINITE) < 0) return;
+
+    /* Esc and Break keys are checked here as well */
+    check_break_keys();
+
+    if(pi->completion_status != 0 && !abort_flag){
+        _snprintf(format,sizeof(format),"\r%%-%us",progress_line_length);
+        format[sizeof(format) - 1] = 0;
+        _snprintf(s,sizeof(s),"%c: 100.00%% completed, fragmented/total = %lu/%lu",
+            letter,pi->fragmented,pi->files);
+        s[sizeof(s) - 1] = 0;
+        winx_printf(format,s);
+        winx_printf("\n");
+        results = udefrag_get_results(pi);
+        if(results){
+            winx_printf("\n%s\n",results);
+            udefrag_release_results(results);
+        }
+    }
+
+    p1 = (int)(__int64)(total->percentage * 100.00);
+    p2 = p1 % 100;
+    p1 = p1 / 100;
+    _snprintf(s,sizeof(s),"Total:    %3u.%02u%% %s, %u disks done, fragmented/total = %lu/%lu",
+        p1,p2,abort_flag ? "aborted" : "completed",total->pass_number,total->fragmented,total->files);
+    s[sizeof(s) - 1] = 0;
+    _snprintf(format,sizeof(format),"\r%%-%us",progress_line_length);
+    format[sizeof(format) - 1] = 0;
+    winx_printf(format,s);
+    progress_line_length = (int)strlen(s);
+
+    winx_release_spin_lock(lock);
+}
+
+/**
+ * @brief Processes multiple volumes.
+ * @details Volumes residing on different
+ * physical disks are processed simultaneously.
+ */
+static void ProcessVolumes(char *letters)
+{
+    char valid_letters[MAX_DOS_DRIVES + 1];
+    winx_spin_lock *lock;
+    int i, n = 0, status;
+
+    if(strlen(letters) < 2){
+        if(letters[0]) ProcessVolume(letters[0]);
+        return;
+    }
+
+    for(i = 0; letters[i]; i++){
+        status = udefrag_validate_volume(letters[i],FALSE);
+        if(status < 0){
+            winx_printf("\nThe disk %c: cannot be processed!\n",letters[i]);
+            if(status == UDEFRAG_UNKNOWN_ERROR)
+                winx_printf("Disk is missing or some unknown error has been encountered.\n");
+            else
+                winx_printf("%s\n",udefrag_get_error_description(status));
+            continue;
+        }
+        valid_letters[n++] = letters[i];
+    }
+    valid_letters[n] = 0;
+    if(n == 0) return;
+
+    lock = winx_init_spin_lock("udefrag_native_progress");
+    if(lock == NULL){
+        /* process them one by one */
+        for(i = 0; i < n && !abort_flag; i++)
+            ProcessVolume(valid_letters[i]);
+        return;
+    }
+
+    progress_line_length = 0;
+    winx_printf("\nPreparing to process %s ...\n",valid_letters);
+    winx_printf(BREAK_MESSAGE);
+    status = udefrag_start_jobs(valid_letters,current_job,current_job_flags,0,
+        update_total_progress,terminator,(void *)lock);
+    winx_printf("\n");
+    if(status < 0){
+        winx_printf("\nProcessing failed!\n");
+        winx_printf("%s\n",udefrag_get_error_description(status));
+    }
+    winx_destroy_spin_lock(lock);
+}
+
+/**
+ * @brief Adds the volume letter
+ * to the list unless it is there.
+ */
+static void AddVolumeLetter(char *letters,char letter)
+{
+    int n;
+
+    letter = winx_toupper(letter);
+    if(strchr(letters,letter)) return;
+    n = (int)strlen(letters);
+    if(n < MAX_DOS_DRIVES){
+        letters[n] = letter;
+        letters[n + 1] = 0;
+    }
+}
+
 /**
  * @brief Displays list of volumes
  * available for defragmentation.
@@ -301,9 +431,12 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
     int a_flag = 0, o_flag = 0;
     int quick_optimize_flag = 0;
     int optimize_mft_flag = 0;
+    int consolidate_flag = 0;
     int all_flag = 0, all_fixed_flag = 0;
     int repeat_flag = 0;
+    int resume_flag = 0;
     char letters[MAX_DOS_DRIVES];
+    char volumes[MAX_DOS_DRIVES + 1];
     int i, n_letters = 0;
     char letter;
     volume_info *v;
@@ -342,6 +475,9 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
         } else if(!wcscmp(argv[i],L"--optimize-mft")){
             optimize_mft_flag = 1;
             continue;
+        } else if(!wcscmp(argv[i],L"--consolidate-free-space")){
+            consolidate_flag = 1;
+            continue;
         } else if(!wcscmp(argv[i],L"--all")){
             all_flag = 1;
             continue;
@@ -354,6 +490,9 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
         } else if(!wcscmp(argv[i],L"--repeat")){
             repeat_flag = 1;
             continue;
+        } else if(!wcscmp(argv[i],L"--resume")){
+            resume_flag = 1;
+            continue;
         }
         /* handle individual drive letters */
         if(wcslen(argv[i]) == 2){
@@ -393,9 +532,11 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
     else if(o_flag) current_job = FULL_OPTIMIZATION_JOB;
     else if(quick_optimize_flag) current_job = QUICK_OPTIMIZATION_JOB;
     else if(optimize_mft_flag) current_job = MFT_OPTIMIZATION_JOB;
+    else if(consolidate_flag) current_job = FREE_SPACE_CONSOLIDATION_JOB;
     else current_job = DEFRAGMENTATION_JOB;
     
     current_job_flags = repeat_flag ? UD_JOB_REPEAT : 0;
+    if(resume_flag) current_job_flags |= UD_JOB_RESUME;
     
     /*
     * In scripting mode the abort_flag has initial value 0.
@@ -491,33 +632,27 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
     if(abort_flag)
         goto done;
     
-    /* process volumes specified on the command line */
-    for(i = 0; i < n_letters; i++){
-        if(abort_flag) break;
-        letter = letters[i];
-        ProcessVolume(letter);
-        if(debug_level > DBG_NORMAL) short_dbg_delay();
-    }
+    /* collect volumes specified on the command line */
+    volumes[0] = 0;
+    for(i = 0; i < n_letters; i++)
+        AddVolumeLetter(volumes,letters[i]);
 
-    if(abort_flag)
-        goto done;
-    
-    /* process all volumes if requested */
+    /* add all volumes if requested */
     if(all_flag || all_fixed_flag){
         v = udefrag_get_vollist(all_fixed_flag ? TRUE : FALSE);
         if(v == NULL){
             winx_printf("\n%ws: udefrag_get_vollist failed\n\n",argv[0]);
             goto fail;
         }
-        for(i = 0; v[i].letter != 0; i++){
-            if(abort_flag) break;
-            letter = v[i].letter;
-            ProcessVolume(letter);
-            if(debug_level > DBG_NORMAL) short_dbg_delay();
-        }
+        for(i = 0; v[i].letter != 0; i++)
+            AddVolumeLetter(volumes,v[i].letter);
         udefrag_release_vollist(v);
     }
 
+    /* process volumes on different disks simultaneously */
+    ProcessVolumes(volumes);
+    if(debug_level > DBG_NORMAL) short_dbg_delay();
+
 done:    
     winx_list_destroy((list_entry **)(void *)&paths);
     return 0;
@@ -145,7 +145,13 @@ void MainFrame::SaveAppConfiguration()
         cfg->Write(wxT("/Algorithm/Sorting"),wxT("m_time"));
     } else if(m_menuBar->FindItem(ID_SortByLastAccessDate)->IsChecked()){
         cfg->Write(wxT("/Algorithm/Sorting"),wxT("a_time"));
+    } else if(m_menuBar->FindItem(ID_SortByDirectoryTree)->IsChecked()){
+        cfg->Write(wxT("/Algorithm/Sorting"),wxT("tree"));
+    } else if(m_menuBar->FindItem(ID_SortByDirectoryLevels)->IsChecked()){
+        cfg->Write(wxT("/Algorithm/Sorting"),wxT("tree_bfs"));
     }
+    cfg->Write(wxT("/Algorithm/SortingZones"),
+        m_menuBar->FindItem(ID_SortByZones)->IsChecked());
     if(m_menuBar->FindItem(ID_SortAscending)->IsChecked()){
         cfg->Write(wxT("/Algorithm/SortingOrder"),wxT("asc"));
     } else {
@@ -172,14 +178,19 @@ void MainFrame::ReadUserPreferences(wxCommandEvent& WXUNUSED(event))
     * The program should be configurable
     * through the options.lua file only.
     */
+    wxUnsetEnv(wxT("UD_CANCELLATION_LATENCY"));
+    wxUnsetEnv(wxT("UD_COLD_ZONE_AGE"));
     wxUnsetEnv(wxT("UD_DBGPRINT_LEVEL"));
     wxUnsetEnv(wxT("UD_DISABLE_REPORTS"));
     wxUnsetEnv(wxT("UD_DRY_RUN"));
+    wxUnsetEnv(wxT("UD_DRY_RUN_LATENCY"));
     wxUnsetEnv(wxT("UD_EX_FILTER"));
     wxUnsetEnv(wxT("UD_FILE_SIZE_THRESHOLD"));
     wxUnsetEnv(wxT("UD_FRAGMENT_SIZE_THRESHOLD"));
     wxUnsetEnv(wxT("UD_FRAGMENTATION_THRESHOLD"));
     wxUnsetEnv(wxT("UD_FRAGMENTS_THRESHOLD"));
+    wxUnsetEnv(wxT("UD_FREE_SPACE_FRAGMENTS"));
+    wxUnsetEnv(wxT("UD_FREE_SPACE_TARGET"));
     wxUnsetEnv(wxT("UD_FREE_COLOR_R"));
     wxUnsetEnv(wxT("UD_FREE_COLOR_G"));
     wxUnsetEnv(wxT("UD_FREE_COLOR_B"));
@@ -187,10 +198,15 @@ void MainFrame::ReadUserPreferences(wxCommandEvent& WXUNUSED(event))
     wxUnsetEnv(wxT("UD_GRID_COLOR_G"));
     wxUnsetEnv(wxT("UD_GRID_COLOR_B"));
     wxUnsetEnv(wxT("UD_GRID_LINE_WIDTH"));
+    wxUnsetEnv(wxT("UD_HOT_ZONE_AGE"));
     wxUnsetEnv(wxT("UD_IN_FILTER"));
+    wxUnsetEnv(wxT("UD_IN_PLACE_OPTIMIZATION"));
+    wxUnsetEnv(wxT("UD_INCREMENTAL_OPTIMIZATION"));
     wxUnsetEnv(wxT("UD_LOG_FILE_PATH"));
     wxUnsetEnv(wxT("UD_MAP_BLOCK_SIZE"));
     wxUnsetEnv(wxT("UD_MINIMIZE_TO_SYSTEM_TRAY"));
+    wxUnsetEnv(wxT("UD_MOVE_QUEUE_DEPTH"));
+    wxUnsetEnv(wxT("UD_MOVE_VERIFICATION"));
     wxUnsetEnv(wxT("UD_OPTIMIZER_FILE_SIZE_THRESHOLD"));
     wxUnsetEnv(wxT("UD_REFRESH_INTERVAL"));
     wxUnsetEnv(wxT("UD_SECONDS_FOR_SHUTDOWN_REJECTION"));
@@ -199,7 +215,9 @@ void MainFrame::ReadUserPreferences(wxCommandEvent& WXUNUSED(event))
     wxUnsetEnv(wxT("UD_SHOW_TASKBAR_ICON_OVERLAY"));
     wxUnsetEnv(wxT("UD_SORTING"));
     wxUnsetEnv(wxT("UD_SORTING_ORDER"));
+    wxUnsetEnv(wxT("UD_SORTING_TRACE"));
     wxUnsetEnv(wxT("UD_TIME_LIMIT"));
+    wxUnsetEnv(wxT("UD_TIMELINE"));
 
     /* interprete guiopts.lua file */
     lua_State *L; int status; wxString error = wxT("");
@@ -134,6 +134,7 @@ void MainFrame::OnLocaleChange(wxCommandEvent& event)
     UD_UpdateMenuItemLabel(ID_QuickOpt   , "&Quick optimization"   , "F7");
     UD_UpdateMenuItemLabel(ID_FullOpt    , "&Full optimization"    , "Ctrl+F7");
     UD_UpdateMenuItemLabel(ID_MftOpt     , "&Optimize MFT"         , "Shift+F7");
+    UD_UpdateMenuItemLabel(ID_ConsolidateFreeSpace, "&Consolidate free space", "Ctrl+Shift+F7");
     UD_UpdateMenuItemLabel(ID_Pause      , "Pa&use"                , "Space");
     UD_UpdateMenuItemLabel(ID_Stop       , "&Stop"                 , "Ctrl+C");
     UD_UpdateMenuItemLabel(ID_ShowReport , "&Show report"          , "F8");
@@ -174,6 +175,9 @@ void MainFrame::OnLocaleChange(wxCommandEvent& event)
     UD_UpdateMenuItemLabel(ID_SortByCreationDate     , "By &creation time"          , "");
     UD_UpdateMenuItemLabel(ID_SortByModificationDate , "By last &modification time" , "");
     UD_UpdateMenuItemLabel(ID_SortByLastAccessDate   , "By &last access time"       , "");
+    UD_UpdateMenuItemLabel(ID_SortByDirectoryTree    , "By directory &tree"         , "");
+    UD_UpdateMenuItemLabel(ID_SortByDirectoryLevels  , "By directory le&vels"       , "");
+    UD_UpdateMenuItemLabel(ID_SortByZones            , "Recently used files &first" , "");
     UD_UpdateMenuItemLabel(ID_SortAscending          , "In &ascending order"        , "");
     UD_UpdateMenuItemLabel(ID_SortDescending         , "In &descending order"       , "");
 
@@ -229,6 +229,7 @@ void MainFrame::OnStartJob(wxCommandEvent& event)
     UD_DisableTool(ID_QuickOpt);
     UD_DisableTool(ID_FullOpt);
     UD_DisableTool(ID_MftOpt);
+    UD_DisableTool(ID_ConsolidateFreeSpace);
     UD_DisableTool(ID_Repeat);
     UD_DisableTool(ID_SkipRem);
     UD_DisableTool(ID_Rescan);
@@ -257,6 +258,14 @@ void MainFrame::OnStartJob(wxCommandEvent& event)
         wxSetEnv(wxT("UD_SORTING"),wxT("m_time"));
     } else if(m_menuBar->FindItem(ID_SortByLastAccessDate)->IsChecked()){
         wxSetEnv(wxT("UD_SORTING"),wxT("a_time"));
+    } else if(m_menuBar->FindItem(ID_SortByDirectoryTree)->IsChecked()){
+        wxSetEnv(wxT("UD_SORTING"),wxT("tree"));
+    } else if(m_menuBar->FindItem(ID_SortByDirectoryLevels)->IsChecked()){
+        wxSetEnv(wxT("UD_SORTING"),wxT("tree_bfs"));
+    }
+    if(m_menuBar->FindItem(ID_SortByZones)->IsChecked()){
+        wxString sorting; wxGetEnv(wxT("UD_SORTING"),&sorting);
+        wxSetEnv(wxT("UD_SORTING"),wxT("zones,") + sorting);
     }
     if(m_menuBar->FindItem(ID_SortAscending)->IsChecked()){
         wxSetEnv(wxT("UD_SORTING_ORDER"),wxT("asc"));
@@ -278,6 +287,9 @@ void MainFrame::OnStartJob(wxCommandEvent& event)
     case ID_FullOpt:
         m_jobThread->m_jobType = FULL_OPTIMIZATION_JOB;
         break;
+    case ID_ConsolidateFreeSpace:
+        m_jobThread->m_jobType = FREE_SPACE_CONSOLIDATION_JOB;
+        break;
     default:
         m_jobThread->m_jobType = MFT_OPTIMIZATION_JOB;
         break;
@@ -300,6 +312,7 @@ void MainFrame::OnJobCompletion(wxCommandEvent& WXUNUSED(event))
     UD_EnableTool(ID_QuickOpt);
     UD_EnableTool(ID_FullOpt);
     UD_EnableTool(ID_MftOpt);
+    UD_EnableTool(ID_ConsolidateFreeSpace);
     UD_EnableTool(ID_Repeat);
     UD_EnableTool(ID_SkipRem);
     UD_EnableTool(ID_Rescan);
@@ -411,7 +411,7 @@ bool MainFrame::CheckForTermination(int time)
 
 BEGIN_EVENT_TABLE(MainFrame, wxFrame)
     // action menu
-    EVT_MENU_RANGE(ID_Analyze, ID_MftOpt,
+    EVT_MENU_RANGE(ID_Analyze, ID_ConsolidateFreeSpace,
                    MainFrame::OnStartJob)
     EVT_MENU(ID_Pause, MainFrame::OnPause)
     EVT_MENU(ID_Stop,  MainFrame::OnStop)
@@ -98,6 +98,7 @@ enum {
     ID_QuickOpt,
     ID_FullOpt,
     ID_MftOpt,
+    ID_ConsolidateFreeSpace,
 
     ID_Pause,
     ID_Stop,
@@ -136,6 +137,10 @@ enum {
     ID_SortByCreationDate,
     ID_SortByModificationDate,
     ID_SortByLastAccessDate,
+    ID_SortByDirectoryTree,
+    ID_SortByDirectoryLevels,
+
+    ID_SortByZones,
 
     ID_SortAscending,
     ID_SortDescending,
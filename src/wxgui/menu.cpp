@@ -80,6 +80,7 @@ void MainFrame::InitMenu()
     m_menuAction->Append(ID_QuickOpt);
     m_menuAction->Append(ID_FullOpt);
     m_menuAction->Append(ID_MftOpt);
+    m_menuAction->Append(ID_ConsolidateFreeSpace);
     m_menuAction->UD_AppendCheckItem(ID_Pause);
     m_menuAction->Append(ID_Stop);
     m_menuAction->AppendSeparator();
@@ -180,6 +181,10 @@ void MainFrame::InitMenu()
     menuSortingConfig->UD_AppendRadioItem(ID_SortByCreationDate);
     menuSortingConfig->UD_AppendRadioItem(ID_SortByModificationDate);
     menuSortingConfig->UD_AppendRadioItem(ID_SortByLastAccessDate);
+    menuSortingConfig->UD_AppendRadioItem(ID_SortByDirectoryTree);
+    menuSortingConfig->UD_AppendRadioItem(ID_SortByDirectoryLevels);
+    menuSortingConfig->AppendSeparator();
+    menuSortingConfig->UD_AppendCheckItem(ID_SortByZones);
     menuSortingConfig->AppendSeparator();
     menuSortingConfig->UD_AppendRadioItem(ID_SortAscending);
     menuSortingConfig->UD_AppendRadioItem(ID_SortDescending);
@@ -282,7 +287,14 @@ void MainFrame::InitMenu()
         m_menuBar->FindItem(ID_SortByModificationDate)->Check();
     } else if(sorting == wxT("a_time")){
         m_menuBar->FindItem(ID_SortByLastAccessDate)->Check();
+    } else if(sorting == wxT("tree")){
+        m_menuBar->FindItem(ID_SortByDirectoryTree)->Check();
+    } else if(sorting == wxT("tree_bfs")){
+        m_menuBar->FindItem(ID_SortByDirectoryLevels)->Check();
     }
+    bool zones = false;
+    cfg->Read(wxT("/Algorithm/SortingZones"),&zones,false);
+    m_menuBar->FindItem(ID_SortByZones)->Check(zones);
     wxString order = cfg->Read(wxT("/Algorithm/SortingOrder"),wxT("asc"));
     if(order == wxT("asc")){
         m_menuBar->FindItem(ID_SortAscending)->Check();